@@ -0,0 +1,278 @@
+#include <string.h>
+#include "checkpoint.h"
+
+// Rounds a byte count up to the checkpoint alignment.
+#define ALIGN_CHECKPOINT(n) (((n) + MFSM_CHECKPOINT_ALIGN - 1) & ~(size_t)(MFSM_CHECKPOINT_ALIGN - 1))
+
+// Events released at a time when clearing a listener.
+#define CLEAR_EVENTS 16
+
+// Offset of the listeners' Event counts in a checkpoint. Each instance is
+// saved as its curState and curInput.
+static size_t getCountsOffset(size_t numInstances) {
+  return sizeof(mfsm_CheckpointHeader) + sizeof(int32_t) * 2 * numInstances;
+}
+
+// Offset of the Events in a checkpoint.
+static size_t getEventsOffset(size_t numInstances, int numListeners) {
+  return ALIGN_CHECKPOINT(getCountsOffset(numInstances) +
+                          sizeof(int32_t) * (size_t)numListeners);
+}
+
+// Most Events a listener can hold, counting the storage it may grow into.
+static int getListenerRoom(const mfsm_EventListener *el) {
+#ifndef MFSM_NO_THREADS
+  if (el->spsc) {
+    return MAX_EVENTS;
+  }
+#endif
+
+  if (el->grown == 0 && el->spare != 0 && el->overflow == MFSM_OVERFLOW_GROW) {
+    return el->spareCapacity;
+  }
+
+  return el->capacity;
+}
+
+// Empties a listener, releasing the Events it held.
+static void clearListener(mfsm_EventListener *el) {
+  mfsm_Event events[CLEAR_EVENTS];
+  int count = 0;
+  while ((count = getEvents(el, events, CLEAR_EVENTS)) > 0) {
+    int i = 0;
+    for (; i < count; i++) {
+      releaseEvent(&events[i]);
+    }
+  }
+}
+
+// size_t getCheckpointSize(size_t, mfsm_EventListener**, int)
+//
+// Finds the number of bytes needed to save a checkpoint of instances and
+// listeners as they are now.
+//
+// Parameters:
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Listeners to save. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+//
+// Returns:
+// Size of the checkpoint in bytes, or 0 for invalid listeners
+size_t getCheckpointSize(size_t numInstances, mfsm_EventListener **listeners,
+                         int numListeners) {
+  if (numListeners < 0 || (listeners == 0 && numListeners > 0)) {
+    return 0;
+  }
+
+  size_t numEvents = 0;
+  int i = 0;
+  for (; i < numListeners; i++) {
+    int count = getNumEvents(listeners[i]);
+    if (count < 0) {
+      return 0;
+    }
+    numEvents += (size_t)count;
+  }
+
+  return getEventsOffset(numInstances, numListeners) + sizeof(mfsm_Event) * numEvents;
+}
+
+// int saveCheckpoint(const mfsm_Instance*, size_t, mfsm_EventListener**, int,
+//                    void*, size_t, size_t*)
+//
+// Saves the state of an array of instances and the Events waiting in
+// listeners. The listeners keep their Events.
+//
+// Parameters:
+// insts          const mfsm_Instance*   Instances to save
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Listeners to save. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+// buf            void*                  Buffer receiving the checkpoint,
+//                                       aligned to MFSM_CHECKPOINT_ALIGN
+// size           size_t                 Size of buf
+// used           size_t*                Receives the size of the checkpoint.
+//                                       May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid instances or listeners
+//  -2 -- buf is too small or not aligned
+//  -3 -- A waiting Event has a payload
+int saveCheckpoint(const mfsm_Instance *insts, size_t numInstances,
+                   mfsm_EventListener **listeners, int numListeners,
+                   void *buf, size_t size, size_t *used) {
+  if ((insts == 0 && numInstances > 0) || numListeners < 0 ||
+      (listeners == 0 && numListeners > 0)) {
+    return -1;
+  }
+
+  int i = 0;
+  for (; i < numListeners; i++) {
+    if (listeners[i] == 0) {
+      return -1;
+    }
+  }
+
+  size_t offset = getEventsOffset(numInstances, numListeners);
+  if (buf == 0 || (uintptr_t)buf % MFSM_CHECKPOINT_ALIGN != 0 || size < offset) {
+    return -2;
+  }
+
+  unsigned char *out = buf;
+  mfsm_CheckpointHeader *h = buf;
+  int32_t *states = (int32_t*)(out + sizeof(mfsm_CheckpointHeader));
+  int32_t *counts = (int32_t*)(out + getCountsOffset(numInstances));
+
+  size_t n = 0;
+  for (; n < numInstances; n++) {
+    states[2 * n] = insts[n].curState;
+    states[2 * n + 1] = insts[n].curInput;
+  }
+
+  // Copy each listener's Events straight into the buffer. SPSC listeners may
+  // gain Events while this runs; only those already waiting are taken.
+  int numEvents = 0;
+  for (i = 0; i < numListeners; i++) {
+    mfsm_Event *events = (mfsm_Event*)(out + offset);
+    int waiting = getNumEvents(listeners[i]);
+    if ((size_t)waiting > (size - offset) / sizeof(mfsm_Event)) {
+      return -2;
+    }
+
+    int count = peekEvents(listeners[i], events, waiting);
+
+    int j = 0;
+    for (; j < count; j++) {
+      if (events[j].payload != 0) {
+        return -3;
+      }
+    }
+
+    counts[i] = count;
+    numEvents += count;
+    offset += sizeof(mfsm_Event) * count;
+  }
+
+  // Clear the padding after the counts so checkpoints of the same state match
+  size_t countsEnd = getCountsOffset(numInstances) + sizeof(int32_t) * numListeners;
+  memset(out + countsEnd, 0, getEventsOffset(numInstances, numListeners) - countsEnd);
+
+  h->magic = MFSM_CHECKPOINT_MAGIC;
+  h->eventSize = sizeof(mfsm_Event);
+  h->size = offset;
+  h->numInstances = numInstances;
+  h->numListeners = numListeners;
+  h->numEvents = numEvents;
+
+  if (used != 0) {
+    *used = offset;
+  }
+
+  return 0;
+}
+
+// int restoreCheckpoint(mfsm_Instance*, size_t, mfsm_EventListener**, int,
+//                       const void*, size_t)
+//
+// Restores the state of an array of instances and the Events waiting in
+// listeners, given in the same order as when the checkpoint was saved. Events
+// already waiting in the listeners are released and replaced. The instances
+// keep their EventQueues. Nothing is restored unless the whole checkpoint
+// fits.
+//
+// Parameters:
+// insts          mfsm_Instance*         Initialized instances
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Initialized listeners. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+// buf            const void*            Checkpoint, aligned to
+//                                       MFSM_CHECKPOINT_ALIGN
+// size           size_t                 Size of buf
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not a checkpoint, or saved by another kind of machine
+//  -2 -- The checkpoint has a different number of instances or listeners
+//  -3 -- The checkpoint is truncated, corrupt or not aligned
+//  -4 -- A listener cannot hold the Events saved for it
+int restoreCheckpoint(mfsm_Instance *insts, size_t numInstances,
+                      mfsm_EventListener **listeners, int numListeners,
+                      const void *buf, size_t size) {
+  const mfsm_CheckpointHeader *h = buf;
+  if (buf == 0 || size < sizeof(mfsm_CheckpointHeader)) {
+    return -1;
+  }
+
+  if ((uintptr_t)buf % MFSM_CHECKPOINT_ALIGN != 0) {
+    return -3;
+  }
+
+  if (h->magic != MFSM_CHECKPOINT_MAGIC || h->eventSize != sizeof(mfsm_Event)) {
+    return -1;
+  }
+
+  if (h->numInstances != numInstances || h->numListeners != numListeners ||
+      (insts == 0 && numInstances > 0) || (listeners == 0 && numListeners > 0)) {
+    return -2;
+  }
+
+  // The counts must add up to the Events the header promises, and those
+  // must fill the rest of the checkpoint
+  size_t offset = getEventsOffset(numInstances, numListeners);
+  if (h->size > size || h->size < offset || h->numEvents < 0 ||
+      h->size - offset != sizeof(mfsm_Event) * (size_t)h->numEvents) {
+    return -3;
+  }
+
+  const unsigned char *in = buf;
+  const int32_t *states = (const int32_t*)(in + sizeof(mfsm_CheckpointHeader));
+  const int32_t *counts = (const int32_t*)(in + getCountsOffset(numInstances));
+
+  int64_t numEvents = 0;
+  int i = 0;
+  for (; i < numListeners; i++) {
+    if (counts[i] < 0) {
+      return -3;
+    }
+    numEvents += counts[i];
+  }
+
+  if (numEvents != h->numEvents) {
+    return -3;
+  }
+
+  for (i = 0; i < numListeners; i++) {
+    if (listeners[i] == 0 || counts[i] > getListenerRoom(listeners[i])) {
+      return -4;
+    }
+  }
+
+  // Everything fits, so restore in one pass
+  size_t n = 0;
+  for (; n < numInstances; n++) {
+    insts[n].curState = states[2 * n];
+    insts[n].curInput = states[2 * n + 1];
+  }
+
+  const mfsm_Event *events = (const mfsm_Event*)(in + offset);
+  for (i = 0; i < numListeners; i++) {
+    clearListener(listeners[i]);
+
+    int j = 0;
+    for (; j < counts[i]; j++) {
+      // Saved Events never have payloads; don't trust a damaged checkpoint
+      mfsm_Event e = events[j];
+      e.payload = 0;
+      appendEvent(listeners[i], e);
+    }
+    events += counts[i];
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "microFSM.h"
+
+/*****************************************************************************
+* Checkpoints
+*
+* Snapshots of the runtime state of many sessions for fast failover. A
+* checkpoint only holds what changes while sessions run: the curState and
+* curInput of each mfsm_Instance and the Events waiting in each
+* EventListener. Definitions, compiled FSMs and EventQueues are not included;
+* the restoring side sets those up the same way as the saving side, then
+* restores the checkpoint over them in one pass.
+*
+* A checkpoint is one contiguous buffer: a header, the instances' states,
+* the number of Events saved for each listener, then the Events themselves.
+* It can be written anywhere and restored by another process on a machine of
+* the same kind. Events with payloads cannot be saved, as payloads live
+* outside the listeners.
+*
+* Nothing may step the instances or retrieve Events from the listeners while
+* a checkpoint is saved or restored. SPSC listeners may still have Events
+* appended while saving; those arriving after their listener was read are
+* left out.
+*****************************************************************************/
+
+#define MFSM_CHECKPOINT_MAGIC 0x4B43464Du // "MFCK" in little endian
+
+// Alignment of checkpoints and of the Events in them
+#define MFSM_CHECKPOINT_ALIGN 8
+
+typedef struct mfsm_CheckpointHeader {
+  uint32_t magic;        // MFSM_CHECKPOINT_MAGIC
+  uint32_t eventSize;    // sizeof(mfsm_Event)
+  uint64_t size;         // Size of the whole checkpoint in bytes
+  uint64_t numInstances;
+  int32_t numListeners;
+  int32_t numEvents;     // Events saved over all listeners
+} mfsm_CheckpointHeader;
+
+// size_t getCheckpointSize(size_t, mfsm_EventListener**, int)
+//
+// Finds the number of bytes needed to save a checkpoint of instances and
+// listeners as they are now.
+//
+// Parameters:
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Listeners to save. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+//
+// Returns:
+// Size of the checkpoint in bytes, or 0 for invalid listeners
+size_t getCheckpointSize(size_t numInstances, mfsm_EventListener **listeners,
+                         int numListeners);
+
+// int saveCheckpoint(const mfsm_Instance*, size_t, mfsm_EventListener**, int,
+//                    void*, size_t, size_t*)
+//
+// Saves the state of an array of instances and the Events waiting in
+// listeners. The listeners keep their Events.
+//
+// Parameters:
+// insts          const mfsm_Instance*   Instances to save
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Listeners to save. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+// buf            void*                  Buffer receiving the checkpoint,
+//                                       aligned to MFSM_CHECKPOINT_ALIGN
+// size           size_t                 Size of buf
+// used           size_t*                Receives the size of the checkpoint.
+//                                       May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid instances or listeners
+//  -2 -- buf is too small or not aligned
+//  -3 -- A waiting Event has a payload
+int saveCheckpoint(const mfsm_Instance *insts, size_t numInstances,
+                   mfsm_EventListener **listeners, int numListeners,
+                   void *buf, size_t size, size_t *used);
+
+// int restoreCheckpoint(mfsm_Instance*, size_t, mfsm_EventListener**, int,
+//                       const void*, size_t)
+//
+// Restores the state of an array of instances and the Events waiting in
+// listeners, given in the same order as when the checkpoint was saved. Events
+// already waiting in the listeners are released and replaced. The instances
+// keep their EventQueues. Nothing is restored unless the whole checkpoint
+// fits.
+//
+// Parameters:
+// insts          mfsm_Instance*         Initialized instances
+// numInstances   size_t                 Number of instances
+// listeners      mfsm_EventListener**   Initialized listeners. May be 0 if
+//                                       numListeners is 0.
+// numListeners   int                    Number of listeners
+// buf            const void*            Checkpoint, aligned to
+//                                       MFSM_CHECKPOINT_ALIGN
+// size           size_t                 Size of buf
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not a checkpoint, or saved by another kind of machine
+//  -2 -- The checkpoint has a different number of instances or listeners
+//  -3 -- The checkpoint is truncated, corrupt or not aligned
+//  -4 -- A listener cannot hold the Events saved for it
+int restoreCheckpoint(mfsm_Instance *insts, size_t numInstances,
+                      mfsm_EventListener **listeners, int numListeners,
+                      const void *buf, size_t size);
+
+#endif //CHECKPOINT_H
@@ -0,0 +1,476 @@
+#include "compiled.h"
+#include "idmap.h"
+
+// The AVX2 stepping kernel needs GCC or Clang on x86 for target attributes
+// and runtime CPU detection.
+#if !defined(MFSM_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__GNUC__)
+#define MFSM_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Rounds a byte count up so the next array in a block stays aligned.
+#define ALIGN_SIZE(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+// int compileFSM(const mfsm_fsm*, mfsm_CompiledFSM*)
+//
+// Builds a compiled, read-only copy of the FSM's states, inputs and
+// transitions. Later changes to the FSM are not reflected in the compiled
+// copy. Release it with freeCompiledFSM().
+//
+// Parameters:
+// fsm  const mfsm_fsm*     Pointer to FSM context
+// c    mfsm_CompiledFSM*   Uninitialized compiled FSM
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Too many states, inputs or output Events to compile
+int compileFSM(const mfsm_fsm *fsm, mfsm_CompiledFSM *c) {
+  int numStates = 0;
+  int numInputs = 0;
+  int i = 0;
+
+  // Count the tracked states and inputs. The FSM's outputs table already
+  // holds each distinct output Event once and is copied as it is.
+  int numOutputs = fsm->numOutputs;
+  for (; i < fsm->maxStates; i++) {
+    if (fsm->states[i] >= MIN_STATE_ID) {
+      numStates++;
+    }
+  }
+
+  for (i = 0; i < fsm->maxInputs; i++) {
+    if (fsm->inputs[i] >= MIN_INPUT_ID) {
+      numInputs++;
+    }
+  }
+
+  if (numStates > MAX_COMPILED_INDEX || numInputs > MAX_COMPILED_INDEX ||
+      numOutputs > MAX_COMPILED_INDEX) {
+    return -2;
+  }
+
+  // Lay every array out in a single block
+  int stateMapSize = numStates * 2 + 1;
+  int inputMapSize = numInputs * 2 + 1;
+  size_t cells = (size_t)numStates * numInputs;
+
+  size_t idBytes = ALIGN_SIZE(sizeof(int) * (numStates + numInputs +
+                                             stateMapSize + inputMapSize) +
+                               sizeof(mfsm_Accept) * numStates);
+  size_t eventBytes = ALIGN_SIZE(sizeof(mfsm_Event) * numOutputs);
+  // The outputs table directly after next lets stepCompiledMany() read next
+  // in 32-bit units without running off the end.
+  size_t tableBytes = sizeof(uint16_t) * cells * 2;
+
+  // Allocate with the FSM's allocator, falling back to the default one for
+  // FSMs using fixed storage.
+  mfsm_Allocator allocator = fsm->allocator;
+  if (allocator.alloc == 0) {
+#ifndef MFSM_NO_MALLOC
+    allocator = *getDefaultAllocator();
+#else
+    return -1;
+#endif
+  }
+
+  char *mem = allocator.alloc(allocator.ctx, idBytes + eventBytes + tableBytes);
+  if (mem == 0) {
+    return -1;
+  }
+
+  int *stateIDs = (int*)mem;
+  int *inputIDs = stateIDs + numStates;
+  int *stateMap = inputIDs + numInputs;
+  int *inputMap = stateMap + stateMapSize;
+  mfsm_Accept *accepts = (mfsm_Accept*)(inputMap + inputMapSize);
+  mfsm_Event *events = (mfsm_Event*)(mem + idBytes);
+  uint16_t *next = (uint16_t*)(mem + idBytes + eventBytes);
+  uint16_t *outputs = next + cells;
+
+  // Assign dense indices in the order the IDs appear in the FSM
+  idMapClear(stateMap, stateMapSize);
+  idMapClear(inputMap, inputMapSize);
+
+  int si = 0;
+  for (i = 0; i < fsm->maxStates; i++) {
+    if (fsm->states[i] >= MIN_STATE_ID) {
+      stateIDs[si] = fsm->states[i];
+      accepts[si] = fsm->accepts[i];
+      idMapInsert(stateMap, stateMapSize, stateIDs, si);
+      si++;
+    }
+  }
+
+  int ni = 0;
+  for (i = 0; i < fsm->maxInputs; i++) {
+    if (fsm->inputs[i] >= MIN_INPUT_ID) {
+      inputIDs[ni] = fsm->inputs[i];
+      idMapInsert(inputMap, inputMapSize, inputIDs, ni);
+      ni++;
+    }
+  }
+
+  c->numStates = numStates;
+  c->numInputs = numInputs;
+  c->numEvents = numOutputs;
+  c->stateIDs = stateIDs;
+  c->inputIDs = inputIDs;
+  c->accepts = accepts;
+  c->stateMap = stateMap;
+  c->inputMap = inputMap;
+  c->stateMapSize = stateMapSize;
+  c->inputMapSize = inputMapSize;
+  c->events = events;
+  c->next = next;
+  c->outputs = outputs;
+  c->mem = mem;
+  c->allocator = allocator;
+
+  for (i = 0; i < numOutputs; i++) {
+    events[i] = fsm->outputs[i];
+  }
+
+  // Fill in the transition and output tables
+  for (si = 0; si < numStates; si++) {
+    for (ni = 0; ni < numInputs; ni++) {
+      const mfsm_Transition *t = getTransition(fsm, inputIDs[ni], stateIDs[si]);
+      size_t cell = (size_t)si * numInputs + ni;
+
+      // Missing transitions stay in the same state
+      next[cell] = (uint16_t)si;
+      outputs[cell] = 0;
+      if (t == 0) {
+        continue;
+      }
+
+      int dest = getCompiledStateIndex(c, t->dest);
+      if (dest != -1) {
+        next[cell] = (uint16_t)dest;
+      }
+
+      outputs[cell] = (uint16_t)(t->output + 1);
+    }
+  }
+
+  return 0;
+}
+
+// void freeCompiledFSM(mfsm_CompiledFSM*)
+//
+// Releases the memory held by a compiled FSM.
+//
+// Parameters:
+// c    mfsm_CompiledFSM*   Compiled FSM context
+//
+// Returns:
+// None
+void freeCompiledFSM(mfsm_CompiledFSM *c) {
+  if (c->mem != 0 && c->allocator.release != 0) {
+    c->allocator.release(c->allocator.ctx, c->mem);
+  }
+
+  c->mem = 0;
+  c->numStates = 0;
+  c->numInputs = 0;
+  c->numEvents = 0;
+}
+
+// int getCompiledStateIndex(const mfsm_CompiledFSM*, int)
+//
+// Translates a state ID into its dense index.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// s    int                       State ID
+//
+// Returns:
+// Success -- Dense index of the state
+// Failure -- -1
+int getCompiledStateIndex(const mfsm_CompiledFSM *c, int s) {
+  if (s < MIN_STATE_ID) {
+    return -1;
+  }
+
+  return idMapFind(c->stateMap, c->stateMapSize, c->stateIDs, s);
+}
+
+// int getCompiledInputIndex(const mfsm_CompiledFSM*, int)
+//
+// Translates an input ID into its dense index.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// n    int                       Input ID
+//
+// Returns:
+// Success -- Dense index of the input
+// Failure -- -1
+int getCompiledInputIndex(const mfsm_CompiledFSM *c, int n) {
+  if (n < MIN_INPUT_ID) {
+    return -1;
+  }
+
+  return idMapFind(c->inputMap, c->inputMapSize, c->inputIDs, n);
+}
+
+// const mfsm_Event* getCompiledOutput(const mfsm_CompiledFSM*, int, int)
+//
+// Finds the output Event of the transition from dense state index s with
+// dense input index n. Indices are not validated.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// s    int                       Dense source state index
+// n    int                       Dense input index
+//
+// Returns:
+// Output Event, or 0 if the transition has none
+const mfsm_Event *getCompiledOutput(const mfsm_CompiledFSM *c, int s, int n) {
+  uint16_t out = c->outputs[s * c->numInputs + n];
+  if (out == 0) {
+    return 0;
+  }
+
+  return &c->events[out - 1];
+}
+
+// int doCompiledTransition(const mfsm_CompiledFSM*, mfsm_Instance*, int)
+//
+// Executes the transition from the instance's current state using input n,
+// looking the transition up in a compiled FSM. Equivalent to
+// doInstanceTransition() but without scanning the definition. Output Events
+// are sent to the instance's EventQueue, if it has one.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// inst mfsm_Instance*            Instance context
+// n    int                       Input ID
+//
+// Returns:
+// Success -- ID of new current State
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- The current state ID is invalid
+int doCompiledTransition(const mfsm_CompiledFSM *c, mfsm_Instance *inst, int n) {
+  int ni = getCompiledInputIndex(c, n);
+  if (ni == -1) {
+    return -1;
+  }
+
+  int si = getCompiledStateIndex(c, inst->curState);
+  if (si == -1) {
+    return -2;
+  }
+
+  inst->curState = c->stateIDs[stepCompiled(c, si, ni)];
+  inst->curInput = n;
+
+  // Try to fire the output event. Like doInstanceTransition(), listeners
+  // see the instance already in its new state.
+  const mfsm_Event *out = getCompiledOutput(c, si, ni);
+  if (inst->eq != 0 && out != 0) {
+    sendEventPtr(inst->eq, *out);
+  }
+
+  return inst->curState;
+}
+
+// int doCompiledTransitionBatch(const mfsm_CompiledFSM*, mfsm_Instance*,
+//                               const int*, size_t, int*, size_t*)
+//
+// Batch version of doCompiledTransition(). Executes a transition for each
+// input in turn, keeping the dense state index between steps. Stops at the
+// first invalid input; the transitions before it stay executed.
+//
+// Parameters:
+// c           const mfsm_CompiledFSM*   Compiled FSM context
+// inst        mfsm_Instance*            Instance context
+// inputs      const int*                Input IDs to execute in order
+// n           size_t                    Number of inputs
+// trajectory  int*                      Receives the state ID after each
+//                                       input. May be 0.
+// numDone     size_t*                   Receives the number of inputs
+//                                       executed, which is the index of the
+//                                       invalid input on failure. May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doCompiledTransitionBatch(const mfsm_CompiledFSM *c, mfsm_Instance *inst,
+                              const int *inputs, size_t n, int *trajectory,
+                              size_t *numDone) {
+  if (numDone != 0) {
+    *numDone = 0;
+  }
+
+  int si = getCompiledStateIndex(c, inst->curState);
+  if (si == -1) {
+    return -2;
+  }
+
+  int result = 0;
+  size_t i = 0;
+  for (; i < n; i++) {
+    int ni = getCompiledInputIndex(c, inputs[i]);
+    if (ni == -1) {
+      result = -1;
+      break;
+    }
+
+    const mfsm_Event *out = getCompiledOutput(c, si, ni);
+    si = stepCompiled(c, si, ni);
+    inst->curInput = inputs[i];
+
+    // Try to fire the output event, with the instance in its new state
+    if (inst->eq != 0 && out != 0) {
+      inst->curState = c->stateIDs[si];
+      sendEventPtr(inst->eq, *out);
+    }
+
+    if (trajectory != 0) {
+      trajectory[i] = c->stateIDs[si];
+    }
+  }
+
+  // Otherwise the state ID is only needed once the batch is finished
+  inst->curState = c->stateIDs[si];
+
+  if (numDone != 0) {
+    *numDone = i;
+  }
+
+  return result;
+}
+
+// Steps states[i] for i in [start, count) one at a time.
+static void stepManyScalar(const mfsm_CompiledFSM *c, int *states,
+                           const int *inputs, size_t start, size_t count) {
+  const uint16_t *next = c->next;
+  int numInputs = c->numInputs;
+
+  size_t i = start;
+  for (; i < count; i++) {
+    states[i] = next[states[i] * numInputs + inputs[i]];
+  }
+}
+
+#ifdef MFSM_AVX2
+// Steps eight sessions per iteration. Each gather reads 32 bits at
+// next + 2 * index; the low half is the entry and the high half is dropped.
+// Returns the number of sessions stepped; the caller finishes the rest.
+__attribute__((target("avx2")))
+static size_t stepManyAVX2(const mfsm_CompiledFSM *c, int *states,
+                           const int *inputs, size_t count) {
+  const int *base = (const int*)c->next;
+  __m256i numInputs = _mm256_set1_epi32(c->numInputs);
+  __m256i low = _mm256_set1_epi32(0xFFFF);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(states + i));
+    __m256i n = _mm256_loadu_si256((const __m256i*)(inputs + i));
+    __m256i cell = _mm256_add_epi32(_mm256_mullo_epi32(s, numInputs), n);
+    __m256i next = _mm256_i32gather_epi32(base, cell, 2);
+    _mm256_storeu_si256((__m256i*)(states + i), _mm256_and_si256(next, low));
+  }
+
+  return i;
+}
+#endif //MFSM_AVX2
+
+// int hasSIMDStepping(void)
+//
+// Finds whether stepCompiledMany() uses the AVX2 path on this CPU.
+//
+// Parameters:
+// None
+//
+// Returns:
+// 1 if AVX2 is used, otherwise 0
+int hasSIMDStepping(void) {
+#ifdef MFSM_AVX2
+  return __builtin_cpu_supports("avx2") ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// int stepCompiledManyScalar(const mfsm_CompiledFSM*, int*, const int*,
+//                            size_t)
+//
+// Same as stepCompiledMany(), but always uses the portable scalar loop.
+//
+// Parameters:
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- Null states or inputs
+int stepCompiledManyScalar(const mfsm_CompiledFSM *c, int *states,
+                           const int *inputs, size_t count) {
+  if (c == 0 || c->next == 0) {
+    return -1;
+  }
+
+  if (states == 0 || inputs == 0) {
+    return -2;
+  }
+
+  stepManyScalar(c, states, inputs, 0, count);
+
+  return 0;
+}
+
+// int stepCompiledMany(const mfsm_CompiledFSM*, int*, const int*, size_t)
+//
+// Steps many independent sessions of the same compiled FSM by one input
+// each: states[i] = next[states[i] * numInputs + inputs[i]]. Uses AVX2 gathers
+// when the CPU supports them. No Events are sent; look outputs up with
+// getCompiledOutput() before stepping if needed. Indices are not validated.
+//
+// Parameters:
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- Null states or inputs
+int stepCompiledMany(const mfsm_CompiledFSM *c, int *states, const int *inputs,
+                     size_t count) {
+  if (c == 0 || c->next == 0) {
+    return -1;
+  }
+
+  if (states == 0 || inputs == 0) {
+    return -2;
+  }
+
+  size_t done = 0;
+
+#ifdef MFSM_AVX2
+  // Gather offsets are signed 32-bit element indices
+  if ((size_t)c->numStates * c->numInputs <= 0x7FFFFFFF && hasSIMDStepping()) {
+    done = stepManyAVX2(c, states, inputs, count);
+  }
+#endif
+
+  stepManyScalar(c, states, inputs, done, count);
+
+  return 0;
+}
@@ -0,0 +1,253 @@
+#ifndef COMPILED_H
+#define COMPILED_H
+
+#include <stdint.h>
+#include "microFSM.h"
+
+/*****************************************************************************
+* Compiled FSMs
+*
+* A read-only snapshot of an mfsm_fsm's topology, built once with
+* compileFSM() after all states, inputs and transitions have been added.
+* State and input IDs are remapped to dense indices starting at 0 and
+* transitions are stored in a packed next[state][input] table, so a step is a
+* single load with no validation. Output events are stored in a separate
+* table so they do not take up room in the cache lines used for stepping.
+*
+* Input/state pairs without a valid transition step back to the same state,
+* which matches the behaviour of doTransition(). Accepting state information
+* is copied along with the states.
+*
+* The compiled FSM does not track a current state; the caller keeps the
+* dense state index and passes it to stepCompiled(). Many independent
+* sessions running the same machine can be kept as an array of dense state
+* indices and stepped together with stepCompiledMany(), which uses AVX2
+* gathers on CPUs that support them. Define MFSM_NO_SIMD to build only the
+* scalar version.
+*****************************************************************************/
+
+// Largest number of states, inputs or distinct output Events which can be
+// compiled. Indices are stored as uint16_t.
+#define MAX_COMPILED_INDEX 0xFFFF
+
+typedef struct mfsm_CompiledFSM {
+  int numStates;  // Number of dense state indices
+  int numInputs;  // Number of dense input indices
+  int numEvents;  // Number of distinct output Events, copied from the FSM's
+                  // outputs table along with any free entries
+
+  const int *stateIDs; // State ID for each dense state index
+  const int *inputIDs; // Input ID for each dense input index
+
+  // Accepting state information for each dense state index
+  const mfsm_Accept *accepts;
+
+  // Next state index for each state/input pair, laid out as
+  // next[state * numInputs + input]. Always followed by at least two bytes
+  // of the same block, so it may be read in 32-bit units.
+  const uint16_t *next;
+
+  // Output Event for each state/input pair, in the same layout as next.
+  // Stores 1 + the index into events, or 0 if the transition has no output.
+  const uint16_t *outputs;
+  const mfsm_Event *events;
+
+  // ID lookup tables (see idmap.h) for translating IDs into dense indices.
+  const int *stateMap;
+  const int *inputMap;
+  int stateMapSize;
+  int inputMapSize;
+
+  void *mem; // Single allocation backing every array above
+
+  // Allocator mem came from. Copied from the source FSM, or the default
+  // allocator if the FSM uses fixed storage.
+  mfsm_Allocator allocator;
+} mfsm_CompiledFSM;
+
+// int compileFSM(const mfsm_fsm*, mfsm_CompiledFSM*)
+//
+// Builds a compiled, read-only copy of the FSM's states, inputs and
+// transitions. Later changes to the FSM are not reflected in the compiled
+// copy. Release it with freeCompiledFSM().
+//
+// Parameters:
+// fsm  const mfsm_fsm*     Pointer to FSM context
+// c    mfsm_CompiledFSM*   Uninitialized compiled FSM
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Memory could not be allocated. FSMs using fixed storage can only
+//        be compiled when the default allocator is available.
+//  -2 -- Too many states, inputs or output Events to compile
+int compileFSM(const mfsm_fsm *fsm, mfsm_CompiledFSM *c);
+
+// void freeCompiledFSM(mfsm_CompiledFSM*)
+//
+// Releases the memory held by a compiled FSM.
+//
+// Parameters:
+// c    mfsm_CompiledFSM*   Compiled FSM context
+//
+// Returns:
+// None
+void freeCompiledFSM(mfsm_CompiledFSM *c);
+
+// int getCompiledStateIndex(const mfsm_CompiledFSM*, int)
+//
+// Translates a state ID into its dense index.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// s    int                       State ID
+//
+// Returns:
+// Success -- Dense index of the state
+// Failure -- -1
+int getCompiledStateIndex(const mfsm_CompiledFSM *c, int s);
+
+// int getCompiledInputIndex(const mfsm_CompiledFSM*, int)
+//
+// Translates an input ID into its dense index.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// n    int                       Input ID
+//
+// Returns:
+// Success -- Dense index of the input
+// Failure -- -1
+int getCompiledInputIndex(const mfsm_CompiledFSM *c, int n);
+
+// const mfsm_Event* getCompiledOutput(const mfsm_CompiledFSM*, int, int)
+//
+// Finds the output Event of the transition from dense state index s with
+// dense input index n. Indices are not validated.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// s    int                       Dense source state index
+// n    int                       Dense input index
+//
+// Returns:
+// Output Event, or 0 if the transition has none
+const mfsm_Event *getCompiledOutput(const mfsm_CompiledFSM *c, int s, int n);
+
+// int doCompiledTransition(const mfsm_CompiledFSM*, mfsm_Instance*, int)
+//
+// Executes the transition from the instance's current state using input n,
+// looking the transition up in a compiled FSM. Equivalent to
+// doInstanceTransition() but without scanning the definition. Output Events
+// are sent to the instance's EventQueue, if it has one.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// inst mfsm_Instance*            Instance context
+// n    int                       Input ID
+//
+// Returns:
+// Success -- ID of new current State
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- The current state ID is invalid
+int doCompiledTransition(const mfsm_CompiledFSM *c, mfsm_Instance *inst, int n);
+
+// int doCompiledTransitionBatch(const mfsm_CompiledFSM*, mfsm_Instance*,
+//                               const int*, size_t, int*, size_t*)
+//
+// Batch version of doCompiledTransition(). Executes a transition for each
+// input in turn, keeping the dense state index between steps. Stops at the
+// first invalid input; the transitions before it stay executed.
+//
+// Parameters:
+// c           const mfsm_CompiledFSM*   Compiled FSM context
+// inst        mfsm_Instance*            Instance context
+// inputs      const int*                Input IDs to execute in order
+// n           size_t                    Number of inputs
+// trajectory  int*                      Receives the state ID after each
+//                                       input. May be 0.
+// numDone     size_t*                   Receives the number of inputs
+//                                       executed, which is the index of the
+//                                       invalid input on failure. May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doCompiledTransitionBatch(const mfsm_CompiledFSM *c, mfsm_Instance *inst,
+                              const int *inputs, size_t n, int *trajectory,
+                              size_t *numDone);
+
+// int stepCompiledMany(const mfsm_CompiledFSM*, int*, const int*, size_t)
+//
+// Steps many independent sessions of the same compiled FSM by one input
+// each: states[i] = next[states[i] * numInputs + inputs[i]]. Uses AVX2 gathers
+// when the CPU supports them. No Events are sent; look outputs up with
+// getCompiledOutput() before stepping if needed. Indices are not validated.
+//
+// Parameters:
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- Null states or inputs
+int stepCompiledMany(const mfsm_CompiledFSM *c, int *states, const int *inputs,
+                     size_t count);
+
+// int stepCompiledManyScalar(const mfsm_CompiledFSM*, int*, const int*,
+//                            size_t)
+//
+// Same as stepCompiledMany(), but always uses the portable scalar loop.
+//
+// Parameters:
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- Null states or inputs
+int stepCompiledManyScalar(const mfsm_CompiledFSM *c, int *states,
+                           const int *inputs, size_t count);
+
+// int hasSIMDStepping(void)
+//
+// Finds whether stepCompiledMany() uses the AVX2 path on this CPU.
+//
+// Parameters:
+// None
+//
+// Returns:
+// 1 if AVX2 is used, otherwise 0
+int hasSIMDStepping(void);
+
+// int stepCompiled(const mfsm_CompiledFSM*, int, int)
+//
+// Finds the next state from dense state index s with dense input index n.
+// Indices are not validated; translate IDs with getCompiledStateIndex() and
+// getCompiledInputIndex() beforehand.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+// s    int                       Dense source state index
+// n    int                       Dense input index
+//
+// Returns:
+// Dense index of the next state
+static inline int stepCompiled(const mfsm_CompiledFSM *c, int s, int n) {
+  return c->next[s * c->numInputs + n];
+}
+
+#endif //COMPILED_H
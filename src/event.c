@@ -1,58 +1,1000 @@
+#include <string.h>
+#ifndef MFSM_NO_THREADS
+#include <sched.h>
+#endif
 #include "event.h"
 
+// Wraps an index into the events array of an EventListener.
+#define EVENT_INDEX(i) ((i) & (MAX_EVENTS - 1))
+
+// Wraps an index into the ring an EventListener is using, which may have
+// grown past MAX_EVENTS.
+#define RING_INDEX(el, i) ((i) & ((el)->capacity - 1))
+
+// Wraps a sequence number into the slots array of an EventBus.
+#define BUS_INDEX(i) ((i) & (MAX_BUS_EVENTS - 1))
+
+/*****************************************************************************
+* Event functions
+*****************************************************************************/
+
+// void initEvent(mfsm_Event*, int)
+//
+// Set default values for an Event. The type is DEFAULT_EVENT_TYPE, data is
+// zeroed and there is no Payload.
+//
+// Parameters:
+// e    mfsm_Event*   Uninitialized Event struct
+// id   int           Unique identifier for the event
+//
+// Returns:
+// None
+void initEvent(mfsm_Event *e, int id) {
+  initTypedEvent(e, id, DEFAULT_EVENT_TYPE);
+}
+
+// void initTypedEvent(mfsm_Event*, int, int)
+//
+// Set default values for an Event of a specific type.
+//
+// Parameters:
+// e      mfsm_Event*   Uninitialized Event struct
+// id     int           Unique identifier for the event
+// type   int           Type of the event, 0 to MAX_EVENT_TYPES - 1
+//
+// Returns:
+// None
+void initTypedEvent(mfsm_Event *e, int id, int type) {
+  e->id = id;
+  e->type = type;
+  memset(e->data, 0, EVENT_DATA_SIZE);
+  e->payload = 0;
+}
+
+// int setEventData(mfsm_Event*, const void*, size_t)
+//
+// Copies data into an Event's inline data area.
+//
+// Parameters:
+// e      mfsm_Event*   Event context
+// src    const void*   Data to copy
+// size   size_t        Bytes to copy, at most EVENT_DATA_SIZE
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid Event
+//  -2 -- Null data or size larger than EVENT_DATA_SIZE
+int setEventData(mfsm_Event *e, const void *src, size_t size) {
+  if (e == 0) {
+    return -1;
+  }
+
+  if (src == 0 || size > EVENT_DATA_SIZE) {
+    return -2;
+  }
+
+  memcpy(e->data, src, size);
+
+  return 0;
+}
+
+// int isSameEvent(const mfsm_Event*, const mfsm_Event*)
+//
+// Compares two Events field by field, including their inline data and
+// Payload pointer.
+//
+// Parameters:
+// a   const mfsm_Event*   First Event
+// b   const mfsm_Event*   Second Event
+//
+// Returns:
+// 1 if the Events are equal, otherwise 0
+int isSameEvent(const mfsm_Event *a, const mfsm_Event *b) {
+  return a->id == b->id && a->type == b->type && a->payload == b->payload &&
+         memcmp(a->data, b->data, EVENT_DATA_SIZE) == 0;
+}
+
+// void releaseEvent(mfsm_Event*)
+//
+// Releases the reference to the Event's Payload, if it has one. Call once for
+// every Event retrieved from an EventListener when done with it.
+//
+// Parameters:
+// e   mfsm_Event*   Event context
+//
+// Returns:
+// None
+void releaseEvent(mfsm_Event *e) {
+  if (e != 0 && e->payload != 0) {
+    releasePayload(e->payload);
+    e->payload = 0;
+  }
+}
+
+/*****************************************************************************
+* Payload functions
+*****************************************************************************/
+
+// Size of a Payload block holding dataSize bytes, rounded up so consecutive
+// blocks stay aligned.
+static size_t payloadBlockSize(size_t dataSize) {
+  size_t align = _Alignof(mfsm_Payload);
+  size_t size = sizeof(mfsm_Payload) + dataSize;
+  return (size + align - 1) / align * align;
+}
+
+#ifndef MFSM_NO_THREADS
+static void lockPool(mfsm_PayloadPool *pool) {
+  while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {
+  }
+}
+
+static void unlockPool(mfsm_PayloadPool *pool) {
+  atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+}
+#else
+#define lockPool(pool)
+#define unlockPool(pool)
+#endif
+
+// size_t getPayloadPoolBytes(size_t, int)
+//
+// Finds the amount of memory needed for a PayloadPool.
+//
+// Parameters:
+// dataSize    size_t   Usable bytes of data in each Payload
+// numBlocks   int      Number of Payloads in the pool
+//
+// Returns:
+// Bytes of memory to pass to initPayloadPool()
+size_t getPayloadPoolBytes(size_t dataSize, int numBlocks) {
+  if (numBlocks < 0) {
+    return 0;
+  }
+
+  return payloadBlockSize(dataSize) * (size_t)numBlocks;
+}
+
+// int initPayloadPool(mfsm_PayloadPool*, void*, size_t, int)
+//
+// Set default values for a PayloadPool and carve its memory into Payloads.
+// The memory must stay valid for as long as the pool is used.
+//
+// Parameters:
+// pool        mfsm_PayloadPool*   Uninitialized PayloadPool struct
+// mem         void*               getPayloadPoolBytes() bytes of memory,
+//                                 aligned like malloc() memory
+// dataSize    size_t              Usable bytes of data in each Payload
+// numBlocks   int                 Number of Payloads in the pool
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid PayloadPool
+//  -2 -- Null or misaligned memory
+//  -3 -- Invalid number of blocks
+int initPayloadPool(mfsm_PayloadPool *pool, void *mem, size_t dataSize, int numBlocks) {
+  if (pool == 0) {
+    return -1;
+  }
+
+  if (mem == 0 || (uintptr_t)mem % _Alignof(mfsm_Payload) != 0) {
+    return -2;
+  }
+
+  if (numBlocks < 1) {
+    return -3;
+  }
+
+  pool->mem = mem;
+  pool->blockSize = payloadBlockSize(dataSize);
+  pool->dataSize = dataSize;
+  pool->numBlocks = numBlocks;
+  pool->numFree = numBlocks;
+  pool->freeList = 0;
+
+#ifndef MFSM_NO_THREADS
+  atomic_flag_clear(&pool->lock);
+#endif
+
+  // Thread the blocks onto the free list, lowest address first
+  int i = numBlocks - 1;
+  for (; i >= 0; i--) {
+    mfsm_Payload *p = (mfsm_Payload*)(pool->mem + pool->blockSize * i);
+    p->pool = pool;
+    p->size = 0;
+    p->nextFree = pool->freeList;
+#ifndef MFSM_NO_THREADS
+    atomic_init(&p->refs, 0);
+#else
+    p->refs = 0;
+#endif
+    pool->freeList = p;
+  }
+
+  return 0;
+}
+
+// mfsm_Payload* allocPayload(mfsm_PayloadPool*)
+//
+// Takes a Payload from the pool. It starts with one reference and a size of
+// 0.
+//
+// Parameters:
+// pool   mfsm_PayloadPool*   PayloadPool context
+//
+// Returns:
+// Success: The Payload
+// Failure: 0 if the pool is invalid or empty
+mfsm_Payload *allocPayload(mfsm_PayloadPool *pool) {
+  if (pool == 0) {
+    return 0;
+  }
+
+  lockPool(pool);
+  mfsm_Payload *p = pool->freeList;
+  if (p != 0) {
+    pool->freeList = p->nextFree;
+    pool->numFree--;
+  }
+  unlockPool(pool);
+
+  if (p == 0) {
+    return 0;
+  }
+
+  p->nextFree = 0;
+  p->size = 0;
+#ifndef MFSM_NO_THREADS
+  atomic_store_explicit(&p->refs, 1, memory_order_relaxed);
+#else
+  p->refs = 1;
+#endif
+
+  return p;
+}
+
+// int retainPayload(mfsm_Payload*)
+//
+// Adds a reference to a Payload.
+//
+// Parameters:
+// p   mfsm_Payload*   Payload context
+//
+// Returns:
+// Success: New number of references
+// Failure:
+//  -1 -- Invalid Payload
+int retainPayload(mfsm_Payload *p) {
+  if (p == 0) {
+    return -1;
+  }
+
+#ifndef MFSM_NO_THREADS
+  return atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed) + 1;
+#else
+  return ++p->refs;
+#endif
+}
+
+// int releasePayload(mfsm_Payload*)
+//
+// Drops a reference to a Payload, returning it to its pool when none are left.
+//
+// Parameters:
+// p   mfsm_Payload*   Payload context
+//
+// Returns:
+// Success: Number of references left
+// Failure:
+//  -1 -- Invalid Payload
+int releasePayload(mfsm_Payload *p) {
+  if (p == 0) {
+    return -1;
+  }
+
+#ifndef MFSM_NO_THREADS
+  // Release so this thread's reads of the data happen before the block is
+  // reused; the last owner acquires everyone else's.
+  int refs = atomic_fetch_sub_explicit(&p->refs, 1, memory_order_release) - 1;
+  if (refs == 0) {
+    atomic_thread_fence(memory_order_acquire);
+  }
+#else
+  int refs = --p->refs;
+#endif
+
+  if (refs != 0) {
+    return refs;
+  }
+
+  mfsm_PayloadPool *pool = p->pool;
+  lockPool(pool);
+  p->nextFree = pool->freeList;
+  pool->freeList = p;
+  pool->numFree++;
+  unlockPool(pool);
+
+  return 0;
+}
+
+/*****************************************************************************
+* EventListener functions
+*****************************************************************************/
+
+// void initEventListener(mfsm_EventListener*)
+//
+// Set default values for an EventListener.
+//
+// Parameters:
+// el    mfsm_EventListener*   Uninitialized EventListener struct
+//
+// Returns:
+// None
+void initEventListener(mfsm_EventListener *el) {
+  el->head = 0;
+  el->numEvents = 0;
+  el->subscriptions = ALL_EVENT_TYPES;
+
+  el->overflow = MFSM_OVERFLOW_DROP_NEWEST;
+  el->capacity = MAX_EVENTS;
+  el->grown = 0;
+  el->spare = 0;
+  el->spareCapacity = 0;
+  el->dropped = 0;
+  el->highWater = 0;
+#ifdef MFSM_STATS
+  el->delivered = 0;
+#endif
+
+#ifndef MFSM_NO_THREADS
+  el->spsc = 0;
+  atomic_init(&el->spscHead, 0);
+  atomic_init(&el->spscTail, 0);
+#endif
+}
+
+#ifndef MFSM_NO_THREADS
+// void initSPSCEventListener(mfsm_EventListener*)
+//
+// Set default values for a single-producer/single-consumer EventListener.
+// One thread may append Events (directly or through sendEvent()) while one
+// other thread retrieves them. appendEvent(), getNextEvent() and getEvents()
+// work as usual, but numEvents is not updated; use getNumEvents().
+//
+// Parameters:
+// el    mfsm_EventListener*   Uninitialized EventListener struct
+//
+// Returns:
+// None
+void initSPSCEventListener(mfsm_EventListener *el) {
+  initEventListener(el);
+  el->spsc = 1;
+}
+
+// Dequeue for SPSC listeners. Only called from the consumer thread. The
+// acquire load of the tail makes the producer's writes to the Events visible.
+static int spscGetEvents(mfsm_EventListener *el, mfsm_Event *dest, int max) {
+  unsigned int head = atomic_load_explicit(&el->spscHead, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&el->spscTail, memory_order_acquire);
+
+  int count = (int)(tail - head);
+  if (count > max) {
+    count = max;
+  }
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  int start = EVENT_INDEX(head);
+  int first = MAX_EVENTS - start;
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(dest, &el->events[start], sizeof(mfsm_Event) * first);
+  memcpy(dest + first, &el->events[0], sizeof(mfsm_Event) * (count - first));
+
+  // Release the slots back to the producer
+  atomic_store_explicit(&el->spscHead, head + count, memory_order_release);
+
+  return count;
+}
+
+// Enqueue for SPSC listeners. Only called from the producer thread. The
+// release store of the tail publishes the Event to the consumer.
+// Under MFSM_OVERFLOW_BLOCK a full queue is polled until the consumer
+// retrieves something.
+static int spscAppendEvent(mfsm_EventListener *el, mfsm_Event e) {
+  unsigned int tail = atomic_load_explicit(&el->spscTail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&el->spscHead, memory_order_acquire);
+
+  while (tail - head >= MAX_EVENTS) {
+    if (el->overflow != MFSM_OVERFLOW_BLOCK) {
+      el->dropped++;
+      return -2;
+    }
+
+    head = atomic_load_explicit(&el->spscHead, memory_order_acquire);
+  }
+
+  el->events[EVENT_INDEX(tail)] = e;
+  atomic_store_explicit(&el->spscTail, tail + 1, memory_order_release);
+
+  int count = (int)(tail + 1 - head);
+  if (count > el->highWater) {
+    el->highWater = count;
+  }
+#ifdef MFSM_STATS
+  el->delivered++;
+#endif
+
+  return count;
+}
+#endif //MFSM_NO_THREADS
+
+// int setSubscriptions(mfsm_EventListener*, uint32_t)
+//
+// Chooses the Event types an EventListener receives. EventQueues read the
+// subscriptions when the listener is added; call refreshListener() on each
+// EventQueue the listener is already registered with.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// mask   uint32_t              Bit t set to receive Events of type t, or
+//                              ALL_EVENT_TYPES
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener
+int setSubscriptions(mfsm_EventListener *el, uint32_t mask) {
+  if (el == 0) {
+    return -1;
+  }
+
+  el->subscriptions = mask;
+
+  return 0;
+}
+
+// The ring an EventListener is currently using.
+static mfsm_Event *listenerRing(mfsm_EventListener *el) {
+  return (el->grown != 0) ? el->grown : el->events;
+}
+
+// Moves a full listener's queue, oldest first, to the start of its spare
+// storage. Returns 0 if there is nothing to grow into.
+static int growListener(mfsm_EventListener *el) {
+  if (el->spare == 0) {
+    return 0;
+  }
+
+  mfsm_Event *ring = listenerRing(el);
+  int first = el->capacity - el->head;
+  if (first > el->numEvents) {
+    first = el->numEvents;
+  }
+
+  memcpy(el->spare, &ring[el->head], sizeof(mfsm_Event) * first);
+  memcpy(el->spare + first, &ring[0], sizeof(mfsm_Event) * (el->numEvents - first));
+
+  el->grown = el->spare;
+  el->capacity = el->spareCapacity;
+  el->head = 0;
+  el->spare = 0;
+  el->spareCapacity = 0;
+
+  return 1;
+}
+
+// int setOverflowPolicy(mfsm_EventListener*, int)
+//
+// Chooses what happens to Events sent to the EventListener while it is full.
+// MFSM_OVERFLOW_DROP_NEWEST rejects them. MFSM_OVERFLOW_DROP_OLDEST makes room
+// by discarding the oldest queued Event; not available for SPSC listeners.
+// MFSM_OVERFLOW_BLOCK makes the sender spin until the consumer makes room;
+// only available for SPSC listeners. MFSM_OVERFLOW_GROW moves the queue to
+// the storage given to setOverflowStorage(), then rejects Events once that is
+// full too; not available for SPSC listeners.
+//
+// Parameters:
+// el       mfsm_EventListener*   EventListener context
+// policy   int                   One of MFSM_OVERFLOW_*
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Unknown policy, or policy not available for this kind of listener
+int setOverflowPolicy(mfsm_EventListener *el, int policy) {
+  if (el == 0) {
+    return -1;
+  }
+
+  int spsc = 0;
+#ifndef MFSM_NO_THREADS
+  spsc = el->spsc;
+#endif
+
+  // Only the consumer may move an SPSC queue's head or storage, and nothing
+  // but a consumer on another thread can empty a full queue.
+  switch (policy) {
+    case MFSM_OVERFLOW_DROP_NEWEST:
+      break;
+    case MFSM_OVERFLOW_DROP_OLDEST:
+    case MFSM_OVERFLOW_GROW:
+      if (spsc) {
+        return -2;
+      }
+      break;
+    case MFSM_OVERFLOW_BLOCK:
+      if (!spsc) {
+        return -2;
+      }
+      break;
+    default:
+      return -2;
+  }
+
+  el->overflow = policy;
+
+  return 0;
+}
+
+// int setOverflowStorage(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Gives an EventListener larger storage to move its queue to under the
+// MFSM_OVERFLOW_GROW policy. The storage must stay valid for as long as the
+// listener is used.
+//
+// Parameters:
+// el         mfsm_EventListener*   EventListener context
+// storage    mfsm_Event*           Array of capacity Events
+// capacity   int                   Power of two larger than MAX_EVENTS
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener, or it has already grown
+//  -2 -- Null storage
+//  -3 -- Capacity is not a power of two larger than MAX_EVENTS
+int setOverflowStorage(mfsm_EventListener *el, mfsm_Event *storage, int capacity) {
+  if (el == 0 || el->grown != 0) {
+    return -1;
+  }
+
+  if (storage == 0) {
+    return -2;
+  }
+
+  if (capacity <= MAX_EVENTS || (capacity & (capacity - 1)) != 0) {
+    return -3;
+  }
+
+  el->spare = storage;
+  el->spareCapacity = capacity;
+
+  return 0;
+}
+
+// int getNumEvents(mfsm_EventListener*)
+//
+// Finds the number of Events waiting in the EventListener. Works for every
+// kind of EventListener.
+//
+// Parameters:
+// el    mfsm_EventListener*   EventListener context
+//
+// Returns:
+// Success: Number of Events in the queue
+// Failure:
+//  -1 -- Null/invalid EventListener
+int getNumEvents(mfsm_EventListener *el) {
+  if (el == 0) {
+    return -1;
+  }
+
+#ifndef MFSM_NO_THREADS
+  if (el->spsc) {
+    unsigned int tail = atomic_load_explicit(&el->spscTail, memory_order_acquire);
+    unsigned int head = atomic_load_explicit(&el->spscHead, memory_order_acquire);
+    return (int)(tail - head);
+  }
+#endif
+
+  return el->numEvents;
+}
+
+// int getNextEvent(mfsm_EventListener*, mfsm_Event*)
+//
+// Dequeue operation. Removes the oldest Event from the EventListener and
+// copies it to a specified destination.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// dest   mfsm_Event*           Destination to copy the event data to
+//
+// Returns:
+// Success: New number of events in the queue
+// Failure:
+//  -1 -- 0/invalid EventListener
+//  -2 -- 0/invalid destination
+//  -3 -- No events to be retrieved from the EventListener
+int getNextEvent(mfsm_EventListener *el, mfsm_Event* dest) {
+  // Validate as much as possible before trying to copy data
+  if (el == 0) {
+    return -1;
+  }
+
+  if (dest == 0) {
+    return -2;
+  }
+
+#ifndef MFSM_NO_THREADS
+  if (el->spsc) {
+    if (spscGetEvents(el, dest, 1) == 0) {
+      return -3;
+    }
+
+    return getNumEvents(el);
+  }
+#endif
+
+  if (el->numEvents < 1) {
+    return -3;
+  }
+
+  // Copy the oldest event to the destination
+  *dest = listenerRing(el)[el->head];
+
+  el->head = RING_INDEX(el, el->head + 1);
+  el->numEvents--; // Controlling the event array makes destroying the Event
+                   // unnecessary.
+
+  return el->numEvents;
+}
+
+// int getEvents(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Bulk dequeue operation. Removes up to max of the oldest Events from the
+// EventListener and copies them, oldest first, to a destination array.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// dest   mfsm_Event*           Destination array with room for max Events
+// max    int                   Largest number of Events to retrieve
+//
+// Returns:
+// Success: Number of Events copied to dest
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Null/invalid destination
+int getEvents(mfsm_EventListener *el, mfsm_Event *dest, int max) {
+  if (el == 0) {
+    return -1;
+  }
+
+  if (dest == 0) {
+    return -2;
+  }
+
+#ifndef MFSM_NO_THREADS
+  if (el->spsc) {
+    return spscGetEvents(el, dest, max);
+  }
+#endif
+
+  int count = (max < el->numEvents) ? max : el->numEvents;
+  if (count <= 0) {
+    return 0;
+  }
+
+  // The queued Events are at most two runs: up to the end of the array, then
+  // from the start of it.
+  mfsm_Event *ring = listenerRing(el);
+  int first = el->capacity - el->head;
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(dest, &ring[el->head], sizeof(mfsm_Event) * first);
+  memcpy(dest + first, &ring[0], sizeof(mfsm_Event) * (count - first));
+
+  el->head = RING_INDEX(el, el->head + count);
+  el->numEvents -= count;
+
+  return count;
+}
+
+// int peekEvents(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Copies up to max of the oldest Events, oldest first, to a destination
+// array without removing them from the EventListener. Payload references are
+// not added. For SPSC listeners, only call it from the consumer thread.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// dest   mfsm_Event*           Destination array with room for max Events
+// max    int                   Largest number of Events to copy
+//
+// Returns:
+// Success: Number of Events copied to dest
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Null/invalid destination
+int peekEvents(mfsm_EventListener *el, mfsm_Event *dest, int max) {
+  if (el == 0) {
+    return -1;
+  }
+
+  if (dest == 0) {
+    return -2;
+  }
+
+  int head = el->head;
+  int count = el->numEvents;
+
+#ifndef MFSM_NO_THREADS
+  // SPSC listeners never grow, so their ring is always events
+  if (el->spsc) {
+    unsigned int spscHead = atomic_load_explicit(&el->spscHead, memory_order_relaxed);
+    unsigned int spscTail = atomic_load_explicit(&el->spscTail, memory_order_acquire);
+    head = EVENT_INDEX(spscHead);
+    count = (int)(spscTail - spscHead);
+  }
+#endif
+
+  if (count > max) {
+    count = max;
+  }
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  mfsm_Event *ring = listenerRing(el);
+  int first = el->capacity - head;
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(dest, &ring[head], sizeof(mfsm_Event) * first);
+  memcpy(dest + first, &ring[0], sizeof(mfsm_Event) * (count - first));
+
+  return count;
+}
+
+// int appendEvent(mfsm_EventListener*, Event)
+//
+// Enqueue operation. Adds an Event to the end of the EventListener's queue.
+// A full listener follows its overflow policy. Events discarded by
+// MFSM_OVERFLOW_DROP_OLDEST have their Payload reference released.
+//
+// Parameters:
+// el   mfsm_EventListener*   EventListener context
+// e    mfsm_Event            Event to be stored
+//
+// Returns:
+// Success -- New number of events in the queue
+// Failure:
+//  -1 -- Invalid EventListener
+//  -2 -- No more room in the EventListener
+int appendEvent(mfsm_EventListener *el, mfsm_Event e) {
+  // Validate as much as possible before trying to copy data
+  if (el == 0) {
+    return -1;
+  }
+
+#ifndef MFSM_NO_THREADS
+  if (el->spsc) {
+    return spscAppendEvent(el, e);
+  }
+#endif
+
+  if (el->numEvents >= el->capacity) {
+    if (el->overflow == MFSM_OVERFLOW_DROP_OLDEST) {
+      // Discard the oldest Event to make room
+      releaseEvent(&listenerRing(el)[el->head]);
+      el->head = RING_INDEX(el, el->head + 1);
+      el->numEvents--;
+      el->dropped++;
+    } else if (el->overflow != MFSM_OVERFLOW_GROW || !growListener(el)) {
+      el->dropped++;
+      return -2;
+    }
+  }
+
+  // Copy the event to the slot after the newest one
+  listenerRing(el)[RING_INDEX(el, el->head + el->numEvents)] = e;
+
+  el->numEvents++;
+  if (el->numEvents > el->highWater) {
+    el->highWater = el->numEvents;
+  }
+#ifdef MFSM_STATS
+  el->delivered++;
+#endif
+
+  return el->numEvents;
+}
+
+#ifndef MFSM_NO_THREADS
 /*****************************************************************************
-* Event functions
+* EventBus functions
 *****************************************************************************/
 
-// void initEvent(mfsm_Event*, int)
+// void initEventBus(mfsm_EventBus*)
 //
-// Set default values for an Event.
+// Set default values for an EventBus.
 //
 // Parameters:
-// e    mfsm_Event*   Uninitialized Event struct
-// id   int           Unique identifier for the event
+// bus   mfsm_EventBus*   Uninitialized EventBus struct
 //
 // Returns:
 // None
-void initEvent(mfsm_Event *e, int id) {
-  e->id = id;
+void initEventBus(mfsm_EventBus *bus) {
+  // Slot i starts out as though it held sequence i - MAX_BUS_EVENTS, which
+  // is older than anything a cursor will look for and is what the first
+  // publisher to the slot waits for.
+  int i = 0;
+  for (; i < MAX_BUS_EVENTS; i++) {
+    atomic_init(&bus->slots[i].seq, 2 * (unsigned int)(i - MAX_BUS_EVENTS) + 2);
+
+    size_t j = 0;
+    for (; j < BUS_EVENT_WORDS; j++) {
+      atomic_init(&bus->slots[i].words[j], 0);
+    }
+  }
+
+  atomic_init(&bus->tail, 0);
 }
 
-/*****************************************************************************
-* EventListener functions
-*****************************************************************************/
+// Copies an Event into a slot one word at a time.
+static void busStore(mfsm_BusSlot *slot, const mfsm_Event *e) {
+  uintptr_t words[BUS_EVENT_WORDS] = {0};
+  memcpy(words, e, sizeof(*e));
 
-// void initEventListener(mfsm_EventListener*)
+  size_t i = 0;
+  for (; i < BUS_EVENT_WORDS; i++) {
+    atomic_store_explicit(&slot->words[i], words[i], memory_order_relaxed);
+  }
+}
+
+// Copies the Event out of a slot one word at a time. The result is only
+// meaningful if the slot's sequence lock did not change meanwhile.
+static void busLoad(const mfsm_BusSlot *slot, mfsm_Event *dest) {
+  uintptr_t words[BUS_EVENT_WORDS];
+
+  size_t i = 0;
+  for (; i < BUS_EVENT_WORDS; i++) {
+    words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+  }
+
+  memcpy(dest, words, sizeof(*dest));
+}
+
+// int publishEvent(mfsm_EventBus*, mfsm_Event)
 //
-// Set default values for an EventListener.
+// Publishes an Event to every BusCursor reading the EventBus. Safe to call
+// from several threads at once. Waits if a publisher one lap behind is still
+// writing the slot.
 //
 // Parameters:
-// el    mfsm_EventListener*   Uninitialized EventListener struct
+// bus   mfsm_EventBus*   EventBus context
+// e     mfsm_Event       Event to be published
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventBus
+int publishEvent(mfsm_EventBus *bus, mfsm_Event e) {
+  if (bus == 0) {
+    return -1;
+  }
+
+  // Claim a sequence number; no other publisher will write it
+  unsigned int seq = atomic_fetch_add_explicit(&bus->tail, 1, memory_order_relaxed);
+  mfsm_BusSlot *slot = &bus->slots[BUS_INDEX(seq)];
+
+  // A publisher preempted after claiming its number can be lapped. Wait for
+  // the previous Event in the slot to be published so that only one
+  // publisher writes the slot at a time.
+  unsigned int prev = 2 * (seq - MAX_BUS_EVENTS) + 2;
+  while (atomic_load_explicit(&slot->seq, memory_order_acquire) != prev) {
+    sched_yield();
+  }
+
+  // Mark the slot as being written before touching the Event, so readers
+  // copying the old Event notice it changed under them.
+  atomic_store_explicit(&slot->seq, 2 * seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  busStore(slot, &e);
+
+  atomic_store_explicit(&slot->seq, 2 * seq + 2, memory_order_release);
+
+  return 0;
+}
+
+// void initBusCursor(mfsm_BusCursor*, mfsm_EventBus*)
+//
+// Set default values for a BusCursor. The cursor receives the Events
+// published after this call.
+//
+// Parameters:
+// cur   mfsm_BusCursor*   Uninitialized BusCursor struct
+// bus   mfsm_EventBus*    EventBus to read from
 //
 // Returns:
 // None
-void initEventListener(mfsm_EventListener *el) {
-  el->numEvents = 0;
+void initBusCursor(mfsm_BusCursor *cur, mfsm_EventBus *bus) {
+  cur->bus = bus;
+  cur->next = (bus == 0) ? 0 : atomic_load_explicit(&bus->tail, memory_order_acquire);
+  cur->dropped = 0;
 }
 
-// int getNextEvent(mfsm_EventListener*, mfsm_Event*)
+// Copies the Event with the cursor's next sequence number to dest. Returns 1
+// on success and 0 if it has not been published yet. Skips ahead past Events
+// that were overwritten before they could be read.
+static int busRead(mfsm_BusCursor *cur, mfsm_Event *dest) {
+  mfsm_EventBus *bus = cur->bus;
+
+  for (;;) {
+    mfsm_BusSlot *slot = &bus->slots[BUS_INDEX(cur->next)];
+    unsigned int want = 2 * cur->next + 2;
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    // Older than wanted (or still being written): nothing new yet
+    if ((int)(seq - want) < 0) {
+      return 0;
+    }
+
+    if (seq == want) {
+      mfsm_Event copy;
+      busLoad(slot, &copy);
+
+      // The copy is only good if no publisher started on the slot meanwhile
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == want) {
+        *dest = copy;
+        cur->next++;
+        return 1;
+      }
+    }
+
+    // The slot was reused by a newer Event: the cursor was lapped. Resume
+    // at the oldest Event still in the ring.
+    unsigned int tail = atomic_load_explicit(&bus->tail, memory_order_acquire);
+    unsigned int oldest = tail - MAX_BUS_EVENTS;
+    if ((int)(oldest - cur->next) <= 0) {
+      oldest = cur->next + 1;
+    }
+
+    cur->dropped += oldest - cur->next;
+    cur->next = oldest;
+  }
+}
+
+// int readBusEvent(mfsm_BusCursor*, mfsm_Event*)
 //
-// Dequeue operation. Removes the oldest Event from the EventListener and
-// copies it to a specified destination.
+// Copies the cursor's next Event to a specified destination and moves the
+// cursor past it.
 //
 // Parameters:
-// el     mfsm_EventListener*   EventListener context
-// dest   mfsm_Event*           Destination to copy the event data to
+// cur    mfsm_BusCursor*   BusCursor context
+// dest   mfsm_Event*       Destination to copy the event data to
 //
 // Returns:
-// Success: New number of events in the queue
+// Success -- 0
 // Failure:
-//  -1 -- 0/invalid EventListener
-//  -2 -- 0/invalid destination
-//  -3 -- No events to be retrieved from the EventListener
-int getNextEvent(mfsm_EventListener *el, mfsm_Event* dest) {
-  // Validate as much as possible before trying to copy data
-  if (el == 0) {
+//  -1 -- Null/invalid BusCursor
+//  -2 -- Null/invalid destination
+//  -3 -- No new events have been published
+int readBusEvent(mfsm_BusCursor *cur, mfsm_Event *dest) {
+  if (cur == 0 || cur->bus == 0) {
     return -1;
   }
 
@@ -60,58 +1002,65 @@ int getNextEvent(mfsm_EventListener *el, mfsm_Event* dest) {
     return -2;
   }
 
-  if (el->numEvents < 1) {
+  if (!busRead(cur, dest)) {
     return -3;
   }
 
-  // Copy the data from the most recent event to the destination
-  // TODO: This works for now, but make it more readable when more variables
-  // are added to the mfsm_Event structure.
-  dest->id = el->events[el->numEvents-1].id;
-
-  el->numEvents--; // Controlling the event array makes destroying the Event
-                   // unnecessary.
-
-  return el->numEvents;
+  return 0;
 }
 
-// int appendEvent(mfsm_EventListener*, Event)
+// int readBusEvents(mfsm_BusCursor*, mfsm_Event*, int)
 //
-// Enqueue operation. Adds an Event to the end of the EventListener's queue.
+// Copies up to max of the cursor's next Events, oldest first, to a
+// destination array and moves the cursor past them.
 //
 // Parameters:
-// el   mfsm_EventListener*   EventListener context
-// e    mfsm_Event            Event to be stored
+// cur    mfsm_BusCursor*   BusCursor context
+// dest   mfsm_Event*       Destination array with room for max Events
+// max    int               Largest number of Events to retrieve
 //
 // Returns:
-// Success -- New number of events in the queue
+// Success: Number of Events copied to dest
 // Failure:
-//  -1 -- Invalid EventListener
-//  -2 -- No more room in the EventListener
-int appendEvent(mfsm_EventListener *el, mfsm_Event e) {
-  // Validate as much as possible before trying to copy data
-  if (el == 0) {
+//  -1 -- Null/invalid BusCursor
+//  -2 -- Null/invalid destination
+int readBusEvents(mfsm_BusCursor *cur, mfsm_Event *dest, int max) {
+  if (cur == 0 || cur->bus == 0) {
     return -1;
   }
 
-  if (el->numEvents >= MAX_EVENTS) {
+  if (dest == 0) {
     return -2;
   }
 
-  // Copy the data from the most recent event to the destination
-  // TODO: This works for now, but make it more readable when more variables
-  // are added to the mfsm_Event structure.
-  el->events[el->numEvents].id = e.id;
-
-  el->numEvents++;
+  int count = 0;
+  while (count < max && busRead(cur, &dest[count])) {
+    count++;
+  }
 
-  return el->numEvents;
+  return count;
 }
+#endif //MFSM_NO_THREADS
 
 /*****************************************************************************
 * EventQueue functions
 *****************************************************************************/
 
+// Sets or clears the bit for listener slot i in every type the listener in
+// it subscribes to.
+static void indexListener(mfsm_EventQueue *eq, int i, uint32_t subscriptions) {
+  uint32_t bit = (uint32_t)1 << i;
+
+  int t = 0;
+  for (; t < MAX_EVENT_TYPES; t++) {
+    if (subscriptions & ((uint32_t)1 << t)) {
+      eq->typeListeners[t] |= bit;
+    } else {
+      eq->typeListeners[t] &= ~bit;
+    }
+  }
+}
+
 // void initEventQueue(mfsm_EventQueue*)
 //
 // Set default values for an EventQueue.
@@ -124,10 +1073,24 @@ int appendEvent(mfsm_EventListener *el, mfsm_Event e) {
 void initEventQueue(mfsm_EventQueue *eq) {
   eq->numListeners = 0;
 
+#ifndef MFSM_NO_THREADS
+  eq->bus = 0;
+#endif
+
   int i = 0;
   for (; i < MAX_EVENT_LISTENERS; i++) {
     eq->listeners[i] = 0;
   }
+
+  for (i = 0; i < MAX_EVENT_TYPES; i++) {
+    eq->typeListeners[i] = 0;
+  }
+
+  eq->numCallbacks = 0;
+  for (i = 0; i < MAX_EVENT_CALLBACKS; i++) {
+    eq->callbacks[i].fn = 0;
+    eq->callbacks[i].ctx = 0;
+  }
 }
 
 // int addListener(mfsm_EventQueue*, mfsm_EventListener*)
@@ -164,6 +1127,7 @@ int addListener(mfsm_EventQueue *eq, mfsm_EventListener *el) {
     if (eq->listeners[i] == 0) {
       eq->listeners[i] = el;
       eq->numListeners++;
+      indexListener(eq, i, el->subscriptions);
       return 0;
     }
   }
@@ -207,6 +1171,7 @@ int removeListener(mfsm_EventQueue *eq, mfsm_EventListener *el) {
       // Nullify the EventListener pointer
       eq->listeners[i] = 0;
       eq->numListeners--;
+      indexListener(eq, i, 0);
       return 0;
     }
   }
@@ -215,36 +1180,230 @@ int removeListener(mfsm_EventQueue *eq, mfsm_EventListener *el) {
   return -4;
 }
 
+// int refreshListener(mfsm_EventQueue*, mfsm_EventListener*)
+//
+// Updates the EventQueue after the subscriptions of one of its EventListeners
+// changed.
+//
+// Parameters:
+// eq   mfsm_EventQueue*      EventQueue context
+// el   mfsm_EventListener*   Registered EventListener
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- Invalid EventListener
+//  -3 -- EventListener was not present in the EventQueue
+int refreshListener(mfsm_EventQueue *eq, mfsm_EventListener *el) {
+  if (eq == 0) {
+    return -1;
+  }
+
+  if (el == 0) {
+    return -2;
+  }
+
+  int i = 0;
+  for (; i < MAX_EVENT_LISTENERS; i++) {
+    if (eq->listeners[i] == el) {
+      indexListener(eq, i, el->subscriptions);
+      return 0;
+    }
+  }
+
+  return -3;
+}
+
+// int addCallback(mfsm_EventQueue*, mfsm_EventCallback, void*)
+//
+// Registers a callback to be called for every Event sent through the
+// EventQueue. The same function may be registered several times with
+// different contexts.
+//
+// Parameters:
+// eq    mfsm_EventQueue*     EventQueue context
+// fn    mfsm_EventCallback   Function to call
+// ctx   void*                Context passed to fn
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- No more room in the EventQueue
+//  -3 -- Invalid callback
+int addCallback(mfsm_EventQueue *eq, mfsm_EventCallback fn, void *ctx) {
+  if (eq == 0) {
+    return -1;
+  }
+
+  if (fn == 0) {
+    return -3;
+  }
+
+  if (eq->numCallbacks >= MAX_EVENT_CALLBACKS) {
+    return -2;
+  }
+
+  int i = 0;
+  for (; i < MAX_EVENT_CALLBACKS; i++) {
+    if (eq->callbacks[i].fn == 0) {
+      eq->callbacks[i].fn = fn;
+      eq->callbacks[i].ctx = ctx;
+      eq->numCallbacks++;
+      return 0;
+    }
+  }
+
+  return -2;
+}
+
+// int removeCallback(mfsm_EventQueue*, mfsm_EventCallback, void*)
+//
+// Removes a callback registered with the same function and context.
+//
+// Parameters:
+// eq    mfsm_EventQueue*     EventQueue context
+// fn    mfsm_EventCallback   Function that was registered
+// ctx   void*                Context it was registered with
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- Invalid callback
+//  -3 -- The callback was not registered with the EventQueue
+int removeCallback(mfsm_EventQueue *eq, mfsm_EventCallback fn, void *ctx) {
+  if (eq == 0) {
+    return -1;
+  }
+
+  if (fn == 0) {
+    return -2;
+  }
+
+  int i = 0;
+  for (; i < MAX_EVENT_CALLBACKS; i++) {
+    if (eq->callbacks[i].fn == fn && eq->callbacks[i].ctx == ctx) {
+      eq->callbacks[i].fn = 0;
+      eq->callbacks[i].ctx = 0;
+      eq->numCallbacks--;
+      return 0;
+    }
+  }
+
+  return -3;
+}
+
+#ifndef MFSM_NO_THREADS
+// int setEventBus(mfsm_EventQueue*, mfsm_EventBus*)
+//
+// Makes the EventQueue publish every Event it sends to an EventBus, in
+// addition to its EventListeners. Several EventQueues may share one EventBus.
+//
+// Parameters:
+// eq    mfsm_EventQueue*   EventQueue context
+// bus   mfsm_EventBus*     EventBus to publish to, or 0 to stop publishing
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+int setEventBus(mfsm_EventQueue *eq, mfsm_EventBus *bus) {
+  if (eq == 0) {
+    return -1;
+  }
+
+  eq->bus = bus;
+
+  return 0;
+}
+#endif //MFSM_NO_THREADS
+
 // int sendEvent(mfsm_EventQueue, mfsm_Event)
 //
-// Send an event to every EventListener registered with the EventQueue.
+// Send an event to every EventListener registered with the EventQueue that
+// subscribes to its type, call every registered callback, and publish it to
+// the EventQueue's EventBus if it has one. Every listener that queues the
+// Event takes a reference to its Payload. Copies the whole EventQueue;
+// prefer sendEventPtr().
 //
 // Parameters:
 // eq   mfsm_EventQueue   EventQueue context
 // e    mfsm_Event        Event to be sent
 //
 // Returns:
-// Success -- 0
+// Success -- Number of listeners that could not queue the Event; 0 if all
+// of them did
 // Failure:
-//  -1 -- Event could not be sent to at least one listener. Confirm they are
-//  still valid.
+//  -1 -- Invalid EventQueue
 int sendEvent(mfsm_EventQueue eq, mfsm_Event e) {
-  // TODO: This function could return the number of errors as a negative
-  // number insead of a singular error code.
+  return sendEventPtr(&eq, e);
+}
+
+// int sendEventPtr(const mfsm_EventQueue*, mfsm_Event)
+//
+// Same as sendEvent(), but takes the EventQueue by pointer.
+//
+// Parameters:
+// eq   const mfsm_EventQueue*   EventQueue context
+// e    mfsm_Event               Event to be sent
+//
+// Returns:
+// Success -- Number of listeners that could not queue the Event; 0 if all
+// of them did
+// Failure:
+//  -1 -- Invalid EventQueue
+int sendEventPtr(const mfsm_EventQueue *eq, mfsm_Event e) {
+  if (eq == 0) {
+    return -1;
+  }
+
   int numErrors = 0; // Count number of listeners that were unavailable
 
-  // Try to send the events
-  int i = 0;
-  for (; i < eq.numListeners; i++) {
-    if (appendEvent(eq.listeners[i], e) < 0) {
+#ifndef MFSM_NO_THREADS
+  if (eq->bus != 0) {
+    publishEvent(eq->bus, e);
+  }
+#endif
+
+  // Try to send the events to the listeners subscribed to the type. The index
+  // has no bits for empty slots, so holes are skipped for free.
+  uint32_t targets = 0;
+  if (e.type >= 0 && e.type < MAX_EVENT_TYPES) {
+    targets = eq->typeListeners[e.type];
+  }
+
+  while (targets != 0) {
+    int i = __builtin_ctz(targets);
+    targets &= targets - 1;
+
+    // Take the listener's reference before the Event becomes visible to it
+    if (e.payload != 0) {
+      retainPayload(e.payload);
+    }
+
+    if (appendEvent(eq->listeners[i], e) < 0) {
       // Append returned an error code
       numErrors++;
+
+      if (e.payload != 0) {
+        releasePayload(e.payload);
+      }
     }
   }
 
-  if (numErrors != 0) {
-    return -1;
+  // Callbacks are called synchronously and cannot fail
+  int seen = 0;
+  int i = 0;
+  for (; i < MAX_EVENT_CALLBACKS && seen < eq->numCallbacks; i++) {
+    if (eq->callbacks[i].fn == 0) {
+      continue;
+    }
+
+    seen++;
+    eq->callbacks[i].fn(eq->callbacks[i].ctx, &e);
   }
 
-  return 0;
+  return numErrors;
 }
@@ -1,9 +1,56 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MFSM_NO_THREADS
+#include <stdatomic.h>
+#endif
+
+// The EventQueue indexes listeners with one bit per slot, so there can be at
+// most 32 of them.
 #define MAX_EVENT_LISTENERS 32
+#define MAX_EVENT_CALLBACKS 32
+
+#if MAX_EVENT_LISTENERS > 32
+#error "MAX_EVENT_LISTENERS must be at most 32"
+#endif
+
+// Event types are 0 to MAX_EVENT_TYPES - 1. Listeners subscribe to a set of
+// them with a bitmask.
+#define MAX_EVENT_TYPES 32
+#define DEFAULT_EVENT_TYPE 0
+#define ALL_EVENT_TYPES 0xFFFFFFFFu
+
+// What an EventListener does with an Event that arrives when it is full.
+// See setOverflowPolicy().
+#define MFSM_OVERFLOW_DROP_NEWEST 0 // Reject the new Event (the default)
+#define MFSM_OVERFLOW_DROP_OLDEST 1 // Overwrite the oldest queued Event
+#define MFSM_OVERFLOW_BLOCK       2 // Wait for the consumer (SPSC only)
+#define MFSM_OVERFLOW_GROW        3 // Move to larger storage once
+
+// Bytes of data carried inside every Event. Larger data goes in a Payload.
+#define EVENT_DATA_SIZE 16
+
+// Capacity of each EventListener's queue. Must be a power of two.
 #define MAX_EVENTS 32
 
+#if (MAX_EVENTS & (MAX_EVENTS - 1)) != 0
+#error "MAX_EVENTS must be a power of two"
+#endif
+
+// Capacity of an EventBus's ring. Must be a power of two.
+#define MAX_BUS_EVENTS 256
+
+#if (MAX_BUS_EVENTS & (MAX_BUS_EVENTS - 1)) != 0
+#error "MAX_BUS_EVENTS must be a power of two"
+#endif
+
+// Size of a cache line. Data written by different threads is kept this far
+// apart to avoid false sharing.
+#define MFSM_CACHE_LINE 64
+
 /*****************************************************************************
 * MFSM Event System
 *
@@ -16,29 +63,158 @@
 *
 * This is something of an Observer pattern with polling instead of function
 * pointers. This way each listening object gets its own queue of events to
-* process independently. This system will probably be redesigned at some
-* point.
+* process independently. Objects that would rather not poll can register a
+* callback with addCallback() instead; it is called for every Event as soon
+* as it is sent. Both kinds can be mixed on one EventQueue.
+*
+* For large fan-outs an EventQueue can also publish to a shared EventBus.
+* Each Event is written to the bus once, and any number of BusCursors read it
+* at their own pace.
 *****************************************************************************/
 
 
+/*****************************************************************************
+* struct Payload
+*
+* Reference counted block of data too large to carry inside an Event. Payloads
+* come from a PayloadPool, a slab of equally sized blocks in memory supplied
+* by the user, so sending one never touches the heap.
+*
+* allocPayload() returns a Payload holding one reference. sendEvent() takes
+* another for every EventListener the Event is queued on, so all of them share
+* the one copy; each receiver calls releaseEvent() once it is done with an
+* Event. The block returns to its pool when the last reference is released.
+* Transitions and compiled FSMs do not hold references: keep a Payload used
+* as a transition output alive for as long as the FSM may send it. Callbacks
+* only see the Payload during the call, and EventBus cursors hold no
+* reference either.
+*****************************************************************************/
+typedef struct mfsm_Payload{
+  struct mfsm_PayloadPool *pool; // Pool the block belongs to
+  struct mfsm_Payload *nextFree; // Next free block while in the pool
+  size_t size;                   // Bytes of data in use, set by the user
+
+#ifndef MFSM_NO_THREADS
+  atomic_int refs;
+#else
+  int refs;
+#endif
+
+  // Data area; the pool's dataSize bytes long
+  _Alignas(16) unsigned char data[];
+} mfsm_Payload;
+
+typedef struct mfsm_PayloadPool{
+  unsigned char *mem;     // User supplied memory holding the blocks
+  size_t blockSize;       // Bytes between consecutive blocks
+  size_t dataSize;        // Usable bytes of data in each block
+  int numBlocks;          // Total number of blocks
+  int numFree;            // Blocks currently in the free list
+  mfsm_Payload *freeList; // Blocks available for allocation
+
+#ifndef MFSM_NO_THREADS
+  atomic_flag lock;       // Guards the free list
+#endif
+} mfsm_PayloadPool;
+
+// size_t getPayloadPoolBytes(size_t, int)
+//
+// Finds the amount of memory needed for a PayloadPool.
+//
+// Parameters:
+// dataSize    size_t   Usable bytes of data in each Payload
+// numBlocks   int      Number of Payloads in the pool
+//
+// Returns:
+// Bytes of memory to pass to initPayloadPool()
+size_t getPayloadPoolBytes(size_t dataSize, int numBlocks);
+
+// int initPayloadPool(mfsm_PayloadPool*, void*, size_t, int)
+//
+// Set default values for a PayloadPool and carve its memory into Payloads.
+// The memory must stay valid for as long as the pool is used.
+//
+// Parameters:
+// pool        mfsm_PayloadPool*   Uninitialized PayloadPool struct
+// mem         void*               getPayloadPoolBytes() bytes of memory,
+//                                 aligned like malloc() memory
+// dataSize    size_t              Usable bytes of data in each Payload
+// numBlocks   int                 Number of Payloads in the pool
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid PayloadPool
+//  -2 -- Null or misaligned memory
+//  -3 -- Invalid number of blocks
+int initPayloadPool(mfsm_PayloadPool *pool, void *mem, size_t dataSize, int numBlocks);
+
+// mfsm_Payload* allocPayload(mfsm_PayloadPool*)
+//
+// Takes a Payload from the pool. It starts with one reference and a size of
+// 0.
+//
+// Parameters:
+// pool   mfsm_PayloadPool*   PayloadPool context
+//
+// Returns:
+// Success: The Payload
+// Failure: 0 if the pool is invalid or empty
+mfsm_Payload *allocPayload(mfsm_PayloadPool *pool);
+
+// int retainPayload(mfsm_Payload*)
+//
+// Adds a reference to a Payload.
+//
+// Parameters:
+// p   mfsm_Payload*   Payload context
+//
+// Returns:
+// Success: New number of references
+// Failure:
+//  -1 -- Invalid Payload
+int retainPayload(mfsm_Payload *p);
+
+// int releasePayload(mfsm_Payload*)
+//
+// Drops a reference to a Payload, returning it to its pool when none are left.
+//
+// Parameters:
+// p   mfsm_Payload*   Payload context
+//
+// Returns:
+// Success: Number of references left
+// Failure:
+//  -1 -- Invalid Payload
+int releasePayload(mfsm_Payload *p);
+
 /*****************************************************************************
 * struct Event
 *
 * Stores data for input/output events sent from Finite State Machine
 * transitions.
 *
-* TODO: Add a type variable and the ability to receive only events of specific
-* types.
+* The type groups Events for delivery: an EventListener only receives Events
+* whose type it subscribes to. See setSubscriptions().
+*
+* Small context (a byte range, a timestamp, a handle) fits in data and is
+* copied with the Event. Anything larger goes in a pooled Payload, which is
+* shared instead of copied.
 *****************************************************************************/
 typedef struct mfsm_Event{
   // Unique identifier for the event. Preferably used with an enumerated type
   // made by the user.
   int id; 
+  int type; // 0 to MAX_EVENT_TYPES - 1
+
+  unsigned char data[EVENT_DATA_SIZE]; // Inline data, copied with the Event
+  mfsm_Payload *payload;               // Shared data, or 0
 } mfsm_Event;
 
 // void initEvent(mfsm_Event*, int)
 //
-// Set default values for an Event.
+// Set default values for an Event. The type is DEFAULT_EVENT_TYPE, data is
+// zeroed and there is no Payload.
 //
 // Parameters:
 // e    mfsm_Event*   Uninitialized Event struct
@@ -48,15 +224,116 @@ typedef struct mfsm_Event{
 // None
 void initEvent(mfsm_Event *e, int id);
 
+// void initTypedEvent(mfsm_Event*, int, int)
+//
+// Set default values for an Event of a specific type.
+//
+// Parameters:
+// e      mfsm_Event*   Uninitialized Event struct
+// id     int           Unique identifier for the event
+// type   int           Type of the event, 0 to MAX_EVENT_TYPES - 1
+//
+// Returns:
+// None
+void initTypedEvent(mfsm_Event *e, int id, int type);
+
+// int setEventData(mfsm_Event*, const void*, size_t)
+//
+// Copies data into an Event's inline data area.
+//
+// Parameters:
+// e      mfsm_Event*   Event context
+// src    const void*   Data to copy
+// size   size_t        Bytes to copy, at most EVENT_DATA_SIZE
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid Event
+//  -2 -- Null data or size larger than EVENT_DATA_SIZE
+int setEventData(mfsm_Event *e, const void *src, size_t size);
+
+// int isSameEvent(const mfsm_Event*, const mfsm_Event*)
+//
+// Compares two Events field by field, including their inline data and
+// Payload pointer.
+//
+// Parameters:
+// a   const mfsm_Event*   First Event
+// b   const mfsm_Event*   Second Event
+//
+// Returns:
+// 1 if the Events are equal, otherwise 0
+int isSameEvent(const mfsm_Event *a, const mfsm_Event *b);
+
+// void releaseEvent(mfsm_Event*)
+//
+// Releases the reference to the Event's Payload, if it has one. Call once for
+// every Event retrieved from an EventListener when done with it.
+//
+// Parameters:
+// e   mfsm_Event*   Event context
+//
+// Returns:
+// None
+void releaseEvent(mfsm_Event *e);
+
 /*****************************************************************************
 * struct EventListener
 *
 * Stores Events for processing at the receiver's convenience. Poll numEvents
-* for changes, then use getNextEvent() to retrieve them one at a time.
+* for changes, then use getNextEvent() to retrieve them one at a time, or
+* getEvents() to retrieve several at once.
+*
+* By default a listener receives Events of every type. setSubscriptions()
+* narrows that down; an EventQueue then skips the listener for other types
+* without touching its queue.
+*
+* The events array is a ring buffer. The oldest Event is at index head and
+* the queue wraps around the end of the array. A listener using the
+* MFSM_OVERFLOW_GROW policy moves to the larger storage given to
+* setOverflowStorage() when events fills up; from then on the queue lives in
+* grown.
+*
+* dropped counts Events the listener lost to overflow and highWater is the
+* most Events it has held at once. Both are only written by the sender.
+*
+* Events are queued by value, data included, so the events array takes
+* MAX_EVENTS * sizeof(mfsm_Event) bytes: 1 KB of a 1216 byte listener with
+* the defaults on 64 bit machines. Lower MAX_EVENTS or EVENT_DATA_SIZE above
+* where that matters.
+*
+* A listener set up with initSPSCEventListener() may have Events appended by
+* one thread (eg. the thread running the FSM) while another thread retrieves
+* them, without locks. Such listeners track the queue with the atomic
+* spscHead/spscTail counters instead of head and numEvents; poll them with
+* getNumEvents(). Not available when built with MFSM_NO_THREADS.
 *****************************************************************************/
 typedef struct mfsm_EventListener{
   mfsm_Event events[MAX_EVENTS]; // Events waiting for processing
+  int head;                      // Index of the oldest Event
   int numEvents;                 // Number of Events in the events array
+  uint32_t subscriptions;        // Bit t set to receive Events of type t
+
+  int overflow;           // Overflow policy, one of MFSM_OVERFLOW_*
+  int capacity;           // Size of the ring in use, a power of two
+  mfsm_Event *grown;      // Ring in use once grown, otherwise 0
+  mfsm_Event *spare;      // Storage to grow into, or 0
+  int spareCapacity;      // Size of spare
+  unsigned int dropped;   // Events lost to overflow
+  int highWater;          // Most Events queued at once
+#ifdef MFSM_STATS
+  unsigned int delivered; // Events queued (see stats.h)
+#endif
+
+#ifndef MFSM_NO_THREADS
+  int spsc; // Non-zero for single-producer/single-consumer listeners
+
+  // Free running counts of Events retrieved (written by the consumer) and
+  // appended (written by the producer). Each has its own cache line.
+  _Alignas(MFSM_CACHE_LINE) atomic_uint spscHead;
+  _Alignas(MFSM_CACHE_LINE) atomic_uint spscTail;
+#endif
 } mfsm_EventListener;
 
 
@@ -71,6 +348,93 @@ typedef struct mfsm_EventListener{
 // None
 void initEventListener(mfsm_EventListener *el);
 
+#ifndef MFSM_NO_THREADS
+// void initSPSCEventListener(mfsm_EventListener*)
+//
+// Set default values for a single-producer/single-consumer EventListener.
+// One thread may append Events (directly or through sendEvent()) while one
+// other thread retrieves them. appendEvent(), getNextEvent() and getEvents()
+// work as usual, but numEvents is not updated; use getNumEvents().
+//
+// Parameters:
+// el    mfsm_EventListener*   Uninitialized EventListener struct
+//
+// Returns:
+// None
+void initSPSCEventListener(mfsm_EventListener *el);
+#endif //MFSM_NO_THREADS
+
+// int setSubscriptions(mfsm_EventListener*, uint32_t)
+//
+// Chooses the Event types an EventListener receives. EventQueues read the
+// subscriptions when the listener is added; call refreshListener() on each
+// EventQueue the listener is already registered with.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// mask   uint32_t              Bit t set to receive Events of type t, or
+//                              ALL_EVENT_TYPES
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener
+int setSubscriptions(mfsm_EventListener *el, uint32_t mask);
+
+// int setOverflowPolicy(mfsm_EventListener*, int)
+//
+// Chooses what happens to Events sent to the EventListener while it is full.
+// MFSM_OVERFLOW_DROP_NEWEST rejects them. MFSM_OVERFLOW_DROP_OLDEST makes room
+// by discarding the oldest queued Event; not available for SPSC listeners.
+// MFSM_OVERFLOW_BLOCK makes the sender spin until the consumer makes room;
+// only available for SPSC listeners. MFSM_OVERFLOW_GROW moves the queue to
+// the storage given to setOverflowStorage(), then rejects Events once that is
+// full too; not available for SPSC listeners.
+//
+// Parameters:
+// el       mfsm_EventListener*   EventListener context
+// policy   int                   One of MFSM_OVERFLOW_*
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Unknown policy, or policy not available for this kind of listener
+int setOverflowPolicy(mfsm_EventListener *el, int policy);
+
+// int setOverflowStorage(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Gives an EventListener larger storage to move its queue to under the
+// MFSM_OVERFLOW_GROW policy. The storage must stay valid for as long as the
+// listener is used.
+//
+// Parameters:
+// el         mfsm_EventListener*   EventListener context
+// storage    mfsm_Event*           Array of capacity Events
+// capacity   int                   Power of two larger than MAX_EVENTS
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid EventListener, or it has already grown
+//  -2 -- Null storage
+//  -3 -- Capacity is not a power of two larger than MAX_EVENTS
+int setOverflowStorage(mfsm_EventListener *el, mfsm_Event *storage, int capacity);
+
+// int getNumEvents(mfsm_EventListener*)
+//
+// Finds the number of Events waiting in the EventListener. Works for every
+// kind of EventListener.
+//
+// Parameters:
+// el    mfsm_EventListener*   EventListener context
+//
+// Returns:
+// Success: Number of Events in the queue
+// Failure:
+//  -1 -- Null/invalid EventListener
+int getNumEvents(mfsm_EventListener *el);
+
 // int getNextEvent(mfsm_EventListener*, mfsm_Event*)
 //
 // Dequeue operation. Removes the oldest Event from the EventListener and
@@ -81,16 +445,53 @@ void initEventListener(mfsm_EventListener *el);
 // dest   mfsm_Event*           Destination to copy the event data to
 //
 // Returns:
-// Success: New number of events in the stack
+// Success: New number of events in the queue
 // Failure:
 //  -1 -- Null/invalid EventListener
 //  -2 -- Null/invalid destination
 //  -3 -- No events to be retrieved from the EventListener
 int getNextEvent(mfsm_EventListener *el, mfsm_Event* dest);
 
+// int getEvents(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Bulk dequeue operation. Removes up to max of the oldest Events from the
+// EventListener and copies them, oldest first, to a destination array.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// dest   mfsm_Event*           Destination array with room for max Events
+// max    int                   Largest number of Events to retrieve
+//
+// Returns:
+// Success: Number of Events copied to dest
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Null/invalid destination
+int getEvents(mfsm_EventListener *el, mfsm_Event *dest, int max);
+
+// int peekEvents(mfsm_EventListener*, mfsm_Event*, int)
+//
+// Copies up to max of the oldest Events, oldest first, to a destination
+// array without removing them from the EventListener. Payload references are
+// not added. For SPSC listeners, only call it from the consumer thread.
+//
+// Parameters:
+// el     mfsm_EventListener*   EventListener context
+// dest   mfsm_Event*           Destination array with room for max Events
+// max    int                   Largest number of Events to copy
+//
+// Returns:
+// Success: Number of Events copied to dest
+// Failure:
+//  -1 -- Null/invalid EventListener
+//  -2 -- Null/invalid destination
+int peekEvents(mfsm_EventListener *el, mfsm_Event *dest, int max);
+
 // int appendEvent(mfsm_EventListener*, Event)
 //
 // Enqueue operation. Adds an Event to the end of the EventListener's queue.
+// A full listener follows its overflow policy. Events discarded by
+// MFSM_OVERFLOW_DROP_OLDEST have their Payload reference released.
 //
 // Parameters:
 // el   mfsm_EventListener*   EventListener context
@@ -103,15 +504,175 @@ int getNextEvent(mfsm_EventListener *el, mfsm_Event* dest);
 //  -2 -- No more room in the EventListener
 int appendEvent(mfsm_EventListener *el, mfsm_Event e);
 
+#ifndef MFSM_NO_THREADS
+/*****************************************************************************
+* struct EventBus
+*
+* Multi-producer/multi-consumer broadcast ring. Any number of threads may
+* publish Events while any number of BusCursors read them, without locks.
+* Every published Event gets the next sequence number and is written once to
+* slot (sequence % MAX_BUS_EVENTS); readers never remove Events, so the bus
+* does not know or care how many of them there are.
+*
+* Publishers do not wait for readers. A publisher only waits when the
+* publisher one lap (MAX_BUS_EVENTS Events) before it has not finished writing
+* the same slot, so each slot has one writer at a time. A reader that falls
+* more than MAX_BUS_EVENTS behind loses the overwritten Events; its cursor
+* skips ahead and counts them in dropped. Not available when built with
+* MFSM_NO_THREADS.
+*****************************************************************************/
+
+// Number of words each EventBus slot stores its Event in
+#define BUS_EVENT_WORDS \
+  ((sizeof(mfsm_Event) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t))
+
+typedef struct mfsm_BusSlot{
+  // Sequence lock for the slot: 2 * sequence + 1 while the Event with that
+  // sequence number is being written, 2 * sequence + 2 once it is published.
+  atomic_uint seq;
+
+  // The Event, copied in and out a word at a time with relaxed atomics so
+  // readers racing a publisher see torn data rather than undefined behavior.
+  // The sequence lock tells them to discard it.
+  atomic_uintptr_t words[BUS_EVENT_WORDS];
+} mfsm_BusSlot;
+
+typedef struct mfsm_EventBus{
+  mfsm_BusSlot slots[MAX_BUS_EVENTS];
+
+  // Sequence number of the next Event to publish. Kept on its own cache line
+  // since every publisher writes it.
+  _Alignas(MFSM_CACHE_LINE) atomic_uint tail;
+} mfsm_EventBus;
+
+/*****************************************************************************
+* struct BusCursor
+*
+* One reader's position in an EventBus. Each cursor must only be used by one
+* thread at a time.
+*****************************************************************************/
+typedef struct mfsm_BusCursor{
+  mfsm_EventBus *bus;   // EventBus being read
+  unsigned int next;    // Sequence number of the next Event to read
+  unsigned int dropped; // Events overwritten before they could be read
+} mfsm_BusCursor;
+
+// void initEventBus(mfsm_EventBus*)
+//
+// Set default values for an EventBus.
+//
+// Parameters:
+// bus   mfsm_EventBus*   Uninitialized EventBus struct
+//
+// Returns:
+// None
+void initEventBus(mfsm_EventBus *bus);
+
+// int publishEvent(mfsm_EventBus*, mfsm_Event)
+//
+// Publishes an Event to every BusCursor reading the EventBus. Safe to call
+// from several threads at once. Waits if a publisher one lap behind is still
+// writing the slot.
+//
+// Parameters:
+// bus   mfsm_EventBus*   EventBus context
+// e     mfsm_Event       Event to be published
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventBus
+int publishEvent(mfsm_EventBus *bus, mfsm_Event e);
+
+// void initBusCursor(mfsm_BusCursor*, mfsm_EventBus*)
+//
+// Set default values for a BusCursor. The cursor receives the Events
+// published after this call.
+//
+// Parameters:
+// cur   mfsm_BusCursor*   Uninitialized BusCursor struct
+// bus   mfsm_EventBus*    EventBus to read from
+//
+// Returns:
+// None
+void initBusCursor(mfsm_BusCursor *cur, mfsm_EventBus *bus);
+
+// int readBusEvent(mfsm_BusCursor*, mfsm_Event*)
+//
+// Copies the cursor's next Event to a specified destination and moves the
+// cursor past it.
+//
+// Parameters:
+// cur    mfsm_BusCursor*   BusCursor context
+// dest   mfsm_Event*       Destination to copy the event data to
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Null/invalid BusCursor
+//  -2 -- Null/invalid destination
+//  -3 -- No new events have been published
+int readBusEvent(mfsm_BusCursor *cur, mfsm_Event *dest);
+
+// int readBusEvents(mfsm_BusCursor*, mfsm_Event*, int)
+//
+// Copies up to max of the cursor's next Events, oldest first, to a
+// destination array and moves the cursor past them.
+//
+// Parameters:
+// cur    mfsm_BusCursor*   BusCursor context
+// dest   mfsm_Event*       Destination array with room for max Events
+// max    int               Largest number of Events to retrieve
+//
+// Returns:
+// Success: Number of Events copied to dest
+// Failure:
+//  -1 -- Null/invalid BusCursor
+//  -2 -- Null/invalid destination
+int readBusEvents(mfsm_BusCursor *cur, mfsm_Event *dest, int max);
+#endif //MFSM_NO_THREADS
+
+/*****************************************************************************
+* struct EventCallback
+*
+* Function called synchronously by sendEvent() (and so by doTransition()) for
+* every Event sent through an EventQueue, with the context pointer it was
+* registered with. The Event is only valid for the duration of the call. The
+* callback must not add or remove listeners or callbacks on the EventQueue
+* that is calling it.
+*****************************************************************************/
+typedef void (*mfsm_EventCallback)(void *ctx, const mfsm_Event *e);
+
+typedef struct mfsm_CallbackListener{
+  mfsm_EventCallback fn; // Function to call, or 0 for an empty slot
+  void *ctx;             // Passed back to fn unchanged
+} mfsm_CallbackListener;
+
 /*****************************************************************************
 * struct EventQueue
 *
-* Stores EventListeners for sending events.
+* Stores EventListeners for sending events, and optionally an EventBus to
+* publish them to.
+*
+* typeListeners indexes the listeners by subscription, so sending an Event
+* only visits the listeners that want its type.
 *****************************************************************************/
 typedef struct mfsm_EventQueue{
-  // Registered listeners to send Events to
+  // Registered listeners to send Events to. Removing a listener leaves a
+  // hole, so numListeners is not the index of the last one.
   mfsm_EventListener *listeners[MAX_EVENT_LISTENERS];
   int numListeners; // Number of EventListeners currently registered
+
+  // Bit i of typeListeners[t] is set when listeners[i] subscribes to type t
+  uint32_t typeListeners[MAX_EVENT_TYPES];
+
+  // Registered callbacks. Like listeners, removal leaves holes.
+  mfsm_CallbackListener callbacks[MAX_EVENT_CALLBACKS];
+  int numCallbacks; // Number of callbacks currently registered
+
+#ifndef MFSM_NO_THREADS
+  mfsm_EventBus *bus; // EventBus to publish to, or 0
+#endif
 } mfsm_EventQueue;
 
 // void initEventQueue(mfsm_EventQueue*)
@@ -157,19 +718,108 @@ int addListener(mfsm_EventQueue *eq, mfsm_EventListener *el);
 //  -3 -- EventListener was not present in the EventQueue
 int removeListener(mfsm_EventQueue *eq, mfsm_EventListener *el);
 
+// int addCallback(mfsm_EventQueue*, mfsm_EventCallback, void*)
+//
+// Registers a callback to be called for every Event sent through the
+// EventQueue. The same function may be registered several times with
+// different contexts.
+//
+// Parameters:
+// eq    mfsm_EventQueue*     EventQueue context
+// fn    mfsm_EventCallback   Function to call
+// ctx   void*                Context passed to fn
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- No more room in the EventQueue
+//  -3 -- Invalid callback
+int addCallback(mfsm_EventQueue *eq, mfsm_EventCallback fn, void *ctx);
+
+// int removeCallback(mfsm_EventQueue*, mfsm_EventCallback, void*)
+//
+// Removes a callback registered with the same function and context.
+//
+// Parameters:
+// eq    mfsm_EventQueue*     EventQueue context
+// fn    mfsm_EventCallback   Function that was registered
+// ctx   void*                Context it was registered with
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- Invalid callback
+//  -3 -- The callback was not registered with the EventQueue
+int removeCallback(mfsm_EventQueue *eq, mfsm_EventCallback fn, void *ctx);
+
+// int refreshListener(mfsm_EventQueue*, mfsm_EventListener*)
+//
+// Updates the EventQueue after the subscriptions of one of its EventListeners
+// changed.
+//
+// Parameters:
+// eq   mfsm_EventQueue*      EventQueue context
+// el   mfsm_EventListener*   Registered EventListener
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+//  -2 -- Invalid EventListener
+//  -3 -- EventListener was not present in the EventQueue
+int refreshListener(mfsm_EventQueue *eq, mfsm_EventListener *el);
+
+#ifndef MFSM_NO_THREADS
+// int setEventBus(mfsm_EventQueue*, mfsm_EventBus*)
+//
+// Makes the EventQueue publish every Event it sends to an EventBus, in
+// addition to its EventListeners. Several EventQueues may share one EventBus.
+//
+// Parameters:
+// eq    mfsm_EventQueue*   EventQueue context
+// bus   mfsm_EventBus*     EventBus to publish to, or 0 to stop publishing
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid EventQueue
+int setEventBus(mfsm_EventQueue *eq, mfsm_EventBus *bus);
+#endif //MFSM_NO_THREADS
+
 // int sendEvent(mfsm_EventQueue, mfsm_Event)
 //
-// Send an event to every EventListener registered with the EventQueue.
+// Send an event to every EventListener registered with the EventQueue that
+// subscribes to its type, call every registered callback, and publish it to
+// the EventQueue's EventBus if it has one. Every listener that queues the
+// Event takes a reference to its Payload. Copies the whole EventQueue;
+// prefer sendEventPtr().
 //
 // Parameters:
 // eq   mfsm_EventQueue   EventQueue context
 // e    mfsm_Event        Event to be sent
 //
 // Returns:
-// Success -- 0
+// Success -- Number of listeners that could not queue the Event; 0 if all
+// of them did
 // Failure:
-//  -1 -- Event could not be sent to at least one listener. Confirm they are
-//  still valid.
+//  -1 -- Invalid EventQueue
 int sendEvent(mfsm_EventQueue eq, mfsm_Event e);
 
+// int sendEventPtr(const mfsm_EventQueue*, mfsm_Event)
+//
+// Same as sendEvent(), but takes the EventQueue by pointer.
+//
+// Parameters:
+// eq   const mfsm_EventQueue*   EventQueue context
+// e    mfsm_Event               Event to be sent
+//
+// Returns:
+// Success -- Number of listeners that could not queue the Event; 0 if all
+// of them did
+// Failure:
+//  -1 -- Invalid EventQueue
+int sendEventPtr(const mfsm_EventQueue *eq, mfsm_Event e);
+
 #endif //EVENT_H
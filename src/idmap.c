@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include "idmap.h"
+
+// Multiplicative (Fibonacci) hash. The product's low bits only depend on
+// the ID's low bits, so IDs with a power of two stride (eg. every multiple of
+// 256) would share a handful of slots; the well mixed high bits are scaled
+// into the table instead. For a table of 2^b slots this is the top b bits of
+// the product, and any other size works too.
+static int idMapHash(int id, int size) {
+  uint32_t h = (uint32_t)id * 2654435769u;
+  return (int)(((uint64_t)h * (uint32_t)size) >> 32);
+}
+
+// void idMapClear(int*, int)
+//
+// Mark every slot in the table as empty.
+//
+// Parameters:
+// slots  int*  Table storage
+// size   int   Number of slots in the table
+//
+// Returns:
+// None
+void idMapClear(int *slots, int size) {
+  int i = 0;
+  for (; i < size; i++) {
+    slots[i] = 0;
+  }
+}
+
+// int idMapFind(const int*, int, const int*, int)
+//
+// Finds the index of an ID in the parallel ID array.
+//
+// Parameters:
+// slots  const int*  Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// id     int         ID to look up
+//
+// Returns:
+// Success -- Index of the ID in the ids array
+// Failure -- -1
+int idMapFind(const int *slots, int size, const int *ids, int id) {
+  int h = idMapHash(id, size);
+  int probes = 0;
+
+  // Walk the probe sequence until an empty slot ends it
+  for (; probes < size && slots[h] != 0; probes++) {
+    if (ids[slots[h]-1] == id) {
+      return slots[h]-1;
+    }
+
+    h = (h + 1 == size) ? 0 : h + 1;
+  }
+
+  return -1;
+}
+
+// int idMapInsert(int*, int, const int*, int)
+//
+// Records the ID stored at ids[index] in the table. The ID must not already
+// be present.
+//
+// Parameters:
+// slots  int*        Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// index  int         Index of the ID in the ids array
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- The table is full
+int idMapInsert(int *slots, int size, const int *ids, int index) {
+  int h = idMapHash(ids[index], size);
+  int probes = 0;
+
+  for (; probes < size; probes++) {
+    if (slots[h] == 0) {
+      slots[h] = index + 1;
+      return 0;
+    }
+
+    h = (h + 1 == size) ? 0 : h + 1;
+  }
+
+  return -1;
+}
+
+// int idMapRemove(int*, int, const int*, int)
+//
+// Removes an ID from the table. Must be called before the ID is cleared from
+// the ids array.
+//
+// Parameters:
+// slots  int*        Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// id     int         ID to remove
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- The ID could not be found
+int idMapRemove(int *slots, int size, const int *ids, int id) {
+  // Find the slot holding the ID
+  int h = idMapHash(id, size);
+  int probes = 0;
+  for (; probes < size && slots[h] != 0; probes++) {
+    if (ids[slots[h]-1] == id) {
+      break;
+    }
+
+    h = (h + 1 == size) ? 0 : h + 1;
+  }
+
+  if (probes == size || slots[h] == 0) {
+    return -1;
+  }
+
+  // Empty the slot, then shift back any later entries in the run which would
+  // no longer be reachable from their home slot.
+  int hole = h;
+  slots[hole] = 0;
+
+  int next = (hole + 1 == size) ? 0 : hole + 1;
+  while (slots[next] != 0) {
+    int home = idMapHash(ids[slots[next]-1], size);
+
+    // Move the entry if its home slot is not cyclically within (hole, next]
+    int reachable = (hole <= next) ? (hole < home && home <= next)
+                                   : (hole < home || home <= next);
+    if (!reachable) {
+      slots[hole] = slots[next];
+      slots[next] = 0;
+      hole = next;
+    }
+
+    next = (next + 1 == size) ? 0 : next + 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+/*****************************************************************************
+* ID Maps
+*
+* Small open-addressed hash tables which map user supplied IDs to their index
+* in a parallel array of IDs (eg. mfsm_fsm.states). The table only stores
+* index+1 in each slot, with 0 marking an empty slot, so the key is always read
+* back from the ID array. Collisions are resolved with linear probing and
+* removals shift the following entries back, so no tombstones are needed.
+*
+* The table should have at least twice as many slots as there are IDs to keep
+* probe sequences short. Small, dense IDs land in their own slot which makes
+* the table behave like a direct index in the common case.
+*****************************************************************************/
+
+// void idMapClear(int*, int)
+//
+// Mark every slot in the table as empty.
+//
+// Parameters:
+// slots  int*  Table storage
+// size   int   Number of slots in the table
+//
+// Returns:
+// None
+void idMapClear(int *slots, int size);
+
+// int idMapFind(const int*, int, const int*, int)
+//
+// Finds the index of an ID in the parallel ID array.
+//
+// Parameters:
+// slots  const int*  Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// id     int         ID to look up
+//
+// Returns:
+// Success -- Index of the ID in the ids array
+// Failure -- -1
+int idMapFind(const int *slots, int size, const int *ids, int id);
+
+// int idMapInsert(int*, int, const int*, int)
+//
+// Records the ID stored at ids[index] in the table. The ID must not already
+// be present.
+//
+// Parameters:
+// slots  int*        Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// index  int         Index of the ID in the ids array
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- The table is full
+int idMapInsert(int *slots, int size, const int *ids, int index);
+
+// int idMapRemove(int*, int, const int*, int)
+//
+// Removes an ID from the table. Must be called before the ID is cleared from
+// the ids array.
+//
+// Parameters:
+// slots  int*        Table storage
+// size   int         Number of slots in the table
+// ids    const int*  ID array the table indexes into
+// id     int         ID to remove
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- The ID could not be found
+int idMapRemove(int *slots, int size, const int *ids, int id);
+
+#endif //IDMAP_H
@@ -0,0 +1,385 @@
+#include <string.h>
+#include "image.h"
+
+#ifndef MFSM_NO_MMAP
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Number of tables in an image.
+#define IMAGE_TABLES 8
+
+// Rounds a byte count up to the image alignment.
+#define ALIGN_IMAGE(n) (((n) + MFSM_IMAGE_ALIGN - 1) & ~(uint64_t)(MFSM_IMAGE_ALIGN - 1))
+
+// Finds the size of each table of a compiled FSM, in image order.
+static void getTableSizes(const mfsm_ImageHeader *h, uint64_t *sizes) {
+  uint64_t cells = (uint64_t)h->numStates * (uint64_t)h->numInputs;
+
+  sizes[0] = sizeof(int) * (uint64_t)h->numStates;
+  sizes[1] = sizeof(int) * (uint64_t)h->numInputs;
+  sizes[2] = sizeof(int) * (uint64_t)h->stateMapSize;
+  sizes[3] = sizeof(int) * (uint64_t)h->inputMapSize;
+  sizes[4] = sizeof(mfsm_Accept) * (uint64_t)h->numStates;
+  sizes[5] = sizeof(mfsm_Event) * (uint64_t)h->numEvents;
+  sizes[6] = sizeof(uint16_t) * cells;
+  sizes[7] = sizeof(uint16_t) * cells;
+}
+
+// Points at each table offset of a header, in image order.
+static void getTableOffsets(mfsm_ImageHeader *h, uint64_t **offsets) {
+  offsets[0] = &h->stateIDs;
+  offsets[1] = &h->inputIDs;
+  offsets[2] = &h->stateMap;
+  offsets[3] = &h->inputMap;
+  offsets[4] = &h->accepts;
+  offsets[5] = &h->events;
+  offsets[6] = &h->next;
+  offsets[7] = &h->outputs;
+}
+
+// Finds each table of a compiled FSM, in image order.
+static void getTables(const mfsm_CompiledFSM *c, const void **tables) {
+  tables[0] = c->stateIDs;
+  tables[1] = c->inputIDs;
+  tables[2] = c->stateMap;
+  tables[3] = c->inputMap;
+  tables[4] = c->accepts;
+  tables[5] = c->events;
+  tables[6] = c->next;
+  tables[7] = c->outputs;
+}
+
+// Fills in the header of a compiled FSM's image. Returns -1 for an invalid
+// compiled FSM or -3 if an output Event has a payload.
+static int makeHeader(const mfsm_CompiledFSM *c, mfsm_ImageHeader *h) {
+  if (c == 0 || c->next == 0) {
+    return -1;
+  }
+
+  int i = 0;
+  for (; i < c->numEvents; i++) {
+    if (c->events[i].payload != 0) {
+      return -3;
+    }
+  }
+
+  memset(h, 0, sizeof(*h));
+  h->magic = MFSM_IMAGE_MAGIC;
+  h->version = MFSM_IMAGE_VERSION;
+  h->byteOrder = MFSM_IMAGE_BYTE_ORDER;
+  h->eventSize = sizeof(mfsm_Event);
+  h->numStates = c->numStates;
+  h->numInputs = c->numInputs;
+  h->numEvents = c->numEvents;
+  h->stateMapSize = c->stateMapSize;
+  h->inputMapSize = c->inputMapSize;
+
+  // Tables follow the header in order. outputs is not aligned separately so
+  // it stays directly after next.
+  uint64_t sizes[IMAGE_TABLES];
+  uint64_t *offsets[IMAGE_TABLES];
+  getTableSizes(h, sizes);
+  getTableOffsets(h, offsets);
+
+  uint64_t pos = ALIGN_IMAGE(sizeof(*h));
+  for (i = 0; i < IMAGE_TABLES; i++) {
+    *offsets[i] = pos;
+    pos += sizes[i];
+    if (i < IMAGE_TABLES - 2) {
+      pos = ALIGN_IMAGE(pos);
+    }
+  }
+
+  h->size = ALIGN_IMAGE(pos);
+
+  return 0;
+}
+
+// size_t getCompiledImageSize(const mfsm_CompiledFSM*)
+//
+// Finds the number of bytes needed to write a compiled FSM as an image.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+//
+// Returns:
+// Size of the image in bytes, or 0 for an invalid compiled FSM
+size_t getCompiledImageSize(const mfsm_CompiledFSM *c) {
+  mfsm_ImageHeader h;
+  if (makeHeader(c, &h) == -1) {
+    return 0;
+  }
+
+  return (size_t)h.size;
+}
+
+// int writeCompiledImage(const mfsm_CompiledFSM*, void*, size_t)
+//
+// Writes a compiled FSM as an image.
+//
+// Parameters:
+// c      const mfsm_CompiledFSM*   Compiled FSM context
+// buf    void*                     Buffer receiving the image, aligned to
+//                                  MFSM_IMAGE_ALIGN
+// size   size_t                    Size of buf
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- buf is too small or not aligned
+//  -3 -- An output Event has a payload
+int writeCompiledImage(const mfsm_CompiledFSM *c, void *buf, size_t size) {
+  mfsm_ImageHeader h;
+  int result = makeHeader(c, &h);
+  if (result != 0) {
+    return result;
+  }
+
+  if (buf == 0 || size < h.size || (uintptr_t)buf % MFSM_IMAGE_ALIGN != 0) {
+    return -2;
+  }
+
+  uint64_t sizes[IMAGE_TABLES];
+  uint64_t *offsets[IMAGE_TABLES];
+  const void *tables[IMAGE_TABLES];
+  getTableSizes(&h, sizes);
+  getTableOffsets(&h, offsets);
+  getTables(c, tables);
+
+  // Zero the padding so equal FSMs give byte for byte equal images
+  unsigned char *out = buf;
+  memset(out, 0, (size_t)h.size);
+  memcpy(out, &h, sizeof(h));
+
+  int i = 0;
+  for (; i < IMAGE_TABLES; i++) {
+    if (sizes[i] > 0) {
+      memcpy(out + *offsets[i], tables[i], (size_t)sizes[i]);
+    }
+  }
+
+  return 0;
+}
+
+// int loadCompiledImage(mfsm_CompiledFSM*, const void*, size_t)
+//
+// Sets up a compiled FSM to use an image in place. The image must stay
+// valid and unchanged for as long as the compiled FSM is used.
+// freeCompiledFSM() does not release it.
+//
+// Parameters:
+// c      mfsm_CompiledFSM*   Uninitialized compiled FSM
+// image  const void*         Image, aligned to MFSM_IMAGE_ALIGN
+// size   size_t              Size of the image
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not an image
+//  -2 -- The image was written by another version or kind of machine
+//  -3 -- The image is truncated, corrupt or not aligned
+int loadCompiledImage(mfsm_CompiledFSM *c, const void *image, size_t size) {
+  if (image == 0 || size < sizeof(mfsm_ImageHeader)) {
+    return -1;
+  }
+
+  if ((uintptr_t)image % MFSM_IMAGE_ALIGN != 0) {
+    return -3;
+  }
+
+  mfsm_ImageHeader h = *(const mfsm_ImageHeader*)image;
+  if (h.magic != MFSM_IMAGE_MAGIC) {
+    return -1;
+  }
+
+  if (h.version != MFSM_IMAGE_VERSION || h.byteOrder != MFSM_IMAGE_BYTE_ORDER ||
+      h.eventSize != sizeof(mfsm_Event)) {
+    return -2;
+  }
+
+  if (h.size > size || h.numStates < 0 || h.numInputs < 0 ||
+      h.numStates > MAX_COMPILED_INDEX || h.numInputs > MAX_COMPILED_INDEX ||
+      h.numEvents < 0 || h.numEvents > MAX_COMPILED_INDEX ||
+      h.stateMapSize <= h.numStates || h.inputMapSize <= h.numInputs) {
+    return -3;
+  }
+
+  // Every table must be inside the image and aligned, except outputs which
+  // must directly follow next (see mfsm_CompiledFSM)
+  uint64_t sizes[IMAGE_TABLES];
+  uint64_t *offsets[IMAGE_TABLES];
+  getTableSizes(&h, sizes);
+  getTableOffsets(&h, offsets);
+
+  int i = 0;
+  for (; i < IMAGE_TABLES; i++) {
+    uint64_t at = *offsets[i];
+    if (at < sizeof(h) || at > h.size || sizes[i] > h.size - at ||
+        (i < IMAGE_TABLES - 1 && at % MFSM_IMAGE_ALIGN != 0)) {
+      return -3;
+    }
+  }
+
+  if (h.outputs != h.next + sizes[6]) {
+    return -3;
+  }
+
+  const unsigned char *base = image;
+  c->numStates = h.numStates;
+  c->numInputs = h.numInputs;
+  c->numEvents = h.numEvents;
+  c->stateIDs = (const int*)(base + h.stateIDs);
+  c->inputIDs = (const int*)(base + h.inputIDs);
+  c->stateMap = (const int*)(base + h.stateMap);
+  c->inputMap = (const int*)(base + h.inputMap);
+  c->stateMapSize = h.stateMapSize;
+  c->inputMapSize = h.inputMapSize;
+  c->accepts = (const mfsm_Accept*)(base + h.accepts);
+  c->events = (const mfsm_Event*)(base + h.events);
+  c->next = (const uint16_t*)(base + h.next);
+  c->outputs = (const uint16_t*)(base + h.outputs);
+
+  // Nothing to release
+  c->mem = 0;
+  c->allocator.alloc = 0;
+  c->allocator.release = 0;
+  c->allocator.ctx = 0;
+
+  return 0;
+}
+
+#ifndef MFSM_NO_MMAP
+// Allocator release callback for mapped images; ctx holds the mapping size.
+static void unmapImage(void *ctx, void *ptr) {
+  munmap(ptr, (size_t)(uintptr_t)ctx);
+}
+
+// Writes count zero bytes to a file.
+static int writeZeros(FILE *f, uint64_t count) {
+  static const unsigned char zeros[MFSM_IMAGE_ALIGN];
+  while (count > 0) {
+    size_t n = (count < MFSM_IMAGE_ALIGN) ? (size_t)count : MFSM_IMAGE_ALIGN;
+    if (fwrite(zeros, 1, n, f) != n) {
+      return -1;
+    }
+    count -= n;
+  }
+
+  return 0;
+}
+
+// int saveCompiledFSM(const mfsm_CompiledFSM*, const char*)
+//
+// Writes a compiled FSM to a file as an image.
+//
+// Parameters:
+// c      const mfsm_CompiledFSM*   Compiled FSM context
+// path   const char*               File to create or replace
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- The file could not be written
+//  -3 -- An output Event has a payload
+int saveCompiledFSM(const mfsm_CompiledFSM *c, const char *path) {
+  mfsm_ImageHeader h;
+  int result = makeHeader(c, &h);
+  if (result != 0) {
+    return result;
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (f == 0) {
+    return -2;
+  }
+
+  uint64_t sizes[IMAGE_TABLES];
+  uint64_t *offsets[IMAGE_TABLES];
+  const void *tables[IMAGE_TABLES];
+  getTableSizes(&h, sizes);
+  getTableOffsets(&h, offsets);
+  getTables(c, tables);
+
+  // Same bytes as writeCompiledImage(), written table by table
+  uint64_t pos = sizeof(h);
+  result = (fwrite(&h, sizeof(h), 1, f) == 1) ? 0 : -2;
+
+  int i = 0;
+  for (; result == 0 && i < IMAGE_TABLES; i++) {
+    if (writeZeros(f, *offsets[i] - pos) != 0 ||
+        (sizes[i] > 0 && fwrite(tables[i], (size_t)sizes[i], 1, f) != 1)) {
+      result = -2;
+    }
+    pos = *offsets[i] + sizes[i];
+  }
+
+  if (result == 0 && writeZeros(f, h.size - pos) != 0) {
+    result = -2;
+  }
+
+  if (fclose(f) != 0) {
+    result = -2;
+  }
+
+  return result;
+}
+
+// int mapCompiledFSM(mfsm_CompiledFSM*, const char*)
+//
+// Memory maps an image file read-only and sets up a compiled FSM to use it.
+// freeCompiledFSM() unmaps the file.
+//
+// Parameters:
+// c      mfsm_CompiledFSM*   Uninitialized compiled FSM
+// path   const char*         Image file
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not an image
+//  -2 -- The image was written by another version or kind of machine
+//  -3 -- The image is truncated or corrupt
+//  -4 -- The file could not be opened or mapped
+int mapCompiledFSM(mfsm_CompiledFSM *c, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -4;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -4;
+  }
+
+  if (st.st_size < (off_t)sizeof(mfsm_ImageHeader)) {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *image = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return -4;
+  }
+
+  int result = loadCompiledImage(c, image, size);
+  if (result != 0) {
+    munmap(image, size);
+    return result;
+  }
+
+  c->mem = image;
+  c->allocator.release = unmapImage;
+  c->allocator.ctx = (void*)(uintptr_t)size;
+
+  return 0;
+}
+#endif //MFSM_NO_MMAP
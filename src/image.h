@@ -0,0 +1,146 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include "compiled.h"
+
+/*****************************************************************************
+* Compiled FSM Images
+*
+* A binary format holding a compiled FSM exactly as it is laid out in memory,
+* so it can be written once and used later without rebuilding or parsing it.
+* Every table sits at an offset from the start of the image, so the image
+* works at any address: loadCompiledImage() only checks the header and
+* points a mfsm_CompiledFSM's arrays into it. Memory mapped image files are
+* read-only and shared between every process mapping them.
+*
+* The header records the format version and the byte order and Event layout
+* of the machine which wrote it; images from other versions or machines are
+* refused rather than converted. The contents of the tables are not checked,
+* so only load images from trusted sources.
+*
+* Output Events with payloads cannot be written, as payloads live outside
+* the compiled FSM. Define MFSM_NO_MMAP to leave out the file functions on
+* systems without mmap().
+*****************************************************************************/
+
+#define MFSM_IMAGE_MAGIC 0x4D53464Du // "MFSM" in little endian
+#define MFSM_IMAGE_VERSION 2
+
+// Written in the machine's own byte order, so a mismatch shows up when read
+#define MFSM_IMAGE_BYTE_ORDER 0x01020304u
+
+// Alignment of the image and of every table in it
+#define MFSM_IMAGE_ALIGN 8
+
+typedef struct mfsm_ImageHeader {
+  uint32_t magic;     // MFSM_IMAGE_MAGIC
+  uint32_t version;   // MFSM_IMAGE_VERSION
+  uint32_t byteOrder; // MFSM_IMAGE_BYTE_ORDER
+  uint32_t eventSize; // sizeof(mfsm_Event)
+  uint64_t size;      // Size of the whole image in bytes
+
+  int32_t numStates;
+  int32_t numInputs;
+  int32_t numEvents;
+  int32_t stateMapSize;
+  int32_t inputMapSize;
+  int32_t reserved;
+
+  // Offset of each table from the start of the image. outputs always
+  // directly follows next.
+  uint64_t stateIDs;
+  uint64_t inputIDs;
+  uint64_t stateMap;
+  uint64_t inputMap;
+  uint64_t accepts;
+  uint64_t events;
+  uint64_t next;
+  uint64_t outputs;
+} mfsm_ImageHeader;
+
+// size_t getCompiledImageSize(const mfsm_CompiledFSM*)
+//
+// Finds the number of bytes needed to write a compiled FSM as an image.
+//
+// Parameters:
+// c    const mfsm_CompiledFSM*   Compiled FSM context
+//
+// Returns:
+// Size of the image in bytes, or 0 for an invalid compiled FSM
+size_t getCompiledImageSize(const mfsm_CompiledFSM *c);
+
+// int writeCompiledImage(const mfsm_CompiledFSM*, void*, size_t)
+//
+// Writes a compiled FSM as an image.
+//
+// Parameters:
+// c      const mfsm_CompiledFSM*   Compiled FSM context
+// buf    void*                     Buffer receiving the image, aligned to
+//                                  MFSM_IMAGE_ALIGN
+// size   size_t                    Size of buf
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- buf is too small or not aligned
+//  -3 -- An output Event has a payload
+int writeCompiledImage(const mfsm_CompiledFSM *c, void *buf, size_t size);
+
+// int loadCompiledImage(mfsm_CompiledFSM*, const void*, size_t)
+//
+// Sets up a compiled FSM to use an image in place. The image must stay
+// valid and unchanged for as long as the compiled FSM is used.
+// freeCompiledFSM() does not release it.
+//
+// Parameters:
+// c      mfsm_CompiledFSM*   Uninitialized compiled FSM
+// image  const void*         Image, aligned to MFSM_IMAGE_ALIGN
+// size   size_t              Size of the image
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not an image
+//  -2 -- The image was written by another version or kind of machine
+//  -3 -- The image is truncated, corrupt or not aligned
+int loadCompiledImage(mfsm_CompiledFSM *c, const void *image, size_t size);
+
+#ifndef MFSM_NO_MMAP
+// int saveCompiledFSM(const mfsm_CompiledFSM*, const char*)
+//
+// Writes a compiled FSM to a file as an image.
+//
+// Parameters:
+// c      const mfsm_CompiledFSM*   Compiled FSM context
+// path   const char*               File to create or replace
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid compiled FSM
+//  -2 -- The file could not be written
+//  -3 -- An output Event has a payload
+int saveCompiledFSM(const mfsm_CompiledFSM *c, const char *path);
+
+// int mapCompiledFSM(mfsm_CompiledFSM*, const char*)
+//
+// Memory maps an image file read-only and sets up a compiled FSM to use it.
+// freeCompiledFSM() unmaps the file.
+//
+// Parameters:
+// c      mfsm_CompiledFSM*   Uninitialized compiled FSM
+// path   const char*         Image file
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Not an image
+//  -2 -- The image was written by another version or kind of machine
+//  -3 -- The image is truncated or corrupt
+//  -4 -- The file could not be opened or mapped
+int mapCompiledFSM(mfsm_CompiledFSM *c, const char *path);
+#endif //MFSM_NO_MMAP
+
+#endif //IMAGE_H
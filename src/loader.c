@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "loader.h"
+
+// Bytes read from a definition file at a time.
+#define LOADER_CHUNK 4096
+
+// Skips spaces, tabs and the carriage returns of CRLF line breaks.
+static const char *skipSpace(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    p++;
+  }
+
+  return p;
+}
+
+// Reads a decimal integer. Returns the character after it, or 0 if there is
+// no integer or it does not fit in an int.
+static const char *parseInt(const char *p, const char *end, int *value) {
+  int negative = 0;
+  if (p < end && *p == '-') {
+    negative = 1;
+    p++;
+  }
+
+  if (p == end || *p < '0' || *p > '9') {
+    return 0;
+  }
+
+  long long v = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    v = v * 10 + (*p - '0');
+    if (v > (long long)INT_MAX + 1) {
+      return 0;
+    }
+  }
+
+  v = negative ? -v : v;
+  if (v > INT_MAX) {
+    return 0;
+  }
+
+  *value = (int)v;
+  return p;
+}
+
+// Adds a state unless the FSM already has it. Returns 0, or the parseLine()
+// error code for an invalid ID or a full FSM.
+static int useState(mfsm_fsm *fsm, int s) {
+  int status = addState(fsm, s);
+  if (status == -1) {
+    return -2;
+  }
+
+  return (status == -3) ? -4 : 0;
+}
+
+// Adds an input unless the FSM already has it, like useState().
+static int useInput(mfsm_fsm *fsm, int n) {
+  int status = addInput(fsm, n);
+  if (status == -1) {
+    return -2;
+  }
+
+  return (status == -3) ? -4 : 0;
+}
+
+// Parses one line, without its line break, and adds its transition.
+static int parseLine(mfsm_Loader *ld, const char *p, const char *end) {
+  // Drop the comment, if any
+  const char *hash = memchr(p, '#', end - p);
+  if (hash != 0) {
+    end = hash;
+  }
+
+  p = skipSpace(p, end);
+  if (p == end) {
+    return 0;
+  }
+
+  // src input -> dst [event]
+  int s = 0;
+  int n = 0;
+  int d = 0;
+  int e = NULL_EVENT_ID;
+
+  p = parseInt(p, end, &s);
+  if (p == 0 || p == end || (*p != ' ' && *p != '\t')) {
+    return -1;
+  }
+
+  p = parseInt(skipSpace(p, end), end, &n);
+  if (p == 0) {
+    return -1;
+  }
+
+  p = skipSpace(p, end);
+  if (end - p < 2 || p[0] != '-' || p[1] != '>') {
+    return -1;
+  }
+
+  p = parseInt(skipSpace(p + 2, end), end, &d);
+  if (p == 0) {
+    return -1;
+  }
+
+  const char *after = skipSpace(p, end);
+  if (after != end) {
+    // Each ID must be followed by a space, "->" or the end of the line
+    if (after == p || (p = parseInt(after, end, &e)) == 0) {
+      return -1;
+    }
+
+    if (skipSpace(p, end) != end) {
+      return -1;
+    }
+
+    if (e == NULL_EVENT_ID) {
+      return -2;
+    }
+  }
+
+  mfsm_fsm *fsm = ld->fsm;
+  int status = useState(fsm, s);
+  if (status == 0) {
+    status = useState(fsm, d);
+  }
+  if (status == 0) {
+    status = useInput(fsm, n);
+  }
+  if (status != 0) {
+    return status;
+  }
+
+  if (isValidTransitionPtr(fsm, n, s) == 0) {
+    return -3;
+  }
+
+  if (addTransition(fsm, n, s, d) != 0) {
+    return -4;
+  }
+
+  if (e != NULL_EVENT_ID) {
+    mfsm_Event event;
+    initEvent(&event, e);
+    if (setTransitionOutput(fsm, n, s, event) != 0) {
+      return -4;
+    }
+  }
+
+  if (fsm->curState < MIN_STATE_ID) {
+    fsm->curState = s;
+  }
+
+  return 0;
+}
+
+// Parses a line and records the first error.
+static int loadLine(mfsm_Loader *ld, const char *p, const char *end) {
+  int status = parseLine(ld, p, end);
+  if (status != 0) {
+    ld->error = status;
+    ld->errorLine = ld->line;
+  }
+
+  return status;
+}
+
+// void initLoader(mfsm_Loader*, mfsm_fsm*)
+//
+// Set default values for a Loader adding transitions to an FSM.
+//
+// Parameters:
+// ld   mfsm_Loader*  Uninitialized Loader struct
+// fsm  mfsm_fsm*     Initialized FSM
+//
+// Returns:
+// None
+void initLoader(mfsm_Loader *ld, mfsm_fsm *fsm) {
+  ld->fsm = fsm;
+  ld->line = 1;
+  ld->error = 0;
+  ld->errorLine = 0;
+  ld->partialLength = 0;
+}
+
+// int feedLoader(mfsm_Loader*, const char*, size_t)
+//
+// Parses the next chunk of a definition. Loading stops at the first error;
+// ld->errorLine holds its line number. Transitions on earlier lines stay in
+// the FSM.
+//
+// Parameters:
+// ld     mfsm_Loader*  Loader context
+// text   const char*   Next chunk of the definition
+// len    size_t        Length of text
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Syntax error
+//  -2 -- Invalid state, input or Event ID
+//  -3 -- The transition was already defined
+//  -4 -- The FSM could not hold the state, input or transition
+//  -5 -- A line split across chunks was longer than LOADER_MAX_LINE
+int feedLoader(mfsm_Loader *ld, const char *text, size_t len) {
+  if (ld->error != 0) {
+    return ld->error;
+  }
+
+  const char *p = text;
+  const char *end = text + len;
+
+  // Finish the line left over from the last chunk
+  if (ld->partialLength > 0) {
+    const char *nl = memchr(p, '\n', len);
+    size_t take = (nl != 0) ? (size_t)(nl - p) + 1 : len;
+    if (take > (size_t)(LOADER_MAX_LINE - ld->partialLength)) {
+      ld->error = -5;
+      ld->errorLine = ld->line;
+      return -5;
+    }
+
+    memcpy(ld->partial + ld->partialLength, p, take);
+    ld->partialLength += (int)take;
+    p += take;
+    if (nl == 0) {
+      return 0;
+    }
+
+    int length = ld->partialLength - 1;
+    ld->partialLength = 0;
+    if (loadLine(ld, ld->partial, ld->partial + length) != 0) {
+      return ld->error;
+    }
+    ld->line++;
+  }
+
+  // Whole lines are parsed straight from the chunk
+  const char *nl = 0;
+  while ((nl = memchr(p, '\n', end - p)) != 0) {
+    if (loadLine(ld, p, nl) != 0) {
+      return ld->error;
+    }
+    ld->line++;
+    p = nl + 1;
+  }
+
+  // Keep the start of a line continuing in the next chunk
+  if (p < end) {
+    if (end - p > LOADER_MAX_LINE) {
+      ld->error = -5;
+      ld->errorLine = ld->line;
+      return -5;
+    }
+
+    memcpy(ld->partial, p, end - p);
+    ld->partialLength = (int)(end - p);
+  }
+
+  return 0;
+}
+
+// int finishLoader(mfsm_Loader*)
+//
+// Parses the last line of a definition if it had no line break.
+//
+// Parameters:
+// ld   mfsm_Loader*  Loader context
+//
+// Returns:
+// Success -- 0
+// Failure -- Same as feedLoader()
+int finishLoader(mfsm_Loader *ld) {
+  if (ld->error != 0 || ld->partialLength == 0) {
+    return ld->error;
+  }
+
+  int length = ld->partialLength;
+  ld->partialLength = 0;
+  return loadLine(ld, ld->partial, ld->partial + length);
+}
+
+// int loadFSMText(mfsm_fsm*, const char*, size_t, int*)
+//
+// Adds every transition of a definition held in memory to an FSM.
+//
+// Parameters:
+// fsm        mfsm_fsm*     Initialized FSM
+// text       const char*   Definition
+// len        size_t        Length of text
+// errorLine  int*          Receives the line of the first error, or 0. May be
+//                          0.
+//
+// Returns:
+// Success -- 0
+// Failure -- Same as feedLoader()
+int loadFSMText(mfsm_fsm *fsm, const char *text, size_t len, int *errorLine) {
+  mfsm_Loader ld;
+  initLoader(&ld, fsm);
+
+  // The last line is parsed in place rather than through the partial buffer,
+  // so it may be any length
+  const char *last = text;
+  const char *nl = 0;
+  while ((nl = memchr(last, '\n', text + len - last)) != 0) {
+    last = nl + 1;
+  }
+
+  int status = feedLoader(&ld, text, last - text);
+  if (status == 0 && last < text + len) {
+    status = loadLine(&ld, last, text + len);
+  }
+
+  if (errorLine != 0) {
+    *errorLine = ld.errorLine;
+  }
+
+  return status;
+}
+
+// int loadFSMFile(mfsm_fsm*, const char*, int*)
+//
+// Adds every transition of a definition file to an FSM, reading it in
+// chunks.
+//
+// Parameters:
+// fsm        mfsm_fsm*     Initialized FSM
+// path       const char*   Definition file
+// errorLine  int*          Receives the line of the first error, or 0. May be
+//                          0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 to -5 -- Same as feedLoader()
+//  -6 -- The file could not be read
+int loadFSMFile(mfsm_fsm *fsm, const char *path, int *errorLine) {
+  if (errorLine != 0) {
+    *errorLine = 0;
+  }
+
+  FILE *f = fopen(path, "rb");
+  if (f == 0) {
+    return -6;
+  }
+
+  mfsm_Loader ld;
+  initLoader(&ld, fsm);
+
+  char chunk[LOADER_CHUNK];
+  int status = 0;
+  size_t read = 0;
+  while (status == 0 && (read = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    status = feedLoader(&ld, chunk, read);
+  }
+
+  if (status == 0) {
+    status = ferror(f) ? -6 : finishLoader(&ld);
+  }
+  fclose(f);
+
+  if (errorLine != 0) {
+    *errorLine = ld.errorLine;
+  }
+
+  return status;
+}
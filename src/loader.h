@@ -0,0 +1,121 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "microFSM.h"
+
+/*****************************************************************************
+* Text Loader
+*
+* Builds an FSM from a text definition with one transition per line:
+*
+*   # comment
+*   1 2 -> 3      State 1 moves to State 3 on Input 2
+*   3 2 -> 1 40   ... and sends Event 40
+*
+* IDs are decimal integers separated by spaces or tabs. Blank lines and
+* anything after a '#' are ignored. States and inputs are added to the FSM
+* the first time they appear; the first state seen becomes the current state
+* if the FSM has none.
+*
+* Text is parsed as it arrives, so definitions can be fed in chunks of any
+* size without being held in memory. Every line is checked once and applied
+* straight away; lines only need copying when they are split across chunks.
+* The result can be minimized with minimizeFSM() and compiled with
+* compileFSM() like any other FSM.
+*****************************************************************************/
+
+// Longest line, including its line break, that can be split across chunks.
+#define LOADER_MAX_LINE 256
+
+typedef struct mfsm_Loader {
+  mfsm_fsm *fsm; // FSM receiving the transitions
+
+  int line;      // Number of the line being read, counting from 1
+  int error;     // First error found, or 0
+  int errorLine; // Line of the first error, or 0
+
+  // Start of a line split across chunks
+  char partial[LOADER_MAX_LINE];
+  int partialLength;
+} mfsm_Loader;
+
+// void initLoader(mfsm_Loader*, mfsm_fsm*)
+//
+// Set default values for a Loader adding transitions to an FSM.
+//
+// Parameters:
+// ld   mfsm_Loader*  Uninitialized Loader struct
+// fsm  mfsm_fsm*     Initialized FSM
+//
+// Returns:
+// None
+void initLoader(mfsm_Loader *ld, mfsm_fsm *fsm);
+
+// int feedLoader(mfsm_Loader*, const char*, size_t)
+//
+// Parses the next chunk of a definition. Loading stops at the first error;
+// ld->errorLine holds its line number. Transitions on earlier lines stay in
+// the FSM.
+//
+// Parameters:
+// ld     mfsm_Loader*  Loader context
+// text   const char*   Next chunk of the definition
+// len    size_t        Length of text
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Syntax error
+//  -2 -- Invalid state, input or Event ID
+//  -3 -- The transition was already defined
+//  -4 -- The FSM could not hold the state, input or transition
+//  -5 -- A line split across chunks was longer than LOADER_MAX_LINE
+int feedLoader(mfsm_Loader *ld, const char *text, size_t len);
+
+// int finishLoader(mfsm_Loader*)
+//
+// Parses the last line of a definition if it had no line break.
+//
+// Parameters:
+// ld   mfsm_Loader*  Loader context
+//
+// Returns:
+// Success -- 0
+// Failure -- Same as feedLoader()
+int finishLoader(mfsm_Loader *ld);
+
+// int loadFSMText(mfsm_fsm*, const char*, size_t, int*)
+//
+// Adds every transition of a definition held in memory to an FSM.
+//
+// Parameters:
+// fsm        mfsm_fsm*     Initialized FSM
+// text       const char*   Definition
+// len        size_t        Length of text
+// errorLine  int*          Receives the line of the first error, or 0. May be
+//                          0.
+//
+// Returns:
+// Success -- 0
+// Failure -- Same as feedLoader()
+int loadFSMText(mfsm_fsm *fsm, const char *text, size_t len, int *errorLine);
+
+// int loadFSMFile(mfsm_fsm*, const char*, int*)
+//
+// Adds every transition of a definition file to an FSM, reading it in
+// chunks.
+//
+// Parameters:
+// fsm        mfsm_fsm*     Initialized FSM
+// path       const char*   Definition file
+// errorLine  int*          Receives the line of the first error, or 0. May be
+//                          0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 to -5 -- Same as feedLoader()
+//  -6 -- The file could not be read
+int loadFSMFile(mfsm_fsm *fsm, const char *path, int *errorLine);
+
+#endif //LOADER_H
@@ -1,7 +1,547 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include "microFSM.h"
+#include "idmap.h"
+
+#ifdef MFSM_STATS
+// Counts a transition taken from state index si with input index ni.
+static void countTransition(mfsm_Stats *stats, int si, int ni) {
+  stats->transitions++;
+  if (stats->pairs != 0 && si < stats->numStates && ni < stats->numInputs) {
+    stats->pairs[si * stats->numInputs + ni]++;
+  }
+}
 
-// An event ID which represents an invalid Event as per documentation.
-#define NULL_EVENT_ID -1
+// Counters of an instance, if it has any. Compiled out without MFSM_STATS.
+#define COUNT_TRANSITION(inst, si, ni) \
+  do { if ((inst)->stats != 0) countTransition((inst)->stats, si, ni); } while (0)
+#define COUNT_FAILURE(inst, code) \
+  do { if ((inst)->stats != 0) (inst)->stats->failed[-(code) - 1]++; } while (0)
+#define COUNT_EVENT(inst) \
+  do { if ((inst)->stats != 0) (inst)->stats->eventsSent++; } while (0)
+#else
+#define COUNT_TRANSITION(inst, si, ni)
+#define COUNT_FAILURE(inst, code)
+#define COUNT_EVENT(inst)
+#endif
+
+#ifdef MFSM_TIMING
+// Starts timing a transition into the instance's histograms, or else the
+// definition's. TIME_PHASE records the time since the last reading into one
+// of them. Compiled out without MFSM_TIMING.
+#define TIME_START(def, inst) \
+  mfsm_Timing *timing = ((inst)->timing != 0) ? (inst)->timing : (def)->timing; \
+  uint64_t timerLast = (timing != 0) ? readTimer() : 0
+#define TIME_PHASE(phase) \
+  do { \
+    if (timing != 0) { \
+      uint64_t timerNow = readTimer(); \
+      recordSample(&timing->phase, timerNow - timerLast); \
+      timerLast = timerNow; \
+    } \
+  } while (0)
+#else
+#define TIME_START(def, inst)
+#define TIME_PHASE(phase)
+#endif
+
+/***************************************
+* Storage Functions
+***************************************/
+
+#ifndef MFSM_NO_MALLOC
+static void *defaultAlloc(void *ctx, size_t size) {
+  return malloc(size);
+}
+
+static void defaultRelease(void *ctx, void *ptr) {
+  free(ptr);
+}
+
+static const mfsm_Allocator defaultAllocator = {
+  defaultAlloc, defaultRelease, 0
+};
+#endif //MFSM_NO_MALLOC
+
+// Number of hash table slots for a given array capacity.
+static int mapSizeFor(int capacity) {
+  return capacity * 2;
+}
+
+// Resets count transitions starting at t.
+static void clearTransitions(mfsm_Transition *t, int count) {
+  int i = 0;
+  for (; i < count; i++) {
+    t[i].dest = MIN_STATE_ID-1;
+    t[i].output = NULL_OUTPUT;
+  }
+}
+
+// Marks a state slot as not accepting.
+static void clearAccept(mfsm_Accept *a) {
+  a->accepting = 0;
+  a->priority = 0;
+  a->tag = 0;
+}
+
+// Releases a block allocated with the FSM's allocator.
+static void fsmRelease(mfsm_fsm *fsm, void *ptr) {
+  if (ptr != 0 && fsm->allocator.release != 0) {
+    fsm->allocator.release(fsm->allocator.ctx, ptr);
+  }
+}
+
+// Mixes one word into the hash of an Event.
+static uint32_t mixEventHash(uint32_t h, uint32_t w) {
+  h = (h ^ w) * 2654435769u;
+  return h ^ (h >> 16);
+}
+
+// Hashes the fields isSameEvent() compares into a slot of the outputs map.
+static int outputHash(const mfsm_Event *e, int size) {
+  uint32_t h = mixEventHash((uint32_t)e->id, (uint32_t)e->type);
+  int i = 0;
+  for (; i < EVENT_DATA_SIZE; i++) {
+    h = mixEventHash(h, e->data[i]);
+  }
+
+  uint64_t payload = (uint64_t)(uintptr_t)e->payload;
+  h = mixEventHash(h, (uint32_t)payload);
+  h = mixEventHash(h, (uint32_t)(payload >> 32));
+
+  return (int)(((uint64_t)h * (uint32_t)size) >> 32);
+}
+
+// Finds the live entry of the outputs table equal to an Event, or -1.
+static int findOutput(const mfsm_fsm *fsm, const mfsm_Event *e) {
+  int size = fsm->outputMapSize;
+  if (size == 0) {
+    return -1;
+  }
+
+  int h = outputHash(e, size);
+  int probes = 0;
+  for (; probes < size && fsm->outputMap[h] != 0; probes++) {
+    if (isSameEvent(&fsm->outputs[fsm->outputMap[h]-1], e)) {
+      return fsm->outputMap[h]-1;
+    }
+
+    h = (h + 1 == size) ? 0 : h + 1;
+  }
+
+  return -1;
+}
+
+// Records outputs[index] in the outputs map. The map has twice as many slots
+// as the table has entries, so there is always an empty one.
+static void insertOutput(mfsm_fsm *fsm, int index) {
+  int size = fsm->outputMapSize;
+  int h = outputHash(&fsm->outputs[index], size);
+  while (fsm->outputMap[h] != 0) {
+    h = (h + 1 == size) ? 0 : h + 1;
+  }
+
+  fsm->outputMap[h] = index + 1;
+}
+
+// Removes outputs[index] from the outputs map while it still holds its
+// Event, shifting back later entries of its run like idMapRemove().
+static void removeOutput(mfsm_fsm *fsm, int index) {
+  int size = fsm->outputMapSize;
+  int hole = outputHash(&fsm->outputs[index], size);
+  while (fsm->outputMap[hole] != index + 1) {
+    hole = (hole + 1 == size) ? 0 : hole + 1;
+  }
+
+  fsm->outputMap[hole] = 0;
+
+  int next = (hole + 1 == size) ? 0 : hole + 1;
+  while (fsm->outputMap[next] != 0) {
+    int home = outputHash(&fsm->outputs[fsm->outputMap[next]-1], size);
+
+    // Move the entry if its home slot is not cyclically within (hole, next]
+    int reachable = (hole <= next) ? (hole < home && home <= next)
+                                   : (hole < home || home <= next);
+    if (!reachable) {
+      fsm->outputMap[hole] = fsm->outputMap[next];
+      fsm->outputMap[next] = 0;
+      hole = next;
+    }
+
+    next = (next + 1 == size) ? 0 : next + 1;
+  }
+}
+
+// Doubles the outputs table and rebuilds its map. Returns 0 on success or -1
+// if the FSM uses fixed storage or memory could not be allocated.
+static int growOutputs(mfsm_fsm *fsm) {
+  if (fsm->allocator.alloc == 0) {
+    return -1;
+  }
+
+  int maxOutputs = (fsm->maxOutputs == 0) ? MAX_OUTPUTS : fsm->maxOutputs * 2;
+  int mapSize = mapSizeFor(maxOutputs);
+  mfsm_Allocator *a = &fsm->allocator;
+
+  mfsm_Event *outputs = a->alloc(a->ctx, sizeof(mfsm_Event) * maxOutputs);
+  int *refs = a->alloc(a->ctx, sizeof(int) * maxOutputs);
+  int *map = a->alloc(a->ctx, sizeof(int) * mapSize);
+  if (outputs == 0 || refs == 0 || map == 0) {
+    fsmRelease(fsm, outputs);
+    fsmRelease(fsm, refs);
+    fsmRelease(fsm, map);
+    return -1;
+  }
+
+  int i = 0;
+  for (; i < fsm->numOutputs; i++) {
+    outputs[i] = fsm->outputs[i];
+    refs[i] = fsm->outputRefs[i];
+  }
+
+  fsmRelease(fsm, fsm->outputs);
+  fsmRelease(fsm, fsm->outputRefs);
+  fsmRelease(fsm, fsm->outputMap);
+
+  fsm->outputs = outputs;
+  fsm->outputRefs = refs;
+  fsm->outputMap = map;
+  fsm->outputMapSize = mapSize;
+  fsm->maxOutputs = maxOutputs;
+
+  idMapClear(map, mapSize);
+  for (i = 0; i < fsm->numOutputs; i++) {
+    if (refs[i] > 0) {
+      insertOutput(fsm, i);
+    }
+  }
+
+  return 0;
+}
+
+// Takes a reference to an output Event for a transition, adding the Event to
+// the outputs table unless an equal one is live. Returns its index, or -1 if
+// the table is full and cannot grow.
+static int acquireOutput(mfsm_fsm *fsm, const mfsm_Event *e) {
+  int i = findOutput(fsm, e);
+  if (i != -1) {
+    fsm->outputRefs[i]++;
+    return i;
+  }
+
+  // Reuse the first free entry, or else add one to the end
+  for (i = fsm->freeOutput; i < fsm->numOutputs; i++) {
+    if (fsm->outputRefs[i] == 0) {
+      break;
+    }
+  }
+
+  if (i == fsm->maxOutputs && growOutputs(fsm) != 0) {
+    fsm->freeOutput = i;
+    return -1;
+  }
+
+  if (i == fsm->numOutputs) {
+    fsm->numOutputs++;
+  }
+
+  fsm->outputs[i] = *e;
+  fsm->outputRefs[i] = 1;
+  insertOutput(fsm, i);
+  fsm->freeOutput = i + 1;
+
+  return i;
+}
+
+// Drops a transition's reference to an output Event, freeing its entry with
+// the last reference. Does nothing for NULL_OUTPUT.
+static void releaseOutput(mfsm_fsm *fsm, int i) {
+  if (i == NULL_OUTPUT || --fsm->outputRefs[i] > 0) {
+    return;
+  }
+
+  removeOutput(fsm, i);
+  initEvent(&fsm->outputs[i], NULL_EVENT_ID); // Forget any Payload
+  if (i < fsm->freeOutput) {
+    fsm->freeOutput = i;
+  }
+}
+
+// Reallocates the FSM's arrays to hold maxStates states and maxInputs inputs,
+// using dense or sparse transition storage. Existing IDs keep their indices.
+// Returns 0 on success or -1 if the FSM uses fixed storage or memory could not
+// be allocated, in which case the FSM is left unchanged.
+static int resizeFSM(mfsm_fsm *fsm, int maxStates, int maxInputs, int sparse) {
+  if (fsm->allocator.alloc == 0) {
+    return -1;
+  }
+
+  int stateMapSize = mapSizeFor(maxStates);
+  int inputMapSize = mapSizeFor(maxInputs);
+  mfsm_Allocator *a = &fsm->allocator;
+
+  int *states = a->alloc(a->ctx, sizeof(int) * maxStates);
+  mfsm_Accept *accepts = a->alloc(a->ctx, sizeof(mfsm_Accept) * maxStates);
+  int *inputs = a->alloc(a->ctx, sizeof(int) * maxInputs);
+  int *stateMap = a->alloc(a->ctx, sizeof(int) * stateMapSize);
+  int *inputMap = a->alloc(a->ctx, sizeof(int) * inputMapSize);
+  mfsm_Transition *destinations = 0;
+  mfsm_EdgeList *edges = 0;
+
+  if (sparse) {
+    edges = a->alloc(a->ctx, sizeof(mfsm_EdgeList) * maxStates);
+  } else {
+    destinations = a->alloc(a->ctx,
+        sizeof(mfsm_Transition) * maxStates * maxInputs);
+  }
+
+  if (states == 0 || accepts == 0 || inputs == 0 || stateMap == 0 ||
+      inputMap == 0 || (destinations == 0 && edges == 0)) {
+    fsmRelease(fsm, states);
+    fsmRelease(fsm, accepts);
+    fsmRelease(fsm, inputs);
+    fsmRelease(fsm, stateMap);
+    fsmRelease(fsm, inputMap);
+    fsmRelease(fsm, destinations);
+    fsmRelease(fsm, edges);
+    return -1;
+  }
+
+  // Copy the existing IDs and transitions, clearing the new space
+  int i = 0;
+  int j = 0;
+  for (; i < maxStates; i++) {
+    states[i] = (i < fsm->maxStates) ? fsm->states[i] : MIN_STATE_ID-1;
+    if (i < fsm->maxStates) {
+      accepts[i] = fsm->accepts[i];
+    } else {
+      clearAccept(&accepts[i]);
+    }
+  }
+
+  for (i = 0; i < maxInputs; i++) {
+    inputs[i] = (i < fsm->maxInputs) ? fsm->inputs[i] : MIN_INPUT_ID-1;
+  }
+
+  if (sparse) {
+    // Edge lists are keyed by input index, so only the list headers move
+    for (i = 0; i < maxStates; i++) {
+      if (i < fsm->maxStates) {
+        edges[i] = fsm->edges[i];
+      } else {
+        edges[i].edges = 0;
+        edges[i].numEdges = 0;
+        edges[i].maxEdges = 0;
+      }
+    }
+  } else {
+    clearTransitions(destinations, maxStates * maxInputs);
+    for (i = 0; i < fsm->maxInputs; i++) {
+      for (j = 0; j < fsm->maxStates; j++) {
+        destinations[i * maxStates + j] =
+          fsm->destinations[i * fsm->maxStates + j];
+      }
+    }
+  }
+
+  // Swap in the new arrays
+  fsmRelease(fsm, fsm->states);
+  fsmRelease(fsm, fsm->accepts);
+  fsmRelease(fsm, fsm->inputs);
+  fsmRelease(fsm, fsm->stateMap);
+  fsmRelease(fsm, fsm->inputMap);
+  fsmRelease(fsm, fsm->destinations);
+  fsmRelease(fsm, fsm->edges);
+
+  fsm->states = states;
+  fsm->accepts = accepts;
+  fsm->inputs = inputs;
+  fsm->stateMap = stateMap;
+  fsm->inputMap = inputMap;
+  fsm->destinations = destinations;
+  fsm->edges = edges;
+  fsm->maxStates = maxStates;
+  fsm->maxInputs = maxInputs;
+  fsm->stateMapSize = stateMapSize;
+  fsm->inputMapSize = inputMapSize;
+
+  // The IDs kept their indices, so the free slot hints still hold
+  int freeState = fsm->freeState;
+  int freeInput = fsm->freeInput;
+  reindexFSM(fsm);
+  fsm->freeState = freeState;
+  fsm->freeInput = freeInput;
+
+  return 0;
+}
+
+// Set the values shared by every kind of FSM, leaving it with no storage.
+static void initEmptyFSM(mfsm_fsm *fsm) {
+  fsm->curState = MIN_STATE_ID-1;
+  fsm->curInput = MIN_INPUT_ID-1;
+  fsm->maxStates = 0;
+  fsm->maxInputs = 0;
+  fsm->freeState = 0;
+  fsm->freeInput = 0;
+  fsm->states = 0;
+  fsm->accepts = 0;
+  fsm->inputs = 0;
+  fsm->stateMap = 0;
+  fsm->inputMap = 0;
+  fsm->stateMapSize = 0;
+  fsm->inputMapSize = 0;
+  fsm->destinations = 0;
+  fsm->edges = 0;
+  fsm->outputs = 0;
+  fsm->outputRefs = 0;
+  fsm->outputMap = 0;
+  fsm->outputMapSize = 0;
+  fsm->numOutputs = 0;
+  fsm->maxOutputs = 0;
+  fsm->freeOutput = 0;
+  fsm->allocator.alloc = 0;
+  fsm->allocator.release = 0;
+  fsm->allocator.ctx = 0;
+
+  // Event Queue
+  initEventQueue(&fsm->eq);
+
+#ifdef MFSM_STATS
+  fsm->stats = 0;
+#endif
+
+#ifdef MFSM_TIMING
+  fsm->timing = 0;
+#endif
+}
+
+// Set up an FSM whose storage comes from an allocator.
+static int initAllocatedFSM(mfsm_fsm *fsm, int stateHint, int inputHint,
+                            const mfsm_Allocator *allocator, int sparse) {
+  initEmptyFSM(fsm);
+
+  if (allocator == 0 || allocator->alloc == 0) {
+    return -1;
+  }
+
+  fsm->allocator = *allocator;
+
+  if (resizeFSM(fsm, stateHint < 1 ? 1 : stateHint,
+                inputHint < 1 ? 1 : inputHint, sparse) != 0) {
+    return -2;
+  }
+
+  return 0;
+}
+
+/***************************************
+* Transition Storage Functions
+*
+* Every access to a stored transition goes through these, so the rest of the
+* library does not need to know whether the FSM uses dense or sparse storage.
+***************************************/
+
+// Finds the position of the edge for input index ni in a sorted edge list, or
+// the position where it would be inserted.
+static int findEdge(const mfsm_EdgeList *list, int ni) {
+  int lo = 0;
+  int hi = list->numEdges;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (list->edges[mid].input < ni) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// Finds the transition stored for an input index and state index. Returns 0
+// if sparse storage has nothing stored for the pair.
+static mfsm_Transition *findTransition(const mfsm_fsm *fsm, int ni, int si) {
+  if (fsm->edges == 0) {
+    return &fsm->destinations[ni * fsm->maxStates + si];
+  }
+
+  const mfsm_EdgeList *list = &fsm->edges[si];
+  int i = findEdge(list, ni);
+  if (i < list->numEdges && list->edges[i].input == ni) {
+    return &list->edges[i].transition;
+  }
+
+  return 0;
+}
+
+// Finds the transition stored for an input index and state index, adding an
+// empty one to sparse storage if needed. Returns 0 if memory could not be
+// allocated.
+static mfsm_Transition *makeTransition(mfsm_fsm *fsm, int ni, int si) {
+  mfsm_Transition *t = findTransition(fsm, ni, si);
+  if (t != 0) {
+    return t;
+  }
+
+  // Grow the edge list if it is full
+  mfsm_EdgeList *list = &fsm->edges[si];
+  int i = 0;
+  if (list->numEdges == list->maxEdges) {
+    int maxEdges = (list->maxEdges == 0) ? 2 : list->maxEdges * 2;
+    mfsm_Edge *edges = fsm->allocator.alloc(fsm->allocator.ctx,
+                                            sizeof(mfsm_Edge) * maxEdges);
+    if (edges == 0) {
+      return 0;
+    }
+
+    for (; i < list->numEdges; i++) {
+      edges[i] = list->edges[i];
+    }
+
+    fsmRelease(fsm, list->edges);
+    list->edges = edges;
+    list->maxEdges = maxEdges;
+  }
+
+  // Shift later edges up to keep the list sorted
+  int pos = findEdge(list, ni);
+  for (i = list->numEdges; i > pos; i--) {
+    list->edges[i] = list->edges[i-1];
+  }
+
+  list->edges[pos].input = ni;
+  clearTransitions(&list->edges[pos].transition, 1);
+  list->numEdges++;
+
+  return &list->edges[pos].transition;
+}
+
+// Drops a transition from sparse storage once it has neither a valid
+// destination nor an output Event. Does nothing for dense storage.
+static void pruneTransition(mfsm_fsm *fsm, int ni, int si) {
+  if (fsm->edges == 0) {
+    return;
+  }
+
+  mfsm_EdgeList *list = &fsm->edges[si];
+  int pos = findEdge(list, ni);
+  if (pos >= list->numEdges || list->edges[pos].input != ni) {
+    return;
+  }
+
+  mfsm_Transition *t = &list->edges[pos].transition;
+  if (t->dest >= MIN_STATE_ID || t->output != NULL_OUTPUT) {
+    return;
+  }
+
+  int i = pos;
+  for (; i < list->numEdges - 1; i++) {
+    list->edges[i] = list->edges[i+1];
+  }
+
+  list->numEdges--;
+}
 
 /***************************************
 * FSM Interface Functions
@@ -9,7 +549,18 @@
 
 // void initFSM (mfsm_fsm*)
 //
-// Set default values for an FSM.
+// Set default values for an FSM. Storage for MAX_STATES states and
+// MAX_INPUTS inputs is allocated with malloc() and grows on demand. Release
+// it with freeFSM(). If the allocation fails, the FSM has no capacity and
+// addState()/addInput() will fail.
+//
+// Migrating from fixed size FSMs: initFSM() used to leave the arrays inside
+// the mfsm_fsm itself. Code which creates FSMs with initFSM() and then
+// discards them should now call freeFSM() to avoid leaking the storage.
+// Built with MFSM_NO_MALLOC, initFSM() keeps the old behaviour: the FSM uses
+// the mfsm_FixedStorage inside it (see initFixedFSM()), never allocates and
+// holds at most MAX_STATES states and MAX_INPUTS inputs. Such an FSM must
+// not be copied by value, as it points into itself.
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -17,14 +568,112 @@
 // Returns:
 // Nothing
 void initFSM(mfsm_fsm *fsm) {
+#ifdef MFSM_NO_MALLOC
+  initFixedFSM(fsm, &fsm->storage);
+#else
+  if (initDynamicFSM(fsm, MAX_STATES, MAX_INPUTS, &defaultAllocator) != 0) {
+    initEmptyFSM(fsm);
+  }
+#endif
+}
+
+#ifndef MFSM_NO_MALLOC
+// const mfsm_Allocator* getDefaultAllocator(void)
+//
+// Returns the malloc() based allocator used by initFSM().
+//
+// Parameters:
+// None
+//
+// Returns:
+// Pointer to the default allocator
+const mfsm_Allocator *getDefaultAllocator(void) {
+  return &defaultAllocator;
+}
+#endif //MFSM_NO_MALLOC
+
+// int initDynamicFSM(mfsm_fsm*, int, int, const mfsm_Allocator*)
+//
+// Set default values for an FSM whose storage is allocated with the given
+// allocator. The arrays start with room for the hinted number of states and
+// inputs and double in size whenever they fill up. Release the storage with
+// freeFSM().
+//
+// Parameters:
+// fsm        mfsm_fsm*              FSM context
+// stateHint  int                    Expected number of states
+// inputHint  int                    Expected number of inputs
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the FSM.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+//  -2 -- Memory could not be allocated
+int initDynamicFSM(mfsm_fsm *fsm, int stateHint, int inputHint,
+                   const mfsm_Allocator *allocator) {
+  return initAllocatedFSM(fsm, stateHint, inputHint, allocator, 0);
+}
+
+// int initSparseFSM(mfsm_fsm*, int, int, const mfsm_Allocator*)
+//
+// Same as initDynamicFSM(), but transitions are stored in per-state edge
+// lists sorted by input rather than a dense input x state table. Memory use
+// grows with the number of transitions instead of states x inputs, at the
+// cost of a short binary search per lookup.
+//
+// Parameters:
+// fsm        mfsm_fsm*              FSM context
+// stateHint  int                    Expected number of states
+// inputHint  int                    Expected number of inputs
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the FSM.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+//  -2 -- Memory could not be allocated
+int initSparseFSM(mfsm_fsm *fsm, int stateHint, int inputHint,
+                  const mfsm_Allocator *allocator) {
+  return initAllocatedFSM(fsm, stateHint, inputHint, allocator, 1);
+}
+
+// void initFixedFSM(mfsm_fsm*, mfsm_FixedStorage*)
+//
+// Set default values for an FSM which keeps its arrays in user supplied
+// storage. The FSM never allocates memory and holds at most MAX_STATES
+// states and MAX_INPUTS inputs. The storage must outlive the FSM.
+//
+// Parameters:
+// fsm      mfsm_fsm*           FSM context
+// storage  mfsm_FixedStorage*  Storage for the FSM's arrays
+//
+// Returns:
+// Nothing
+void initFixedFSM(mfsm_fsm *fsm, mfsm_FixedStorage *storage) {
   int i = 0;
-  int j = 0;
-  fsm->curState = MIN_STATE_ID-1;
-  fsm->curInput = MIN_INPUT_ID-1;
+  initEmptyFSM(fsm);
+
+  fsm->maxStates = MAX_STATES;
+  fsm->maxInputs = MAX_INPUTS;
+  fsm->states = storage->states;
+  fsm->accepts = storage->accepts;
+  fsm->inputs = storage->inputs;
+  fsm->stateMap = storage->stateMap;
+  fsm->inputMap = storage->inputMap;
+  fsm->stateMapSize = STATE_MAP_SIZE;
+  fsm->inputMapSize = INPUT_MAP_SIZE;
+  fsm->destinations = storage->destinations;
+  fsm->outputs = storage->outputs;
+  fsm->outputRefs = storage->outputRefs;
+  fsm->outputMap = storage->outputMap;
+  fsm->outputMapSize = OUTPUT_MAP_SIZE;
+  fsm->maxOutputs = MAX_OUTPUTS;
 
   // States array
   for(; i < MAX_STATES; i++) {
     fsm->states[i] = 0;
+    clearAccept(&fsm->accepts[i]);
   }
 
   // Inputs array
@@ -32,21 +681,89 @@ void initFSM(mfsm_fsm *fsm) {
     fsm->inputs[i] = 0;
   }
 
+  // ID lookup tables
+  idMapClear(fsm->stateMap, STATE_MAP_SIZE);
+  idMapClear(fsm->inputMap, INPUT_MAP_SIZE);
+  idMapClear(fsm->outputMap, OUTPUT_MAP_SIZE);
+
   // Destinations array
-  for(i = 0; i < MAX_INPUTS; i++) {
-    for(j = 0; j < MAX_STATES; j++) {
-      fsm->destinations[i][j].dest = 0;
-      initEvent(&fsm->destinations[i][j].outputEvent, NULL_EVENT_ID);
+  clearTransitions(fsm->destinations, MAX_STATES * MAX_INPUTS);
+}
+
+// void freeFSM(mfsm_fsm*)
+//
+// Releases any memory allocated by the FSM. Does nothing for FSMs using
+// fixed storage.
+//
+// Parameters:
+// fsm  mfsm_fsm*  FSM context
+//
+// Returns:
+// Nothing
+void freeFSM(mfsm_fsm *fsm) {
+  if (fsm->allocator.alloc == 0) {
+    return;
+  }
+
+  fsmRelease(fsm, fsm->states);
+  fsmRelease(fsm, fsm->accepts);
+  fsmRelease(fsm, fsm->inputs);
+  fsmRelease(fsm, fsm->stateMap);
+  fsmRelease(fsm, fsm->inputMap);
+  fsmRelease(fsm, fsm->destinations);
+  fsmRelease(fsm, fsm->outputs);
+  fsmRelease(fsm, fsm->outputRefs);
+  fsmRelease(fsm, fsm->outputMap);
+
+  if (fsm->edges != 0) {
+    int i = 0;
+    for (; i < fsm->maxStates; i++) {
+      fsmRelease(fsm, fsm->edges[i].edges);
     }
+
+    fsmRelease(fsm, fsm->edges);
   }
 
-  // Event Queue
-  initEventQueue(&fsm->eq);
+  initEmptyFSM(fsm);
+}
+
+// void reindexFSM(mfsm_fsm*)
+//
+// Rebuilds the state and input ID lookup tables from the states and inputs
+// arrays. Only needed if the arrays were modified without using addState(),
+// removeState(), addInput() or removeInput().
+//
+// Parameters:
+// fsm  mfsm_fsm* Pointer to FSM context
+//
+// Returns:
+// Nothing
+void reindexFSM(mfsm_fsm *fsm) {
+  idMapClear(fsm->stateMap, fsm->stateMapSize);
+  idMapClear(fsm->inputMap, fsm->inputMapSize);
+
+  // Slots may have been freed anywhere
+  fsm->freeState = 0;
+  fsm->freeInput = 0;
+
+  int i = 0;
+  for (; i < fsm->maxStates; i++) {
+    if (fsm->states[i] >= MIN_STATE_ID) {
+      idMapInsert(fsm->stateMap, fsm->stateMapSize, fsm->states, i);
+    }
+  }
+
+  for (i = 0; i < fsm->maxInputs; i++) {
+    if (fsm->inputs[i] >= MIN_INPUT_ID) {
+      idMapInsert(fsm->inputMap, fsm->inputMapSize, fsm->inputs, i);
+    }
+  }
 }
 
 // int isValidStateID(struct mfsm_fsm, int)
 //
-// Ensures the state ID is present in the FSM.
+// Ensures the state ID is present in the FSM. Copies the FSM; prefer
+// isValidStateIDPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -56,24 +773,32 @@ void initFSM(mfsm_fsm *fsm) {
 // 0        -- Valid state ID
 // Non-Zero -- Invalid state ID
 int isValidStateID(mfsm_fsm fsm, int s) {
-  // Confirm the ID is above the minimum
-  if (s < MIN_STATE_ID) {
-    return -1;
-  }
+  return isValidStateIDPtr(&fsm, s);
+}
 
-  int i = 0;
-  for (; i < MAX_STATES; i++) {
-    if (fsm.states[i] == s) {
-      return 0;
-    }
+// int isValidStateIDPtr(const mfsm_fsm*, int)
+//
+// Ensures the state ID is present in the FSM.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// s          int              State ID
+//
+// Returns:
+// 0        -- Valid state ID
+// Non-Zero -- Invalid state ID
+int isValidStateIDPtr(const mfsm_fsm *fsm, int s) {
+  if (getStateIndexPtr(fsm, s) == -1) {
+    return -1;
   }
 
-  return -1;
+  return 0;
 }
 
 // int isValidInputID(struct mfsm_fsm, int)
 //
-// Ensures the input ID is present in the FSM.
+// Ensures the input ID is present in the FSM. Copies the FSM; prefer
+// isValidInputIDPtr().
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -83,24 +808,32 @@ int isValidStateID(mfsm_fsm fsm, int s) {
 // 0        -- Valid input ID
 // Non-Zero -- Invalid input ID
 int isValidInputID(mfsm_fsm fsm, int n) {
-  // Confirm the ID is above the minimum
-  if (n < MIN_INPUT_ID) {
-    return -1;
-  }
+  return isValidInputIDPtr(&fsm, n);
+}
 
-  int i = 0;
-  for (; i < MAX_INPUTS; i++) {
-    if (fsm.inputs[i] == n) {
-      return 0;
-    }
+// int isValidInputIDPtr(const mfsm_fsm*, int)
+//
+// Ensures the input ID is present in the FSM.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+//
+// Returns:
+// 0        -- Valid input ID
+// Non-Zero -- Invalid input ID
+int isValidInputIDPtr(const mfsm_fsm *fsm, int n) {
+  if (getInputIndexPtr(fsm, n) == -1) {
+    return -1;
   }
 
-  return -1;
+  return 0;
 }
 
 // int isValidTransition(struct mfsm_fsm, int, int)
 //
-// Verifies the presence of a transition from state s with input n.
+// Verifies the presence of a transition from state s with input n. Copies the
+// FSM; prefer isValidTransitionPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -113,20 +846,39 @@ int isValidInputID(mfsm_fsm fsm, int n) {
 // -2 -- Invalid source state
 // -3 -- Transition has invalid destination state ID
 int isValidTransition(mfsm_fsm fsm, int n, int s) {
+  return isValidTransitionPtr(&fsm, n, s);
+}
+
+// int isValidTransitionPtr(const mfsm_fsm*, int, int)
+//
+// Verifies the presence of a transition from state s with input n.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// n          int              Input ID
+// s          int              Source state ID
+//
+// Returns:
+// 0  -- Valid transition
+// -1 -- Invalid input
+// -2 -- Invalid source state
+// -3 -- Transition has invalid destination state ID
+int isValidTransitionPtr(const mfsm_fsm *fsm, int n, int s) {
   // Find the given input
-  int ni = getInputIndex(fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Find the given source state
-  int si = getStateIndex(fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -2;
   }
 
   // Validate the transition's destination state
-  if (isValidStateID(fsm, fsm.destinations[ni][si].dest) != 0) {
+  const mfsm_Transition *t = findTransition(fsm, ni, si);
+  if (t == 0 || isValidStateIDPtr(fsm, t->dest) != 0) {
     return -3;
   }
 
@@ -134,6 +886,52 @@ int isValidTransition(mfsm_fsm fsm, int n, int s) {
   return 0;
 }
 
+// const mfsm_Transition* getTransition(const mfsm_fsm*, int, int)
+//
+// Finds the stored transition from state s with input n.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+// s    int              Source state ID
+//
+// Returns:
+// Success -- Pointer to the transition. Its destination may be invalid if no
+// transition has been added.
+// Failure -- 0 if the input or source state is invalid
+const mfsm_Transition *getTransition(const mfsm_fsm *fsm, int n, int s) {
+  int ni = getInputIndexPtr(fsm, n);
+  int si = getStateIndexPtr(fsm, s);
+  if (ni == -1 || si == -1) {
+    return 0;
+  }
+
+  return findTransition(fsm, ni, si);
+}
+
+// const mfsm_Event* getTransitionOutput(const mfsm_fsm*, int, int)
+//
+// Finds the Event sent when the transition from state s with input n is
+// executed.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+// s    int              Source state ID
+//
+// Returns:
+// Success -- Pointer to the Event in the FSM's outputs table
+// Failure -- 0 if the input or source state is invalid, or the transition
+// sends no Event
+const mfsm_Event *getTransitionOutput(const mfsm_fsm *fsm, int n, int s) {
+  const mfsm_Transition *transition = getTransition(fsm, n, s);
+  if (transition == 0 || transition->output == NULL_OUTPUT) {
+    return 0;
+  }
+
+  return &fsm->outputs[transition->output];
+}
+
 // int addTransition(struct mfsm_fsm, int, int, int)
 //
 // Creates a transition from State s with Input n to State d.
@@ -152,29 +950,34 @@ int isValidTransition(mfsm_fsm fsm, int n, int s) {
 // -4 -- Something went wrong associating the transition and states
 int addTransition(mfsm_fsm *fsm, int n, int s, int d) {
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Find the given source state
-  int si = getStateIndex(*fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -2;
   }
 
   // Confirm the destination state exists
-  if (isValidStateID(*fsm, d) == -1) {
+  if (isValidStateIDPtr(fsm, d) == -1) {
     return -3;
   }
 
   // Associate the input and source state with the destination state
-  mfsm_Transition *transition = &fsm->destinations[ni][si];
+  mfsm_Transition *transition = makeTransition(fsm, ni, si);
+  if (transition == 0) {
+    return -4;
+  }
+
   transition->dest = d;
-  initEvent(&transition->outputEvent, NULL_EVENT_ID);
+  releaseOutput(fsm, transition->output);
+  transition->output = NULL_OUTPUT;
 
   // Confirm the transition's destination state was set correctly
-  if (isValidTransition(*fsm, n, s) != 0) {
+  if (isValidTransitionPtr(fsm, n, s) != 0) {
     return -4;
   }
 
@@ -197,22 +1000,26 @@ int addTransition(mfsm_fsm *fsm, int n, int s, int d) {
 // -3 -- Something went wrong removing the transition destination
 int removeTransition(mfsm_fsm *fsm, int n, int s) {
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Find the given source state
-  int si = getStateIndex(*fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -2;
   }
 
   // Reset the destination ID for the state/input transition
-  fsm->destinations[ni][si].dest = MIN_STATE_ID-1;
+  mfsm_Transition *transition = findTransition(fsm, ni, si);
+  if (transition != 0) {
+    transition->dest = MIN_STATE_ID-1;
+    pruneTransition(fsm, ni, si);
+  }
 
   // Confirm the transition's destination state was reset and is invalid
-  if (isValidTransition(*fsm, n, s) == 0) {
+  if (isValidTransitionPtr(fsm, n, s) == 0) {
     return -3;
   }
 
@@ -233,19 +1040,23 @@ int removeTransition(mfsm_fsm *fsm, int n, int s) {
 // -2 -- Something went wrong removing the transition destinations
 int removeTransitionAll(mfsm_fsm *fsm, int n) {
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Reset the all destination IDs for the transition input
   int i = 0;
-  for (; i < MAX_STATES; i++) {
+  for (; i < fsm->maxStates; i++) {
     // Reset the destination
-    fsm->destinations[ni][i].dest = MIN_STATE_ID-1;
+    mfsm_Transition *transition = findTransition(fsm, ni, i);
+    if (transition != 0) {
+      transition->dest = MIN_STATE_ID-1;
+      pruneTransition(fsm, ni, i);
+    }
 
     // Confirm the transition's destination state was reset and is invalid
-    if (isValidTransition(*fsm, n, fsm->states[i]) == 0) {
+    if (isValidTransitionPtr(fsm, n, fsm->states[i]) == 0) {
       return -2;
     }
   }
@@ -256,41 +1067,54 @@ int removeTransitionAll(mfsm_fsm *fsm, int n) {
 // int setTransitionOutput(mfsm_fsm*, int, int, mfsm_Event)
 //
 // Set an Event to be sent out to all listeners when the transition is
-// executed.
+// executed. The Event is copied into the FSM's outputs table unless an equal
+// one is already there, found through a hash of its fields.
 //
 // Parameters:
 // fsm  mfsm_fsm* Pointer to FSM context
 // n    int       Input ID
 // s    int       Source state ID
+// e    mfsm_Event Event to send. An ID of NULL_EVENT_ID sends no Event.
 //
 // Returns:
 // Success -- 0
 // Failure:
 //  -1 -- Invalid input ID
 //  -2 -- Invalid source state ID
-//  -3 -- Something went wrong setting the event
+//  -3 -- Something went wrong setting the event, eg. the transitions of an
+//        FSM using fixed storage already send MAX_OUTPUTS distinct Events
 int setTransitionOutput(mfsm_fsm *fsm, int n, int s, mfsm_Event e) {
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Find the given source state
-  int si = getStateIndex(*fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -2;
   }
 
-  // Copy the Event into the Transition
-  // TODO: This must be updated if the Event struct is changed.
-  // This may indicate the need for a copy function for Events.
-  initEvent(&fsm->destinations[ni][si].outputEvent, e.id);
+  // Share the Event with any transition sending an equal one
+  int output = NULL_OUTPUT;
+  if (e.id != NULL_EVENT_ID) {
+    output = acquireOutput(fsm, &e);
+    if (output == -1) {
+      return -3;
+    }
+  }
 
-  if (fsm->destinations[ni][si].outputEvent.id != e.id) {
+  mfsm_Transition *transition = makeTransition(fsm, ni, si);
+  if (transition == 0) {
+    releaseOutput(fsm, output);
     return -3;
   }
 
+  releaseOutput(fsm, transition->output);
+  transition->output = output;
+  pruneTransition(fsm, ni, si);
+
   return 0;
 }
 
@@ -312,24 +1136,28 @@ int setTransitionOutput(mfsm_fsm *fsm, int n, int s, mfsm_Event e) {
 //  -3 -- Something went wrong resetting the event
 int clearTransitionOutput(mfsm_fsm *fsm, int n, int s) {
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Find the given source state
-  int si = getStateIndex(*fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -2;
   }
 
-  // Invalidate the output event
-  initEvent(&fsm->destinations[ni][si].outputEvent, NULL_EVENT_ID);
-
-  if (fsm->destinations[ni][si].outputEvent.id != NULL_EVENT_ID) {
-    return -3;
+  // Invalidate the output event. Nothing to do if no transition is stored.
+  mfsm_Transition *transition = findTransition(fsm, ni, si);
+  if (transition == 0) {
+    return 0;
   }
 
+  releaseOutput(fsm, transition->output);
+  transition->output = NULL_OUTPUT;
+
+  pruneTransition(fsm, ni, si);
+
   return 0;
 }
 
@@ -353,21 +1181,32 @@ int addState(mfsm_fsm *fsm, int s) {
   }
 
   // Ensure the state is not already being tracked
-  if (getStateIndex(*fsm, s) != -1) {
+  if (getStateIndexPtr(fsm, s) != -1) {
     return -2;
   }
 
-  // Insert the state ID into the first free space in the states array
-  int i = 0;
-  for (; i < MAX_STATES; i++) {
+  // Insert the state ID into the first free space in the states array. The
+  // slots before freeState are all in use.
+  int i = fsm->freeState;
+  for (; i < fsm->maxStates; i++) {
     if (fsm->states[i] < MIN_STATE_ID) {
-      fsm->states[i] = s;
-      return 0;
+      break;
     }
   }
 
-  // A free space could not be found for the ID.
-  return -3;
+  // A free space could not be found for the ID. Grow the array if possible;
+  // the first new index is free.
+  if (i == fsm->maxStates &&
+      resizeFSM(fsm, fsm->maxStates * 2, fsm->maxInputs, fsm->edges != 0) != 0) {
+    fsm->freeState = i;
+    return -3;
+  }
+
+  fsm->states[i] = s;
+  clearAccept(&fsm->accepts[i]);
+  idMapInsert(fsm->stateMap, fsm->stateMapSize, fsm->states, i);
+  fsm->freeState = i + 1;
+  return 0;
 }
 
 // int removeState(mfsm_fsm*, int)
@@ -383,17 +1222,90 @@ int addState(mfsm_fsm *fsm, int s) {
 // -1 -- State could not be found
 int removeState(mfsm_fsm *fsm, int s) {
   // Find the index of the state ID
-  int si = getStateIndex(*fsm, s);
+  int si = getStateIndexPtr(fsm, s);
   if (si == -1) {
     return -1;
   }
 
   // Reset the index to an invalid ID so it can be reused
+  idMapRemove(fsm->stateMap, fsm->stateMapSize, fsm->states, s);
   fsm->states[si] = MIN_STATE_ID-1;
+  clearAccept(&fsm->accepts[si]);
+  if (si < fsm->freeState) {
+    fsm->freeState = si;
+  }
   
   return 0;
 }
 
+// int setAcceptingState(mfsm_fsm*, int, int, int)
+//
+// Marks a state as accepting. New states are not accepting.
+//
+// Parameters:
+// fsm        mfsm_fsm* Pointer to FSM context
+// s          int       State ID
+// priority   int       Priority over other accepting states it may be
+//                      combined with
+// tag        int       User value reported with matches
+//
+// Returns:
+// 0  -- State successfully marked
+// -1 -- State could not be found
+int setAcceptingState(mfsm_fsm *fsm, int s, int priority, int tag) {
+  int si = getStateIndexPtr(fsm, s);
+  if (si == -1) {
+    return -1;
+  }
+
+  fsm->accepts[si].accepting = 1;
+  fsm->accepts[si].priority = priority;
+  fsm->accepts[si].tag = tag;
+
+  return 0;
+}
+
+// int clearAcceptingState(mfsm_fsm*, int)
+//
+// Marks a state as not accepting.
+//
+// Parameters:
+// fsm  mfsm_fsm* Pointer to FSM context
+// s    int       State ID
+//
+// Returns:
+// 0  -- State successfully cleared
+// -1 -- State could not be found
+int clearAcceptingState(mfsm_fsm *fsm, int s) {
+  int si = getStateIndexPtr(fsm, s);
+  if (si == -1) {
+    return -1;
+  }
+
+  clearAccept(&fsm->accepts[si]);
+
+  return 0;
+}
+
+// const mfsm_Accept* getAcceptingState(const mfsm_fsm*, int)
+//
+// Finds the accepting state information of a state.
+//
+// Parameters:
+// fsm  const mfsm_fsm* Pointer to FSM context
+// s    int             State ID
+//
+// Returns:
+// The state's information, or 0 if the state is invalid or not accepting
+const mfsm_Accept *getAcceptingState(const mfsm_fsm *fsm, int s) {
+  int si = getStateIndexPtr(fsm, s);
+  if (si == -1 || !fsm->accepts[si].accepting) {
+    return 0;
+  }
+
+  return &fsm->accepts[si];
+}
+
 // int addInput(mfsm_fsm*, int)
 //
 // Adds an input ID to the list of tracked inputs.
@@ -414,21 +1326,31 @@ int addInput(mfsm_fsm *fsm, int n) {
   }
 
   // Ensure the input is not already being tracked
-  if (getInputIndex(*fsm, n) != -1) {
+  if (getInputIndexPtr(fsm, n) != -1) {
     return -2;
   }
 
-  // Insert the input ID into the first free space in the inputs array
-  int i = 0;
-  for (; i < MAX_INPUTS; i++) {
+  // Insert the input ID into the first free space in the inputs array. The
+  // slots before freeInput are all in use.
+  int i = fsm->freeInput;
+  for (; i < fsm->maxInputs; i++) {
     if (fsm->inputs[i] < MIN_INPUT_ID) {
-      fsm->inputs[i] = n;
-      return 0;
+      break;
     }
   }
 
-  // A free space could not be found for the ID.
-  return -3;
+  // A free space could not be found for the ID. Grow the array if possible;
+  // the first new index is free.
+  if (i == fsm->maxInputs &&
+      resizeFSM(fsm, fsm->maxStates, fsm->maxInputs * 2, fsm->edges != 0) != 0) {
+    fsm->freeInput = i;
+    return -3;
+  }
+
+  fsm->inputs[i] = n;
+  idMapInsert(fsm->inputMap, fsm->inputMapSize, fsm->inputs, i);
+  fsm->freeInput = i + 1;
+  return 0;
 }
 
 // int removeInput(mfsm_fsm*, int)
@@ -444,13 +1366,17 @@ int addInput(mfsm_fsm *fsm, int n) {
 // -1 -- Input could not be found
 int removeInput(mfsm_fsm *fsm, int n) {
   // Find the index of the input ID
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(fsm, n);
   if (ni == -1) {
     return -1;
   }
 
   // Reset the index to an invalid ID so it can be reused
+  idMapRemove(fsm->inputMap, fsm->inputMapSize, fsm->inputs, n);
   fsm->inputs[ni] = MIN_INPUT_ID-1;
+  if (ni < fsm->freeInput) {
+    fsm->freeInput = ni;
+  }
   
   return 0;
 }
@@ -471,32 +1397,234 @@ int removeInput(mfsm_fsm *fsm, int n) {
 //  -1 -- Invalid input ID
 //  -2 -- The current state ID is invalid
 int doTransition(mfsm_fsm *fsm, int n) {
+  // Treat the FSM as its own definition and single instance
+  mfsm_Instance inst;
+  inst.curState = fsm->curState;
+  inst.curInput = fsm->curInput;
+  inst.eq = &fsm->eq;
+#ifdef MFSM_STATS
+  inst.stats = fsm->stats;
+#endif
+#ifdef MFSM_TIMING
+  inst.timing = 0; // Falls back to the FSM's own
+#endif
+
+  int result = doInstanceTransition(fsm, &inst, n);
+
+  fsm->curState = inst.curState;
+  fsm->curInput = inst.curInput;
+
+  return result;
+}
+
+// void initInstance(mfsm_Instance*, int, mfsm_EventQueue*)
+//
+// Set default values for an FSM instance.
+//
+// Parameters:
+// inst   mfsm_Instance*    Uninitialized instance
+// s      int               ID of the starting state
+// eq     mfsm_EventQueue*  EventQueue for output Events, or 0 for none
+//
+// Returns:
+// Nothing
+void initInstance(mfsm_Instance *inst, int s, mfsm_EventQueue *eq) {
+  inst->curState = s;
+  inst->curInput = MIN_INPUT_ID-1;
+  inst->eq = eq;
+#ifdef MFSM_STATS
+  inst->stats = 0;
+#endif
+#ifdef MFSM_TIMING
+  inst->timing = 0;
+#endif
+}
+
+// int doInstanceTransition(const mfsm_fsm*, mfsm_Instance*, int)
+//
+// Executes the transition from the instance's current state using input n,
+// looking the transition up in a shared FSM definition. Output Events are
+// sent to the instance's EventQueue, if it has one.
+//
+// Parameters:
+// def  const mfsm_fsm*   Pointer to the shared FSM definition
+// inst mfsm_Instance*    Instance context
+// n    int               Input ID
+//
+// Returns:
+// Success -- ID of new current State
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- The current state ID is invalid
+int doInstanceTransition(const mfsm_fsm *def, mfsm_Instance *inst, int n) {
+  TIME_START(def, inst);
+
   // Find the given input
-  int ni = getInputIndex(*fsm, n);
+  int ni = getInputIndexPtr(def, n);
   if (ni == -1) {
+    COUNT_FAILURE(inst, -1);
     return -1;
   }
 
   // Find the current source state
-  int si = getStateIndex(*fsm, fsm->curState);
+  int si = getStateIndexPtr(def, inst->curState);
   if (si == -1) {
+    COUNT_FAILURE(inst, -2);
     return -2;
   }
 
-  // Check if there is a new destination for the transition
-  if (isValidTransition(*fsm, n, fsm->curState) == 0) {
-    fsm->curState = fsm->destinations[ni][si].dest;
+  COUNT_TRANSITION(inst, si, ni);
+
+  // Check if there is a new destination for the transition. The input and
+  // source state are already known to be valid, so only the destination needs
+  // to be checked.
+  const mfsm_Transition *transition = findTransition(def, ni, si);
+  if (transition == 0) {
+    // Nothing is stored in sparse storage, so stay in the same state
+    inst->curInput = n;
+    TIME_PHASE(transition);
+    return inst->curState;
   }
 
-  // Try to fire the output event
-  if (fsm->destinations[ni][si].outputEvent.id != NULL_EVENT_ID) {
-    sendEvent(fsm->eq, fsm->destinations[ni][si].outputEvent);
+  if (isValidStateIDPtr(def, transition->dest) == 0) {
+    inst->curState = transition->dest;
   }
+  inst->curInput = n;
+  TIME_PHASE(transition);
+
+  // Try to fire the output event, with the instance in its new state
+  if (inst->eq != 0 && transition->output != NULL_OUTPUT) {
+    sendEventPtr(inst->eq, def->outputs[transition->output]);
+    COUNT_EVENT(inst);
+    TIME_PHASE(dispatch);
+  }
+
+  return inst->curState;
+}
 
-  // Set the current Input
-  fsm->curInput = n;
 
-  return fsm->curState;
+// int doTransitionBatch(mfsm_fsm*, const int*, size_t, int*, size_t*)
+//
+// Executes a transition for each input in turn, as if doTransition() was
+// called for each one. The current state is only validated once, so this is
+// cheaper than calling doTransition() in a loop. Stops at the first invalid
+// input; the transitions before it stay executed.
+//
+// Parameters:
+// fsm         mfsm_fsm*     FSM context
+// inputs      const int*    Input IDs to execute in order
+// n           size_t        Number of inputs
+// trajectory  int*          Receives the state ID after each input. May be 0.
+// numDone     size_t*       Receives the number of inputs executed, which is
+//                           the index of the invalid input on failure. May
+//                           be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doTransitionBatch(mfsm_fsm *fsm, const int *inputs, size_t n,
+                      int *trajectory, size_t *numDone) {
+  // Treat the FSM as its own definition and single instance
+  mfsm_Instance inst;
+  inst.curState = fsm->curState;
+  inst.curInput = fsm->curInput;
+  inst.eq = &fsm->eq;
+#ifdef MFSM_STATS
+  inst.stats = fsm->stats;
+#endif
+#ifdef MFSM_TIMING
+  inst.timing = 0; // Falls back to the FSM's own
+#endif
+
+  int result = doInstanceTransitionBatch(fsm, &inst, inputs, n, trajectory,
+                                         numDone);
+
+  fsm->curState = inst.curState;
+  fsm->curInput = inst.curInput;
+
+  return result;
+}
+
+// int doInstanceTransitionBatch(const mfsm_fsm*, mfsm_Instance*, const int*,
+//                               size_t, int*, size_t*)
+//
+// Batch version of doInstanceTransition(). See doTransitionBatch().
+//
+// Parameters:
+// def         const mfsm_fsm*   Pointer to the shared FSM definition
+// inst        mfsm_Instance*    Instance context
+// inputs      const int*        Input IDs to execute in order
+// n           size_t            Number of inputs
+// trajectory  int*              Receives the state ID after each input. May
+//                               be 0.
+// numDone     size_t*           Receives the number of inputs executed. May
+//                               be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doInstanceTransitionBatch(const mfsm_fsm *def, mfsm_Instance *inst,
+                              const int *inputs, size_t n, int *trajectory,
+                              size_t *numDone) {
+  if (numDone != 0) {
+    *numDone = 0;
+  }
+
+  // Find the current source state once. After that the state index is kept
+  // in step with the state ID, so it never needs to be looked up again.
+  int si = getStateIndexPtr(def, inst->curState);
+  if (si == -1) {
+    COUNT_FAILURE(inst, -2);
+    return -2;
+  }
+
+  size_t i = 0;
+  for (; i < n; i++) {
+    int ni = getInputIndexPtr(def, inputs[i]);
+    if (ni == -1) {
+      if (numDone != 0) {
+        *numDone = i;
+      }
+
+      COUNT_FAILURE(inst, -1);
+      return -1;
+    }
+
+    COUNT_TRANSITION(inst, si, ni);
+
+    const mfsm_Transition *transition = findTransition(def, ni, si);
+    if (transition != 0) {
+      // Move to the destination if it is valid
+      int di = getStateIndexPtr(def, transition->dest);
+      if (di != -1) {
+        si = di;
+        inst->curState = transition->dest;
+      }
+    }
+
+    inst->curInput = inputs[i];
+
+    // Try to fire the output event, with the instance in its new state
+    if (transition != 0 && inst->eq != 0 &&
+        transition->output != NULL_OUTPUT) {
+      sendEventPtr(inst->eq, def->outputs[transition->output]);
+      COUNT_EVENT(inst);
+    }
+
+    if (trajectory != 0) {
+      trajectory[i] = inst->curState;
+    }
+  }
+
+  if (numDone != 0) {
+    *numDone = n;
+  }
+
+  return 0;
 }
 
 
@@ -506,7 +1634,8 @@ int doTransition(mfsm_fsm *fsm, int n) {
 
 // int getStateIndex(struct mfsm_fsm, int)
 //
-// Finds the index of the given state in the states array.
+// Finds the index of the given state in the states array. Copies the FSM;
+// prefer getStateIndexPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -516,23 +1645,33 @@ int doTransition(mfsm_fsm *fsm, int n) {
 // Success -- Index of the given state
 // Failure -- -1
 int getStateIndex(mfsm_fsm fsm, int state) {
-  if (isValidStateID(fsm, state) != 0) {
-    return -1;
-  }
+  return getStateIndexPtr(&fsm, state);
+}
 
-  int i = 0;
-  for (; i < MAX_STATES; i++) {
-    if (fsm.states[i] == state) {
-      return i;
-    }
+// int getStateIndexPtr(const mfsm_fsm*, int)
+//
+// Finds the index of the given state in the states array.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// src        int              State ID
+//
+// Returns:
+// Success -- Index of the given state
+// Failure -- -1
+int getStateIndexPtr(const mfsm_fsm *fsm, int state) {
+  // Confirm the ID is above the minimum
+  if (state < MIN_STATE_ID) {
+    return -1;
   }
 
-  return -1;
+  return idMapFind(fsm->stateMap, fsm->stateMapSize, fsm->states, state);
 }
 
 // int getInputIndex(struct mfsm_fsm, int)
 //
-// Finds the index of the given input in the inputs array.
+// Finds the index of the given input in the inputs array. Copies the FSM;
+// prefer getInputIndexPtr().
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -542,16 +1681,25 @@ int getStateIndex(mfsm_fsm fsm, int state) {
 // Success -- Index of the given input
 // Failure -- -1
 int getInputIndex(mfsm_fsm fsm, int n) {
-  if (isValidInputID(fsm, n) != 0) {
-    return -1;
-  }
+  return getInputIndexPtr(&fsm, n);
+}
 
-  int i = 0;
-  for (; i < MAX_INPUTS; i++) {
-    if (fsm.inputs[i] == n) {
-      return i;
-    }
+// int getInputIndexPtr(const mfsm_fsm*, int)
+//
+// Finds the index of the given input in the inputs array.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID 
+//
+// Returns:
+// Success -- Index of the given input
+// Failure -- -1
+int getInputIndexPtr(const mfsm_fsm *fsm, int n) {
+  // Confirm the ID is above the minimum
+  if (n < MIN_INPUT_ID) {
+    return -1;
   }
 
-  return -1;
+  return idMapFind(fsm->inputMap, fsm->inputMapSize, fsm->inputs, n);
 }
@@ -1,13 +1,34 @@
 #ifndef MICROFSM_H
 #define MICROFSM_H
 
+#include <stddef.h>
 #include "event.h"
+#include "stats.h"
+#include "timing.h"
 
+// Capacity of FSMs using fixed storage (see initFixedFSM()), and the starting
+// capacity of FSMs created with initFSM().
 #define MAX_STATES 128
 #define MAX_INPUTS 32
 #define MIN_STATE_ID 1
 #define MIN_INPUT_ID 1
 
+// An event ID which represents an invalid Event as per documentation.
+#define NULL_EVENT_ID -1
+
+// Output index of a transition which sends no Event.
+#define NULL_OUTPUT -1
+
+// Distinct output Events an FSM using fixed storage can hold at once, and
+// the starting size of the output table of other FSMs.
+#define MAX_OUTPUTS 64
+
+// Number of slots in the ID lookup tables of fixed storage. Kept at twice the
+// number of IDs so lookups rarely need more than one probe.
+#define STATE_MAP_SIZE (MAX_STATES*2)
+#define INPUT_MAP_SIZE (MAX_INPUTS*2)
+#define OUTPUT_MAP_SIZE (MAX_OUTPUTS*2)
+
 /***************************************
  * MicroFSM
  *
@@ -15,17 +36,78 @@
  * user may define the nature of states, transitions, and the topology of the
  * FSM. All the library requires is an ID to track the states and
  * transitions.
+ *
+ * An FSM's arrays either live in a user supplied mfsm_FixedStorage (see
+ * initFixedFSM()), which never allocates, or are allocated through an
+ * mfsm_Allocator and grow as states and inputs are added (see
+ * initDynamicFSM()). Transitions are normally stored in a dense
+ * input x state table. Large machines with few transitions can store them in
+ * sorted per-state edge lists instead (see initSparseFSM()); the rest of the
+ * API behaves the same either way. Define MFSM_NO_MALLOC to build without the default
+ * malloc() based allocator, eg. for microcontrollers; initFSM() then uses
+ * fixed storage inside the mfsm_fsm.
 **************************************/
 
 // Factored out transition destinations into a separate structure to enable
 // more flexibility for input/output events, etc.
+//
+// The Event itself lives in the FSM's outputs table, shared by every
+// transition sending an equal Event. With its inline data and Payload
+// pointer an mfsm_Event is 32 bytes on 64 bit machines; embedding it would
+// make this struct 40 bytes instead of 8, and the default 128 x 32 dense
+// table 160 KB instead of 32 KB.
 typedef struct mfsm_Transition {
   int dest; // ID of destination State
 
-  // Event to be dispatched from the FSM when the transition is executed
-  mfsm_Event outputEvent;
+  // Index in the FSM's outputs table of the Event to be dispatched when the
+  // transition is executed, or NULL_OUTPUT. See getTransitionOutput().
+  int output;
 } mfsm_Transition;
 
+// A transition stored in sparse storage, keyed by the index of its input.
+typedef struct mfsm_Edge {
+  int input; // Index of the input in the inputs array
+  mfsm_Transition transition;
+} mfsm_Edge;
+
+// Transitions leaving one state in sparse storage, sorted by input index.
+typedef struct mfsm_EdgeList {
+  mfsm_Edge *edges;
+  int numEdges;
+  int maxEdges;
+} mfsm_EdgeList;
+
+// Memory allocation callbacks, eg. for placing FSMs in an arena. alloc
+// returns 0 on failure. release may be a no-op for arenas.
+typedef struct mfsm_Allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void (*release)(void *ctx, void *ptr);
+  void *ctx; // Passed to both callbacks
+} mfsm_Allocator;
+
+// Accepting state information, kept for every state. Recognisers report a
+// match whenever the machine enters an accepting state (see scanner.h).
+typedef struct mfsm_Accept {
+  int accepting; // Non-zero if the state is accepting
+  int priority;  // When accepting states are combined into one, the highest
+                 // priority one's tag is kept
+  int tag;       // User value reported with matches, eg. a token type
+} mfsm_Accept;
+
+// Storage for an FSM which never allocates memory. Holds MAX_STATES states
+// and MAX_INPUTS inputs.
+typedef struct mfsm_FixedStorage {
+  int states[MAX_STATES];
+  mfsm_Accept accepts[MAX_STATES];
+  int inputs[MAX_INPUTS];
+  int stateMap[STATE_MAP_SIZE];
+  int inputMap[INPUT_MAP_SIZE];
+  mfsm_Transition destinations[MAX_INPUTS*MAX_STATES];
+  mfsm_Event outputs[MAX_OUTPUTS];
+  int outputRefs[MAX_OUTPUTS];
+  int outputMap[OUTPUT_MAP_SIZE];
+} mfsm_FixedStorage;
+
 typedef struct mfsm_fsm {
   // ID of the currently active state. Used as the "source" state in
   // transitions.
@@ -33,26 +115,114 @@ typedef struct mfsm_fsm {
 
   int curInput; // ID of the current Input
 
-  int states[MAX_STATES]; // Stores IDs of states tracked within the FSM
-  int inputs[MAX_INPUTS]; // Stores IDs of tracked inputs to the FSM
+  int maxStates; // Capacity of the states array
+  int maxInputs; // Capacity of the inputs array
+
+  // Every slot of the states and inputs arrays below these indexes is in
+  // use, so addState() and addInput() start looking for a free slot here.
+  int freeState;
+  int freeInput;
+
+  int *states; // Stores IDs of states tracked within the FSM
+  int *inputs; // Stores IDs of tracked inputs to the FSM
+
+  // Accepting state information, PARALLEL with the states array
+  mfsm_Accept *accepts;
+
+  // Hash tables mapping state/input IDs to their index in the states and
+  // inputs arrays. Kept up to date by addState(), removeState(), addInput()
+  // and removeInput(). Call reindexFSM() after writing to the arrays directly.
+  int *stateMap;
+  int *inputMap;
+  int stateMapSize;
+  int inputMapSize;
 
   // Stores ID's of destination states, etc when the FSM recieves a specific
   // input from a specific source state. The states and inputs arrays are
-  // PARALLEL with the transitions array; indexes must be identical.
-  mfsm_Transition destinations[MAX_INPUTS][MAX_STATES];
+  // PARALLEL with the transitions array; indexes must be identical. Laid out
+  // as destinations[input index * maxStates + state index]. Use
+  // getTransition() rather than indexing it directly. 0 for sparse storage.
+  mfsm_Transition *destinations;
+
+  // Sparse storage: one edge list per entry of the states array, or 0 for
+  // dense storage. See initSparseFSM().
+  mfsm_EdgeList *edges;
+
+  // Distinct output Events set with setTransitionOutput(), indexed by
+  // mfsm_Transition.output. outputRefs is PARALLEL with outputs and counts
+  // the transitions sending each Event; an entry is free for reuse once its
+  // count drops to 0. outputMap is a hash table of the live entries, holding
+  // index+1 in each slot with 0 for an empty slot. The first numOutputs
+  // entries have been used, and none before freeOutput are free.
+  mfsm_Event *outputs;
+  int *outputRefs;
+  int *outputMap;
+  int outputMapSize;
+  int numOutputs;
+  int maxOutputs;
+  int freeOutput;
+
+  // Allocator used to grow the arrays. alloc is 0 for fixed storage.
+  mfsm_Allocator allocator;
 
   // Enable outside parties to listen to events being dispatched from this
   // structure.
   mfsm_EventQueue eq;
+
+#ifdef MFSM_STATS
+  mfsm_Stats *stats; // Counters for doTransition(), or 0
+#endif
+
+#ifdef MFSM_TIMING
+  // Histograms for doTransition(), and for instances using this FSM as their
+  // definition which have none of their own. May be 0.
+  mfsm_Timing *timing;
+#endif
+
+#ifdef MFSM_NO_MALLOC
+  // Storage used by initFSM() when there is no allocator, as the arrays were
+  // embedded before storage could grow.
+  mfsm_FixedStorage storage;
+#endif
 } mfsm_fsm;
 
+// Runtime state of one session of an FSM. Any number of instances may share
+// a single mfsm_fsm as their definition (states, inputs and transitions), in
+// which case the definition's own curState, curInput and eq are unused.
+typedef struct mfsm_Instance {
+  int curState; // ID of the currently active state
+  int curInput; // ID of the last Input
+
+  // Optional EventQueue receiving this instance's output Events. May be 0.
+  mfsm_EventQueue *eq;
+
+#ifdef MFSM_STATS
+  mfsm_Stats *stats; // Counters for this instance's transitions, or 0
+#endif
+
+#ifdef MFSM_TIMING
+  mfsm_Timing *timing; // Histograms for this instance's transitions, or 0
+#endif
+} mfsm_Instance;
+
 /***************************************
 * FSM Interface Functions
 ***************************************/
 
 // void initFSM (mfsm_fsm*)
 //
-// Set default values for an FSM.
+// Set default values for an FSM. Storage for MAX_STATES states and
+// MAX_INPUTS inputs is allocated with malloc() and grows on demand. Release
+// it with freeFSM(). If the allocation fails, the FSM has no capacity and
+// addState()/addInput() will fail.
+//
+// Migrating from fixed size FSMs: initFSM() used to leave the arrays inside
+// the mfsm_fsm itself. Code which creates FSMs with initFSM() and then
+// discards them should now call freeFSM() to avoid leaking the storage.
+// Built with MFSM_NO_MALLOC, initFSM() keeps the old behaviour: the FSM uses
+// the mfsm_FixedStorage inside it (see initFixedFSM()), never allocates and
+// holds at most MAX_STATES states and MAX_INPUTS inputs. Such an FSM must
+// not be copied by value, as it points into itself.
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -61,9 +231,104 @@ typedef struct mfsm_fsm {
 // Nothing
 void initFSM(mfsm_fsm *fsm);
 
+#ifndef MFSM_NO_MALLOC
+// const mfsm_Allocator* getDefaultAllocator(void)
+//
+// Returns the malloc() based allocator used by initFSM().
+//
+// Parameters:
+// None
+//
+// Returns:
+// Pointer to the default allocator
+const mfsm_Allocator *getDefaultAllocator(void);
+#endif //MFSM_NO_MALLOC
+
+// int initDynamicFSM(mfsm_fsm*, int, int, const mfsm_Allocator*)
+//
+// Set default values for an FSM whose storage is allocated with the given
+// allocator. The arrays start with room for the hinted number of states and
+// inputs and double in size whenever they fill up. Release the storage with
+// freeFSM().
+//
+// Parameters:
+// fsm        mfsm_fsm*              FSM context
+// stateHint  int                    Expected number of states
+// inputHint  int                    Expected number of inputs
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the FSM.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+//  -2 -- Memory could not be allocated
+int initDynamicFSM(mfsm_fsm *fsm, int stateHint, int inputHint,
+                   const mfsm_Allocator *allocator);
+
+// int initSparseFSM(mfsm_fsm*, int, int, const mfsm_Allocator*)
+//
+// Same as initDynamicFSM(), but transitions are stored in per-state edge
+// lists sorted by input rather than a dense input x state table. Memory use
+// grows with the number of transitions instead of states x inputs, at the
+// cost of a short binary search per lookup.
+//
+// Parameters:
+// fsm        mfsm_fsm*              FSM context
+// stateHint  int                    Expected number of states
+// inputHint  int                    Expected number of inputs
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the FSM.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+//  -2 -- Memory could not be allocated
+int initSparseFSM(mfsm_fsm *fsm, int stateHint, int inputHint,
+                  const mfsm_Allocator *allocator);
+
+// void initFixedFSM(mfsm_fsm*, mfsm_FixedStorage*)
+//
+// Set default values for an FSM which keeps its arrays in user supplied
+// storage. The FSM never allocates memory and holds at most MAX_STATES
+// states and MAX_INPUTS inputs. The storage must outlive the FSM.
+//
+// Parameters:
+// fsm      mfsm_fsm*           FSM context
+// storage  mfsm_FixedStorage*  Storage for the FSM's arrays
+//
+// Returns:
+// Nothing
+void initFixedFSM(mfsm_fsm *fsm, mfsm_FixedStorage *storage);
+
+// void freeFSM(mfsm_fsm*)
+//
+// Releases any memory allocated by the FSM. Does nothing for FSMs using
+// fixed storage.
+//
+// Parameters:
+// fsm  mfsm_fsm*  FSM context
+//
+// Returns:
+// Nothing
+void freeFSM(mfsm_fsm *fsm);
+
+// void reindexFSM(mfsm_fsm*)
+//
+// Rebuilds the state and input ID lookup tables from the states and inputs
+// arrays. Only needed if the arrays were modified without using addState(),
+// removeState(), addInput() or removeInput().
+//
+// Parameters:
+// fsm  mfsm_fsm* Pointer to FSM context
+//
+// Returns:
+// Nothing
+void reindexFSM(mfsm_fsm *fsm);
+
 // int isValidStateID(struct mfsm_fsm, int)
 //
-// Ensures the state ID is present in the FSM.
+// Ensures the state ID is present in the FSM. Copies the FSM; prefer
+// isValidStateIDPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -74,9 +339,23 @@ void initFSM(mfsm_fsm *fsm);
 // Non-Zero -- Invalid state ID
 int isValidStateID(mfsm_fsm fsm, int s);
 
+// int isValidStateIDPtr(const mfsm_fsm*, int)
+//
+// Ensures the state ID is present in the FSM without copying the FSM.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// s          int              State ID
+//
+// Returns:
+// 0        -- Valid state ID
+// Non-Zero -- Invalid state ID
+int isValidStateIDPtr(const mfsm_fsm *fsm, int s);
+
 // int isValidInputID(struct mfsm_fsm, int)
 //
-// Ensures the input ID is present in the FSM.
+// Ensures the input ID is present in the FSM. Copies the FSM; prefer
+// isValidInputIDPtr().
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -87,9 +366,23 @@ int isValidStateID(mfsm_fsm fsm, int s);
 // Non-Zero -- Invalid input ID
 int isValidInputID(mfsm_fsm fsm, int n);
 
+// int isValidInputIDPtr(const mfsm_fsm*, int)
+//
+// Ensures the input ID is present in the FSM without copying the FSM.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+//
+// Returns:
+// 0        -- Valid input ID
+// Non-Zero -- Invalid input ID
+int isValidInputIDPtr(const mfsm_fsm *fsm, int n);
+
 // int isValidTransition(struct mfsm_fsm, int, int)
 //
-// Verifies the presence of a transition from state s with input n.
+// Verifies the presence of a transition from state s with input n. Copies the
+// FSM; prefer isValidTransitionPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -103,6 +396,55 @@ int isValidInputID(mfsm_fsm fsm, int n);
 // -3 -- Transition has invalid destination state ID
 int isValidTransition(mfsm_fsm fsm, int n, int s);
 
+// int isValidTransitionPtr(const mfsm_fsm*, int, int)
+//
+// Verifies the presence of a transition from state s with input n without
+// copying the FSM.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// n          int              Input ID
+// s          int              Source state ID
+//
+// Returns:
+// 0  -- Valid transition
+// -1 -- Invalid input
+// -2 -- Invalid source state
+// -3 -- Transition has invalid destination state ID
+int isValidTransitionPtr(const mfsm_fsm *fsm, int n, int s);
+
+// const mfsm_Transition* getTransition(const mfsm_fsm*, int, int)
+//
+// Finds the stored transition from state s with input n.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+// s    int              Source state ID
+//
+// Returns:
+// Success -- Pointer to the transition. Its destination may be invalid if no
+// transition has been added.
+// Failure -- 0 if the input or source state is invalid, or if an FSM using
+// sparse storage has nothing stored for the pair
+const mfsm_Transition *getTransition(const mfsm_fsm *fsm, int n, int s);
+
+// const mfsm_Event* getTransitionOutput(const mfsm_fsm*, int, int)
+//
+// Finds the Event sent when the transition from state s with input n is
+// executed.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID
+// s    int              Source state ID
+//
+// Returns:
+// Success -- Pointer to the Event in the FSM's outputs table
+// Failure -- 0 if the input or source state is invalid, or the transition
+// sends no Event
+const mfsm_Event *getTransitionOutput(const mfsm_fsm *fsm, int n, int s);
+
 // int addTransition(struct mfsm_fsm, int, int, int)
 //
 // Creates a transition from State s with Input n to State d.
@@ -154,19 +496,22 @@ int removeTransitionAll(mfsm_fsm *fsm, int n);
 // int setTransitionOutput(mfsm_fsm*, int, int, mfsm_Event)
 //
 // Set an Event to be sent out to all listeners when the transition is
-// executed.
+// executed. The Event is copied into the FSM's outputs table unless an equal
+// one is already there, found through a hash of its fields.
 //
 // Parameters:
 // fsm  mfsm_fsm* Pointer to FSM context
 // n    int       Input ID
 // s    int       Source state ID
+// e    mfsm_Event Event to send. An ID of NULL_EVENT_ID sends no Event.
 //
 // Returns:
 // Success -- 0
 // Failure:
 //  -1 -- Invalid input ID
 //  -2 -- Invalid source state ID
-//  -3 -- Something went wrong setting the event
+//  -3 -- Something went wrong setting the event, eg. the transitions of an
+//        FSM using fixed storage already send MAX_OUTPUTS distinct Events
 int setTransitionOutput(mfsm_fsm *fsm, int n, int s, mfsm_Event e);
 
 // int clearTransitionOutput(mfsm_fsm*, int, int)
@@ -199,7 +544,8 @@ int clearTransitionOutput(mfsm_fsm *fsm, int n, int s);
 // 0  -- State successfully created
 // -1 -- State ID exceeded acceptable bounds (0 < s)
 // -2 -- State ID already exists
-// -3 -- The states array is full. No more states can be tracked at this time.
+// -3 -- The states array is full and could not be grown. No more states can
+//       be tracked at this time.
 int addState(mfsm_fsm *fsm, int s);
 
 // int removeState(mfsm_fsm*, int)
@@ -215,6 +561,47 @@ int addState(mfsm_fsm *fsm, int s);
 // -1 -- State could not be found
 int removeState(mfsm_fsm *fsm, int s);
 
+// int setAcceptingState(mfsm_fsm*, int, int, int)
+//
+// Marks a state as accepting. New states are not accepting.
+//
+// Parameters:
+// fsm        mfsm_fsm* Pointer to FSM context
+// s          int       State ID
+// priority   int       Priority over other accepting states it may be
+//                      combined with
+// tag        int       User value reported with matches
+//
+// Returns:
+// 0  -- State successfully marked
+// -1 -- State could not be found
+int setAcceptingState(mfsm_fsm *fsm, int s, int priority, int tag);
+
+// int clearAcceptingState(mfsm_fsm*, int)
+//
+// Marks a state as not accepting.
+//
+// Parameters:
+// fsm  mfsm_fsm* Pointer to FSM context
+// s    int       State ID
+//
+// Returns:
+// 0  -- State successfully cleared
+// -1 -- State could not be found
+int clearAcceptingState(mfsm_fsm *fsm, int s);
+
+// const mfsm_Accept* getAcceptingState(const mfsm_fsm*, int)
+//
+// Finds the accepting state information of a state.
+//
+// Parameters:
+// fsm  const mfsm_fsm* Pointer to FSM context
+// s    int             State ID
+//
+// Returns:
+// The state's information, or 0 if the state is invalid or not accepting
+const mfsm_Accept *getAcceptingState(const mfsm_fsm *fsm, int s);
+
 // int addInput(mfsm_fsm*, int)
 //
 // Adds an input ID to the list of tracked inputs.
@@ -227,7 +614,8 @@ int removeState(mfsm_fsm *fsm, int s);
 // 0  -- Input successfully created
 // -1 -- Input ID exceeded acceptable bounds (0 < n)
 // -2 -- Input ID already exists
-// -3 -- The inputs array is full. No more inputs can be tracked at this time.
+// -3 -- The inputs array is full and could not be grown. No more inputs can
+//       be tracked at this time.
 int addInput(mfsm_fsm *fsm, int n);
 
 // int removeInput(mfsm_fsm*, int)
@@ -250,7 +638,8 @@ int removeInput(mfsm_fsm *fsm, int n);
 
 // int getStateIndex(struct mfsm_fsm, int)
 //
-// Finds the index of the given state in the states array.
+// Finds the index of the given state in the states array. Copies the FSM;
+// prefer getStateIndexPtr().
 //
 // Parameters:
 // fsm        mfsm_fsm  FSM context
@@ -261,9 +650,24 @@ int removeInput(mfsm_fsm *fsm, int n);
 // Failure -- -1
 int getStateIndex(mfsm_fsm fsm, int state);
 
+// int getStateIndexPtr(const mfsm_fsm*, int)
+//
+// Finds the index of the given state in the states array without copying the
+// FSM.
+//
+// Parameters:
+// fsm        const mfsm_fsm*  Pointer to FSM context
+// src        int              State ID
+//
+// Returns:
+// Success -- Index of the given state
+// Failure -- -1
+int getStateIndexPtr(const mfsm_fsm *fsm, int state);
+
 // int getInputIndex(struct mfsm_fsm, int)
 //
-// Finds the index of the given input in the inputs array.
+// Finds the index of the given input in the inputs array. Copies the FSM;
+// prefer getInputIndexPtr().
 //
 // Parameters:
 // fsm  mfsm_fsm  FSM context
@@ -274,6 +678,20 @@ int getStateIndex(mfsm_fsm fsm, int state);
 // Failure -- -1
 int getInputIndex(mfsm_fsm fsm, int n);
 
+// int getInputIndexPtr(const mfsm_fsm*, int)
+//
+// Finds the index of the given input in the inputs array without copying the
+// FSM.
+//
+// Parameters:
+// fsm  const mfsm_fsm*  Pointer to FSM context
+// n    int              Input ID 
+//
+// Returns:
+// Success -- Index of the given input
+// Failure -- -1
+int getInputIndexPtr(const mfsm_fsm *fsm, int n);
+
 // int doTransition(struct mfsm_fsm*, int)
 //
 // Executes the transition from the FSM's current state using input n. Returns
@@ -289,4 +707,83 @@ int getInputIndex(mfsm_fsm fsm, int n);
 //  -1 -- Invalid input ID
 int doTransition(mfsm_fsm *fsm, int n);
 
+// void initInstance(mfsm_Instance*, int, mfsm_EventQueue*)
+//
+// Set default values for an FSM instance.
+//
+// Parameters:
+// inst   mfsm_Instance*    Uninitialized instance
+// s      int               ID of the starting state
+// eq     mfsm_EventQueue*  EventQueue for output Events, or 0 for none
+//
+// Returns:
+// Nothing
+void initInstance(mfsm_Instance *inst, int s, mfsm_EventQueue *eq);
+
+// int doInstanceTransition(const mfsm_fsm*, mfsm_Instance*, int)
+//
+// Executes the transition from the instance's current state using input n,
+// looking the transition up in a shared FSM definition. Output Events are
+// sent to the instance's EventQueue, if it has one.
+//
+// Parameters:
+// def  const mfsm_fsm*   Pointer to the shared FSM definition
+// inst mfsm_Instance*    Instance context
+// n    int               Input ID
+//
+// Returns:
+// Success -- ID of new current State
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- The current state ID is invalid
+int doInstanceTransition(const mfsm_fsm *def, mfsm_Instance *inst, int n);
+
+// int doTransitionBatch(mfsm_fsm*, const int*, size_t, int*, size_t*)
+//
+// Executes a transition for each input in turn, as if doTransition() was
+// called for each one. The current state is only validated once, so this is
+// cheaper than calling doTransition() in a loop. Stops at the first invalid
+// input; the transitions before it stay executed.
+//
+// Parameters:
+// fsm         mfsm_fsm*     FSM context
+// inputs      const int*    Input IDs to execute in order
+// n           size_t        Number of inputs
+// trajectory  int*          Receives the state ID after each input. May be 0.
+// numDone     size_t*       Receives the number of inputs executed, which is
+//                           the index of the invalid input on failure. May
+//                           be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doTransitionBatch(mfsm_fsm *fsm, const int *inputs, size_t n,
+                      int *trajectory, size_t *numDone);
+
+// int doInstanceTransitionBatch(const mfsm_fsm*, mfsm_Instance*, const int*,
+//                               size_t, int*, size_t*)
+//
+// Batch version of doInstanceTransition(). See doTransitionBatch().
+//
+// Parameters:
+// def         const mfsm_fsm*   Pointer to the shared FSM definition
+// inst        mfsm_Instance*    Instance context
+// inputs      const int*        Input IDs to execute in order
+// n           size_t            Number of inputs
+// trajectory  int*              Receives the state ID after each input. May
+//                               be 0.
+// numDone     size_t*           Receives the number of inputs executed. May
+//                               be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID at index *numDone
+//  -2 -- The current state ID is invalid
+int doInstanceTransitionBatch(const mfsm_fsm *def, mfsm_Instance *inst,
+                              const int *inputs, size_t n, int *trajectory,
+                              size_t *numDone);
+
 #endif //MICROFSM_H
@@ -0,0 +1,464 @@
+#include <string.h>
+#include "minimize.h"
+
+// Working arrays of one minimization, all carved out of a single block.
+// States and inputs are numbered densely in the order they appear in the
+// source FSM.
+typedef struct Partition {
+  int numStates;
+  int numInputs;
+
+  const mfsm_Accept *accepts; // Source accepts array
+  int *stateIdx;  // Source array index of each dense state
+  int *inputIdx;  // Source array index of each dense input
+  int *denseOf;   // Dense index of each source state slot, or -1
+  int *dest;      // Dense destination for each state/input pair
+  int *outKey;    // Output Event class for each state/input pair, 0 if none
+
+  // Predecessors of each state for each input, as
+  // preds[predStart[input * (numStates + 1) + state] ...]
+  int *predStart;
+  int *preds;
+
+  // The blocks: each block is a contiguous range of elems. Marked states are
+  // moved to the front of their block.
+  int *elems;
+  int *loc;       // Position of each state in elems
+  int *blockOf;
+  int *bStart;
+  int *bEnd;
+  int *bMark;     // Number of marked states at the front of each block
+  int *inWork;
+  int *work;      // Blocks still to be used as splitters
+  int *touched;   // Blocks with marked states
+  int *scratch;
+  int numBlocks;
+  int numWork;
+} Partition;
+
+// Orders states by accepting state information, then by their outputs.
+static int compareStates(const Partition *p, int a, int b) {
+  const mfsm_Accept *x = &p->accepts[p->stateIdx[a]];
+  const mfsm_Accept *y = &p->accepts[p->stateIdx[b]];
+
+  if (x->accepting != y->accepting) {
+    return x->accepting - y->accepting;
+  }
+
+  if (x->accepting && x->priority != y->priority) {
+    return (x->priority < y->priority) ? -1 : 1;
+  }
+
+  if (x->accepting && x->tag != y->tag) {
+    return (x->tag < y->tag) ? -1 : 1;
+  }
+
+  int i = 0;
+  for (; i < p->numInputs; i++) {
+    int ka = p->outKey[a * p->numInputs + i];
+    int kb = p->outKey[b * p->numInputs + i];
+    if (ka != kb) {
+      return ka - kb;
+    }
+  }
+
+  return 0;
+}
+
+// Sorts elems[0 .. n) with compareStates(), using tmp as scratch space.
+static void sortStates(const Partition *p, int *elems, int *tmp, int n) {
+  int width = 1;
+  for (; width < n; width *= 2) {
+    int lo = 0;
+    for (; lo < n; lo += 2 * width) {
+      int mid = (lo + width < n) ? lo + width : n;
+      int hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+      int i = lo;
+      int j = mid;
+      int k = lo;
+
+      while (i < mid && j < hi) {
+        tmp[k++] = (compareStates(p, elems[j], elems[i]) < 0) ? elems[j++] : elems[i++];
+      }
+      while (i < mid) {
+        tmp[k++] = elems[i++];
+      }
+      while (j < hi) {
+        tmp[k++] = elems[j++];
+      }
+    }
+
+    memcpy(elems, tmp, sizeof(int) * n);
+  }
+}
+
+// Adds a block to the splitter worklist.
+static void pushWork(Partition *p, int b) {
+  p->inWork[b] = 1;
+  p->work[p->numWork++] = b;
+}
+
+// Moves state s to the marked front of its block.
+static void markState(Partition *p, int s, int *numTouched) {
+  int b = p->blockOf[s];
+  int front = p->bStart[b] + p->bMark[b];
+  if (p->loc[s] < front) {
+    return;
+  }
+
+  int other = p->elems[front];
+  p->elems[p->loc[s]] = other;
+  p->loc[other] = p->loc[s];
+  p->elems[front] = s;
+  p->loc[s] = front;
+
+  if (p->bMark[b]++ == 0) {
+    p->touched[(*numTouched)++] = b;
+  }
+}
+
+// Splits the marked front off a block. Hopcroft's rule: if the block is still
+// waiting to be a splitter both halves must be, otherwise only the smaller.
+static void splitBlock(Partition *p, int b) {
+  int marked = p->bMark[b];
+  int size = p->bEnd[b] - p->bStart[b];
+  p->bMark[b] = 0;
+  if (marked == size) {
+    return;
+  }
+
+  int nb = p->numBlocks++;
+  p->bStart[nb] = p->bStart[b];
+  p->bEnd[nb] = p->bStart[b] + marked;
+  p->bMark[nb] = 0;
+  p->inWork[nb] = 0;
+  p->bStart[b] += marked;
+
+  int i = p->bStart[nb];
+  for (; i < p->bEnd[nb]; i++) {
+    p->blockOf[p->elems[i]] = nb;
+  }
+
+  if (p->inWork[b] || marked <= size - marked) {
+    pushWork(p, nb);
+  } else {
+    pushWork(p, b);
+  }
+}
+
+// Refines the initial blocks until every block only holds equivalent states.
+static void refine(Partition *p) {
+  int n = p->numStates;
+
+  while (p->numWork > 0) {
+    int a = p->work[--p->numWork];
+    p->inWork[a] = 0;
+
+    // The splitter may itself be split below, so work from a copy
+    int size = p->bEnd[a] - p->bStart[a];
+    memcpy(p->scratch, p->elems + p->bStart[a], sizeof(int) * size);
+
+    int ni = 0;
+    for (; ni < p->numInputs; ni++) {
+      const int *start = p->predStart + ni * (n + 1);
+      int numTouched = 0;
+
+      int i = 0;
+      for (; i < size; i++) {
+        int t = p->scratch[i];
+        int j = start[t];
+        for (; j < start[t + 1]; j++) {
+          markState(p, p->preds[j], &numTouched);
+        }
+      }
+
+      for (i = 0; i < numTouched; i++) {
+        splitBlock(p, p->touched[i]);
+      }
+    }
+  }
+}
+
+// Copies one block representative's transitions into the minimal FSM.
+static int copyTransitions(const mfsm_fsm *src, mfsm_fsm *dst,
+                           const Partition *p, const int *rep, int s) {
+  int sid = src->states[p->stateIdx[s]];
+
+  int ni = 0;
+  for (; ni < p->numInputs; ni++) {
+    int nid = src->inputs[p->inputIdx[ni]];
+    const mfsm_Transition *t = getTransition(src, nid, sid);
+    if (t == 0) {
+      continue;
+    }
+
+    int d = p->dest[s * p->numInputs + ni];
+    if (d == s && t->output == NULL_OUTPUT) {
+      continue;
+    }
+
+    int did = src->states[p->stateIdx[rep[p->blockOf[d]]]];
+    if (addTransition(dst, nid, sid, did) != 0) {
+      return -1;
+    }
+
+    if (t->output != NULL_OUTPUT &&
+        setTransitionOutput(dst, nid, sid, src->outputs[t->output]) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// int minimizeFSM(const mfsm_fsm*, mfsm_fsm*)
+//
+// Builds a minimal copy of an FSM. The copy uses the same kind of storage
+// (dense or sparse) and allocator as the source, falling back to the default
+// allocator for FSMs using fixed storage. Its current state is the
+// replacement of the source's current state; listeners are not copied.
+// Release it with freeFSM().
+//
+// Parameters:
+// src  const mfsm_fsm*   FSM to minimize
+// dst  mfsm_fsm*         Uninitialized FSM receiving the minimal copy
+//
+// Returns:
+// Success -- Number of states in the minimal copy
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid FSM
+int minimizeFSM(const mfsm_fsm *src, mfsm_fsm *dst) {
+  if (src == 0 || dst == 0 || src == dst) {
+    return -2;
+  }
+
+  int numStates = 0;
+  int numInputs = 0;
+  int i = 0;
+  for (; i < src->maxStates; i++) {
+    numStates += (src->states[i] >= MIN_STATE_ID);
+  }
+
+  for (i = 0; i < src->maxInputs; i++) {
+    numInputs += (src->inputs[i] >= MIN_INPUT_ID);
+  }
+
+  mfsm_Allocator allocator = src->allocator;
+  if (allocator.alloc == 0) {
+#ifndef MFSM_NO_MALLOC
+    allocator = *getDefaultAllocator();
+#else
+    return -1;
+#endif
+  }
+
+  // Lay every array out in a single block
+  size_t n = (size_t)numStates;
+  size_t cells = n * numInputs;
+  size_t ints = n * 14 + (size_t)numInputs + (size_t)src->maxStates +
+                cells * 3 + (size_t)numInputs * (n + 1);
+
+  int *mem = allocator.alloc(allocator.ctx, sizeof(int) * ints + 1);
+  if (mem == 0) {
+    return -1;
+  }
+
+  Partition p;
+  p.numStates = numStates;
+  p.numInputs = numInputs;
+  p.accepts = src->accepts;
+  p.stateIdx = mem;
+  p.inputIdx = p.stateIdx + n;
+  p.denseOf = p.inputIdx + numInputs;
+  p.dest = p.denseOf + src->maxStates;
+  p.outKey = p.dest + cells;
+  p.preds = p.outKey + cells;
+  p.predStart = p.preds + cells;
+  p.elems = p.predStart + (size_t)numInputs * (n + 1);
+  p.loc = p.elems + n;
+  p.blockOf = p.loc + n;
+  p.bStart = p.blockOf + n;
+  p.bEnd = p.bStart + n;
+  p.bMark = p.bEnd + n;
+  p.inWork = p.bMark + n;
+  p.work = p.inWork + n;
+  p.touched = p.work + n;
+  p.scratch = p.touched + n;
+  p.numBlocks = 0;
+  p.numWork = 0;
+  int *reach = p.scratch + n;
+  int *rep = reach + n;
+  int *tmp = rep + n;
+
+  // Number the states and inputs
+  int s = 0;
+  for (i = 0; i < src->maxStates; i++) {
+    p.denseOf[i] = -1;
+    if (src->states[i] >= MIN_STATE_ID) {
+      p.denseOf[i] = s;
+      p.stateIdx[s++] = i;
+    }
+  }
+
+  int ni = 0;
+  for (i = 0; i < src->maxInputs; i++) {
+    if (src->inputs[i] >= MIN_INPUT_ID) {
+      p.inputIdx[ni++] = i;
+    }
+  }
+
+  // Read the transitions. Equal output Events share an index in the outputs
+  // table, so the index tells the Events apart.
+  for (s = 0; s < numStates; s++) {
+    int sid = src->states[p.stateIdx[s]];
+
+    for (ni = 0; ni < numInputs; ni++) {
+      const mfsm_Transition *t = getTransition(src, src->inputs[p.inputIdx[ni]], sid);
+      int cell = s * numInputs + ni;
+      p.dest[cell] = s;
+      p.outKey[cell] = 0;
+      if (t == 0) {
+        continue;
+      }
+
+      int di = getStateIndexPtr(src, t->dest);
+      if (di != -1) {
+        p.dest[cell] = p.denseOf[di];
+      }
+
+      p.outKey[cell] = t->output + 1;
+    }
+  }
+
+  // Only keep the states reachable from the current state, if it has one
+  int start = getStateIndexPtr(src, src->curState);
+  for (s = 0; s < numStates; s++) {
+    reach[s] = (start == -1);
+  }
+
+  if (start != -1) {
+    int top = 0;
+    p.work[top++] = p.denseOf[start];
+    reach[p.denseOf[start]] = 1;
+
+    while (top > 0) {
+      int r = p.work[--top];
+      for (ni = 0; ni < numInputs; ni++) {
+        int d = p.dest[r * numInputs + ni];
+        if (!reach[d]) {
+          reach[d] = 1;
+          p.work[top++] = d;
+        }
+      }
+    }
+  }
+
+  // Build the predecessor lists of the reachable states
+  for (i = 0; i < numInputs * (numStates + 1); i++) {
+    p.predStart[i] = 0;
+  }
+
+  for (s = 0; s < numStates; s++) {
+    if (!reach[s]) {
+      continue;
+    }
+
+    for (ni = 0; ni < numInputs; ni++) {
+      p.predStart[ni * (numStates + 1) + p.dest[s * numInputs + ni] + 1]++;
+    }
+  }
+
+  int total = 0;
+  for (i = 0; i < numInputs * (numStates + 1); i++) {
+    total += p.predStart[i];
+    p.predStart[i] = total;
+  }
+
+  for (ni = 0; ni < numInputs; ni++) {
+    const int *start = p.predStart + ni * (numStates + 1);
+    memcpy(tmp, start, sizeof(int) * numStates);
+
+    for (s = 0; s < numStates; s++) {
+      if (reach[s]) {
+        p.preds[tmp[p.dest[s * numInputs + ni]]++] = s;
+      }
+    }
+  }
+
+  // Start with one block for each combination of accepting state information
+  // and outputs
+  int numReach = 0;
+  for (s = 0; s < numStates; s++) {
+    if (reach[s]) {
+      p.elems[numReach++] = s;
+    }
+  }
+
+  sortStates(&p, p.elems, tmp, numReach);
+
+  for (i = 0; i < numReach; i++) {
+    int e = p.elems[i];
+    if (i == 0 || compareStates(&p, p.elems[i - 1], e) != 0) {
+      int b = p.numBlocks++;
+      p.bStart[b] = i;
+      p.bMark[b] = 0;
+      pushWork(&p, b);
+    }
+
+    p.bEnd[p.numBlocks - 1] = i + 1;
+    p.blockOf[e] = p.numBlocks - 1;
+    p.loc[e] = i;
+  }
+
+  refine(&p);
+
+  // Each block is replaced by its first state
+  int numBlocks = p.numBlocks;
+  for (i = 0; i < numBlocks; i++) {
+    rep[i] = -1;
+  }
+
+  for (s = 0; s < numStates; s++) {
+    if (reach[s] && rep[p.blockOf[s]] == -1) {
+      rep[p.blockOf[s]] = s;
+    }
+  }
+
+  int result = (src->edges != 0)
+      ? initSparseFSM(dst, numBlocks, numInputs, &allocator)
+      : initDynamicFSM(dst, numBlocks, numInputs, &allocator);
+
+  for (ni = 0; result == 0 && ni < numInputs; ni++) {
+    result = addInput(dst, src->inputs[p.inputIdx[ni]]);
+  }
+
+  for (i = 0; result == 0 && i < numBlocks; i++) {
+    s = rep[i];
+    const mfsm_Accept *a = &src->accepts[p.stateIdx[s]];
+    result = addState(dst, src->states[p.stateIdx[s]]);
+    if (result == 0 && a->accepting) {
+      result = setAcceptingState(dst, src->states[p.stateIdx[s]], a->priority, a->tag);
+    }
+  }
+
+  for (i = 0; result == 0 && i < numBlocks; i++) {
+    result = copyTransitions(src, dst, &p, rep, rep[i]);
+  }
+
+  if (result == 0 && start != -1) {
+    dst->curState = src->states[p.stateIdx[rep[p.blockOf[p.denseOf[start]]]]];
+    dst->curInput = src->curInput;
+  }
+
+  if (allocator.release != 0) {
+    allocator.release(allocator.ctx, mem);
+  }
+
+  if (result != 0) {
+    freeFSM(dst);
+    return -1;
+  }
+
+  return numBlocks;
+}
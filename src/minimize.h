@@ -0,0 +1,39 @@
+#ifndef MINIMIZE_H
+#define MINIMIZE_H
+
+#include "microFSM.h"
+
+/*****************************************************************************
+* Minimization
+*
+* Builds the equivalent FSM with the fewest states, using Hopcroft's
+* partition refinement. Two states are equivalent when they have the same
+* accepting state information, produce the same output Event for every input
+* and move to equivalent states for every input. A missing transition, or one
+* to an invalid state, stays in the same state like doTransition() does.
+*
+* Each group of equivalent states is replaced by the first of them in the
+* source FSM, keeping its ID. Input IDs are unchanged. If the source FSM has
+* a valid current state, states which cannot be reached from it are dropped.
+*****************************************************************************/
+
+// int minimizeFSM(const mfsm_fsm*, mfsm_fsm*)
+//
+// Builds a minimal copy of an FSM. The copy uses the same kind of storage
+// (dense or sparse) and allocator as the source, falling back to the default
+// allocator for FSMs using fixed storage. Its current state is the
+// replacement of the source's current state; listeners are not copied.
+// Release it with freeFSM().
+//
+// Parameters:
+// src  const mfsm_fsm*   FSM to minimize
+// dst  mfsm_fsm*         Uninitialized FSM receiving the minimal copy
+//
+// Returns:
+// Success -- Number of states in the minimal copy
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid FSM
+int minimizeFSM(const mfsm_fsm *src, mfsm_fsm *dst);
+
+#endif //MINIMIZE_H
@@ -0,0 +1,717 @@
+#include <limits.h>
+#include <string.h>
+#include "nfa.h"
+#include "idmap.h"
+
+// Releases a block allocated with an allocator.
+static void release(const mfsm_Allocator *a, void *ptr) {
+  if (ptr != 0 && a->release != 0) {
+    a->release(a->ctx, ptr);
+  }
+}
+
+// Moves the first used bytes of an array into a new block of size bytes.
+// Returns the new block, or 0 if it could not be allocated, in which case
+// the old one is kept.
+static void *growArray(const mfsm_Allocator *a, void *old, size_t used,
+                       size_t size) {
+  void *ptr = a->alloc(a->ctx, size);
+  if (ptr == 0) {
+    return 0;
+  }
+
+  if (used > 0) {
+    memcpy(ptr, old, used);
+  }
+
+  release(a, old);
+  return ptr;
+}
+
+// Doubles the room for states.
+static int growStates(mfsm_NFA *nfa) {
+  mfsm_Allocator *a = &nfa->allocator;
+  int maxStates = (nfa->maxStates == 0) ? 8 : nfa->maxStates * 2;
+  int stateMapSize = maxStates * 2;
+
+  int *states = a->alloc(a->ctx, sizeof(int) * maxStates);
+  mfsm_Accept *accepts = a->alloc(a->ctx, sizeof(mfsm_Accept) * maxStates);
+  int *stateMap = a->alloc(a->ctx, sizeof(int) * stateMapSize);
+  if (states == 0 || accepts == 0 || stateMap == 0) {
+    release(a, states);
+    release(a, accepts);
+    release(a, stateMap);
+    return -1;
+  }
+
+  idMapClear(stateMap, stateMapSize);
+
+  int i = 0;
+  for (; i < nfa->numStates; i++) {
+    states[i] = nfa->states[i];
+    accepts[i] = nfa->accepts[i];
+    idMapInsert(stateMap, stateMapSize, states, i);
+  }
+
+  release(a, nfa->states);
+  release(a, nfa->accepts);
+  release(a, nfa->stateMap);
+
+  nfa->states = states;
+  nfa->accepts = accepts;
+  nfa->stateMap = stateMap;
+  nfa->stateMapSize = stateMapSize;
+  nfa->maxStates = maxStates;
+
+  return 0;
+}
+
+// Finds the index of a state ID, or -1.
+static int findNFAState(const mfsm_NFA *nfa, int s) {
+  if (s < MIN_STATE_ID || nfa->numStates == 0) {
+    return -1;
+  }
+
+  return idMapFind(nfa->stateMap, nfa->stateMapSize, nfa->states, s);
+}
+
+// int initNFA(mfsm_NFA*, const mfsm_Allocator*)
+//
+// Set default values for an empty NFA. Release it with freeNFA().
+//
+// Parameters:
+// nfa        mfsm_NFA*              Uninitialized NFA struct
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the NFA.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+int initNFA(mfsm_NFA *nfa, const mfsm_Allocator *allocator) {
+  nfa->numStates = 0;
+  nfa->maxStates = 0;
+  nfa->states = 0;
+  nfa->accepts = 0;
+  nfa->stateMap = 0;
+  nfa->stateMapSize = 0;
+  nfa->edges = 0;
+  nfa->numEdges = 0;
+  nfa->maxEdges = 0;
+  nfa->allocator.alloc = 0;
+  nfa->allocator.release = 0;
+  nfa->allocator.ctx = 0;
+
+  if (allocator == 0 || allocator->alloc == 0) {
+    return -1;
+  }
+
+  nfa->allocator = *allocator;
+
+  return 0;
+}
+
+// void freeNFA(mfsm_NFA*)
+//
+// Releases the memory held by an NFA.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+//
+// Returns:
+// None
+void freeNFA(mfsm_NFA *nfa) {
+  release(&nfa->allocator, nfa->states);
+  release(&nfa->allocator, nfa->accepts);
+  release(&nfa->allocator, nfa->stateMap);
+  release(&nfa->allocator, nfa->edges);
+
+  nfa->states = 0;
+  nfa->accepts = 0;
+  nfa->stateMap = 0;
+  nfa->edges = 0;
+  nfa->numStates = 0;
+  nfa->maxStates = 0;
+  nfa->numEdges = 0;
+  nfa->maxEdges = 0;
+}
+
+// int addNFAState(mfsm_NFA*, int)
+//
+// Adds a state to the NFA.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+// s    int        State ID
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid or duplicate state ID
+//  -2 -- Memory could not be allocated
+int addNFAState(mfsm_NFA *nfa, int s) {
+  if (s < MIN_STATE_ID || findNFAState(nfa, s) != -1) {
+    return -1;
+  }
+
+  if (nfa->numStates == nfa->maxStates && growStates(nfa) != 0) {
+    return -2;
+  }
+
+  int i = nfa->numStates++;
+  nfa->states[i] = s;
+  nfa->accepts[i].accepting = 0;
+  nfa->accepts[i].priority = 0;
+  nfa->accepts[i].tag = 0;
+  idMapInsert(nfa->stateMap, nfa->stateMapSize, nfa->states, i);
+
+  return 0;
+}
+
+// int addNFAEdge(mfsm_NFA*, int, int, int)
+//
+// Adds an edge from State s with Input n to State d. States may have several
+// edges for the same input.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+// n    int        Input ID, or NFA_EPSILON
+// s    int        Source state ID
+// d    int        Destination state ID
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- Invalid source state ID
+//  -3 -- Invalid destination state ID
+//  -4 -- Memory could not be allocated
+int addNFAEdge(mfsm_NFA *nfa, int n, int s, int d) {
+  if (n < MIN_INPUT_ID && n != NFA_EPSILON) {
+    return -1;
+  }
+
+  int si = findNFAState(nfa, s);
+  if (si == -1) {
+    return -2;
+  }
+
+  int di = findNFAState(nfa, d);
+  if (di == -1) {
+    return -3;
+  }
+
+  if (nfa->numEdges == nfa->maxEdges) {
+    int maxEdges = (nfa->maxEdges == 0) ? 16 : nfa->maxEdges * 2;
+    mfsm_NFAEdge *edges = growArray(&nfa->allocator, nfa->edges,
+                                    sizeof(mfsm_NFAEdge) * nfa->numEdges,
+                                    sizeof(mfsm_NFAEdge) * maxEdges);
+    if (edges == 0) {
+      return -4;
+    }
+
+    nfa->edges = edges;
+    nfa->maxEdges = maxEdges;
+  }
+
+  mfsm_NFAEdge *e = &nfa->edges[nfa->numEdges++];
+  e->src = si;
+  e->input = n;
+  e->dest = di;
+
+  return 0;
+}
+
+// int setNFAAccepting(mfsm_NFA*, int, int, int)
+//
+// Marks a state of the NFA as accepting.
+//
+// Parameters:
+// nfa        mfsm_NFA*  NFA context
+// s          int        State ID
+// priority   int        Priority when sets hold several accepting states
+// tag        int        User value reported with matches
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- State could not be found
+int setNFAAccepting(mfsm_NFA *nfa, int s, int priority, int tag) {
+  int si = findNFAState(nfa, s);
+  if (si == -1) {
+    return -1;
+  }
+
+  nfa->accepts[si].accepting = 1;
+  nfa->accepts[si].priority = priority;
+  nfa->accepts[si].tag = tag;
+
+  return 0;
+}
+
+/***************************************
+* Subset Construction
+***************************************/
+
+// Working state of one determinizeNFA() call. Sets of NFA states are kept as
+// sorted lists of state indices, one after another in members.
+typedef struct Subsets {
+  const mfsm_Allocator *allocator;
+  int maxSets;
+
+  // Distinct input IDs of the NFA's edges, and their lookup table
+  int numInputs;
+  int *inputIDs;
+  int *inputMap;
+  int inputMapSize;
+
+  // Destinations of each state's edges for each input, as
+  // adj[adjStart[state * (numInputs + 1) + input] ...]. Epsilon edges use
+  // input numInputs.
+  int *adjStart;
+  int *adj;
+
+  int *mark;      // Stamp of the last set each NFA state was added to
+  int stamp;
+  int *cur;       // Set being built
+  int *stack;
+
+  // The sets found so far
+  int *members;
+  size_t numMembers;
+  size_t maxMembers;
+  size_t *setStart;   // Start of each set in members, numSets + 1 entries
+  unsigned int *hashes;
+  int *next;          // Set reached from each set with each input
+  int numSets;
+  int setRoom;        // Sets setStart, hashes and next have room for
+
+  // Hash table of set index + 1, 0 for an empty slot
+  int *table;
+  int tableSize;
+} Subsets;
+
+// Sorts a list of state indices.
+static void sortStates(int *s, int n) {
+  // Heap sort: sets can be large, and nothing here may allocate
+  int i = n / 2 - 1;
+  int end = n - 1;
+  for (;; ) {
+    int root;
+    if (i >= 0) {
+      root = i--;
+    } else if (end > 0) {
+      int t = s[0];
+      s[0] = s[end];
+      s[end] = t;
+      end--;
+      root = 0;
+    } else {
+      break;
+    }
+
+    for (;;) {
+      int child = root * 2 + 1;
+      if (child > end) {
+        break;
+      }
+
+      if (child < end && s[child + 1] > s[child]) {
+        child++;
+      }
+
+      if (s[root] >= s[child]) {
+        break;
+      }
+
+      int t = s[root];
+      s[root] = s[child];
+      s[child] = t;
+      root = child;
+    }
+  }
+}
+
+static unsigned int hashSet(const int *s, int n) {
+  unsigned int h = 2166136261u;
+  int i = 0;
+  for (; i < n; i++) {
+    h = (h ^ (unsigned int)s[i]) * 16777619u;
+  }
+
+  return h ^ (unsigned int)n;
+}
+
+// Adds the states reachable through epsilon edges to the n states in cur,
+// which are all marked, then sorts the set. Returns the new size.
+static int closeSet(Subsets *b, int n) {
+  int k = b->numInputs;
+  int top = 0;
+  int i = 0;
+  for (; i < n; i++) {
+    b->stack[top++] = b->cur[i];
+  }
+
+  while (top > 0) {
+    int s = b->stack[--top];
+    int j = b->adjStart[s * (k + 1) + k];
+    for (; j < b->adjStart[s * (k + 1) + k + 1]; j++) {
+      int d = b->adj[j];
+      if (b->mark[d] != b->stamp) {
+        b->mark[d] = b->stamp;
+        b->cur[n++] = d;
+        b->stack[top++] = d;
+      }
+    }
+  }
+
+  sortStates(b->cur, n);
+  return n;
+}
+
+// Doubles the hash table and re-inserts every set.
+static int growTable(Subsets *b) {
+  int size = (b->tableSize == 0) ? 64 : b->tableSize * 2;
+  int *table = b->allocator->alloc(b->allocator->ctx, sizeof(int) * size);
+  if (table == 0) {
+    return -1;
+  }
+
+  int i = 0;
+  for (; i < size; i++) {
+    table[i] = 0;
+  }
+
+  for (i = 0; i < b->numSets; i++) {
+    unsigned int slot = b->hashes[i] & (unsigned int)(size - 1);
+    while (table[slot] != 0) {
+      slot = (slot + 1) & (unsigned int)(size - 1);
+    }
+    table[slot] = i + 1;
+  }
+
+  release(b->allocator, b->table);
+  b->table = table;
+  b->tableSize = size;
+
+  return 0;
+}
+
+// Finds the set of the n states in cur, adding it if it is new. Returns its
+// index, -1 if memory could not be allocated or -3 if there are too many sets.
+static int findSet(Subsets *b, int n) {
+  unsigned int h = hashSet(b->cur, n);
+  unsigned int mask = (unsigned int)(b->tableSize - 1);
+  unsigned int slot = h & mask;
+
+  for (; b->table[slot] != 0; slot = (slot + 1) & mask) {
+    int i = b->table[slot] - 1;
+    size_t len = b->setStart[i + 1] - b->setStart[i];
+    if (b->hashes[i] == h && len == (size_t)n &&
+        memcmp(b->members + b->setStart[i], b->cur, sizeof(int) * n) == 0) {
+      return i;
+    }
+  }
+
+  if (b->numSets == b->maxSets) {
+    return -3;
+  }
+
+  // Make room for the new set
+  const mfsm_Allocator *a = b->allocator;
+  if (b->numMembers + n > b->maxMembers) {
+    size_t maxMembers = b->maxMembers * 2;
+    while (maxMembers < b->numMembers + n) {
+      maxMembers *= 2;
+    }
+
+    int *members = growArray(a, b->members, sizeof(int) * b->numMembers,
+                             sizeof(int) * maxMembers);
+    if (members == 0) {
+      return -1;
+    }
+
+    b->members = members;
+    b->maxMembers = maxMembers;
+  }
+
+  if (b->numSets == b->setRoom) {
+    int setRoom = b->setRoom * 2;
+    size_t *setStart = growArray(a, b->setStart, sizeof(size_t) * (b->numSets + 1),
+                                 sizeof(size_t) * (setRoom + 1));
+    if (setStart == 0) {
+      return -1;
+    }
+    b->setStart = setStart;
+
+    unsigned int *hashes = growArray(a, b->hashes, sizeof(unsigned int) * b->numSets,
+                                     sizeof(unsigned int) * setRoom);
+    if (hashes == 0) {
+      return -1;
+    }
+    b->hashes = hashes;
+
+    int *next = growArray(a, b->next, sizeof(int) * b->numSets * b->numInputs,
+                          sizeof(int) * (setRoom * b->numInputs + 1));
+    if (next == 0) {
+      return -1;
+    }
+    b->next = next;
+    b->setRoom = setRoom;
+  }
+
+  int i = b->numSets++;
+  memcpy(b->members + b->numMembers, b->cur, sizeof(int) * n);
+  b->numMembers += n;
+  b->setStart[i + 1] = b->numMembers;
+  b->hashes[i] = h;
+  b->table[slot] = i + 1;
+
+  // Keep the table at most half full
+  if (b->numSets * 2 > b->tableSize && growTable(b) != 0) {
+    return -1;
+  }
+
+  return i;
+}
+
+// Builds the lookup tables of the NFA's inputs and edges, and the first
+// arrays for the sets. Everything sized by the NFA shares one block.
+static int initSubsets(Subsets *b, const mfsm_NFA *nfa, int maxSets) {
+  const mfsm_Allocator *a = &nfa->allocator;
+  int numStates = nfa->numStates;
+  int numEdges = nfa->numEdges;
+
+  memset(b, 0, sizeof(*b));
+  b->allocator = a;
+  b->maxSets = maxSets;
+
+  // Every edge could have its own input. The adjacency table is allocated
+  // separately, once the number of inputs is known.
+  int inputMapSize = numEdges * 2 + 1;
+  size_t ints = (size_t)numEdges + inputMapSize + (size_t)numStates * 3;
+  int *mem = a->alloc(a->ctx, sizeof(int) * (ints + 1));
+  if (mem == 0) {
+    return -1;
+  }
+
+  b->inputIDs = mem;
+  b->inputMap = b->inputIDs + numEdges;
+  b->inputMapSize = inputMapSize;
+  b->mark = b->inputMap + inputMapSize;
+  b->cur = b->mark + numStates;
+  b->stack = b->cur + numStates;
+  b->adjStart = 0;
+
+  idMapClear(b->inputMap, inputMapSize);
+
+  int i = 0;
+  for (; i < numEdges; i++) {
+    int n = nfa->edges[i].input;
+    if (n != NFA_EPSILON &&
+        idMapFind(b->inputMap, inputMapSize, b->inputIDs, n) == -1) {
+      b->inputIDs[b->numInputs] = n;
+      idMapInsert(b->inputMap, inputMapSize, b->inputIDs, b->numInputs);
+      b->numInputs++;
+    }
+  }
+
+  for (i = 0; i < numStates; i++) {
+    b->mark[i] = 0;
+  }
+
+  // Group the edges by source state and input
+  int k = b->numInputs;
+  size_t cells = (size_t)numStates * (k + 1);
+  b->adjStart = a->alloc(a->ctx, sizeof(int) * (cells + 1 + numEdges));
+  if (b->adjStart == 0) {
+    return -1;
+  }
+  b->adj = b->adjStart + cells + 1;
+
+  size_t c = 0;
+  for (; c <= cells; c++) {
+    b->adjStart[c] = 0;
+  }
+
+  for (i = 0; i < numEdges; i++) {
+    const mfsm_NFAEdge *e = &nfa->edges[i];
+    int ni = (e->input == NFA_EPSILON) ? k :
+             idMapFind(b->inputMap, inputMapSize, b->inputIDs, e->input);
+    b->adjStart[(size_t)e->src * (k + 1) + ni]++;
+  }
+
+  // Each entry becomes the end of its edges, and the start once they are
+  // filled in back to front
+  for (c = 1; c < cells; c++) {
+    b->adjStart[c] += b->adjStart[c - 1];
+  }
+  b->adjStart[cells] = numEdges;
+
+  for (i = 0; i < numEdges; i++) {
+    const mfsm_NFAEdge *e = &nfa->edges[i];
+    int ni = (e->input == NFA_EPSILON) ? k :
+             idMapFind(b->inputMap, inputMapSize, b->inputIDs, e->input);
+    b->adj[--b->adjStart[(size_t)e->src * (k + 1) + ni]] = e->dest;
+  }
+
+  // First arrays for the sets
+  b->maxMembers = (size_t)numStates + 16;
+  b->setRoom = 16;
+  b->members = a->alloc(a->ctx, sizeof(int) * b->maxMembers);
+  b->setStart = a->alloc(a->ctx, sizeof(size_t) * (b->setRoom + 1));
+  b->hashes = a->alloc(a->ctx, sizeof(unsigned int) * b->setRoom);
+  b->next = a->alloc(a->ctx, sizeof(int) * (b->setRoom * k + 1));
+  if (b->members == 0 || b->setStart == 0 || b->hashes == 0 ||
+      b->next == 0 || growTable(b) != 0) {
+    return -1;
+  }
+
+  b->setStart[0] = 0;
+
+  return 0;
+}
+
+static void freeSubsets(Subsets *b) {
+  release(b->allocator, b->inputIDs);
+  release(b->allocator, b->adjStart);
+  release(b->allocator, b->members);
+  release(b->allocator, b->setStart);
+  release(b->allocator, b->hashes);
+  release(b->allocator, b->next);
+  release(b->allocator, b->table);
+}
+
+// int determinizeNFA(const mfsm_NFA*, mfsm_fsm*, int, int, int)
+//
+// Adds the deterministic equivalent of the NFA, started in State start, to
+// an initialized FSM. Its states get the IDs firstID, firstID + 1, ... with
+// firstID standing for the start set, which also becomes the FSM's current
+// state. The NFA's inputs are added to the FSM if it does not have them yet.
+//
+// Parameters:
+// nfa        const mfsm_NFA*  NFA context
+// dst        mfsm_fsm*        FSM receiving the new states and transitions
+// start      int              ID of the NFA's start state
+// firstID    int              ID of the first new state
+// maxStates  int              Most states the result may have
+//
+// Returns:
+// Success -- Number of states added
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid start state or first ID
+//  -3 -- The result would have more than maxStates states
+//  -4 -- The FSM could not hold the result, or already uses one of its
+//        state IDs. Some of the result may have been added.
+int determinizeNFA(const mfsm_NFA *nfa, mfsm_fsm *dst, int start, int firstID,
+                   int maxStates) {
+  int si = findNFAState(nfa, start);
+  if (si == -1 || firstID < MIN_STATE_ID || maxStates < 1) {
+    return -2;
+  }
+
+  Subsets b;
+  if (initSubsets(&b, nfa, maxStates) != 0) {
+    freeSubsets(&b);
+    return -1;
+  }
+
+  int k = b.numInputs;
+
+  // The start set
+  b.stamp = 1;
+  b.mark[si] = b.stamp;
+  b.cur[0] = si;
+  int result = findSet(&b, closeSet(&b, 1));
+
+  // Follow every input from every set, in the order the sets are found
+  int d = 0;
+  for (; result >= 0 && d < b.numSets; d++) {
+    int ni = 0;
+    for (; result >= 0 && ni < k; ni++) {
+      int n = 0;
+      b.stamp++;
+
+      size_t m = b.setStart[d];
+      for (; m < b.setStart[d + 1]; m++) {
+        int s = b.members[m];
+        int j = b.adjStart[s * (k + 1) + ni];
+        for (; j < b.adjStart[s * (k + 1) + ni + 1]; j++) {
+          int t = b.adj[j];
+          if (b.mark[t] != b.stamp) {
+            b.mark[t] = b.stamp;
+            b.cur[n++] = t;
+          }
+        }
+      }
+
+      result = findSet(&b, closeSet(&b, n));
+      if (result >= 0) {
+        b.next[(size_t)d * k + ni] = result;
+      }
+    }
+  }
+
+  if (result < 0) {
+    freeSubsets(&b);
+    return result;
+  }
+
+  if (firstID > INT_MAX - b.numSets) {
+    freeSubsets(&b);
+    return -2;
+  }
+
+  // Copy the result into the FSM
+  result = 0;
+  for (d = 0; result == 0 && d < k; d++) {
+    if (isValidInputIDPtr(dst, b.inputIDs[d]) != 0 &&
+        addInput(dst, b.inputIDs[d]) != 0) {
+      result = -4;
+    }
+  }
+
+  for (d = 0; result == 0 && d < b.numSets; d++) {
+    if (isValidStateIDPtr(dst, firstID + d) == 0 ||
+        addState(dst, firstID + d) != 0) {
+      result = -4;
+      break;
+    }
+
+    // The accepting state with the highest priority decides the tag
+    const mfsm_Accept *best = 0;
+    size_t m = b.setStart[d];
+    for (; m < b.setStart[d + 1]; m++) {
+      const mfsm_Accept *a = &nfa->accepts[b.members[m]];
+      if (a->accepting && (best == 0 || a->priority > best->priority)) {
+        best = a;
+      }
+    }
+
+    if (best != 0) {
+      setAcceptingState(dst, firstID + d, best->priority, best->tag);
+    }
+  }
+
+  for (d = 0; result == 0 && d < b.numSets; d++) {
+    int ni = 0;
+    for (; ni < k; ni++) {
+      int t = b.next[(size_t)d * k + ni];
+      if (t != d && addTransition(dst, b.inputIDs[ni], firstID + d, firstID + t) != 0) {
+        result = -4;
+        break;
+      }
+    }
+  }
+
+  int numSets = b.numSets;
+  freeSubsets(&b);
+
+  if (result != 0) {
+    return result;
+  }
+
+  dst->curState = firstID;
+
+  return numSets;
+}
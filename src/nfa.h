@@ -0,0 +1,154 @@
+#ifndef NFA_H
+#define NFA_H
+
+#include "microFSM.h"
+
+/*****************************************************************************
+* NFAs
+*
+* Nondeterministic machines for describing patterns. A state may have any
+* number of edges for the same input, as well as epsilon edges which are
+* followed without consuming an input. determinizeNFA() turns an NFA into an
+* ordinary mfsm_fsm with the subset construction: every state of the result
+* stands for the set of NFA states the NFA could be in. Each set is only
+* built once; sets are looked up in a hash table as they are found.
+*
+* A state of the result is accepting if any NFA state in its set is. The
+* accepting state with the highest priority decides its priority and tag;
+* ties go to the state added to the NFA first. An empty set becomes a
+* non-accepting state which never leaves itself, so inputs the NFA has no
+* edge for stop all further matches.
+*
+* The result can be minimized with minimizeFSM() and compiled with
+* compileFSM() like any other FSM.
+*****************************************************************************/
+
+// Input ID of epsilon edges.
+#define NFA_EPSILON (MIN_INPUT_ID-1)
+
+typedef struct mfsm_NFAEdge {
+  int src;   // Index of the source state in the states array
+  int input; // Input ID, or NFA_EPSILON
+  int dest;  // Index of the destination state in the states array
+} mfsm_NFAEdge;
+
+typedef struct mfsm_NFA {
+  int numStates;
+  int maxStates;
+  int *states;          // State IDs, in the order they were added
+  mfsm_Accept *accepts; // PARALLEL with states
+
+  // ID lookup table (see idmap.h) into states
+  int *stateMap;
+  int stateMapSize;
+
+  mfsm_NFAEdge *edges;
+  int numEdges;
+  int maxEdges;
+
+  // Allocator used for every array above and by determinizeNFA()
+  mfsm_Allocator allocator;
+} mfsm_NFA;
+
+// int initNFA(mfsm_NFA*, const mfsm_Allocator*)
+//
+// Set default values for an empty NFA. Release it with freeNFA().
+//
+// Parameters:
+// nfa        mfsm_NFA*              Uninitialized NFA struct
+// allocator  const mfsm_Allocator*  Allocator to use. Copied into the NFA.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid allocator
+int initNFA(mfsm_NFA *nfa, const mfsm_Allocator *allocator);
+
+// void freeNFA(mfsm_NFA*)
+//
+// Releases the memory held by an NFA.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+//
+// Returns:
+// None
+void freeNFA(mfsm_NFA *nfa);
+
+// int addNFAState(mfsm_NFA*, int)
+//
+// Adds a state to the NFA.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+// s    int        State ID
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid or duplicate state ID
+//  -2 -- Memory could not be allocated
+int addNFAState(mfsm_NFA *nfa, int s);
+
+// int addNFAEdge(mfsm_NFA*, int, int, int)
+//
+// Adds an edge from State s with Input n to State d. States may have several
+// edges for the same input.
+//
+// Parameters:
+// nfa  mfsm_NFA*  NFA context
+// n    int        Input ID, or NFA_EPSILON
+// s    int        Source state ID
+// d    int        Destination state ID
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid input ID
+//  -2 -- Invalid source state ID
+//  -3 -- Invalid destination state ID
+//  -4 -- Memory could not be allocated
+int addNFAEdge(mfsm_NFA *nfa, int n, int s, int d);
+
+// int setNFAAccepting(mfsm_NFA*, int, int, int)
+//
+// Marks a state of the NFA as accepting.
+//
+// Parameters:
+// nfa        mfsm_NFA*  NFA context
+// s          int        State ID
+// priority   int        Priority when sets hold several accepting states
+// tag        int        User value reported with matches
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- State could not be found
+int setNFAAccepting(mfsm_NFA *nfa, int s, int priority, int tag);
+
+// int determinizeNFA(const mfsm_NFA*, mfsm_fsm*, int, int, int)
+//
+// Adds the deterministic equivalent of the NFA, started in State start, to
+// an initialized FSM. Its states get the IDs firstID, firstID + 1, ... with
+// firstID standing for the start set, which also becomes the FSM's current
+// state. The NFA's inputs are added to the FSM if it does not have them yet.
+//
+// Parameters:
+// nfa        const mfsm_NFA*  NFA context
+// dst        mfsm_fsm*        FSM receiving the new states and transitions
+// start      int              ID of the NFA's start state
+// firstID    int              ID of the first new state
+// maxStates  int              Most states the result may have
+//
+// Returns:
+// Success -- Number of states added
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid start state or first ID
+//  -3 -- The result would have more than maxStates states
+//  -4 -- The FSM could not hold the result, or already uses one of its
+//        state IDs. Some of the result may have been added.
+int determinizeNFA(const mfsm_NFA *nfa, mfsm_fsm *dst, int start, int firstID,
+                   int maxStates);
+
+#endif //NFA_H
@@ -0,0 +1,316 @@
+#include "pool.h"
+
+#ifndef MFSM_NO_THREADS
+
+// Steps the sessions in one chunk, recording output Events if the worker has
+// a buffer for them.
+static void stepChunk(mfsm_StepPool *pool, mfsm_PoolWorker *w, size_t chunk) {
+  const mfsm_CompiledFSM *c = pool->c;
+  size_t begin = chunk * POOL_CHUNK_SESSIONS;
+  size_t end = begin + POOL_CHUNK_SESSIONS;
+  if (end > pool->count) {
+    end = pool->count;
+  }
+
+  if (w->events == 0) {
+    stepCompiledMany(c, pool->states + begin, pool->inputs + begin, end - begin);
+    return;
+  }
+
+  int *states = pool->states;
+  const int *inputs = pool->inputs;
+  int numInputs = c->numInputs;
+
+  size_t i = begin;
+  for (; i < end; i++) {
+    int cell = states[i] * numInputs + inputs[i];
+    int out = c->outputs[cell];
+
+    if (out != 0) {
+      if (w->numEvents < w->capacity) {
+        w->events[w->numEvents].session = i;
+        w->events[w->numEvents].event = &c->events[out - 1];
+        w->numEvents++;
+      } else {
+        w->dropped++;
+      }
+    }
+
+    states[i] = c->next[cell];
+  }
+}
+
+// Works through the worker's own chunks, then steals what is left of every
+// other worker's, starting with its neighbour. Claims are made with an atomic
+// increment, so a chunk is only ever stepped once.
+static void runWorker(mfsm_StepPool *pool, mfsm_PoolWorker *w) {
+  int k = 0;
+  for (; k < pool->numWorkers; k++) {
+    mfsm_PoolWorker *victim = &pool->workers[(w->index + k) % pool->numWorkers];
+
+    for (;;) {
+      size_t chunk = atomic_fetch_add_explicit(&victim->next, 1, memory_order_relaxed);
+      if (chunk >= victim->end) {
+        break;
+      }
+
+      stepChunk(pool, w, chunk);
+    }
+  }
+}
+
+// Thread body of workers 1 and up: wait for a step, run it, report back.
+static void *workerThread(void *arg) {
+  mfsm_PoolWorker *w = arg;
+  mfsm_StepPool *pool = w->pool;
+  unsigned int seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->generation == seen) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+
+    if (pool->stop) {
+      break;
+    }
+
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    runWorker(pool, w);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+// Stops and joins the first numThreads worker threads.
+static void stopWorkers(mfsm_StepPool *pool, int numThreads) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  int i = 1;
+  for (; i < numThreads; i++) {
+    pthread_join(pool->threads[i], 0);
+  }
+}
+
+// int initStepPool(mfsm_StepPool*, int)
+//
+// Starts the worker threads of a step pool. The calling thread counts as one
+// of the workers.
+//
+// Parameters:
+// pool         mfsm_StepPool*   Uninitialized StepPool struct
+// numWorkers   int              Number of workers, 1 to MAX_POOL_WORKERS
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid number of workers
+//  -3 -- A thread could not be started
+//  -4 -- The pool's lock could not be initialized
+int initStepPool(mfsm_StepPool *pool, int numWorkers) {
+  if (pool == 0) {
+    return -1;
+  }
+
+  if (numWorkers < 1 || numWorkers > MAX_POOL_WORKERS) {
+    return -2;
+  }
+
+  pool->numWorkers = numWorkers;
+  pool->c = 0;
+  pool->states = 0;
+  pool->inputs = 0;
+  pool->count = 0;
+  pool->generation = 0;
+  pool->running = 0;
+  pool->stop = 0;
+
+  if (pthread_mutex_init(&pool->lock, 0) != 0) {
+    pool->numWorkers = 0;
+    return -4;
+  }
+
+  if (pthread_cond_init(&pool->start, 0) != 0) {
+    pthread_mutex_destroy(&pool->lock);
+    pool->numWorkers = 0;
+    return -4;
+  }
+
+  if (pthread_cond_init(&pool->done, 0) != 0) {
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pool->numWorkers = 0;
+    return -4;
+  }
+
+  int i = 0;
+  for (; i < numWorkers; i++) {
+    mfsm_PoolWorker *w = &pool->workers[i];
+    atomic_init(&w->next, 0);
+    w->end = 0;
+    w->events = 0;
+    w->capacity = 0;
+    w->numEvents = 0;
+    w->dropped = 0;
+    w->pool = pool;
+    w->index = i;
+  }
+
+  // Worker 0 is whichever thread calls runStepPool()
+  for (i = 1; i < numWorkers; i++) {
+    if (pthread_create(&pool->threads[i], 0, workerThread, &pool->workers[i]) != 0) {
+      // Join the threads already started
+      stopWorkers(pool, i);
+      pthread_cond_destroy(&pool->done);
+      pthread_cond_destroy(&pool->start);
+      pthread_mutex_destroy(&pool->lock);
+      pool->numWorkers = 0;
+      return -3;
+    }
+  }
+
+  return 0;
+}
+
+// void freeStepPool(mfsm_StepPool*)
+//
+// Stops and joins the worker threads of a step pool.
+//
+// Parameters:
+// pool   mfsm_StepPool*   StepPool context
+//
+// Returns:
+// None
+void freeStepPool(mfsm_StepPool *pool) {
+  if (pool == 0) {
+    return;
+  }
+
+  stopWorkers(pool, pool->numWorkers);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  pool->numWorkers = 0;
+}
+
+// int setPoolEventBuffer(mfsm_StepPool*, int, mfsm_SessionEvent*, size_t)
+//
+// Gives a worker a buffer to record output Events in. The buffer must stay
+// valid for as long as the pool is used, or until it is replaced.
+//
+// Parameters:
+// pool       mfsm_StepPool*       StepPool context
+// worker     int                  Worker index, 0 to numWorkers - 1
+// events     mfsm_SessionEvent*   Buffer, or 0 to stop recording
+// capacity   size_t               Size of events
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid worker index
+int setPoolEventBuffer(mfsm_StepPool *pool, int worker,
+                       mfsm_SessionEvent *events, size_t capacity) {
+  if (pool == 0) {
+    return -1;
+  }
+
+  if (worker < 0 || worker >= pool->numWorkers) {
+    return -2;
+  }
+
+  mfsm_PoolWorker *w = &pool->workers[worker];
+  w->events = events;
+  w->capacity = (events == 0) ? 0 : capacity;
+  w->numEvents = 0;
+  w->dropped = 0;
+
+  return 0;
+}
+
+// int runStepPool(mfsm_StepPool*, const mfsm_CompiledFSM*, int*, const int*,
+//                 size_t)
+//
+// Steps every session by one input using all of the pool's workers, and
+// returns once all of them are done. Same effect as stepCompiledMany(). Each
+// worker's event buffer is emptied first, then receives the output Events of
+// the sessions it stepped, in session order within each chunk. Indices are
+// not validated.
+//
+// Parameters:
+// pool     mfsm_StepPool*            StepPool context
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid compiled FSM
+//  -3 -- Null states or inputs
+int runStepPool(mfsm_StepPool *pool, const mfsm_CompiledFSM *c, int *states,
+                const int *inputs, size_t count) {
+  if (pool == 0 || pool->numWorkers < 1) {
+    return -1;
+  }
+
+  if (c == 0 || c->next == 0) {
+    return -2;
+  }
+
+  if (states == 0 || inputs == 0) {
+    return -3;
+  }
+
+  // Hand out the chunks evenly
+  size_t numChunks = (count + POOL_CHUNK_SESSIONS - 1) / POOL_CHUNK_SESSIONS;
+  size_t n = (size_t)pool->numWorkers;
+
+  size_t i = 0;
+  for (; i < n; i++) {
+    mfsm_PoolWorker *w = &pool->workers[i];
+    atomic_store_explicit(&w->next, numChunks * i / n, memory_order_relaxed);
+    w->end = numChunks * (i + 1) / n;
+    w->numEvents = 0;
+    w->dropped = 0;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->c = c;
+  pool->states = states;
+  pool->inputs = inputs;
+  pool->count = count;
+  pool->running = pool->numWorkers;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  runWorker(pool, &pool->workers[0]);
+
+  // Wait for the other workers; the mutex makes their writes visible here
+  pthread_mutex_lock(&pool->lock);
+  pool->running--;
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+#endif //MFSM_NO_THREADS
@@ -0,0 +1,167 @@
+#ifndef POOL_H
+#define POOL_H
+
+#ifndef MFSM_NO_THREADS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "compiled.h"
+
+/*****************************************************************************
+* Step Pools
+*
+* A fixed set of worker threads which step a large array of sessions of one
+* compiled FSM, like stepCompiledMany() spread over several cores. The
+* session array is cut into chunks of POOL_CHUNK_SESSIONS. Each worker starts
+* with an equal, contiguous range of chunks and, once its own range is used
+* up, steals the remaining chunks of the other workers one at a time, so a
+* slow or descheduled worker does not hold up the whole step.
+*
+* Output Events are recorded in a separate buffer for each worker, so workers
+* never share a write. Buffers are optional; without them the pool only
+* updates the states.
+*
+* The thread calling runStepPool() works as worker 0, so a pool of one worker
+* starts no threads. Not available when built with MFSM_NO_THREADS.
+*****************************************************************************/
+
+#define MAX_POOL_WORKERS 64
+
+// Sessions per chunk. A multiple of the number of ints in a cache line, so
+// chunks of a cache aligned state array never share a line.
+#define POOL_CHUNK_SESSIONS 4096
+
+#if POOL_CHUNK_SESSIONS % (MFSM_CACHE_LINE / 4) != 0
+#error "POOL_CHUNK_SESSIONS must fill whole cache lines"
+#endif
+
+/*****************************************************************************
+* struct SessionEvent
+*
+* An output Event produced while stepping a session. The Event belongs to the
+* compiled FSM and stays valid until it is freed.
+*****************************************************************************/
+typedef struct mfsm_SessionEvent {
+  size_t session;          // Index of the session in the state array
+  const mfsm_Event *event; // Output Event of the transition it took
+} mfsm_SessionEvent;
+
+/*****************************************************************************
+* struct PoolWorker
+*
+* Per-worker state, each on its own cache lines. next and end delimit the
+* chunks the worker has not started yet; other workers steal from the same
+* range by claiming from next. next is written by every stealer, so it has a
+* cache line to itself, apart from the fields only the owner writes.
+*****************************************************************************/
+typedef struct mfsm_PoolWorker {
+  _Alignas(MFSM_CACHE_LINE) atomic_size_t next; // Next unclaimed chunk
+
+  _Alignas(MFSM_CACHE_LINE) size_t end;         // One past the last chunk
+
+  // Output Events recorded by this worker during the last step
+  mfsm_SessionEvent *events; // Buffer given to setPoolEventBuffer(), or 0
+  size_t capacity;           // Size of events
+  size_t numEvents;          // Events recorded
+  size_t dropped;            // Events that did not fit
+
+  struct mfsm_StepPool *pool;
+  int index;
+} mfsm_PoolWorker;
+
+typedef struct mfsm_StepPool {
+  mfsm_PoolWorker workers[MAX_POOL_WORKERS];
+  pthread_t threads[MAX_POOL_WORKERS];
+  int numWorkers;
+
+  // Current step, read by the workers once generation changes
+  const mfsm_CompiledFSM *c;
+  int *states;
+  const int *inputs;
+  size_t count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;    // Signalled when a step or shutdown begins
+  pthread_cond_t done;     // Signalled when the last worker finishes
+  unsigned int generation; // Incremented for every step
+  int running;             // Workers still busy with the current step
+  int stop;                // Non-zero once the pool is being freed
+} mfsm_StepPool;
+
+// int initStepPool(mfsm_StepPool*, int)
+//
+// Starts the worker threads of a step pool. The calling thread counts as one
+// of the workers.
+//
+// Parameters:
+// pool         mfsm_StepPool*   Uninitialized StepPool struct
+// numWorkers   int              Number of workers, 1 to MAX_POOL_WORKERS
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid number of workers
+//  -3 -- A thread could not be started
+//  -4 -- The pool's lock could not be initialized
+int initStepPool(mfsm_StepPool *pool, int numWorkers);
+
+// void freeStepPool(mfsm_StepPool*)
+//
+// Stops and joins the worker threads of a step pool.
+//
+// Parameters:
+// pool   mfsm_StepPool*   StepPool context
+//
+// Returns:
+// None
+void freeStepPool(mfsm_StepPool *pool);
+
+// int setPoolEventBuffer(mfsm_StepPool*, int, mfsm_SessionEvent*, size_t)
+//
+// Gives a worker a buffer to record output Events in. The buffer must stay
+// valid for as long as the pool is used, or until it is replaced.
+//
+// Parameters:
+// pool       mfsm_StepPool*       StepPool context
+// worker     int                  Worker index, 0 to numWorkers - 1
+// events     mfsm_SessionEvent*   Buffer, or 0 to stop recording
+// capacity   size_t               Size of events
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid worker index
+int setPoolEventBuffer(mfsm_StepPool *pool, int worker,
+                       mfsm_SessionEvent *events, size_t capacity);
+
+// int runStepPool(mfsm_StepPool*, const mfsm_CompiledFSM*, int*, const int*,
+//                 size_t)
+//
+// Steps every session by one input using all of the pool's workers, and
+// returns once all of them are done. Same effect as stepCompiledMany(). Each
+// worker's event buffer is emptied first, then receives the output Events of
+// the sessions it stepped, in session order within each chunk. Indices are
+// not validated.
+//
+// Parameters:
+// pool     mfsm_StepPool*            StepPool context
+// c        const mfsm_CompiledFSM*   Compiled FSM context
+// states   int*                      Dense state index of each session,
+//                                    updated in place
+// inputs   const int*                Dense input index for each session
+// count    size_t                    Number of sessions
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid StepPool
+//  -2 -- Invalid compiled FSM
+//  -3 -- Null states or inputs
+int runStepPool(mfsm_StepPool *pool, const mfsm_CompiledFSM *c, int *states,
+                const int *inputs, size_t count);
+
+#endif //MFSM_NO_THREADS
+
+#endif //POOL_H
@@ -0,0 +1,324 @@
+#include "scanner.h"
+#include "idmap.h"
+
+// int initScanner(mfsm_Scanner*, const mfsm_CompiledFSM*, const int*,
+//                 const int*, int)
+//
+// Builds a scanner from a compiled FSM. Release it with freeScanner().
+//
+// Parameters:
+// sc             mfsm_Scanner*             Uninitialized Scanner struct
+// c              const mfsm_CompiledFSM*   Compiled FSM to scan with
+// byteInputs     const int*                Input ID for each of the
+//                                          SCANNER_BYTES byte values
+// accepting      const int*                IDs of extra accepting states,
+//                                          which get tag 0 unless marked
+//                                          in the FSM
+// numAccepting   int                       Number of extra accepting states
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid compiled FSM or byte map
+//  -3 -- An accepting state ID is not in the compiled FSM
+int initScanner(mfsm_Scanner *sc, const mfsm_CompiledFSM *c,
+                const int *byteInputs, const int *accepting, int numAccepting) {
+  if (c == 0 || c->next == 0 || c->numStates < 1 || byteInputs == 0) {
+    return -2;
+  }
+
+  if (numAccepting > 0 && accepting == 0) {
+    return -3;
+  }
+
+  int i = 0;
+  for (; i < numAccepting; i++) {
+    if (getCompiledStateIndex(c, accepting[i]) == -1) {
+      return -3;
+    }
+  }
+
+  // Lay every array out in a single block. toScan maps compiled state indices
+  // to scanner states and is only needed while building.
+  int numStates = c->numStates;
+  int stateMapSize = numStates * 2 + 1;
+  size_t cells = (size_t)numStates * SCANNER_BYTES;
+  size_t idBytes = sizeof(int) * (numStates * 3 + stateMapSize);
+
+  // Compiled FSMs loaded from images have no allocator of their own
+  mfsm_Allocator allocator = c->allocator;
+  if (allocator.alloc == 0) {
+#ifndef MFSM_NO_MALLOC
+    allocator = *getDefaultAllocator();
+#else
+    return -1;
+#endif
+  }
+
+  char *mem = allocator.alloc(allocator.ctx, idBytes + sizeof(uint16_t) * cells);
+  if (mem == 0) {
+    return -1;
+  }
+
+  int *stateIDs = (int*)mem;
+  int *tags = stateIDs + numStates;
+  int *toScan = tags + numStates;
+  int *stateMap = toScan + numStates;
+  uint16_t *next = (uint16_t*)(mem + idBytes);
+
+  // Non-accepting states first, then accepting ones, otherwise keeping the
+  // compiled order
+  for (i = 0; i < numStates; i++) {
+    toScan[i] = c->accepts[i].accepting;
+  }
+
+  for (i = 0; i < numAccepting; i++) {
+    toScan[getCompiledStateIndex(c, accepting[i])] = 1;
+  }
+
+  int firstAccepting = 0;
+  for (i = 0; i < numStates; i++) {
+    firstAccepting += (toScan[i] == 0);
+  }
+
+  int plain = 0;
+  int accept = firstAccepting;
+  for (i = 0; i < numStates; i++) {
+    toScan[i] = (toScan[i] == 0) ? plain++ : accept++;
+    stateIDs[toScan[i]] = c->stateIDs[i];
+    tags[toScan[i]] = c->accepts[i].accepting ? c->accepts[i].tag : 0;
+  }
+
+  idMapClear(stateMap, stateMapSize);
+  for (i = 0; i < numStates; i++) {
+    idMapInsert(stateMap, stateMapSize, stateIDs, i);
+  }
+
+  // Fold the byte map into the transition table
+  int byteClass[SCANNER_BYTES];
+  int b = 0;
+  for (; b < SCANNER_BYTES; b++) {
+    byteClass[b] = getCompiledInputIndex(c, byteInputs[b]);
+  }
+
+  for (i = 0; i < numStates; i++) {
+    uint16_t *row = next + (size_t)toScan[i] * SCANNER_BYTES;
+
+    for (b = 0; b < SCANNER_BYTES; b++) {
+      if (byteClass[b] == -1) {
+        row[b] = (uint16_t)toScan[i];
+      } else {
+        row[b] = (uint16_t)toScan[stepCompiled(c, i, byteClass[b])];
+      }
+    }
+  }
+
+  sc->numStates = numStates;
+  sc->firstAccepting = firstAccepting;
+  sc->next = next;
+  sc->stateIDs = stateIDs;
+  sc->tags = tags;
+  sc->stateMap = stateMap;
+  sc->stateMapSize = stateMapSize;
+  sc->mem = mem;
+  sc->allocator = allocator;
+
+  return 0;
+}
+
+// void freeScanner(mfsm_Scanner*)
+//
+// Releases the memory held by a scanner.
+//
+// Parameters:
+// sc   mfsm_Scanner*   Scanner context
+//
+// Returns:
+// None
+void freeScanner(mfsm_Scanner *sc) {
+  if (sc->mem != 0 && sc->allocator.release != 0) {
+    sc->allocator.release(sc->allocator.ctx, sc->mem);
+  }
+
+  sc->mem = 0;
+  sc->next = 0;
+  sc->numStates = 0;
+}
+
+// int scanBytes(const mfsm_Scanner*, int*, const uint8_t*, size_t, size_t*,
+//               size_t, size_t*, size_t*)
+//
+// Runs the scanner over a buffer, starting in state *state. Every time a
+// byte leaves the machine in an accepting state, the byte's offset in buf is
+// written to offsets. Stops early once offsets is full. A stream can be
+// scanned in pieces by passing the same state variable to every call.
+//
+// Parameters:
+// sc           const mfsm_Scanner*   Scanner context
+// state        int*                  State ID to start in. Receives the state
+//                                    ID after the last byte scanned.
+// buf          const uint8_t*        Bytes to scan
+// len          size_t                Number of bytes
+// offsets      size_t*               Receives the offsets of accepting bytes.
+//                                    May be 0 if maxOffsets is 0.
+// maxOffsets   size_t                Size of offsets
+// numOffsets   size_t*               Receives the number of offsets written.
+//                                    May be 0.
+// consumed     size_t*               Receives the number of bytes scanned.
+//                                    May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid scanner or buffer
+//  -2 -- The starting state ID is invalid
+//  -3 -- offsets filled up; scanning stopped after *consumed bytes
+int scanBytes(const mfsm_Scanner *sc, int *state, const uint8_t *buf,
+              size_t len, size_t *offsets, size_t maxOffsets,
+              size_t *numOffsets, size_t *consumed) {
+  if (numOffsets != 0) {
+    *numOffsets = 0;
+  }
+
+  if (consumed != 0) {
+    *consumed = 0;
+  }
+
+  if (sc == 0 || sc->next == 0 || (buf == 0 && len != 0)) {
+    return -1;
+  }
+
+  if (state == 0 || *state < MIN_STATE_ID) {
+    return -2;
+  }
+
+  int start = idMapFind(sc->stateMap, sc->stateMapSize, sc->stateIDs, *state);
+  if (start == -1) {
+    return -2;
+  }
+
+  const uint16_t *next = sc->next;
+  unsigned int firstAccepting = (unsigned int)sc->firstAccepting;
+  unsigned int s = (unsigned int)start;
+  size_t n = 0;
+  int result = 0;
+
+  size_t i = 0;
+  for (; i < len; i++) {
+    unsigned int t = next[(size_t)s * SCANNER_BYTES + buf[i]];
+
+    if (t >= firstAccepting) {
+      // Leave byte i unscanned so the caller can resume from it
+      if (n == maxOffsets) {
+        result = -3;
+        break;
+      }
+
+      offsets[n++] = i;
+    }
+
+    s = t;
+  }
+
+  *state = sc->stateIDs[s];
+
+  if (numOffsets != 0) {
+    *numOffsets = n;
+  }
+
+  if (consumed != 0) {
+    *consumed = i;
+  }
+
+  return result;
+}
+
+// int scanMatches(const mfsm_Scanner*, int*, const uint8_t*, size_t,
+//                 mfsm_Match*, size_t, size_t*, size_t*)
+//
+// Same as scanBytes(), but records each match with its accepting state and
+// tag.
+//
+// Parameters:
+// sc           const mfsm_Scanner*   Scanner context
+// state        int*                  State ID to start in. Receives the state
+//                                    ID after the last byte scanned.
+// buf          const uint8_t*        Bytes to scan
+// len          size_t                Number of bytes
+// matches      mfsm_Match*           Receives the matches. May be 0 if
+//                                    maxMatches is 0.
+// maxMatches   size_t                Size of matches
+// numMatches   size_t*               Receives the number of matches written.
+//                                    May be 0.
+// consumed     size_t*               Receives the number of bytes scanned.
+//                                    May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid scanner or buffer
+//  -2 -- The starting state ID is invalid
+//  -3 -- matches filled up; scanning stopped after *consumed bytes
+int scanMatches(const mfsm_Scanner *sc, int *state, const uint8_t *buf,
+                size_t len, mfsm_Match *matches, size_t maxMatches,
+                size_t *numMatches, size_t *consumed) {
+  if (numMatches != 0) {
+    *numMatches = 0;
+  }
+
+  if (consumed != 0) {
+    *consumed = 0;
+  }
+
+  if (sc == 0 || sc->next == 0 || (buf == 0 && len != 0)) {
+    return -1;
+  }
+
+  if (state == 0 || *state < MIN_STATE_ID) {
+    return -2;
+  }
+
+  int start = idMapFind(sc->stateMap, sc->stateMapSize, sc->stateIDs, *state);
+  if (start == -1) {
+    return -2;
+  }
+
+  const uint16_t *next = sc->next;
+  unsigned int firstAccepting = (unsigned int)sc->firstAccepting;
+  unsigned int s = (unsigned int)start;
+  size_t n = 0;
+  int result = 0;
+
+  size_t i = 0;
+  for (; i < len; i++) {
+    unsigned int t = next[(size_t)s * SCANNER_BYTES + buf[i]];
+
+    if (t >= firstAccepting) {
+      // Leave byte i unscanned so the caller can resume from it
+      if (n == maxMatches) {
+        result = -3;
+        break;
+      }
+
+      matches[n].offset = i;
+      matches[n].state = sc->stateIDs[t];
+      matches[n].tag = sc->tags[t];
+      n++;
+    }
+
+    s = t;
+  }
+
+  *state = sc->stateIDs[s];
+
+  if (numMatches != 0) {
+    *numMatches = n;
+  }
+
+  if (consumed != 0) {
+    *consumed = i;
+  }
+
+  return result;
+}
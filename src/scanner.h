@@ -0,0 +1,157 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stdint.h>
+#include "compiled.h"
+
+/*****************************************************************************
+* Byte Scanners
+*
+* Runs a compiled FSM over a buffer of bytes as a DFA, eg. to recognise
+* tokens or protocol messages. A scanner is built once from a compiled FSM,
+* a byte -> input ID map and a set of accepting states. It folds the map into
+* a next[state][byte] table so each byte costs one load, and numbers the
+* accepting states last so spotting one costs one comparison. scanBytes()
+* reports the offset of every byte that leaves the machine in an accepting
+* state; scanMatches() also reports the state and its tag.
+*
+* The accepting states are those marked with setAcceptingState() before the
+* FSM was compiled, plus any listed when building the scanner.
+*
+* Bytes mapped to an input the FSM does not have, like missing transitions,
+* leave the state unchanged. The scanner keeps its own copy of everything it
+* needs, so the compiled FSM may be freed once the scanner is built.
+*****************************************************************************/
+
+// Number of distinct byte values.
+#define SCANNER_BYTES 256
+
+typedef struct mfsm_Scanner {
+  int numStates;      // Number of scanner states
+  int firstAccepting; // Scanner states from here up are accepting
+
+  // Next scanner state for each state/byte pair, laid out as
+  // next[state * SCANNER_BYTES + byte].
+  const uint16_t *next;
+
+  const int *stateIDs;   // State ID for each scanner state
+  const int *tags;       // Tag of each scanner state, 0 if not accepting
+  const int *stateMap;   // ID lookup table (see idmap.h) into stateIDs
+  int stateMapSize;
+
+  void *mem; // Single allocation backing every array above
+
+  // Allocator mem came from. Copied from the compiled FSM, or the default
+  // allocator if the compiled FSM has none.
+  mfsm_Allocator allocator;
+} mfsm_Scanner;
+
+/*****************************************************************************
+* struct Match
+*
+* A byte which left the scanner in an accepting state.
+*****************************************************************************/
+typedef struct mfsm_Match {
+  size_t offset; // Offset of the byte in the scanned buffer
+  int state;     // ID of the accepting state
+  int tag;       // Tag of the accepting state
+} mfsm_Match;
+
+// int initScanner(mfsm_Scanner*, const mfsm_CompiledFSM*, const int*,
+//                 const int*, int)
+//
+// Builds a scanner from a compiled FSM. Release it with freeScanner().
+//
+// Parameters:
+// sc             mfsm_Scanner*             Uninitialized Scanner struct
+// c              const mfsm_CompiledFSM*   Compiled FSM to scan with
+// byteInputs     const int*                Input ID for each of the
+//                                          SCANNER_BYTES byte values
+// accepting      const int*                IDs of extra accepting states,
+//                                          which get tag 0 unless marked
+//                                          in the FSM
+// numAccepting   int                       Number of extra accepting states
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Memory could not be allocated
+//  -2 -- Invalid compiled FSM or byte map
+//  -3 -- An accepting state ID is not in the compiled FSM
+int initScanner(mfsm_Scanner *sc, const mfsm_CompiledFSM *c,
+                const int *byteInputs, const int *accepting, int numAccepting);
+
+// void freeScanner(mfsm_Scanner*)
+//
+// Releases the memory held by a scanner.
+//
+// Parameters:
+// sc   mfsm_Scanner*   Scanner context
+//
+// Returns:
+// None
+void freeScanner(mfsm_Scanner *sc);
+
+// int scanBytes(const mfsm_Scanner*, int*, const uint8_t*, size_t, size_t*,
+//               size_t, size_t*, size_t*)
+//
+// Runs the scanner over a buffer, starting in state *state. Every time a
+// byte leaves the machine in an accepting state, the byte's offset in buf is
+// written to offsets. Stops early once offsets is full. A stream can be
+// scanned in pieces by passing the same state variable to every call.
+//
+// Parameters:
+// sc           const mfsm_Scanner*   Scanner context
+// state        int*                  State ID to start in. Receives the state
+//                                    ID after the last byte scanned.
+// buf          const uint8_t*        Bytes to scan
+// len          size_t                Number of bytes
+// offsets      size_t*               Receives the offsets of accepting bytes.
+//                                    May be 0 if maxOffsets is 0.
+// maxOffsets   size_t                Size of offsets
+// numOffsets   size_t*               Receives the number of offsets written.
+//                                    May be 0.
+// consumed     size_t*               Receives the number of bytes scanned.
+//                                    May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid scanner or buffer
+//  -2 -- The starting state ID is invalid
+//  -3 -- offsets filled up; scanning stopped after *consumed bytes
+int scanBytes(const mfsm_Scanner *sc, int *state, const uint8_t *buf,
+              size_t len, size_t *offsets, size_t maxOffsets,
+              size_t *numOffsets, size_t *consumed);
+
+// int scanMatches(const mfsm_Scanner*, int*, const uint8_t*, size_t,
+//                 mfsm_Match*, size_t, size_t*, size_t*)
+//
+// Same as scanBytes(), but records each match with its accepting state and
+// tag.
+//
+// Parameters:
+// sc           const mfsm_Scanner*   Scanner context
+// state        int*                  State ID to start in. Receives the state
+//                                    ID after the last byte scanned.
+// buf          const uint8_t*        Bytes to scan
+// len          size_t                Number of bytes
+// matches      mfsm_Match*           Receives the matches. May be 0 if
+//                                    maxMatches is 0.
+// maxMatches   size_t                Size of matches
+// numMatches   size_t*               Receives the number of matches written.
+//                                    May be 0.
+// consumed     size_t*               Receives the number of bytes scanned.
+//                                    May be 0.
+//
+// Returns:
+// Success -- 0
+// Failure:
+//  -1 -- Invalid scanner or buffer
+//  -2 -- The starting state ID is invalid
+//  -3 -- matches filled up; scanning stopped after *consumed bytes
+int scanMatches(const mfsm_Scanner *sc, int *state, const uint8_t *buf,
+                size_t len, mfsm_Match *matches, size_t maxMatches,
+                size_t *numMatches, size_t *consumed);
+
+#endif //SCANNER_H
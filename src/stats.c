@@ -0,0 +1,110 @@
+#include <string.h>
+#include "stats.h"
+
+#ifdef MFSM_STATS
+
+// void initStats(mfsm_Stats*, uint64_t*, int, int)
+//
+// Set default values for a set of counters, all starting at 0.
+//
+// Parameters:
+// stats      mfsm_Stats*   Uninitialized Stats struct
+// pairs      uint64_t*     numStates * numInputs counters per (state, input),
+//                          or 0
+// numStates  int           Number of state indexes in pairs
+// numInputs  int           Number of input indexes in pairs
+//
+// Returns:
+// None
+void initStats(mfsm_Stats *stats, uint64_t *pairs, int numStates, int numInputs) {
+  stats->pairs = pairs;
+  stats->numStates = (pairs != 0 && numStates > 0) ? numStates : 0;
+  stats->numInputs = (pairs != 0 && numInputs > 0) ? numInputs : 0;
+  resetStats(stats);
+}
+
+// void snapshotStats(const mfsm_Stats*, mfsm_Stats*, uint64_t*)
+//
+// Copies a set of counters. The snapshot's pairs table is the one given, and
+// receives a copy of the counters' table.
+//
+// Parameters:
+// stats   const mfsm_Stats*   Stats context
+// dest    mfsm_Stats*         Receives the snapshot
+// pairs   uint64_t*           Room for stats->numStates * stats->numInputs
+//                             counters, or 0 to leave the table out
+//
+// Returns:
+// None
+void snapshotStats(const mfsm_Stats *stats, mfsm_Stats *dest, uint64_t *pairs) {
+  *dest = *stats;
+  dest->pairs = pairs;
+
+  if (pairs == 0 || stats->pairs == 0) {
+    dest->pairs = 0;
+    dest->numStates = 0;
+    dest->numInputs = 0;
+    return;
+  }
+
+  memcpy(pairs, stats->pairs,
+         sizeof(uint64_t) * stats->numStates * stats->numInputs);
+}
+
+// void resetStats(mfsm_Stats*)
+//
+// Sets every counter, including the pairs table, back to 0.
+//
+// Parameters:
+// stats   mfsm_Stats*   Stats context
+//
+// Returns:
+// None
+void resetStats(mfsm_Stats *stats) {
+  stats->transitions = 0;
+  stats->eventsSent = 0;
+
+  int i = 0;
+  for (; i < MFSM_STATS_ERRORS; i++) {
+    stats->failed[i] = 0;
+  }
+
+  if (stats->pairs != 0) {
+    memset(stats->pairs, 0,
+           sizeof(uint64_t) * stats->numStates * stats->numInputs);
+  }
+}
+
+// void snapshotListenerStats(const mfsm_EventListener*, mfsm_ListenerStats*)
+//
+// Copies the counters of an EventListener.
+//
+// Parameters:
+// el     const mfsm_EventListener*   EventListener context
+// dest   mfsm_ListenerStats*         Receives the snapshot
+//
+// Returns:
+// None
+void snapshotListenerStats(const mfsm_EventListener *el, mfsm_ListenerStats *dest) {
+  dest->delivered = el->delivered;
+  dest->dropped = el->dropped;
+  dest->highWater = el->highWater;
+}
+
+// void resetListenerStats(mfsm_EventListener*)
+//
+// Sets an EventListener's delivered and dropped counts back to 0, and its
+// highWater mark to the number of Events it holds now.
+//
+// Parameters:
+// el   mfsm_EventListener*   EventListener context
+//
+// Returns:
+// None
+void resetListenerStats(mfsm_EventListener *el) {
+  el->delivered = 0;
+  el->dropped = 0;
+  el->highWater = getNumEvents(el);
+}
+
+#endif //MFSM_STATS
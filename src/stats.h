@@ -0,0 +1,117 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "event.h"
+
+/*****************************************************************************
+* Instrumentation
+*
+* Counters kept by the transition and Event functions, for feeding metrics
+* exporters. Only built when MFSM_STATS is defined; otherwise none of the
+* counters, struct members or functions below exist and the hot paths are
+* unchanged.
+*
+* doTransition() and doInstanceTransition() (and their batch versions) count
+* into the mfsm_Stats attached to the FSM or instance, if any. Counters are
+* plain integers, not atomics: give each thread its own mfsm_Stats (or
+* attach one per instance), and snapshot and reset it from the thread that
+* updates it.
+*
+* Each EventListener counts the Events delivered to it alongside its
+* existing dropped count and highWater mark. These are written by the thread
+* sending Events, so read and reset them from that thread.
+*****************************************************************************/
+
+#ifdef MFSM_STATS
+
+// Number of doTransition() error codes counted, -1 to -MFSM_STATS_ERRORS
+#define MFSM_STATS_ERRORS 2
+
+typedef struct mfsm_Stats {
+  uint64_t transitions;                 // Transitions executed
+  uint64_t failed[MFSM_STATS_ERRORS];   // Failures, at failed[-code - 1]
+  uint64_t eventsSent;                  // Output Events sent
+
+  // Optional table of transitions executed per (state, input), indexed
+  // [state index * numInputs + input index] by the definition's state and
+  // input indexes. Pairs outside the table are only counted in transitions.
+  uint64_t *pairs;
+  int numStates;
+  int numInputs;
+} mfsm_Stats;
+
+typedef struct mfsm_ListenerStats {
+  unsigned int delivered; // Events queued
+  unsigned int dropped;   // Events lost to overflow
+  int highWater;          // Most Events queued at once
+} mfsm_ListenerStats;
+
+// void initStats(mfsm_Stats*, uint64_t*, int, int)
+//
+// Set default values for a set of counters, all starting at 0.
+//
+// Parameters:
+// stats      mfsm_Stats*   Uninitialized Stats struct
+// pairs      uint64_t*     numStates * numInputs counters per (state, input),
+//                          or 0
+// numStates  int           Number of state indexes in pairs
+// numInputs  int           Number of input indexes in pairs
+//
+// Returns:
+// None
+void initStats(mfsm_Stats *stats, uint64_t *pairs, int numStates, int numInputs);
+
+// void snapshotStats(const mfsm_Stats*, mfsm_Stats*, uint64_t*)
+//
+// Copies a set of counters. The snapshot's pairs table is the one given, and
+// receives a copy of the counters' table.
+//
+// Parameters:
+// stats   const mfsm_Stats*   Stats context
+// dest    mfsm_Stats*         Receives the snapshot
+// pairs   uint64_t*           Room for stats->numStates * stats->numInputs
+//                             counters, or 0 to leave the table out
+//
+// Returns:
+// None
+void snapshotStats(const mfsm_Stats *stats, mfsm_Stats *dest, uint64_t *pairs);
+
+// void resetStats(mfsm_Stats*)
+//
+// Sets every counter, including the pairs table, back to 0.
+//
+// Parameters:
+// stats   mfsm_Stats*   Stats context
+//
+// Returns:
+// None
+void resetStats(mfsm_Stats *stats);
+
+// void snapshotListenerStats(const mfsm_EventListener*, mfsm_ListenerStats*)
+//
+// Copies the counters of an EventListener.
+//
+// Parameters:
+// el     const mfsm_EventListener*   EventListener context
+// dest   mfsm_ListenerStats*         Receives the snapshot
+//
+// Returns:
+// None
+void snapshotListenerStats(const mfsm_EventListener *el, mfsm_ListenerStats *dest);
+
+// void resetListenerStats(mfsm_EventListener*)
+//
+// Sets an EventListener's delivered and dropped counts back to 0, and its
+// highWater mark to the number of Events it holds now.
+//
+// Parameters:
+// el   mfsm_EventListener*   EventListener context
+//
+// Returns:
+// None
+void resetListenerStats(mfsm_EventListener *el);
+
+#endif //MFSM_STATS
+
+#endif //STATS_H
@@ -0,0 +1,168 @@
+#include "timing.h"
+
+#ifdef MFSM_TIMING
+
+// Mask of the linear part of a bucket index.
+#define SUB_MASK ((1 << MFSM_HIST_SUB_BITS) - 1)
+
+// Finds the bucket of a value. Small values map to themselves; larger ones
+// keep their top MFSM_HIST_SUB_BITS bits below the highest set bit.
+static int getBucket(uint64_t value) {
+  if (value <= SUB_MASK) {
+    return (int)value;
+  }
+
+  int shift = 63 - __builtin_clzll(value) - MFSM_HIST_SUB_BITS;
+  return ((shift + 1) << MFSM_HIST_SUB_BITS) + (int)((value >> shift) & SUB_MASK);
+}
+
+// Finds the largest value which falls in a bucket.
+static uint64_t getBucketTop(int bucket) {
+  if (bucket <= SUB_MASK) {
+    return (uint64_t)bucket;
+  }
+
+  int shift = (bucket >> MFSM_HIST_SUB_BITS) - 1;
+  uint64_t base = (uint64_t)((1 << MFSM_HIST_SUB_BITS) + (bucket & SUB_MASK)) << shift;
+  return base + (((uint64_t)1 << shift) - 1);
+}
+
+// void initHistogram(mfsm_Histogram*)
+//
+// Set default values for an empty Histogram.
+//
+// Parameters:
+// h   mfsm_Histogram*   Uninitialized Histogram struct
+//
+// Returns:
+// None
+void initHistogram(mfsm_Histogram *h) {
+  int i = 0;
+  for (; i < MFSM_HIST_BUCKETS; i++) {
+    h->counts[i] = 0;
+  }
+
+  h->total = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+}
+
+// void initTiming(mfsm_Timing*)
+//
+// Set default values for a Timing with empty histograms.
+//
+// Parameters:
+// t   mfsm_Timing*   Uninitialized Timing struct
+//
+// Returns:
+// None
+void initTiming(mfsm_Timing *t) {
+  initHistogram(&t->transition);
+  initHistogram(&t->dispatch);
+}
+
+// void recordSample(mfsm_Histogram*, uint64_t)
+//
+// Adds a sample to a Histogram.
+//
+// Parameters:
+// h       mfsm_Histogram*   Histogram context
+// value   uint64_t          Sample
+//
+// Returns:
+// None
+void recordSample(mfsm_Histogram *h, uint64_t value) {
+  h->counts[getBucket(value)]++;
+  h->total++;
+
+  if (value < h->min) {
+    h->min = value;
+  }
+
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+// void mergeHistogram(mfsm_Histogram*, const mfsm_Histogram*)
+//
+// Adds every sample of one Histogram to another.
+//
+// Parameters:
+// dest   mfsm_Histogram*         Histogram receiving the samples
+// src    const mfsm_Histogram*   Histogram to add
+//
+// Returns:
+// None
+void mergeHistogram(mfsm_Histogram *dest, const mfsm_Histogram *src) {
+  int i = 0;
+  for (; i < MFSM_HIST_BUCKETS; i++) {
+    dest->counts[i] += src->counts[i];
+  }
+
+  dest->total += src->total;
+
+  if (src->min < dest->min) {
+    dest->min = src->min;
+  }
+
+  if (src->max > dest->max) {
+    dest->max = src->max;
+  }
+}
+
+// uint64_t getPercentile(const mfsm_Histogram*, double)
+//
+// Finds the value below which a percentage of the samples fall. The result
+// is the top of the bucket holding that sample, capped at the largest
+// sample.
+//
+// Parameters:
+// h         const mfsm_Histogram*   Histogram context
+// percent   double                  Percentile, 0 to 100. Values outside
+//                                   the range are clamped to it.
+//
+// Returns:
+// The percentile, or 0 with no samples
+uint64_t getPercentile(const mfsm_Histogram *h, double percent) {
+  if (h->total == 0) {
+    return 0;
+  }
+
+  // Clamp first: converting a negative or huge double to uint64_t is
+  // undefined. NaN fails both comparisons and becomes 0.
+  if (!(percent >= 0.0)) {
+    percent = 0.0;
+  } else if (percent > 100.0) {
+    percent = 100.0;
+  }
+
+  // Rank of the sample wanted, counting from 1
+  double exact = percent / 100.0 * (double)h->total;
+  uint64_t rank = (uint64_t)exact;
+  if ((double)rank < exact) {
+    rank++;
+  }
+
+  if (rank < 1) {
+    return h->min;
+  }
+
+  if (rank > h->total) {
+    rank = h->total;
+  }
+
+  uint64_t seen = 0;
+  int i = 0;
+  for (; i < MFSM_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+
+  uint64_t top = getBucketTop(i);
+  return (top < h->max) ? top : h->max;
+}
+
+#endif //MFSM_TIMING
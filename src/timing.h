@@ -0,0 +1,144 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+/*****************************************************************************
+* Timing
+*
+* Latency histograms for doTransition() and doInstanceTransition(). Only
+* built when MFSM_TIMING is defined; otherwise none of the struct members or
+* functions below exist and the hot paths are unchanged.
+*
+* Each transition is timed in two phases: the transition phase (looking up
+* and taking the transition) and the dispatch phase (sending its output
+* Event, only when there is one). Samples go into the mfsm_Timing attached
+* to the instance, or else the one attached to the definition, so one
+* mfsm_Timing can cover every instance of a definition. Like mfsm_Stats,
+* histograms are not atomic: instances stepped by different threads need
+* their own, which can be combined with mergeHistogram().
+*
+* Times are read with rdtsc on x86, in TSC cycles, and with
+* clock_gettime(CLOCK_MONOTONIC) elsewhere or when MFSM_TIMING_CLOCK is
+* defined, in nanoseconds. Failed transitions are not timed. The batch
+* transition functions are not timed. "make bench-timing" measures the cost
+* of timing each transition.
+*
+* Histograms are log-linear: values below 2^MFSM_HIST_SUB_BITS each get a
+* bucket, and every power of two above that is split into
+* 2^MFSM_HIST_SUB_BITS equal buckets. Percentiles are accurate to within one
+* bucket, ie. 1 / 2^MFSM_HIST_SUB_BITS of the value.
+*****************************************************************************/
+
+#ifdef MFSM_TIMING
+
+#if !defined(MFSM_TIMING_CLOCK) && (defined(__x86_64__) || defined(__i386__))
+#define MFSM_TIMER_TSC
+#include <x86intrin.h>
+#define MFSM_TIMER_UNITS "cycles"
+#else
+#include <time.h>
+#define MFSM_TIMER_UNITS "ns"
+#endif
+
+// Linear buckets per power of two, as a power of two
+#define MFSM_HIST_SUB_BITS 4
+
+// Buckets needed to cover every 64 bit value
+#define MFSM_HIST_BUCKETS ((64 - MFSM_HIST_SUB_BITS + 1) << MFSM_HIST_SUB_BITS)
+
+typedef struct mfsm_Histogram {
+  uint64_t counts[MFSM_HIST_BUCKETS];
+  uint64_t total; // Number of samples
+  uint64_t min;   // Smallest sample, or UINT64_MAX with no samples
+  uint64_t max;   // Largest sample
+} mfsm_Histogram;
+
+typedef struct mfsm_Timing {
+  mfsm_Histogram transition; // Looking up and taking transitions
+  mfsm_Histogram dispatch;   // Sending output Events
+} mfsm_Timing;
+
+// uint64_t readTimer(void)
+//
+// Reads the clock used for timing transitions.
+//
+// Parameters:
+// None
+//
+// Returns:
+// Current time, in TSC cycles or nanoseconds (see above)
+static inline uint64_t readTimer(void) {
+#ifdef MFSM_TIMER_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// void initHistogram(mfsm_Histogram*)
+//
+// Set default values for an empty Histogram.
+//
+// Parameters:
+// h   mfsm_Histogram*   Uninitialized Histogram struct
+//
+// Returns:
+// None
+void initHistogram(mfsm_Histogram *h);
+
+// void initTiming(mfsm_Timing*)
+//
+// Set default values for a Timing with empty histograms.
+//
+// Parameters:
+// t   mfsm_Timing*   Uninitialized Timing struct
+//
+// Returns:
+// None
+void initTiming(mfsm_Timing *t);
+
+// void recordSample(mfsm_Histogram*, uint64_t)
+//
+// Adds a sample to a Histogram.
+//
+// Parameters:
+// h       mfsm_Histogram*   Histogram context
+// value   uint64_t          Sample
+//
+// Returns:
+// None
+void recordSample(mfsm_Histogram *h, uint64_t value);
+
+// void mergeHistogram(mfsm_Histogram*, const mfsm_Histogram*)
+//
+// Adds every sample of one Histogram to another.
+//
+// Parameters:
+// dest   mfsm_Histogram*         Histogram receiving the samples
+// src    const mfsm_Histogram*   Histogram to add
+//
+// Returns:
+// None
+void mergeHistogram(mfsm_Histogram *dest, const mfsm_Histogram *src);
+
+// uint64_t getPercentile(const mfsm_Histogram*, double)
+//
+// Finds the value below which a percentage of the samples fall. The result
+// is the top of the bucket holding that sample, capped at the largest
+// sample.
+//
+// Parameters:
+// h         const mfsm_Histogram*   Histogram context
+// percent   double                  Percentile, 0 to 100. Values outside
+//                                   the range are clamped to it.
+//
+// Returns:
+// The percentile, or 0 with no samples
+uint64_t getPercentile(const mfsm_Histogram *h, double percent);
+
+#endif //MFSM_TIMING
+
+#endif //TIMING_H
@@ -0,0 +1,967 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "microFSM.h"
+#include "event.h"
+#include "idmap.h"
+#include "compiled.h"
+#include "pool.h"
+#include "scanner.h"
+#include "minimize.h"
+#include "nfa.h"
+#include "image.h"
+#include "checkpoint.h"
+
+/**************************************
+Bench.c
+
+Rough micro-benchmarks for the hot paths of the library. Each benchmark
+prints the average time per operation in nanoseconds. Numbers are only
+meaningful relative to each other on the same machine.
+**************************************/
+
+// Prevents the compiler from discarding results of benchmarked work.
+static volatile int benchSink = 0;
+
+// Current time in nanoseconds from a monotonic clock.
+static double nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/****************************************
+* ID lookup
+****************************************/
+
+// The lookup used before ID maps were added: scan every slot.
+static int linearFind(const int *ids, int size, int id) {
+  int i = 0;
+  for (; i < size; i++) {
+    if (ids[i] == id) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// IDs are 1 + i * stride: an odd stride gives sparse IDs so the table has
+// to hash rather than index directly, and a power of two stride checks that
+// they do not pile up in a few slots.
+void bench_idLookup(int numIDs, int stride) {
+  int mapSize = numIDs * 2;
+  int *ids = malloc(sizeof(int) * numIDs);
+  int *slots = malloc(sizeof(int) * mapSize);
+  idMapClear(slots, mapSize);
+
+  int i = 0;
+  for (; i < numIDs; i++) {
+    ids[i] = 1 + i * stride;
+    idMapInsert(slots, mapSize, ids, i);
+  }
+
+  int iterations = 2000000;
+  int sum = 0;
+
+  double start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    sum += linearFind(ids, numIDs, ids[(i * 31) % numIDs]);
+  }
+  double linear = (nowNs() - start) / iterations;
+
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    sum += idMapFind(slots, mapSize, ids, ids[(i * 31) % numIDs]);
+  }
+  double mapped = (nowNs() - start) / iterations;
+
+  benchSink += sum;
+  printf("ID lookup, %5d IDs, stride %3d: linear %8.2f ns  map %6.2f ns\n",
+         numIDs, stride, linear, mapped);
+
+  free(ids);
+  free(slots);
+}
+
+
+/****************************************
+* Transitions
+****************************************/
+
+// Builds an FSM with every state/input pair connected to a pseudo-random
+// destination.
+static void buildRandomFSM(mfsm_fsm *fsm, int numStates, int numInputs) {
+  initFSM(fsm);
+
+  int i = 0;
+  int j = 0;
+  for (; i < numStates; i++) {
+    addState(fsm, i + 1);
+  }
+
+  for (i = 0; i < numInputs; i++) {
+    addInput(fsm, i + 1);
+  }
+
+  unsigned int seed = 12345;
+  for (i = 0; i < numStates; i++) {
+    for (j = 0; j < numInputs; j++) {
+      seed = seed * 1103515245u + 12345u;
+      addTransition(fsm, j + 1, i + 1, (int)((seed >> 8) % numStates) + 1);
+    }
+  }
+
+  fsm->curState = 1;
+}
+
+void bench_compiledStep(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  int iterations = 2000000;
+  int i = 0;
+
+  double start = nowNs();
+  for (; i < iterations; i++) {
+    doTransition(&fsm, (i % MAX_INPUTS) + 1);
+  }
+  double dynamic = (nowNs() - start) / iterations;
+
+  int s = getCompiledStateIndex(&c, 1);
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    s = stepCompiled(&c, s, i % MAX_INPUTS);
+  }
+  double compiled = (nowNs() - start) / iterations;
+
+  benchSink += s + fsm.curState;
+  printf("Transition, %d states: doTransition %6.2f ns  stepCompiled %6.2f ns\n",
+         MAX_STATES, dynamic, compiled);
+
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+}
+
+// Builds a large FSM where only a few percent of state/input pairs have a
+// transition.
+static void fillSparseFSM(mfsm_fsm *fsm, int numStates, int numInputs) {
+  int i = 0;
+  for (; i < numStates; i++) {
+    addState(fsm, i + 1);
+  }
+
+  for (i = 0; i < numInputs; i++) {
+    addInput(fsm, i + 1);
+  }
+
+  // Every state gets one transition so that walks never get stuck
+  unsigned int seed = 12345;
+  for (i = 0; i < numStates; i++) {
+    seed = seed * 1103515245u + 12345u;
+    addTransition(fsm, (i % numInputs) + 1, i + 1,
+                  (int)((seed >> 8) % numStates) + 1);
+  }
+}
+
+// Bytes used to store an FSM's transitions.
+static size_t transitionBytes(const mfsm_fsm *fsm) {
+  if (fsm->edges == 0) {
+    return sizeof(mfsm_Transition) * fsm->maxStates * fsm->maxInputs;
+  }
+
+  size_t bytes = sizeof(mfsm_EdgeList) * fsm->maxStates;
+  int i = 0;
+  for (; i < fsm->maxStates; i++) {
+    bytes += sizeof(mfsm_Edge) * fsm->edges[i].maxEdges;
+  }
+
+  return bytes;
+}
+
+void bench_sparseStorage(void) {
+  int numStates = 2048;
+  int numInputs = 32;
+
+  mfsm_fsm dense;
+  mfsm_fsm sparse;
+  initDynamicFSM(&dense, numStates, numInputs, getDefaultAllocator());
+  initSparseFSM(&sparse, numStates, numInputs, getDefaultAllocator());
+  fillSparseFSM(&dense, numStates, numInputs);
+  fillSparseFSM(&sparse, numStates, numInputs);
+
+  // Walk the FSMs, always using the input each state has a transition for
+  int iterations = 2000000;
+  int i = 0;
+  dense.curState = 1;
+  double start = nowNs();
+  for (; i < iterations; i++) {
+    doTransition(&dense, ((dense.curState - 1) % numInputs) + 1);
+  }
+  double denseNs = (nowNs() - start) / iterations;
+
+  sparse.curState = 1;
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    doTransition(&sparse, ((sparse.curState - 1) % numInputs) + 1);
+  }
+  double sparseNs = (nowNs() - start) / iterations;
+
+  benchSink += dense.curState + sparse.curState;
+  printf("Storage, %d states x %d inputs, 1 transition per state:\n",
+         numStates, numInputs);
+  printf("  dense  %8zu KB  doTransition %6.2f ns\n",
+         transitionBytes(&dense) / 1024, denseNs);
+  printf("  sparse %8zu KB  doTransition %6.2f ns\n",
+         transitionBytes(&sparse) / 1024, sparseNs);
+
+  freeFSM(&dense);
+  freeFSM(&sparse);
+}
+
+void bench_batchTransition(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  // Decoded packet buffers of a few hundred inputs
+  int inputs[256];
+  int i = 0;
+  for (; i < 256; i++) {
+    inputs[i] = (i * 7 % MAX_INPUTS) + 1;
+  }
+
+  int rounds = 10000;
+  int r = 0;
+  double start = nowNs();
+  for (; r < rounds; r++) {
+    for (i = 0; i < 256; i++) {
+      doTransition(&fsm, inputs[i]);
+    }
+  }
+  double single = (nowNs() - start) / (rounds * 256.0);
+
+  start = nowNs();
+  for (r = 0; r < rounds; r++) {
+    doTransitionBatch(&fsm, inputs, 256, 0, 0);
+  }
+  double batch = (nowNs() - start) / (rounds * 256.0);
+
+  mfsm_Instance inst;
+  initInstance(&inst, 1, 0);
+  start = nowNs();
+  for (r = 0; r < rounds; r++) {
+    doCompiledTransitionBatch(&c, &inst, inputs, 256, 0, 0);
+  }
+  double compiled = (nowNs() - start) / (rounds * 256.0);
+
+  benchSink += fsm.curState + inst.curState;
+  printf("Per input, 256 input batches: doTransition %6.2f ns  "
+         "doTransitionBatch %6.2f ns  doCompiledTransitionBatch %6.2f ns\n",
+         single, batch, compiled);
+
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+}
+
+#define SESSIONS 50000
+
+// One tick over many sessions of the same machine, each getting one input:
+// doInstanceTransition() per session against stepping the whole state array.
+void bench_manySessions(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  static mfsm_Instance instances[SESSIONS];
+  static int inputIDs[SESSIONS];
+  static int states[SESSIONS];
+  static int inputs[SESSIONS];
+  unsigned int seed = 777;
+  int i = 0;
+  for (; i < SESSIONS; i++) {
+    seed = seed * 1103515245u + 12345u;
+    initInstance(&instances[i], (int)((seed >> 8) % MAX_STATES) + 1, 0);
+    states[i] = getCompiledStateIndex(&c, instances[i].curState);
+    inputIDs[i] = (int)((seed >> 16) % MAX_INPUTS) + 1;
+    inputs[i] = getCompiledInputIndex(&c, inputIDs[i]);
+  }
+
+  int ticks = 100;
+  int t = 0;
+  double start = nowNs();
+  for (; t < ticks; t++) {
+    for (i = 0; i < SESSIONS; i++) {
+      doInstanceTransition(&fsm, &instances[i], inputIDs[i]);
+    }
+  }
+  double single = (nowNs() - start) / ((double)ticks * SESSIONS);
+
+  start = nowNs();
+  for (t = 0; t < ticks; t++) {
+    stepCompiledManyScalar(&c, states, inputs, SESSIONS);
+  }
+  double scalar = (nowNs() - start) / ((double)ticks * SESSIONS);
+
+  start = nowNs();
+  for (t = 0; t < ticks; t++) {
+    stepCompiledMany(&c, states, inputs, SESSIONS);
+  }
+  double vector = (nowNs() - start) / ((double)ticks * SESSIONS);
+
+  benchSink += states[SESSIONS - 1] + instances[SESSIONS - 1].curState;
+  printf("Per session, %d sessions: doInstanceTransition %6.2f ns  "
+         "scalar %6.2f ns  stepCompiledMany%s %6.2f ns\n",
+         SESSIONS, single, scalar, hasSIMDStepping() ? " (AVX2)" : "", vector);
+
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+}
+
+#define POOL_SESSIONS 500000
+
+// Scaling of runStepPool() from one worker up to one per online core.
+void bench_stepPool(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  static _Alignas(MFSM_CACHE_LINE) int states[POOL_SESSIONS];
+  static int inputs[POOL_SESSIONS];
+  int i = 0;
+  for (; i < POOL_SESSIONS; i++) {
+    states[i] = i % c.numStates;
+    inputs[i] = (i * 7) % c.numInputs;
+  }
+
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  } else if (cores > MAX_POOL_WORKERS) {
+    cores = MAX_POOL_WORKERS;
+  }
+
+  printf("Step pool, %d sessions:", POOL_SESSIONS);
+
+  int workers = 1;
+  for (; workers <= cores; workers++) {
+    mfsm_StepPool pool;
+    initStepPool(&pool, workers);
+
+    int ticks = 50;
+    int t = 0;
+    double start = nowNs();
+    for (; t < ticks; t++) {
+      runStepPool(&pool, &c, states, inputs, POOL_SESSIONS);
+    }
+    double perTick = (nowNs() - start) / ticks;
+
+    freeStepPool(&pool);
+    printf("  %d worker%s %7.1f us/tick", workers, workers == 1 ? "" : "s",
+           perTick / 1e3);
+  }
+  printf("\n");
+
+  benchSink += states[POOL_SESSIONS - 1];
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+}
+
+#define SCAN_BYTES (64 * 1024 * 1024)
+
+// Throughput over a byte stream: doTransition() per byte with the byte mapped
+// to an input ID, against scanBytes() over the whole buffer.
+void bench_scanBytes(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  int byteInputs[SCANNER_BYTES];
+  int b = 0;
+  for (; b < SCANNER_BYTES; b++) {
+    byteInputs[b] = b % MAX_INPUTS + 1;
+  }
+
+  int accepting[4] = {1, 2, 3, 4};
+  mfsm_Scanner sc;
+  initScanner(&sc, &c, byteInputs, accepting, 4);
+
+  uint8_t *buf = malloc(SCAN_BYTES);
+  unsigned int seed = 4242;
+  size_t i = 0;
+  for (; i < SCAN_BYTES; i++) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = (uint8_t)(seed >> 16);
+  }
+
+  // The per-byte loop is slow, so only time part of the buffer
+  size_t slowBytes = SCAN_BYTES / 16;
+  size_t hits = 0;
+  double start = nowNs();
+  for (i = 0; i < slowBytes; i++) {
+    doTransition(&fsm, byteInputs[buf[i]]);
+    hits += (fsm.curState <= 4);
+  }
+  double perByte = (nowNs() - start) / slowBytes;
+
+  static size_t offsets[4096];
+  int state = 1;
+  size_t done = 0;
+  start = nowNs();
+  while (done < SCAN_BYTES) {
+    size_t n = 0;
+    size_t used = 0;
+    scanBytes(&sc, &state, buf + done, SCAN_BYTES - done, offsets, 4096, &n, &used);
+    hits += n;
+    done += used;
+  }
+  double scan = (nowNs() - start) / SCAN_BYTES;
+
+  // Matches with their states and tags, against a check after every step
+  int si = 0;
+  start = nowNs();
+  for (i = 0; i < SCAN_BYTES; i++) {
+    si = stepCompiled(&c, si, getCompiledInputIndex(&c, byteInputs[buf[i]]));
+    hits += c.accepts[si].accepting;
+  }
+  double perStep = (nowNs() - start) / SCAN_BYTES;
+
+  static mfsm_Match matches[4096];
+  state = 1;
+  done = 0;
+  start = nowNs();
+  while (done < SCAN_BYTES) {
+    size_t n = 0;
+    size_t used = 0;
+    scanMatches(&sc, &state, buf + done, SCAN_BYTES - done, matches, 4096, &n, &used);
+    hits += n;
+    done += used;
+  }
+  double match = (nowNs() - start) / SCAN_BYTES;
+
+  benchSink += (int)hits;
+  printf("Byte stream: doTransition per byte %6.3f GB/s  scanBytes %6.3f GB/s\n",
+         1.0 / perByte, 1.0 / scan);
+  printf("Matches:     stepCompiled + check %6.3f GB/s  scanMatches %6.3f GB/s\n",
+         1.0 / perStep, 1.0 / match);
+
+  free(buf);
+  freeScanner(&sc);
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+}
+
+#define DUP_BASE 64
+#define DUP_COPIES 256
+#define DUP_INPUTS 16
+
+// doTransition() on a generated machine made of many equivalent copies of a
+// small one, before and after minimizeFSM().
+void bench_minimize(void) {
+  int numStates = DUP_BASE * DUP_COPIES;
+  mfsm_fsm fsm;
+  initDynamicFSM(&fsm, numStates, DUP_INPUTS, getDefaultAllocator());
+
+  int i = 0;
+  int j = 0;
+  for (; i < numStates; i++) {
+    addState(&fsm, i + 1);
+  }
+
+  for (i = 0; i < DUP_INPUTS; i++) {
+    addInput(&fsm, i + 1);
+  }
+
+  // Each transition of a base state leads into a random copy of the same
+  // destination
+  unsigned int seed = 777;
+  static int dest[DUP_BASE][DUP_INPUTS];
+  for (i = 0; i < DUP_BASE; i++) {
+    for (j = 0; j < DUP_INPUTS; j++) {
+      seed = seed * 1103515245u + 12345u;
+      dest[i][j] = (int)((seed >> 8) % DUP_BASE);
+    }
+  }
+
+  for (i = 0; i < numStates; i++) {
+    if (i % DUP_BASE % 3 == 0) {
+      setAcceptingState(&fsm, i + 1, 0, i % DUP_BASE % 4);
+    }
+
+    for (j = 0; j < DUP_INPUTS; j++) {
+      seed = seed * 1103515245u + 12345u;
+      int copy = (int)((seed >> 8) % DUP_COPIES);
+      addTransition(&fsm, j + 1, i + 1, copy * DUP_BASE + dest[i % DUP_BASE][j] + 1);
+    }
+  }
+  fsm.curState = 1;
+
+  mfsm_fsm min;
+  double start = nowNs();
+  int minStates = minimizeFSM(&fsm, &min);
+  double minimizeMs = (nowNs() - start) / 1e6;
+
+  int iterations = 2000000;
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    seed = seed * 1103515245u + 12345u;
+    doTransition(&fsm, (int)((seed >> 8) % DUP_INPUTS) + 1);
+  }
+  double fullNs = (nowNs() - start) / iterations;
+
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    seed = seed * 1103515245u + 12345u;
+    doTransition(&min, (int)((seed >> 8) % DUP_INPUTS) + 1);
+  }
+  double minNs = (nowNs() - start) / iterations;
+
+  benchSink += fsm.curState + min.curState;
+  printf("Minimization of %d states x %d inputs: %.1f ms\n",
+         numStates, DUP_INPUTS, minimizeMs);
+  printf("  generated %6d states %8zu KB  doTransition %6.2f ns\n",
+         numStates, transitionBytes(&fsm) / 1024, fullNs);
+  printf("  minimized %6d states %8zu KB  doTransition %6.2f ns\n",
+         minStates, transitionBytes(&min) / 1024, minNs);
+
+  freeFSM(&min);
+  freeFSM(&fsm);
+}
+
+#define NFA_TAIL 12
+
+// Subset construction of (a|b)*a(a|b){NFA_TAIL}, whose smallest DFA has
+// 2^(NFA_TAIL+1) states.
+void bench_determinize(void) {
+  mfsm_NFA nfa;
+  initNFA(&nfa, getDefaultAllocator());
+
+  int i = 1;
+  for (; i <= NFA_TAIL + 2; i++) {
+    addNFAState(&nfa, i);
+  }
+
+  addNFAEdge(&nfa, 1, 1, 1);
+  addNFAEdge(&nfa, 2, 1, 1);
+  addNFAEdge(&nfa, 1, 1, 2);
+  for (i = 2; i <= NFA_TAIL + 1; i++) {
+    addNFAEdge(&nfa, 1, i, i + 1);
+    addNFAEdge(&nfa, 2, i, i + 1);
+  }
+  setNFAAccepting(&nfa, NFA_TAIL + 2, 0, 1);
+
+  mfsm_fsm fsm;
+  initSparseFSM(&fsm, 1 << (NFA_TAIL + 1), 2, getDefaultAllocator());
+  double start = nowNs();
+  int states = determinizeNFA(&nfa, &fsm, 1, 1, 1 << 20);
+  double ms = (nowNs() - start) / 1e6;
+
+  printf("Subset construction, %d NFA states: %d DFA states in %.1f ms\n",
+         nfa.numStates, states, ms);
+
+  benchSink += states;
+  freeFSM(&fsm);
+  freeNFA(&nfa);
+}
+
+// Startup cost of a large machine: building and compiling it against
+// mapping an image of it saved earlier.
+void bench_loadImage(void) {
+  static mfsm_fsm fsm;
+  const char *path = "tests/bench_image.tmp";
+
+  double start = nowNs();
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+  double build = (nowNs() - start) / 1e3;
+  saveCompiledFSM(&c, path);
+
+  // Touch every row so both sides pay for the tables being paged in
+  start = nowNs();
+  mfsm_CompiledFSM img;
+  int status = mapCompiledFSM(&img, path);
+  int s = 0;
+  int i = 0;
+  for (; i < img.numStates; i++) {
+    s = stepCompiled(&img, i, s % MAX_INPUTS);
+  }
+  double map = (nowNs() - start) / 1e3;
+
+  printf("Startup, %d states: build+compile %.0f us  mapCompiledFSM %.0f us (status %d)\n",
+         MAX_STATES, build, map, status);
+
+  benchSink += s;
+  freeCompiledFSM(&img);
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+  remove(path);
+}
+
+#define CHECKPOINT_SESSIONS 1000000
+
+// Saving and restoring the runtime state of many sessions, against copying
+// whole FSM structs per session.
+void bench_checkpoint(void) {
+  mfsm_Instance *insts = malloc(sizeof(mfsm_Instance) * CHECKPOINT_SESSIONS);
+  int i = 0;
+  for (; i < CHECKPOINT_SESSIONS; i++) {
+    initInstance(&insts[i], (i % MAX_STATES) + 1, 0);
+  }
+
+  mfsm_EventListener el;
+  initEventListener(&el);
+  mfsm_Event e;
+  for (i = 0; i < MAX_EVENTS / 2; i++) {
+    initEvent(&e, i);
+    appendEvent(&el, e);
+  }
+  mfsm_EventListener *listeners[1] = {&el};
+
+  size_t size = getCheckpointSize(CHECKPOINT_SESSIONS, listeners, 1);
+  uint64_t *buf = malloc(size);
+
+  double start = nowNs();
+  saveCheckpoint(insts, CHECKPOINT_SESSIONS, listeners, 1, buf, size, 0);
+  double save = (nowNs() - start) / 1e6;
+
+  start = nowNs();
+  restoreCheckpoint(insts, CHECKPOINT_SESSIONS, listeners, 1, buf, size);
+  double restore = (nowNs() - start) / 1e6;
+
+  printf("Checkpoint, %d sessions: %.1f B/session (fixed FSM copy %zu B), save %.1f ms  restore %.1f ms\n",
+         CHECKPOINT_SESSIONS, (double)size / CHECKPOINT_SESSIONS,
+         sizeof(mfsm_fsm) + sizeof(mfsm_FixedStorage), save, restore);
+
+  benchSink += insts[CHECKPOINT_SESSIONS - 1].curState;
+  free(buf);
+  free(insts);
+}
+
+/****************************************
+* Events
+****************************************/
+
+#define SPSC_EVENTS 10000000
+
+// Consumer side of the SPSC benchmark. Drains events in bulk and checks they
+// arrive in order.
+static void *spscConsumer(void *arg) {
+  mfsm_EventListener *el = arg;
+  mfsm_Event out[MAX_EVENTS];
+  int expected = 0;
+  long errors = 0;
+
+  while (expected < SPSC_EVENTS) {
+    int n = getEvents(el, out, MAX_EVENTS);
+    if (n == 0) {
+      // Let the producer run if both threads share a core
+      sched_yield();
+    }
+
+    int i = 0;
+    for (; i < n; i++) {
+      errors += (out[i].id != expected);
+      expected++;
+    }
+  }
+
+  return (void*)errors;
+}
+
+void bench_spscListener(void) {
+  static mfsm_EventListener el;
+  initSPSCEventListener(&el);
+
+  pthread_t consumer;
+  double start = nowNs();
+  pthread_create(&consumer, 0, spscConsumer, &el);
+
+  // Producer side: wait while the queue is full
+  mfsm_Event e;
+  int i = 0;
+  for (; i < SPSC_EVENTS; i++) {
+    initEvent(&e, i);
+    while (appendEvent(&el, e) == -2) {
+      sched_yield();
+    }
+  }
+
+  void *errors = 0;
+  pthread_join(consumer, &errors);
+  double elapsed = nowNs() - start;
+
+  printf("SPSC listener, 2 threads: %6.1f M events/s%s\n",
+         SPSC_EVENTS / elapsed * 1e3,
+         errors == 0 ? "" : "  (EVENTS OUT OF ORDER)");
+}
+
+#define FANOUT_LISTENERS 16
+#define FANOUT_EVENTS 1000000
+
+// Fan-out of one Event to many readers: per-listener copies through
+// sendEventPtr() against one write to an EventBus read by as many cursors.
+// Readers drain after every MAX_EVENTS / 2 Events so listeners never fill.
+void bench_busFanout(void) {
+  static mfsm_EventListener listeners[FANOUT_LISTENERS];
+  static mfsm_EventBus bus;
+  mfsm_BusCursor cursors[FANOUT_LISTENERS];
+  mfsm_EventQueue eq;
+  mfsm_EventQueue busEq;
+  mfsm_Event e;
+  mfsm_Event out[MAX_EVENTS];
+  int batch = MAX_EVENTS / 2;
+  long sum = 0;
+
+  initEventQueue(&eq);
+  initEventQueue(&busEq);
+  initEventBus(&bus);
+  setEventBus(&busEq, &bus);
+
+  int i = 0;
+  for (; i < FANOUT_LISTENERS; i++) {
+    initEventListener(&listeners[i]);
+    addListener(&eq, &listeners[i]);
+    initBusCursor(&cursors[i], &bus);
+  }
+
+  double start = nowNs();
+  for (i = 0; i < FANOUT_EVENTS; i += batch) {
+    int j = 0;
+    for (; j < batch; j++) {
+      initEvent(&e, i + j);
+      sendEventPtr(&eq, e);
+    }
+    for (j = 0; j < FANOUT_LISTENERS; j++) {
+      sum += getEvents(&listeners[j], out, MAX_EVENTS);
+    }
+  }
+  double copies = (nowNs() - start) / FANOUT_EVENTS;
+
+  start = nowNs();
+  for (i = 0; i < FANOUT_EVENTS; i += batch) {
+    int j = 0;
+    for (; j < batch; j++) {
+      initEvent(&e, i + j);
+      sendEventPtr(&busEq, e);
+    }
+    for (j = 0; j < FANOUT_LISTENERS; j++) {
+      sum += readBusEvents(&cursors[j], out, MAX_EVENTS);
+    }
+  }
+  double shared = (nowNs() - start) / FANOUT_EVENTS;
+  benchSink += (int)sum;
+
+  printf("Fan-out to %d readers: listener copies %6.1f ns/event (%zu bytes), "
+         "EventBus %6.1f ns/event (%zu bytes)\n",
+         FANOUT_LISTENERS, copies, sizeof(listeners), shared, sizeof(bus));
+}
+
+#define CALLBACK_EVENTS 10000000
+
+// Callback for bench_callbackLatency(): the same work the polling side does
+// with each Event it drains.
+static void benchCallback(void *ctx, const mfsm_Event *e) {
+  *(long*)ctx += e->id;
+}
+
+// Time from sending an Event to a receiver having handled it. The polling
+// receiver checks its listener and drains it after every send; the callback
+// receiver is called from inside sendEventPtr().
+void bench_callbackLatency(void) {
+  static mfsm_EventListener el;
+  mfsm_EventQueue polled;
+  mfsm_EventQueue called;
+  mfsm_Event e;
+  mfsm_Event d;
+  long sum = 0;
+
+  initEventListener(&el);
+  initEventQueue(&polled);
+  addListener(&polled, &el);
+  initEventQueue(&called);
+  addCallback(&called, benchCallback, &sum);
+
+  double start = nowNs();
+  int i = 0;
+  for (; i < CALLBACK_EVENTS; i++) {
+    initEvent(&e, i);
+    sendEventPtr(&polled, e);
+    while (getNumEvents(&el) > 0) {
+      getNextEvent(&el, &d);
+      sum += d.id;
+    }
+  }
+  double poll = (nowNs() - start) / CALLBACK_EVENTS;
+
+  start = nowNs();
+  for (i = 0; i < CALLBACK_EVENTS; i++) {
+    initEvent(&e, i);
+    sendEventPtr(&called, e);
+  }
+  double callback = (nowNs() - start) / CALLBACK_EVENTS;
+  benchSink += (int)sum;
+
+  printf("Send to handled: poll-drain %6.2f ns  callback %6.2f ns\n",
+         poll, callback);
+}
+
+#define TYPED_EVENTS 1000000
+
+// Cost of sending an Event when each of MAX_EVENT_LISTENERS listeners wants
+// one type, against every listener receiving every Event and discarding the
+// ones it does not want.
+void bench_typedDispatch(void) {
+  static mfsm_EventListener listeners[MAX_EVENT_LISTENERS];
+  mfsm_EventQueue eq;
+  mfsm_Event e;
+  mfsm_Event out[MAX_EVENTS];
+  double elapsed[2];
+  long kept = 0;
+
+  int filtered = 0;
+  for (; filtered < 2; filtered++) {
+    initEventQueue(&eq);
+
+    int i = 0;
+    for (; i < MAX_EVENT_LISTENERS; i++) {
+      initEventListener(&listeners[i]);
+      if (filtered) {
+        setSubscriptions(&listeners[i], 1u << (i % MAX_EVENT_TYPES));
+      }
+      addListener(&eq, &listeners[i]);
+    }
+
+    double start = nowNs();
+    for (i = 0; i < TYPED_EVENTS; i++) {
+      initTypedEvent(&e, i, i % MAX_EVENT_TYPES);
+      sendEventPtr(&eq, e);
+
+      // Drain before any listener fills up, keeping only the wanted type
+      if (i % (MAX_EVENTS / 2) == 0) {
+        int j = 0;
+        for (; j < MAX_EVENT_LISTENERS; j++) {
+          int n = getEvents(&listeners[j], out, MAX_EVENTS);
+          int k = 0;
+          for (; k < n; k++) {
+            kept += (out[k].type == j % MAX_EVENT_TYPES);
+          }
+        }
+      }
+    }
+    elapsed[filtered] = (nowNs() - start) / TYPED_EVENTS;
+  }
+  benchSink += (int)kept;
+
+  printf("Typed dispatch, %d listeners: unfiltered %6.1f ns/event  "
+         "subscriptions %6.1f ns/event\n",
+         MAX_EVENT_LISTENERS, elapsed[0], elapsed[1]);
+}
+
+#ifdef MFSM_TIMING
+/****************************************
+* Timing
+****************************************/
+
+// Cost of timing transitions: the same steps with and without histograms
+// attached, and the latencies they recorded. Every transition sends an
+// Event to a callback so both phases are timed.
+void bench_timing(void) {
+  static mfsm_fsm fsm;
+  buildRandomFSM(&fsm, MAX_STATES, MAX_INPUTS);
+
+  mfsm_Event e;
+  int s = 1;
+  int n = 1;
+  for (; s <= MAX_STATES; s++) {
+    for (n = 1; n <= MAX_INPUTS; n++) {
+      initEvent(&e, n);
+      setTransitionOutput(&fsm, n, s, e);
+    }
+  }
+
+  long sum = 0;
+  addCallback(&fsm.eq, benchCallback, &sum);
+
+  static mfsm_Timing timing;
+  initTiming(&timing);
+
+  int iterations = 2000000;
+  int i = 0;
+  double start = nowNs();
+  for (; i < iterations; i++) {
+    doTransition(&fsm, (i % MAX_INPUTS) + 1);
+  }
+  double plain = (nowNs() - start) / iterations;
+
+  fsm.timing = &timing;
+  start = nowNs();
+  for (i = 0; i < iterations; i++) {
+    doTransition(&fsm, (i % MAX_INPUTS) + 1);
+  }
+  double timed = (nowNs() - start) / iterations;
+
+  printf("Timing, %d states: doTransition %6.2f ns  timed %6.2f ns (+%.2f ns)\n",
+         MAX_STATES, plain, timed, timed - plain);
+  printf("  transition p50 %llu  p99 %llu  p99.9 %llu  max %llu %s\n",
+         (unsigned long long)getPercentile(&timing.transition, 50),
+         (unsigned long long)getPercentile(&timing.transition, 99),
+         (unsigned long long)getPercentile(&timing.transition, 99.9),
+         (unsigned long long)timing.transition.max, MFSM_TIMER_UNITS);
+  printf("  dispatch   p50 %llu  p99 %llu  p99.9 %llu  max %llu %s\n",
+         (unsigned long long)getPercentile(&timing.dispatch, 50),
+         (unsigned long long)getPercentile(&timing.dispatch, 99),
+         (unsigned long long)getPercentile(&timing.dispatch, 99.9),
+         (unsigned long long)timing.dispatch.max, MFSM_TIMER_UNITS);
+
+  benchSink += (int)sum + fsm.curState;
+  freeFSM(&fsm);
+}
+#endif //MFSM_TIMING
+
+int main(int argc, char **argv) {
+  printf("Running benchmarks...\n\n");
+
+  bench_idLookup(8, 7);
+  bench_idLookup(128, 7);
+  bench_idLookup(4096, 7);
+  bench_idLookup(128, 256);
+  bench_idLookup(4096, 256);
+
+  bench_compiledStep();
+  bench_sparseStorage();
+  bench_batchTransition();
+  bench_manySessions();
+  bench_stepPool();
+  bench_scanBytes();
+  bench_minimize();
+  bench_determinize();
+  bench_loadImage();
+  bench_checkpoint();
+
+  bench_spscListener();
+  bench_busFanout();
+  bench_callbackLatency();
+  bench_typedDispatch();
+
+#ifdef MFSM_TIMING
+  bench_timing();
+#endif
+
+  return 0;
+}
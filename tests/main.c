@@ -1,6 +1,20 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "test.h"
 #include "microFSM.h"
 #include "event.h"
+#include "idmap.h"
+#include "compiled.h"
+#include "pool.h"
+#include "scanner.h"
+#include "minimize.h"
+#include "nfa.h"
+#include "image.h"
+#include "loader.h"
+#include "checkpoint.h"
+#include "stats.h"
+#include "timing.h"
 
 // Utility function tests
 
@@ -9,11 +23,14 @@ void test_getStateIndex(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.states[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to get the correct index
   int i = getStateIndex(fsm, 7);
   assertMsg(i == 4, "The returned state index was incorrect");
 
+  freeFSM(&fsm);
+
   report("getStateIndex()");
 }
 
@@ -22,14 +39,328 @@ void test_getInputIndex(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.inputs[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to get the correct index
   int i = getInputIndex(fsm, 7);
   assertMsg(i == 4, "The returned input index was incorrect");
 
+  freeFSM(&fsm);
+
   report("getInputIndex()");
 }
 
+void test_getStateIndexPtr(void) {
+  // Create a mock fsm and state
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  fsm.states[4] = 7;
+  reindexFSM(&fsm);
+
+  // Attempt to get the correct index without copying the FSM
+  int i = getStateIndexPtr(&fsm, 7);
+  assertMsg(i == 4, "The returned state index was incorrect");
+
+  i = getStateIndexPtr(&fsm, 8);
+  assertMsg(i == -1, "A missing state returned an index");
+
+  freeFSM(&fsm);
+
+  report("getStateIndexPtr()");
+}
+
+void test_getInputIndexPtr(void) {
+  // Create a mock fsm and input
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  fsm.inputs[4] = 7;
+  reindexFSM(&fsm);
+
+  // Attempt to get the correct index without copying the FSM
+  int i = getInputIndexPtr(&fsm, 7);
+  assertMsg(i == 4, "The returned input index was incorrect");
+
+  i = getInputIndexPtr(&fsm, 8);
+  assertMsg(i == -1, "A missing input returned an index");
+
+  freeFSM(&fsm);
+
+  report("getInputIndexPtr()");
+}
+
+void test_idMap(void) {
+  // Create a small table so that the IDs are forced to collide
+  int ids[6] = {3, 11, 19, 27, 35, 43};
+  int slots[8];
+  idMapClear(slots, 8);
+
+  int i = 0;
+  for (; i < 6; i++) {
+    idMapInsert(slots, 8, ids, i);
+  }
+
+  // Every ID should be found at its index
+  for (i = 0; i < 6; i++) {
+    assertMsg(idMapFind(slots, 8, ids, ids[i]) == i, "An ID was not found at its index");
+  }
+
+  assertMsg(idMapFind(slots, 8, ids, 4) == -1, "A missing ID was found");
+
+  // Remove from the middle of the probe sequences and search again
+  i = idMapRemove(slots, 8, ids, 11);
+  assertMsg(i == 0, "The ID could not be removed");
+  ids[1] = 0;
+
+  i = idMapRemove(slots, 8, ids, 27);
+  assertMsg(i == 0, "The ID could not be removed");
+  ids[3] = 0;
+
+  assertMsg(idMapFind(slots, 8, ids, 11) == -1, "A removed ID was found");
+  assertMsg(idMapFind(slots, 8, ids, 27) == -1, "A removed ID was found");
+  assertMsg(idMapFind(slots, 8, ids, 3) == 0, "An ID was lost after removal");
+  assertMsg(idMapFind(slots, 8, ids, 19) == 2, "An ID was lost after removal");
+  assertMsg(idMapFind(slots, 8, ids, 35) == 4, "An ID was lost after removal");
+  assertMsg(idMapFind(slots, 8, ids, 43) == 5, "An ID was lost after removal");
+
+  // IDs with a power of two stride should still spread across the table.
+  // Hashing them all to a few home slots would give one run of 128 slots.
+  int strides[2] = {256, 16};
+  int strided[128];
+  int bigSlots[256];
+  int s = 0;
+  for (; s < 2; s++) {
+    idMapClear(bigSlots, 256);
+    for (i = 0; i < 128; i++) {
+      strided[i] = (i + 1) * strides[s];
+      idMapInsert(bigSlots, 256, strided, i);
+    }
+
+    int run = 0;
+    int longest = 0;
+    for (i = 0; i < 256; i++) {
+      run = (bigSlots[i] != 0) ? run + 1 : 0;
+      longest = (run > longest) ? run : longest;
+    }
+
+    assertMsg(longest <= 16, "Strided IDs formed a long probe sequence");
+
+    for (i = 0; i < 128; i++) {
+      assertMsg(idMapFind(bigSlots, 256, strided, strided[i]) == i, "A strided ID was not found at its index");
+    }
+
+    for (i = 0; i < 128; i += 2) {
+      assertMsg(idMapRemove(bigSlots, 256, strided, strided[i]) == 0, "A strided ID could not be removed");
+    }
+
+    for (i = 0; i < 128; i++) {
+      assertMsg(idMapFind(bigSlots, 256, strided, strided[i]) == ((i % 2) ? i : -1), "A strided ID was wrong after removal");
+    }
+  }
+
+  report("idMap*()");
+}
+
+void test_reindexFSM(void) {
+  // Create an fsm and write to the arrays directly
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  fsm.states[3] = 12;
+  fsm.inputs[2] = 5;
+
+  // The lookup tables do not know about the IDs yet
+  assertMsg(getStateIndexPtr(&fsm, 12) == -1, "Unindexed state was found");
+
+  reindexFSM(&fsm);
+  assertMsg(getStateIndexPtr(&fsm, 12) == 3, "The state was not reindexed");
+  assertMsg(getInputIndexPtr(&fsm, 5) == 2, "The input was not reindexed");
+
+  // States added and removed through the API stay indexed
+  addState(&fsm, 40);
+  removeState(&fsm, 12);
+  assertMsg(getStateIndexPtr(&fsm, 12) == -1, "A removed state was found");
+  assertMsg(isValidStateIDPtr(&fsm, 40) == 0, "An added state was not found");
+
+  freeFSM(&fsm);
+
+  report("reindexFSM()");
+}
+
+// Allocator which counts its outstanding allocations
+static int liveAllocations = 0;
+
+static void *countingAlloc(void *ctx, size_t size) {
+  liveAllocations++;
+  return malloc(size);
+}
+
+static void countingRelease(void *ctx, void *ptr) {
+  liveAllocations--;
+  free(ptr);
+}
+
+void test_initDynamicFSM(void) {
+  mfsm_Allocator a;
+  a.alloc = countingAlloc;
+  a.release = countingRelease;
+  a.ctx = 0;
+
+  // Start with room for a tiny machine
+  mfsm_fsm fsm;
+  int i = initDynamicFSM(&fsm, 3, 2, &a);
+  assertMsg(i == 0, "The FSM could not be initialized");
+  assertMsg(fsm.maxStates == 3, "The state capacity hint was not used");
+  assertMsg(fsm.maxInputs == 2, "The input capacity hint was not used");
+
+  // Grow well past the fixed size limits
+  int numStates = 2000;
+  int numInputs = 40;
+  int errors = 0;
+  for (i = 1; i <= numStates; i++) {
+    errors += (addState(&fsm, i) != 0);
+  }
+
+  for (i = 1; i <= numInputs; i++) {
+    errors += (addInput(&fsm, i) != 0);
+  }
+
+  assertMsg(errors == 0, "IDs could not be added after growing");
+
+  // Add a transition chain, then grow the inputs again and check it survived
+  for (i = 1; i < numStates; i++) {
+    errors += (addTransition(&fsm, (i % numInputs) + 1, i, i + 1) != 0);
+  }
+
+  for (i = numInputs + 1; i <= numInputs * 2; i++) {
+    errors += (addInput(&fsm, i) != 0);
+  }
+
+  for (i = 1; i < numStates; i++) {
+    errors += (isValidTransitionPtr(&fsm, (i % numInputs) + 1, i) != 0);
+    errors += (getTransition(&fsm, (i % numInputs) + 1, i)->dest != i + 1);
+  }
+
+  assertMsg(errors == 0, "Transitions were lost while growing");
+
+  fsm.curState = 1;
+  assertMsg(doTransition(&fsm, 2) == 2, "The grown FSM could not transition");
+
+  freeFSM(&fsm);
+  assertMsg(liveAllocations == 0, "Memory was not released");
+
+  // Allocators without an alloc callback are refused
+  a.alloc = 0;
+  assertMsg(initDynamicFSM(&fsm, 3, 2, &a) == -1, "An invalid allocator was accepted");
+
+  report("initDynamicFSM()");
+}
+
+void test_initSparseFSM(void) {
+  // Build the same machine with dense and sparse storage
+  mfsm_fsm dense;
+  mfsm_fsm sparse;
+  initDynamicFSM(&dense, 4, 2, getDefaultAllocator());
+  int i = initSparseFSM(&sparse, 4, 2, getDefaultAllocator());
+  assertMsg(i == 0, "The sparse FSM could not be initialized");
+
+  mfsm_fsm *fsms[2] = {&dense, &sparse};
+  mfsm_Event e;
+  initEvent(&e, 11);
+
+  int f = 0;
+  for (; f < 2; f++) {
+    for (i = 1; i <= 50; i++) {
+      addState(fsms[f], i);
+    }
+
+    for (i = 1; i <= 8; i++) {
+      addInput(fsms[f], i);
+    }
+
+    // Add transitions out of order so the edge lists have to be sorted
+    addTransition(fsms[f], 5, 1, 2);
+    addTransition(fsms[f], 2, 1, 3);
+    addTransition(fsms[f], 8, 1, 4);
+    addTransition(fsms[f], 1, 2, 1);
+    addTransition(fsms[f], 3, 3, 1);
+    setTransitionOutput(fsms[f], 2, 1, e);
+    setTransitionOutput(fsms[f], 7, 4, e); // Output without a destination
+    removeTransition(fsms[f], 8, 1);
+
+    // Growing the states array has to keep the edge lists
+    for (i = 51; i <= 200; i++) {
+      addState(fsms[f], i);
+    }
+  }
+
+  // Both FSMs should agree on every state/input pair
+  int mismatches = 0;
+  int s = 1;
+  for (; s <= 200; s++) {
+    for (i = 1; i <= 8; i++) {
+      mismatches += (isValidTransitionPtr(&dense, i, s) !=
+                     isValidTransitionPtr(&sparse, i, s));
+    }
+  }
+  assertMsg(mismatches == 0, "Sparse and dense storage disagreed");
+
+  const mfsm_Transition *t = getTransition(&sparse, 2, 1);
+  assertMsg(t != 0 && t->dest == 3, "The sparse transition was incorrect");
+  assertMsg(getTransitionOutput(&sparse, 2, 1) != 0 && getTransitionOutput(&sparse, 2, 1)->id == 11, "The sparse output Event was incorrect");
+
+  // Only pairs with a transition or an output are stored
+  assertMsg(sparse.edges[getStateIndexPtr(&sparse, 1)].numEdges == 2, "Removed transitions were kept");
+  assertMsg(getTransition(&sparse, 4, 1) == 0, "An empty transition was stored");
+
+  // Transitions and output Events behave the same way when executed
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&sparse.eq, &el);
+
+  sparse.curState = 1;
+  assertMsg(doTransition(&sparse, 2) == 3, "The sparse FSM did not transition");
+  assertMsg(el.numEvents == 1, "The sparse output Event was not sent");
+  assertMsg(doTransition(&sparse, 6) == 3, "A missing transition changed state");
+
+  sparse.curState = 4;
+  assertMsg(doTransition(&sparse, 7) == 4, "An output-only transition changed state");
+  assertMsg(el.numEvents == 2, "An output-only transition did not send its Event");
+
+  // Clearing the output removes the last trace of the pair
+  clearTransitionOutput(&sparse, 7, 4);
+  assertMsg(getTransition(&sparse, 7, 4) == 0, "A cleared transition was kept");
+
+  freeFSM(&dense);
+  freeFSM(&sparse);
+
+  report("initSparseFSM()");
+}
+
+void test_initFixedFSM(void) {
+  static mfsm_FixedStorage storage;
+  mfsm_fsm fsm;
+  initFixedFSM(&fsm, &storage);
+
+  // Fill the states array; the fixed storage cannot grow
+  int i = 1;
+  int errors = 0;
+  for (; i <= MAX_STATES; i++) {
+    errors += (addState(&fsm, i) != 0);
+  }
+
+  assertMsg(errors == 0, "The fixed storage could not be filled");
+  assertMsg(addState(&fsm, MAX_STATES + 1) == -3, "The fixed storage grew");
+
+  // The FSM still works normally
+  addInput(&fsm, 1);
+  addTransition(&fsm, 1, 1, 2);
+  fsm.curState = 1;
+  assertMsg(doTransition(&fsm, 1) == 2, "The fixed FSM could not transition");
+
+  freeFSM(&fsm);
+
+  report("initFixedFSM()");
+}
+
 // FSM Interface function tests
 
 void test_isValidStateID(void) {
@@ -37,11 +368,14 @@ void test_isValidStateID(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.states[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to verify the transition
   int i = isValidStateID(fsm, 7);
   assertMsg(i == 0, "The state was considered invalid");
 
+  freeFSM(&fsm);
+
   report("isValidStateID()");
 }
 
@@ -50,11 +384,14 @@ void test_isValidInputID(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.inputs[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to verify the input ID
   int i = isValidInputID(fsm, 7);
   assertMsg(i == 0, "The input was considered invalid");
 
+  freeFSM(&fsm);
+
   report("isValidInputID()");
 }
 
@@ -65,7 +402,8 @@ void test_isValidTransition(void) {
   fsm.inputs[4] = 7;            // Input
   fsm.states[9] = 2;            // Source state
   fsm.states[8] = 6;            // Destination state
-  fsm.destinations[4][9].dest = 6;   // Make the associations
+  fsm.destinations[4 * fsm.maxStates + 9].dest = 6; // Make the associations
+  reindexFSM(&fsm);
 
   // Attempt to verify the transition
   int i = isValidTransition(fsm, 7, 2);
@@ -74,9 +412,45 @@ void test_isValidTransition(void) {
     printf("Returned: %d\n", i);
   }
 
+  freeFSM(&fsm);
+
   report("isValidTransition()");
 }
 
+void test_isValidIDPtr(void) {
+  // Create a mock fsm, input, source state, and destination state
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  fsm.inputs[4] = 7;            // Input
+  fsm.states[9] = 2;            // Source state
+  fsm.states[8] = 6;            // Destination state
+  fsm.destinations[4 * fsm.maxStates + 9].dest = 6; // Make the associations
+  reindexFSM(&fsm);
+
+  // Attempt to verify the IDs and transition through the pointer API
+  int i = isValidStateIDPtr(&fsm, 2);
+  assertMsg(i == 0, "The state was considered invalid");
+
+  i = isValidStateIDPtr(&fsm, 3);
+  assertMsg(i != 0, "A missing state was considered valid");
+
+  i = isValidInputIDPtr(&fsm, 7);
+  assertMsg(i == 0, "The input was considered invalid");
+
+  i = isValidInputIDPtr(&fsm, 3);
+  assertMsg(i != 0, "A missing input was considered valid");
+
+  i = isValidTransitionPtr(&fsm, 7, 2);
+  assertMsg(i == 0, "The transition was considered invalid");
+
+  i = isValidTransitionPtr(&fsm, 7, 6);
+  assertMsg(i == -3, "A transition without a destination was considered valid");
+
+  freeFSM(&fsm);
+
+  report("isValid*Ptr()");
+}
+
 void test_addState(void) {
   // Create a mock fsm
   mfsm_fsm fsm;
@@ -89,6 +463,26 @@ void test_addState(void) {
     printf("Returned: %d\n", i);
   }
 
+  // Freed slots are reused lowest first, and the array still grows when full
+  int s = 8;
+  for (; s < 8 + MAX_STATES; s++) {
+    addState(&fsm, s);
+  }
+  removeState(&fsm, 20);
+  removeState(&fsm, 10);
+  addState(&fsm, 1000);
+  addState(&fsm, 1001);
+  assertMsg(getStateIndexPtr(&fsm, 1000) == 3 && getStateIndexPtr(&fsm, 1001) == 13, "A freed state slot was not reused");
+  assertMsg(addState(&fsm, 1002) == 0 && getStateIndexPtr(&fsm, 1002) == MAX_STATES + 1, "The states array did not grow");
+
+  // Slots cleared directly are found again after reindexFSM()
+  fsm.states[5] = MIN_STATE_ID-1;
+  reindexFSM(&fsm);
+  addState(&fsm, 1003);
+  assertMsg(getStateIndexPtr(&fsm, 1003) == 5, "A slot freed before reindexFSM() was not reused");
+
+  freeFSM(&fsm);
+
   report("addState()");
 }
 
@@ -97,6 +491,7 @@ void test_removeState(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.states[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to remove a state
   int i = removeState(&fsm, 7);
@@ -107,9 +502,65 @@ void test_removeState(void) {
     assertMsg(fsm.states[4] < MIN_STATE_ID, "Index was not reset after  supposed removal");
   }
 
+  freeFSM(&fsm);
+
   report("removeState()");
 }
 
+void test_setAcceptingState(void) {
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+
+  assertMsg(getAcceptingState(&fsm, 2) == 0, "A new state was accepting");
+  assertMsg(setAcceptingState(&fsm, 2, 5, 42) == 0, "The state could not be marked accepting");
+
+  const mfsm_Accept *a = getAcceptingState(&fsm, 2);
+  assertMsg(a != 0 && a->priority == 5 && a->tag == 42, "The accepting state information was not stored");
+  assertMsg(getAcceptingState(&fsm, 1) == 0, "The wrong state was marked accepting");
+  assertMsg(setAcceptingState(&fsm, 9, 0, 0) == -1, "An invalid state was marked accepting");
+
+  // Growing the FSM keeps the flags
+  int i = 3;
+  for (; i < 3 + MAX_STATES; i++) {
+    addState(&fsm, i);
+  }
+  a = getAcceptingState(&fsm, 2);
+  assertMsg(a != 0 && a->tag == 42, "The accepting state was lost when the FSM grew");
+
+  // The flags are part of the compiled FSM
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+  int si = getCompiledStateIndex(&c, 2);
+  assertMsg(c.accepts[si].accepting && c.accepts[si].tag == 42, "The accepting state was not compiled");
+  assertMsg(!c.accepts[getCompiledStateIndex(&c, 1)].accepting, "A plain state was compiled as accepting");
+  freeCompiledFSM(&c);
+
+  // Removing and re-adding a state clears the flag
+  removeState(&fsm, 2);
+  addState(&fsm, 2);
+  assertMsg(getAcceptingState(&fsm, 2) == 0, "A re-added state was still accepting");
+
+  freeFSM(&fsm);
+
+  report("setAcceptingState()");
+}
+
+void test_clearAcceptingState(void) {
+  mfsm_fsm fsm;
+  mfsm_FixedStorage storage;
+  initFixedFSM(&fsm, &storage);
+  addState(&fsm, 1);
+  setAcceptingState(&fsm, 1, 0, 3);
+
+  assertMsg(clearAcceptingState(&fsm, 1) == 0, "The accepting state could not be cleared");
+  assertMsg(getAcceptingState(&fsm, 1) == 0, "The state was still accepting");
+  assertMsg(clearAcceptingState(&fsm, 9) == -1, "An invalid state was cleared");
+
+  report("clearAcceptingState()");
+}
+
 void test_addInput(void) {
   // Create a mock fsm
   mfsm_fsm fsm;
@@ -122,6 +573,18 @@ void test_addInput(void) {
     printf("Returned: %d\n", i);
   }
 
+  // Freed slots are reused lowest first, and the array still grows when full
+  int n = 8;
+  for (; n < 8 + MAX_INPUTS; n++) {
+    addInput(&fsm, n);
+  }
+  removeInput(&fsm, 12);
+  addInput(&fsm, 1000);
+  assertMsg(getInputIndexPtr(&fsm, 1000) == 5, "A freed input slot was not reused");
+  assertMsg(addInput(&fsm, 1001) == 0 && getInputIndexPtr(&fsm, 1001) == MAX_INPUTS + 1, "The inputs array did not grow");
+
+  freeFSM(&fsm);
+
   report("addInput()");
 }
 
@@ -130,6 +593,7 @@ void test_removeInput(void) {
   mfsm_fsm fsm;
   initFSM(&fsm);
   fsm.inputs[4] = 7;
+  reindexFSM(&fsm);
 
   // Attempt to remove an input
   int i = removeInput(&fsm, 7);
@@ -140,6 +604,8 @@ void test_removeInput(void) {
     assertMsg(fsm.inputs[4] < MIN_INPUT_ID, "Index was not reset after  supposed removal");
   }
 
+  freeFSM(&fsm);
+
   report("removeInput()");
 }
 
@@ -150,6 +616,7 @@ void test_addTransition(void) {
   fsm.inputs[4] = 7;            // Input
   fsm.states[9] = 2;            // Source state
   fsm.states[8] = 6;            // Destination state
+  reindexFSM(&fsm);
 
   // Attempt to create the transition
   int i = addTransition(&fsm, 7, 2, 6);
@@ -159,12 +626,14 @@ void test_addTransition(void) {
   }
 
   // Test whether the transition is stored in the destinations array
-  int d = fsm.destinations[4][9].dest;
+  int d = getTransition(&fsm, 7, 2)->dest;
   assertMsg(d == 6, "The stored destination ID was incorrect");
   if (d != 6) {
     printf("Value: %d\n", d);
   }
 
+  freeFSM(&fsm);
+
   report("addTransition()");
 }
 
@@ -175,6 +644,7 @@ void test_removeTransition(void) {
   fsm.inputs[4] = 7;            // Input
   fsm.states[9] = 2;            // Source state
   fsm.states[8] = 6;            // Destination state
+  reindexFSM(&fsm);
 
   // Attempt to create the transition
   int i = addTransition(&fsm, 7, 2, 6);
@@ -191,9 +661,11 @@ void test_removeTransition(void) {
   }
 
   // Test whether the transition was removed from the destinations array
-  int d = isValidStateID(fsm, fsm.destinations[4][9].dest);
+  int d = isValidStateID(fsm, getTransition(&fsm, 7, 2)->dest);
   assertMsg(d != 0, "The stored destination ID was still valid");
 
+  freeFSM(&fsm);
+
   report("removeTransition()");
 }
 
@@ -214,6 +686,7 @@ void test_removeTransitionAll(void) {
   fsm.states[1] = 4;
   fsm.states[3] = 5;
   fsm.states[5] = 6;
+  reindexFSM(&fsm);
 
   // Create the transitions
   addTransition(&fsm, 7, 1, 4);
@@ -228,15 +701,17 @@ void test_removeTransitionAll(void) {
   }
 
   // Test whether the transitions were removed from the destinations array
-  int d = isValidStateID(fsm, fsm.destinations[3][2].dest);
+  int d = isValidStateID(fsm, getTransition(&fsm, 7, 1)->dest);
   assertMsg(d != 0, "The stored destination ID #1 was still valid");
 
-  d = isValidStateID(fsm, fsm.destinations[3][4].dest);
+  d = isValidStateID(fsm, getTransition(&fsm, 7, 2)->dest);
   assertMsg(d != 0, "The stored destination ID #2 was still valid");
 
-  d = isValidStateID(fsm, fsm.destinations[3][6].dest);
+  d = isValidStateID(fsm, getTransition(&fsm, 7, 3)->dest);
   assertMsg(d != 0, "The stored destination ID #3 was still valid");
 
+  freeFSM(&fsm);
+
   report("removeTransitionAll()");
 }
 
@@ -254,9 +729,68 @@ void test_setTransitionOutput(void) {
   initEvent(&e, 4);
 
   // Set the output Event
-  setTransitionOutput(&fsm, 2, 7, e);
+  int i = setTransitionOutput(&fsm, 2, 7, e);
+  assertMsg(i == 0, "The output Event could not be set");
+
+  // Test whether the Event is stored in the transition
+  assertMsg(getTransitionOutput(&fsm, 2, 7)->id == 4, "The stored output Event was incorrect");
+
+  // Equal Events share one entry in the outputs table
+  addTransition(&fsm, 2, 9, 7);
+  setTransitionOutput(&fsm, 2, 9, e);
+  assertMsg(fsm.numOutputs == 1 && getTransitionOutput(&fsm, 2, 9) == getTransitionOutput(&fsm, 2, 7), "An equal Event was stored twice");
+
+  setEventData(&e, "x", 1);
+  setTransitionOutput(&fsm, 2, 9, e);
+  assertMsg(fsm.numOutputs == 2 && getTransitionOutput(&fsm, 2, 9)->data[0] == 'x', "A different Event was not stored");
+  assertMsg(getTransitionOutput(&fsm, 2, 7)->data[0] == 0, "Another transition's Event was changed");
+
+  // Replacing an output frees the old Event's entry for reuse. The new Event
+  // is added before the old one is released, so three entries get used.
+  for (i = 0; i < 1000; i++) {
+    initEvent(&e, 100 + i);
+    setTransitionOutput(&fsm, 2, 9, e);
+  }
+  assertMsg(fsm.numOutputs == 3 && getTransitionOutput(&fsm, 2, 9)->id == 1099, "A replaced output Event was kept");
+
+  // The table grows past its starting size
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    addState(&fsm, 100 + i);
+    initEvent(&e, 100 + i);
+    setTransitionOutput(&fsm, 2, 100 + i, e);
+  }
+  int same = 1;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    same &= (getTransitionOutput(&fsm, 2, 100 + i)->id == 100 + i);
+  }
+  assertMsg(same && fsm.numOutputs == MAX_OUTPUTS + 2 && fsm.maxOutputs > MAX_OUTPUTS, "The outputs table did not grow");
+  assertMsg(getTransitionOutput(&fsm, 2, 7)->id == 4 && getTransitionOutput(&fsm, 2, 9)->id == 1099, "Outputs were lost when the table grew");
+
+  freeFSM(&fsm);
+
+  // Fixed storage holds at most MAX_OUTPUTS distinct Events at once
+  static mfsm_FixedStorage storage;
+  initFixedFSM(&fsm, &storage);
+  addInput(&fsm, 2);
+  for (i = 0; i <= MAX_OUTPUTS; i++) {
+    addState(&fsm, 1 + i);
+  }
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    initEvent(&e, 100 + i);
+    setTransitionOutput(&fsm, 2, 1 + i, e);
+  }
+  initEvent(&e, 99);
+  assertMsg(setTransitionOutput(&fsm, 2, MAX_OUTPUTS + 1, e) == -3, "A full outputs table was not reported");
+  assertMsg(getTransitionOutput(&fsm, 2, MAX_OUTPUTS + 1) == 0, "A failed call set an output Event");
 
-  // TODO: Test the output of this function.
+  // Cleared outputs make room again
+  clearTransitionOutput(&fsm, 2, 1);
+  assertMsg(setTransitionOutput(&fsm, 2, MAX_OUTPUTS + 1, e) == 0, "A cleared output Event was not freed");
+  assertMsg(getTransitionOutput(&fsm, 2, MAX_OUTPUTS + 1)->id == 99 && getTransitionOutput(&fsm, 2, 2)->id == 101, "Outputs were mixed up when an entry was reused");
+
+  assertMsg(sizeof(mfsm_Transition) == 2 * sizeof(int), "Transitions hold more than an index for their Event");
+
+  report("setTransitionOutput()");
 }
 
 void test_clearTransitionOutput(void) {
@@ -276,9 +810,15 @@ void test_clearTransitionOutput(void) {
   setTransitionOutput(&fsm, 2, 7, e);
 
   // Clear the output Event
-  clearTransitionOutput(&fsm, 2, 7);
+  int i = clearTransitionOutput(&fsm, 2, 7);
+  assertMsg(i == 0, "The output Event could not be cleared");
+
+  // Test whether the Event was removed from the transition
+  assertMsg(getTransitionOutput(&fsm, 2, 7) == 0, "The output Event was not cleared");
+
+  freeFSM(&fsm);
 
-  // TODO: Test the output of this function.
+  report("clearTransitionOutput()");
 }
 
 void test_doTransition(void) {
@@ -288,6 +828,7 @@ void test_doTransition(void) {
   fsm.inputs[4] = 7;            // Input
   fsm.states[9] = 2;            // Source state
   fsm.states[8] = 6;            // Destination state
+  reindexFSM(&fsm);
   fsm.curState = 2;
 
   // Create an event listener and test Event
@@ -326,117 +867,2081 @@ void test_doTransition(void) {
   getNextEvent(&el, &next);
   assertMsg(next.id == e.id, "Received Event ID does not match output Event");
 
+  freeFSM(&fsm);
+
   report("doTransition()");
 }
 
 
-/****************************************
-* Test Event System
-****************************************/
-void test_initEvent(void) {
-  // Initialize an event
+void test_doInstanceTransition(void) {
+  // Create a shared definition with a two state loop
+  mfsm_fsm def;
+  initFSM(&def);
+  addState(&def, 1);
+  addState(&def, 2);
+  addInput(&def, 5);
+  addTransition(&def, 5, 1, 2);
+  addTransition(&def, 5, 2, 1);
+
   mfsm_Event e;
-  initEvent(&e, 7);
+  initEvent(&e, 30);
+  setTransitionOutput(&def, 5, 1, e);
 
-  // Test if it was properly initialized
-  assertMsg(e.id == 7, "Event ID was not properly initialized");
-  if (e.id != 7) {
-    printf("Value: %d\n", e.id);
-  }
+  // Create two instances, only one of which has listeners
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&eq, &el);
 
-  report("initEvent()");
-}
+  mfsm_Instance a;
+  mfsm_Instance b;
+  initInstance(&a, 1, &eq);
+  initInstance(&b, 2, 0);
 
-void test_appendEvent(void) {
-  // Create some Events and an EventListener
-  mfsm_Event e1;
-  mfsm_Event e2;
-  initEvent(&e1, 7);
-  initEvent(&e2, 9);
+  // Step both instances and make sure they do not affect each other
+  int i = doInstanceTransition(&def, &a, 5);
+  assertMsg(i == 2, "Instance A did not transition");
+  assertMsg(a.curInput == 5, "Instance A's input was not recorded");
+  assertMsg(el.numEvents == 1, "Instance A's output Event was not sent");
 
-  mfsm_EventListener el;
-  initEventListener(&el);
+  i = doInstanceTransition(&def, &b, 5);
+  assertMsg(i == 1, "Instance B did not transition");
+  assertMsg(a.curState == 2, "Instance B changed Instance A's state");
+  assertMsg(el.numEvents == 1, "Instance B sent an Event without a queue");
 
-  // Add the event to the listener
-  appendEvent(&el, e1);
-  appendEvent(&el, e2);
+  // Invalid inputs leave the instance untouched
+  i = doInstanceTransition(&def, &b, 9);
+  assertMsg(i == -1, "An invalid input was accepted");
+  assertMsg(b.curState == 1, "An invalid input changed state");
 
-  // Test if the events were added to the queue.
-  assertMsg(el.events[0].id == 7, "Event #1 was not successfully appended");
-  assertMsg(el.numEvents == 1, "numEvents was not updated");
-  assertMsg(el.events[1].id == 9, "Event #2 was not successfully appended");
-  assertMsg(el.numEvents == 2, "numEvents was not updated");
+  freeFSM(&def);
 
-  report("appendEvent()");
+  report("doInstanceTransition()");
 }
 
-void test_getNextEvent(void) {
-  // Create some Events and an EventListener
-  mfsm_Event e1;
-  mfsm_Event e2;
-  initEvent(&e1, 7);
-  initEvent(&e2, 9);
+void test_doTransitionBatch(void) {
+  // Create a three state loop with an output Event
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addState(&fsm, 3);
+  addInput(&fsm, 5);
+  addInput(&fsm, 6);
+  addTransition(&fsm, 5, 1, 2);
+  addTransition(&fsm, 5, 2, 3);
+  addTransition(&fsm, 5, 3, 1);
+
+  mfsm_Event e;
+  initEvent(&e, 30);
+  setTransitionOutput(&fsm, 5, 3, e);
 
   mfsm_EventListener el;
   initEventListener(&el);
+  addListener(&fsm.eq, &el);
+  fsm.curState = 1;
+
+  // Run the whole batch, recording the trajectory
+  int inputs[6] = {5, 5, 6, 5, 5, 5};
+  int trajectory[6];
+  size_t done = 99;
+  int i = doTransitionBatch(&fsm, inputs, 6, trajectory, &done);
+  assertMsg(i == 0, "The batch was not successful");
+  assertMsg(done == 6, "Not every input was executed");
+  assertMsg(trajectory[0] == 2 && trajectory[1] == 3 && trajectory[2] == 3 &&
+            trajectory[3] == 1 && trajectory[4] == 2 && trajectory[5] == 3,
+            "The recorded trajectory was incorrect");
+  assertMsg(fsm.curState == 3, "The current state was not updated");
+  assertMsg(fsm.curInput == 5, "The current input was not updated");
+  assertMsg(el.numEvents == 1, "The output Event was not sent");
+
+  // Stop at the first invalid input
+  int bad[4] = {5, 5, 9, 5};
+  i = doTransitionBatch(&fsm, bad, 4, 0, &done);
+  assertMsg(i == -1, "An invalid input was accepted");
+  assertMsg(done == 2, "The index of the invalid input was incorrect");
+  assertMsg(fsm.curState == 2, "The inputs before the invalid one were not executed");
+
+  freeFSM(&fsm);
+
+  report("doTransitionBatch()");
+}
 
-  // Add the event to the listener
-  appendEvent(&el, e1);
-  appendEvent(&el, e2);
+/****************************************
+* Test Compiled FSMs
+****************************************/
+void test_compileFSM(void) {
+  // Create an FSM with a gap in the states array and an output Event
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 7);
+  addState(&fsm, 8);
+  addState(&fsm, 9);
+  removeState(&fsm, 8);
+  addInput(&fsm, 2);
+  addInput(&fsm, 3);
+  addTransition(&fsm, 2, 7, 9);
+  addTransition(&fsm, 2, 9, 7);
 
-  // Test if the events were added to the queue.
-  assertMsg(el.events[0].id == 7, "Event #1 was not successfully appended");
-  assertMsg(el.numEvents == 1, "numEvents was not updated");
-  assertMsg(el.events[1].id == 9, "Event #2 was not successfully appended");
-  assertMsg(el.numEvents == 2, "numEvents was not updated");
+  mfsm_Event e;
+  initEvent(&e, 4);
+  setTransitionOutput(&fsm, 2, 9, e);
 
-  // Try to retrieve the events and retest them
-  mfsm_Event d;
-  getNextEvent(&el, &d);
-  assertMsg(d.id == 9, "Event #2 was not successfully retrieved");
-  assertMsg(el.numEvents == 1, "numEvents was not updated");
+  mfsm_CompiledFSM c;
+  int i = compileFSM(&fsm, &c);
 
-  getNextEvent(&el, &d);
-  assertMsg(d.id == 7, "Event #1 was not successfully retrieved");
-  assertMsg(el.numEvents == 0, "numEvents was not updated");
+  // The compiled FSM does not depend on the original
+  freeFSM(&fsm);
 
-  report("getNextEvent()");
-}
+  assertMsg(i == 0, "The FSM could not be compiled");
+  if (i != 0) {
+    printf("Returned: %d\n", i);
+    report("compileFSM()");
+    return;
+  }
 
-void test_initEventQueue(void) {
-  // Initialize an EventQueue
-  mfsm_EventQueue eq;
-  initEventQueue(&eq);
+  // Only tracked IDs are given dense indices
+  assertMsg(c.numStates == 2, "The number of compiled states was incorrect");
+  assertMsg(c.numInputs == 2, "The number of compiled inputs was incorrect");
+  assertMsg(getCompiledStateIndex(&c, 8) == -1, "A removed state was compiled");
 
-  // Test if it was properly initialized
-  assertMsg(eq.numListeners == 0, "EventQueue was not properly initialized");
-  if (eq.numListeners != 0) {
-    printf("Value: %d\n", eq.numListeners);
+  int s7 = getCompiledStateIndex(&c, 7);
+  int s9 = getCompiledStateIndex(&c, 9);
+  int n2 = getCompiledInputIndex(&c, 2);
+  int n3 = getCompiledInputIndex(&c, 3);
+  assertMsg(s7 >= 0 && s9 >= 0 && n2 >= 0 && n3 >= 0, "An ID was not compiled");
+  assertMsg(c.stateIDs[s9] == 9, "The dense index did not map back to its ID");
+
+  // Step through the transitions
+  assertMsg(stepCompiled(&c, s7, n2) == s9, "The compiled transition was incorrect");
+  assertMsg(stepCompiled(&c, s9, n2) == s7, "The compiled transition was incorrect");
+  assertMsg(stepCompiled(&c, s7, n3) == s7, "A missing transition changed state");
+
+  // Check the output Events
+  const mfsm_Event *out = getCompiledOutput(&c, s9, n2);
+  assertMsg(out != 0 && out->id == 4, "The output Event was not compiled");
+  assertMsg(getCompiledOutput(&c, s7, n2) == 0, "An output Event was invented");
+
+  freeCompiledFSM(&c);
+
+  freeFSM(&fsm);
+
+  // More transitions with outputs than MAX_COMPILED_INDEX compile as long as
+  // they send few distinct Events
+  mfsm_Event shared;
+  initEvent(&shared, 4);
+  initFSM(&fsm);
+  int s = 1;
+  int n = 1;
+  for (; s <= 300; s++) {
+    addState(&fsm, s);
+  }
+  for (; n <= 256; n++) {
+    addInput(&fsm, n);
+    for (s = 1; s <= 300; s++) {
+      addTransition(&fsm, n, s, s % 300 + 1);
+      setTransitionOutput(&fsm, n, s, shared);
+    }
   }
 
-  assertMsg(eq.listeners[3] == 0, "EventQueue was not properly initialized");
-  if (eq.listeners[3] != 0) {
-    printf("Value: %p\n", eq.listeners[3]);
+  i = compileFSM(&fsm, &c);
+  assertMsg(i == 0 && c.numEvents == 1, "Shared output Events were not compiled once");
+  if (i == 0) {
+    out = getCompiledOutput(&c, getCompiledStateIndex(&c, 300), getCompiledInputIndex(&c, 256));
+    assertMsg(out != 0 && out->id == 4, "A shared output Event was not compiled");
+    freeCompiledFSM(&c);
   }
 
-  report("initEventQueue()");
+  freeFSM(&fsm);
+
+  report("compileFSM()");
 }
 
-void test_addListener(void) {
-  // Create some EventListeners and an EventQueue
-  mfsm_EventListener el1;
-  mfsm_EventListener el2;
-  initEventListener(&el1);
-  initEventListener(&el2);
+void test_doCompiledTransition(void) {
+  // Create and compile a two state loop
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addInput(&fsm, 5);
+  addTransition(&fsm, 5, 1, 2);
+  addTransition(&fsm, 5, 2, 1);
 
-  mfsm_EventQueue eq;
+  mfsm_Event e;
+  initEvent(&e, 30);
+  setTransitionOutput(&fsm, 5, 2, e);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&eq, &el);
+
+  mfsm_Instance inst;
+  initInstance(&inst, 1, &eq);
+
+  // Step around the loop
+  int i = doCompiledTransition(&c, &inst, 5);
+  assertMsg(i == 2, "The instance did not transition");
+  assertMsg(el.numEvents == 0, "An output Event was invented");
+
+  i = doCompiledTransition(&c, &inst, 5);
+  assertMsg(i == 1, "The instance did not transition back");
+  assertMsg(el.numEvents == 1, "The output Event was not sent");
+
+  i = doCompiledTransition(&c, &inst, 6);
+  assertMsg(i == -1, "An invalid input was accepted");
+
+  freeCompiledFSM(&c);
+
+  freeFSM(&fsm);
+
+  report("doCompiledTransition()");
+}
+
+void test_doCompiledTransitionBatch(void) {
+  // Create and compile a three state loop
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addState(&fsm, 3);
+  addInput(&fsm, 5);
+  addInput(&fsm, 6);
+  addTransition(&fsm, 5, 1, 2);
+  addTransition(&fsm, 5, 2, 3);
+  addTransition(&fsm, 5, 3, 1);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+  freeFSM(&fsm);
+
+  mfsm_Instance inst;
+  initInstance(&inst, 1, 0);
+
+  int inputs[5] = {5, 6, 5, 7, 5};
+  int trajectory[5];
+  size_t done = 99;
+  int i = doCompiledTransitionBatch(&c, &inst, inputs, 5, trajectory, &done);
+  assertMsg(i == -1, "An invalid input was accepted");
+  assertMsg(done == 3, "The index of the invalid input was incorrect");
+  assertMsg(trajectory[0] == 2 && trajectory[1] == 2 && trajectory[2] == 3,
+            "The recorded trajectory was incorrect");
+  assertMsg(inst.curState == 3, "The current state was not updated");
+
+  freeCompiledFSM(&c);
+
+  report("doCompiledTransitionBatch()");
+}
+
+// Callback for the output Event ordering test: records the state and input
+// of the instance as the Event is sent
+typedef struct stateCallbackCtx {
+  const mfsm_Instance *inst;
+  int state;
+  int input;
+} stateCallbackCtx;
+
+static void stateCallback(void *ctx, const mfsm_Event *e) {
+  stateCallbackCtx *c = ctx;
+  c->state = c->inst->curState;
+  c->input = c->inst->curInput;
+}
+
+void test_transitionOutputOrder(void) {
+  // Create a two state loop with an output Event on the first transition
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addInput(&fsm, 5);
+  addTransition(&fsm, 5, 1, 2);
+  addTransition(&fsm, 5, 2, 1);
+
+  mfsm_Event e;
+  initEvent(&e, 30);
+  setTransitionOutput(&fsm, 5, 1, e);
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  mfsm_Instance inst;
+  stateCallbackCtx ctx = {&inst, 0, 0};
+  addCallback(&eq, stateCallback, &ctx);
+
+  // Listeners should see the instance already in its new state on every path
+  int inputs[1] = {5};
+  initInstance(&inst, 1, &eq);
+  doInstanceTransition(&fsm, &inst, 5);
+  assertMsg(ctx.state == 2 && ctx.input == 5, "doInstanceTransition() sent the Event before changing state");
+
+  ctx.state = 0;
+  initInstance(&inst, 1, &eq);
+  doInstanceTransitionBatch(&fsm, &inst, inputs, 1, 0, 0);
+  assertMsg(ctx.state == 2 && ctx.input == 5, "doInstanceTransitionBatch() sent the Event before changing state");
+
+  ctx.state = 0;
+  initInstance(&inst, 1, &eq);
+  doCompiledTransition(&c, &inst, 5);
+  assertMsg(ctx.state == 2 && ctx.input == 5, "doCompiledTransition() sent the Event before changing state");
+
+  ctx.state = 0;
+  initInstance(&inst, 1, &eq);
+  doCompiledTransitionBatch(&c, &inst, inputs, 1, 0, 0);
+  assertMsg(ctx.state == 2 && ctx.input == 5, "doCompiledTransitionBatch() sent the Event before changing state");
+
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+
+  report("*Transition() output order");
+}
+
+void test_stepCompiledMany(void) {
+  // Build a machine where every state/input pair goes somewhere different
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  int i = 1;
+  for (; i <= 13; i++) {
+    addState(&fsm, i);
+  }
+  for (i = 1; i <= 5; i++) {
+    addInput(&fsm, i);
+  }
+  int s = 1;
+  for (; s <= 13; s++) {
+    for (i = 1; i <= 5; i++) {
+      addTransition(&fsm, i, s, (s * 7 + i * 3) % 13 + 1);
+    }
+  }
+
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+  freeFSM(&fsm);
+
+  // An odd count exercises the scalar tail after the vector loop
+  enum { SESSIONS = 1003 };
+  static int states[SESSIONS];
+  static int scalar[SESSIONS];
+  static int inputs[SESSIONS];
+  for (i = 0; i < SESSIONS; i++) {
+    states[i] = scalar[i] = i % c.numStates;
+    inputs[i] = (i / 3) % c.numInputs;
+  }
+
+  int errors = 0;
+  int step = 0;
+  for (; step < 4; step++) {
+    assertMsg(stepCompiledMany(&c, states, inputs, SESSIONS) == 0, "Sessions could not be stepped");
+    for (i = 0; i < SESSIONS; i++) {
+      scalar[i] = stepCompiled(&c, scalar[i], inputs[i]);
+      errors += (states[i] != scalar[i]);
+    }
+  }
+  assertMsg(errors == 0, "Sessions were stepped to the wrong states");
+
+  // The scalar fallback agrees as well
+  stepCompiledManyScalar(&c, scalar, inputs, SESSIONS);
+  stepCompiledMany(&c, states, inputs, SESSIONS);
+  assertMsg(memcmp(states, scalar, sizeof(states)) == 0, "The scalar fallback disagreed");
+
+  assertMsg(stepCompiledMany(0, states, inputs, 1) == -1, "A null compiled FSM was stepped");
+  assertMsg(stepCompiledMany(&c, 0, inputs, 1) == -2, "Null states were stepped");
+  assertMsg(stepCompiledManyScalar(&c, states, 0, 1) == -2, "Null inputs were stepped");
+
+  freeCompiledFSM(&c);
+
+  report("stepCompiledMany()");
+}
+
+// Counts the states tracked by an FSM.
+static int countStates(const mfsm_fsm *fsm) {
+  int n = 0;
+  int i = 0;
+  for (; i < fsm->maxStates; i++) {
+    n += (fsm->states[i] >= MIN_STATE_ID);
+  }
+
+  return n;
+}
+
+void test_minimizeFSM(void) {
+  // 2 and 3 behave the same, 5 cannot be reached
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  int s = 1;
+  for (; s <= 5; s++) {
+    addState(&fsm, s);
+  }
+  addInput(&fsm, 1);
+  addInput(&fsm, 2);
+  addTransition(&fsm, 1, 1, 2);
+  addTransition(&fsm, 2, 1, 3);
+  for (s = 2; s <= 5; s++) {
+    addTransition(&fsm, 1, s, 4);
+    addTransition(&fsm, 2, s, 4);
+  }
+  setAcceptingState(&fsm, 4, 0, 7);
+  fsm.curState = 1;
+
+  mfsm_fsm min;
+  assertMsg(minimizeFSM(&fsm, &min) == 3, "The equivalent states were not merged");
+  assertMsg(isValidStateIDPtr(&min, 3) != 0 && isValidStateIDPtr(&min, 5) != 0, "A merged or unreachable state was kept");
+  assertMsg(getTransition(&min, 2, 1)->dest == 2, "A transition was not redirected to the merged state");
+  assertMsg(getAcceptingState(&min, 4) != 0 && getAcceptingState(&min, 4)->tag == 7, "The accepting state was lost");
+  assertMsg(min.curState == 1, "The current state was not kept");
+  freeFSM(&min);
+
+  // Different output Events keep states apart
+  mfsm_Event e;
+  initEvent(&e, 9);
+  setTransitionOutput(&fsm, 1, 2, e);
+  assertMsg(minimizeFSM(&fsm, &min) == 4, "States with different outputs were merged");
+  assertMsg(getTransitionOutput(&min, 1, 2)->id == 9, "The output Event was not kept");
+  freeFSM(&min);
+
+  // So do different tags
+  clearTransitionOutput(&fsm, 1, 2);
+  addTransition(&fsm, 1, 3, 5);
+  addTransition(&fsm, 2, 3, 5);
+  setAcceptingState(&fsm, 5, 0, 8);
+  assertMsg(minimizeFSM(&fsm, &min) == 5, "Accepting states with different tags were merged");
+  freeFSM(&min);
+  freeFSM(&fsm);
+
+  // Generated machine: 8 copies of a random 16 state machine, with every
+  // transition leading into a random copy of its destination
+  int base = 16;
+  int copies = 8;
+  int inputs = 4;
+  initFSM(&fsm);
+  for (s = 1; s <= base * copies; s++) {
+    addState(&fsm, s);
+  }
+  int n = 1;
+  for (; n <= inputs; n++) {
+    addInput(&fsm, n);
+  }
+
+  unsigned int seed = 99;
+  int dest[16][4];
+  int b = 0;
+  for (; b < base; b++) {
+    for (n = 0; n < inputs; n++) {
+      seed = seed * 1103515245u + 12345u;
+      dest[b][n] = (seed >> 8) % base;
+    }
+  }
+
+  for (s = 0; s < base * copies; s++) {
+    b = s % base;
+    if (b % 3 == 0) {
+      setAcceptingState(&fsm, s + 1, 0, b % 2);
+    }
+
+    for (n = 0; n < inputs; n++) {
+      seed = seed * 1103515245u + 12345u;
+      int copy = (seed >> 8) % copies;
+      addTransition(&fsm, n + 1, s + 1, copy * base + dest[b][n] + 1);
+    }
+
+    if (b % 4 == 0) {
+      initEvent(&e, 100 + b % 8);
+      setTransitionOutput(&fsm, 1, s + 1, e);
+    }
+  }
+  fsm.curState = 1;
+
+  int states = minimizeFSM(&fsm, &min);
+  assertMsg(states > 0 && states <= base, "The generated machine was not minimized");
+  assertMsg(countStates(&min) == states && min.maxStates < fsm.maxStates, "The transition table did not shrink");
+
+  // Both machines behave the same on a random walk
+  int same = 1;
+  int i = 0;
+  for (; i < 1000; i++) {
+    seed = seed * 1103515245u + 12345u;
+    n = (seed >> 8) % inputs + 1;
+    const mfsm_Event *t = getTransitionOutput(&fsm, n, fsm.curState);
+    const mfsm_Event *u = getTransitionOutput(&min, n, min.curState);
+    same &= ((t == 0) == (u == 0)) && (t == 0 || t->id == u->id);
+
+    doTransition(&fsm, n);
+    doTransition(&min, n);
+    const mfsm_Accept *x = getAcceptingState(&fsm, fsm.curState);
+    const mfsm_Accept *y = getAcceptingState(&min, min.curState);
+    same &= ((x == 0) == (y == 0)) && (x == 0 || x->tag == y->tag);
+  }
+  assertMsg(same, "The minimized machine behaved differently");
+
+  freeFSM(&min);
+  freeFSM(&fsm);
+
+  assertMsg(minimizeFSM(0, &min) == -2, "A null FSM was minimized");
+
+  report("minimizeFSM()");
+}
+
+void test_addNFAState(void) {
+  mfsm_NFA nfa;
+  assertMsg(initNFA(&nfa, getDefaultAllocator()) == 0, "NFA could not be initialized");
+  assertMsg(initNFA(&nfa, 0) == -1, "An NFA without an allocator was initialized");
+  initNFA(&nfa, getDefaultAllocator());
+
+  int s = 1;
+  int failed = 0;
+  for (; s <= 100; s++) {
+    failed += (addNFAState(&nfa, s) != 0);
+  }
+  assertMsg(failed == 0 && nfa.numStates == 100, "The states could not be added");
+  assertMsg(addNFAState(&nfa, 50) == -1, "A duplicate state was added");
+  assertMsg(addNFAState(&nfa, MIN_STATE_ID-1) == -1, "An invalid state was added");
+  assertMsg(setNFAAccepting(&nfa, 50, 1, 2) == 0 && nfa.accepts[49].tag == 2, "The state could not be marked accepting");
+  assertMsg(setNFAAccepting(&nfa, 101, 1, 2) == -1, "A missing state was marked accepting");
+
+  freeNFA(&nfa);
+
+  report("addNFAState()");
+}
+
+void test_addNFAEdge(void) {
+  mfsm_NFA nfa;
+  initNFA(&nfa, getDefaultAllocator());
+  addNFAState(&nfa, 1);
+  addNFAState(&nfa, 2);
+
+  assertMsg(addNFAEdge(&nfa, 1, 1, 2) == 0, "The edge could not be added");
+  assertMsg(addNFAEdge(&nfa, 1, 1, 1) == 0, "A second edge for the same input could not be added");
+  assertMsg(addNFAEdge(&nfa, NFA_EPSILON, 2, 1) == 0, "An epsilon edge could not be added");
+  assertMsg(nfa.numEdges == 3 && nfa.edges[2].input == NFA_EPSILON, "The edges were not stored");
+  assertMsg(addNFAEdge(&nfa, -5, 1, 2) == -1, "An invalid input was accepted");
+  assertMsg(addNFAEdge(&nfa, 1, 3, 2) == -2, "An invalid source state was accepted");
+  assertMsg(addNFAEdge(&nfa, 1, 1, 3) == -3, "An invalid destination state was accepted");
+
+  freeNFA(&nfa);
+
+  report("addNFAEdge()");
+}
+
+void test_determinizeNFA(void) {
+  // (a|b)*abb, with input 1 as 'a' and input 2 as 'b'
+  mfsm_NFA nfa;
+  initNFA(&nfa, getDefaultAllocator());
+  int s = 1;
+  for (; s <= 8; s++) {
+    addNFAState(&nfa, s);
+  }
+  addNFAEdge(&nfa, NFA_EPSILON, 1, 2);
+  addNFAEdge(&nfa, 1, 2, 2);
+  addNFAEdge(&nfa, 2, 2, 2);
+  addNFAEdge(&nfa, 1, 2, 3);
+  addNFAEdge(&nfa, 2, 3, 4);
+  addNFAEdge(&nfa, 2, 4, 5);
+  setNFAAccepting(&nfa, 5, 0, 1);
+
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  // Sets {1,2}, {2}, {2,3}, {2,4} and {2,5}; the first two are equivalent
+  assertMsg(determinizeNFA(&nfa, &fsm, 1, 100, 64) == 5, "Each set of states was not built exactly once");
+  assertMsg(fsm.curState == 100, "The start set was not made the current state");
+
+  mfsm_fsm min;
+  assertMsg(minimizeFSM(&fsm, &min) == 4, "The result could not be minimized");
+  freeFSM(&min);
+
+  int inputs[4] = {1, 2, 1, 2};
+  doTransitionBatch(&fsm, inputs, 4, 0, 0);
+  assertMsg(getAcceptingState(&fsm, fsm.curState) == 0, "\"abab\" was accepted");
+  doTransition(&fsm, 2);
+  assertMsg(getAcceptingState(&fsm, fsm.curState) != 0, "\"ababb\" was not accepted");
+  freeFSM(&fsm);
+
+  // Add "ab" with a higher priority, and "b" with the same priority
+  addNFAEdge(&nfa, 1, 2, 6);
+  addNFAEdge(&nfa, 2, 6, 7);
+  addNFAEdge(&nfa, 2, 2, 8);
+  setNFAAccepting(&nfa, 7, 1, 2);
+  setNFAAccepting(&nfa, 8, 0, 3);
+
+  initFSM(&fsm);
+  int states = determinizeNFA(&nfa, &fsm, 1, 100, 64);
+  assertMsg(states > 0, "The NFA could not be determinized");
+
+  // Plugs into the compiled form and the scanner
+  mfsm_CompiledFSM c;
+  compileFSM(&fsm, &c);
+  int byteInputs[SCANNER_BYTES];
+  int b = 0;
+  for (; b < SCANNER_BYTES; b++) {
+    byteInputs[b] = 0;
+  }
+  byteInputs['a'] = 1;
+  byteInputs['b'] = 2;
+
+  mfsm_Scanner sc;
+  initScanner(&sc, &c, byteInputs, 0, 0);
+  mfsm_Match matches[4];
+  size_t n = 0;
+  int state = 100;
+  scanMatches(&sc, &state, (const uint8_t*)"babb", 4, matches, 4, &n, 0);
+  assertMsg(n == 3, "The wrong number of matches was found");
+  assertMsg(matches[0].offset == 0 && matches[0].tag == 3, "\"b\" was not matched");
+  assertMsg(matches[1].offset == 2 && matches[1].tag == 2, "The higher priority tag was not kept");
+  assertMsg(matches[2].offset == 3 && matches[2].tag == 1, "A tie did not go to the first state added");
+  freeScanner(&sc);
+  freeCompiledFSM(&c);
+
+  // The state cap, bad arguments and clashing IDs
+  mfsm_fsm other;
+  initFSM(&other);
+  assertMsg(determinizeNFA(&nfa, &other, 1, 100, states - 1) == -3, "The state cap was not enforced");
+  assertMsg(determinizeNFA(&nfa, &other, 9, 100, 64) == -2, "An invalid start state was accepted");
+  assertMsg(determinizeNFA(&nfa, &fsm, 1, 100, 64) == -4, "State IDs already in use were added again");
+  freeFSM(&other);
+  freeFSM(&fsm);
+  freeNFA(&nfa);
+
+  report("determinizeNFA()");
+}
+
+// Compiles a recogniser for "ab": state 3 is reached right after each match.
+// Input 1 is 'a', input 2 is 'b' and input 3 is any other byte.
+static void buildScanFSM(mfsm_CompiledFSM *c, int *byteInputs) {
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addState(&fsm, 3);
+  addInput(&fsm, 1);
+  addInput(&fsm, 2);
+  addInput(&fsm, 3);
+
+  int s = 1;
+  for (; s <= 3; s++) {
+    addTransition(&fsm, 1, s, 2);
+    addTransition(&fsm, 2, s, (s == 2) ? 3 : 1);
+    addTransition(&fsm, 3, s, 1);
+  }
+
+  compileFSM(&fsm, c);
+  freeFSM(&fsm);
+
+  int b = 0;
+  for (; b < SCANNER_BYTES; b++) {
+    byteInputs[b] = 3;
+  }
+  byteInputs['a'] = 1;
+  byteInputs['b'] = 2;
+}
+
+void test_initScanner(void) {
+  mfsm_CompiledFSM c;
+  int byteInputs[SCANNER_BYTES];
+  buildScanFSM(&c, byteInputs);
+
+  mfsm_Scanner sc;
+  int accepting[1] = {3};
+  assertMsg(initScanner(&sc, &c, byteInputs, accepting, 1) == 0, "Scanner could not be built");
+  assertMsg(sc.firstAccepting == 2 && sc.stateIDs[2] == 3, "Accepting states were not numbered last");
+  assertMsg(sc.next[0 * SCANNER_BYTES + 'a'] == 1, "The byte map was not folded into the table");
+
+  // Bytes without a valid input leave the state alone
+  byteInputs['z'] = 99;
+  mfsm_Scanner other;
+  initScanner(&other, &c, byteInputs, accepting, 1);
+  assertMsg(other.next[1 * SCANNER_BYTES + 'z'] == 1, "An unmapped byte changed the state");
+  freeScanner(&other);
+
+  int missing[1] = {8};
+  assertMsg(initScanner(&other, &c, byteInputs, missing, 1) == -3, "An unknown accepting state was accepted");
+  assertMsg(initScanner(&other, &c, 0, accepting, 1) == -2, "A null byte map was accepted");
+  assertMsg(initScanner(&other, 0, byteInputs, accepting, 1) == -2, "A null compiled FSM was accepted");
+
+  // The scanner does not need the compiled FSM afterwards
+  freeCompiledFSM(&c);
+  int state = 1;
+  size_t n = 0;
+  size_t offsets[4];
+  scanBytes(&sc, &state, (const uint8_t*)"ab", 2, offsets, 4, &n, 0);
+  assertMsg(n == 1, "The scanner depended on the compiled FSM");
+
+  freeScanner(&sc);
+
+  report("initScanner()");
+}
+
+void test_scanBytes(void) {
+  mfsm_CompiledFSM c;
+  int byteInputs[SCANNER_BYTES];
+  buildScanFSM(&c, byteInputs);
+
+  mfsm_Scanner sc;
+  int accepting[1] = {3};
+  initScanner(&sc, &c, byteInputs, accepting, 1);
+  freeCompiledFSM(&c);
+
+  const uint8_t *text = (const uint8_t*)"xxabab.ab";
+  size_t offsets[8];
+  size_t n = 0;
+  size_t done = 0;
+  int state = 1;
+  assertMsg(scanBytes(&sc, &state, text, 9, offsets, 8, &n, &done) == 0, "The buffer could not be scanned");
+  assertMsg(n == 3 && offsets[0] == 3 && offsets[1] == 5 && offsets[2] == 8, "The matches were reported at the wrong offsets");
+  assertMsg(done == 9 && state == 3, "The final state was incorrect");
+
+  // A match split across two buffers is still found
+  state = 1;
+  scanBytes(&sc, &state, text, 3, offsets, 8, &n, 0);
+  assertMsg(n == 0 && state == 2, "The first piece was scanned incorrectly");
+  scanBytes(&sc, &state, text + 3, 6, offsets, 8, &n, 0);
+  assertMsg(n == 3 && offsets[0] == 0, "The split match was not found");
+
+  // A full offsets buffer stops before the match that does not fit
+  state = 1;
+  assertMsg(scanBytes(&sc, &state, text, 9, offsets, 2, &n, &done) == -3, "A full offsets buffer was not reported");
+  assertMsg(n == 2 && done == 8 && state == 2, "Scanning did not stop before the extra match");
+  scanBytes(&sc, &state, text + done, 9 - done, offsets, 2, &n, 0);
+  assertMsg(n == 1 && offsets[0] == 0, "Scanning could not be resumed");
+
+  state = 7;
+  assertMsg(scanBytes(&sc, &state, text, 9, offsets, 8, &n, 0) == -2, "An invalid state was accepted");
+  assertMsg(scanBytes(0, &state, text, 9, offsets, 8, &n, 0) == -1, "A null scanner was accepted");
+
+  freeScanner(&sc);
+
+  report("scanBytes()");
+}
+
+void test_scanMatches(void) {
+  mfsm_CompiledFSM c;
+  int byteInputs[SCANNER_BYTES];
+
+  // "ab" ends in state 3, any 'c' in state 4
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  int s = 1;
+  for (; s <= 4; s++) {
+    addState(&fsm, s);
+  }
+  for (s = 1; s <= 4; s++) {
+    addInput(&fsm, s);
+  }
+  for (s = 1; s <= 4; s++) {
+    addTransition(&fsm, 1, s, 2);
+    addTransition(&fsm, 2, s, (s == 2) ? 3 : 1);
+    addTransition(&fsm, 3, s, 4);
+    addTransition(&fsm, 4, s, 1);
+  }
+  setAcceptingState(&fsm, 3, 0, 10);
+  setAcceptingState(&fsm, 4, 1, 20);
+  compileFSM(&fsm, &c);
+  freeFSM(&fsm);
+
+  int b = 0;
+  for (; b < SCANNER_BYTES; b++) {
+    byteInputs[b] = 4;
+  }
+  byteInputs['a'] = 1;
+  byteInputs['b'] = 2;
+  byteInputs['c'] = 3;
+
+  // Accepting states come from the compiled FSM; none need listing
+  mfsm_Scanner sc;
+  assertMsg(initScanner(&sc, &c, byteInputs, 0, 0) == 0, "Scanner could not be built");
+  assertMsg(sc.firstAccepting == 2, "The FSM's accepting states were not used");
+  freeCompiledFSM(&c);
+
+  const uint8_t *text = (const uint8_t*)"abxcab";
+  mfsm_Match matches[4];
+  size_t n = 0;
+  size_t done = 0;
+  int state = 1;
+  assertMsg(scanMatches(&sc, &state, text, 6, matches, 4, &n, &done) == 0, "The buffer could not be scanned");
+  assertMsg(n == 3, "The wrong number of matches was found");
+  assertMsg(matches[0].offset == 1 && matches[0].state == 3 && matches[0].tag == 10, "The first match was incorrect");
+  assertMsg(matches[1].offset == 3 && matches[1].state == 4 && matches[1].tag == 20, "The second match was incorrect");
+  assertMsg(matches[2].offset == 5 && matches[2].tag == 10, "The third match was incorrect");
+  assertMsg(done == 6 && state == 3, "The final state was incorrect");
+
+  // A full match buffer stops before the match that does not fit
+  state = 1;
+  assertMsg(scanMatches(&sc, &state, text, 6, matches, 1, &n, &done) == -3, "A full match buffer was not reported");
+  assertMsg(n == 1 && done == 3, "Scanning did not stop before the extra match");
+
+  state = 9;
+  assertMsg(scanMatches(&sc, &state, text, 6, matches, 4, &n, 0) == -2, "An invalid state was accepted");
+  assertMsg(scanMatches(0, &state, text, 6, matches, 4, &n, 0) == -1, "A null scanner was accepted");
+
+  freeScanner(&sc);
+
+  report("scanMatches()");
+}
+
+// Compiles a machine where sessions in state 1 emit Event 40 on input 1
+static void buildPoolFSM(mfsm_CompiledFSM *c) {
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  int i = 1;
+  for (; i <= 6; i++) {
+    addState(&fsm, i);
+  }
+  addInput(&fsm, 1);
+  addInput(&fsm, 2);
+  int s = 1;
+  for (; s <= 6; s++) {
+    addTransition(&fsm, 1, s, s % 6 + 1);
+    addTransition(&fsm, 2, s, (s + 2) % 6 + 1);
+  }
+
+  mfsm_Event e;
+  initEvent(&e, 40);
+  setTransitionOutput(&fsm, 1, 1, e);
+
+  compileFSM(&fsm, c);
+  freeFSM(&fsm);
+}
+
+void test_initStepPool(void) {
+  mfsm_StepPool pool;
+  assertMsg(initStepPool(&pool, 4) == 0, "StepPool could not be started");
+  assertMsg(pool.numWorkers == 4 && pool.workers[3].index == 3, "StepPool was not properly initialized");
+  assertMsg(offsetof(mfsm_PoolWorker, end) - offsetof(mfsm_PoolWorker, next) >= MFSM_CACHE_LINE, "A worker's stolen and owned fields share a cache line");
+  freeStepPool(&pool);
+
+  assertMsg(initStepPool(&pool, 0) == -2, "A StepPool without workers was started");
+  assertMsg(initStepPool(&pool, MAX_POOL_WORKERS + 1) == -2, "Too many workers were started");
+  assertMsg(initStepPool(0, 1) == -1, "A null StepPool was started");
+
+  report("initStepPool()");
+}
+
+void test_runStepPool(void) {
+  mfsm_CompiledFSM c;
+  buildPoolFSM(&c);
+
+  // Several chunks, the last one partial
+  enum { POOL_SESSIONS = POOL_CHUNK_SESSIONS * 5 + 123 };
+  static int states[POOL_SESSIONS];
+  static int expected[POOL_SESSIONS];
+  static int inputs[POOL_SESSIONS];
+  int i = 0;
+  for (; i < POOL_SESSIONS; i++) {
+    states[i] = expected[i] = i % c.numStates;
+    inputs[i] = (i % 7 == 0);
+  }
+
+  mfsm_StepPool pool;
+  initStepPool(&pool, 3);
+
+  int errors = 0;
+  int step = 0;
+  for (; step < 3; step++) {
+    assertMsg(runStepPool(&pool, &c, states, inputs, POOL_SESSIONS) == 0, "Sessions could not be stepped");
+    stepCompiledManyScalar(&c, expected, inputs, POOL_SESSIONS);
+    errors += memcmp(states, expected, sizeof(states)) != 0;
+  }
+  assertMsg(errors == 0, "The pool stepped sessions to the wrong states");
+
+  // A pool of one worker runs on the calling thread
+  mfsm_StepPool single;
+  initStepPool(&single, 1);
+  runStepPool(&single, &c, states, inputs, POOL_SESSIONS);
+  stepCompiledManyScalar(&c, expected, inputs, POOL_SESSIONS);
+  assertMsg(memcmp(states, expected, sizeof(states)) == 0, "A single worker stepped the wrong states");
+  freeStepPool(&single);
+
+  assertMsg(runStepPool(0, &c, states, inputs, 1) == -1, "A null StepPool was run");
+  assertMsg(runStepPool(&pool, 0, states, inputs, 1) == -2, "A null compiled FSM was run");
+  assertMsg(runStepPool(&pool, &c, states, 0, 1) == -3, "Null inputs were run");
+
+  freeStepPool(&pool);
+  freeCompiledFSM(&c);
+
+  report("runStepPool()");
+}
+
+void test_setPoolEventBuffer(void) {
+  mfsm_CompiledFSM c;
+  buildPoolFSM(&c);
+
+  enum { POOL_SESSIONS = POOL_CHUNK_SESSIONS * 4 };
+  static int states[POOL_SESSIONS];
+  static int inputs[POOL_SESSIONS];
+  int i = 0;
+  int expected = 0;
+  for (; i < POOL_SESSIONS; i++) {
+    states[i] = i % c.numStates;
+    inputs[i] = 0;
+    expected += (c.stateIDs[states[i]] == 1);
+  }
+
+  mfsm_StepPool pool;
+  initStepPool(&pool, 2);
+
+  static mfsm_SessionEvent buffers[2][POOL_SESSIONS];
+  assertMsg(setPoolEventBuffer(&pool, 0, buffers[0], POOL_SESSIONS) == 0, "Buffer #1 could not be set");
+  assertMsg(setPoolEventBuffer(&pool, 1, buffers[1], POOL_SESSIONS) == 0, "Buffer #2 could not be set");
+  assertMsg(setPoolEventBuffer(&pool, 2, buffers[1], POOL_SESSIONS) == -2, "A buffer was set on a missing worker");
+  assertMsg(setPoolEventBuffer(0, 0, buffers[0], POOL_SESSIONS) == -1, "A buffer was set on a null StepPool");
+
+  runStepPool(&pool, &c, states, inputs, POOL_SESSIONS);
+
+  // Every session that left state 1 is reported once, by some worker
+  int found = 0;
+  int errors = 0;
+  int w = 0;
+  for (; w < 2; w++) {
+    size_t j = 0;
+    for (; j < pool.workers[w].numEvents; j++) {
+      mfsm_SessionEvent *se = &buffers[w][j];
+      errors += (se->event->id != 40 || se->session % c.numStates != 0);
+      found++;
+    }
+    errors += (pool.workers[w].dropped != 0);
+  }
+  assertMsg(found == expected, "Output Events were lost");
+  assertMsg(errors == 0, "The wrong output Events were recorded");
+
+  // Events that do not fit are counted
+  setPoolEventBuffer(&pool, 0, buffers[0], 1);
+  setPoolEventBuffer(&pool, 1, buffers[1], 1);
+  for (i = 0; i < POOL_SESSIONS; i++) {
+    states[i] = 0;
+  }
+  runStepPool(&pool, &c, states, inputs, POOL_SESSIONS);
+  size_t total = pool.workers[0].numEvents + pool.workers[0].dropped +
+                 pool.workers[1].numEvents + pool.workers[1].dropped;
+  assertMsg(total == POOL_SESSIONS, "Dropped Events were not counted");
+
+  freeStepPool(&pool);
+  freeCompiledFSM(&c);
+
+  report("setPoolEventBuffer()");
+}
+
+void test_writeCompiledImage(void) {
+  mfsm_CompiledFSM c;
+  buildPoolFSM(&c);
+
+  size_t size = getCompiledImageSize(&c);
+  assertMsg(size > sizeof(mfsm_ImageHeader) && size % MFSM_IMAGE_ALIGN == 0, "The image size was incorrect");
+
+  uint64_t *buf = malloc(size + MFSM_IMAGE_ALIGN);
+  uint64_t *copy = malloc(size);
+  assertMsg(writeCompiledImage(&c, buf, size) == 0, "The image could not be written");
+  writeCompiledImage(&c, copy, size);
+  assertMsg(memcmp(buf, copy, size) == 0, "Writing the same FSM twice gave different images");
+
+  const mfsm_ImageHeader *h = (const mfsm_ImageHeader*)buf;
+  assertMsg(h->magic == MFSM_IMAGE_MAGIC && h->version == MFSM_IMAGE_VERSION, "The header was not filled in");
+  assertMsg(h->size == size && h->outputs == h->next + sizeof(uint16_t) * 12, "The tables were not laid out in order");
+
+  assertMsg(writeCompiledImage(&c, buf, size - 1) == -2, "A buffer which was too small was accepted");
+  assertMsg(writeCompiledImage(&c, (char*)buf + 1, size) == -2, "An unaligned buffer was accepted");
+  assertMsg(writeCompiledImage(0, buf, size) == -1, "A null compiled FSM was written");
+  freeCompiledFSM(&c);
+
+  // Payloads live outside the FSM, so they cannot be written
+  void *poolMem = malloc(getPayloadPoolBytes(8, 4));
+  mfsm_PayloadPool payloads;
+  initPayloadPool(&payloads, poolMem, 8, 4);
+
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addInput(&fsm, 1);
+  mfsm_Event e;
+  initEvent(&e, 5);
+  e.payload = allocPayload(&payloads);
+  setTransitionOutput(&fsm, 1, 1, e);
+  compileFSM(&fsm, &c);
+  assertMsg(writeCompiledImage(&c, buf, size) == -3, "An Event with a payload was written");
+  releasePayload(e.payload);
+  freeCompiledFSM(&c);
+  freeFSM(&fsm);
+  free(poolMem);
+
+  free(copy);
+  free(buf);
+
+  report("writeCompiledImage()");
+}
+
+void test_loadCompiledImage(void) {
+  mfsm_CompiledFSM c;
+  buildPoolFSM(&c);
+  size_t size = getCompiledImageSize(&c);
+  uint64_t *buf = malloc(size);
+  writeCompiledImage(&c, buf, size);
+
+  mfsm_CompiledFSM img;
+  assertMsg(loadCompiledImage(&img, buf, size) == 0, "The image could not be loaded");
+  assertMsg((const void*)img.next > (const void*)buf && (const void*)img.next < (const void*)((char*)buf + size), "The image was not used in place");
+  assertMsg(img.numStates == c.numStates && getCompiledStateIndex(&img, 4) == getCompiledStateIndex(&c, 4), "The state IDs were not loaded");
+
+  // Steps the same way as the original
+  mfsm_Instance a;
+  mfsm_Instance b;
+  initInstance(&a, 1, 0);
+  initInstance(&b, 1, 0);
+  int same = 1;
+  int i = 0;
+  for (; i < 20; i++) {
+    same &= (doCompiledTransition(&c, &a, i % 3 ? 1 : 2) == doCompiledTransition(&img, &b, i % 3 ? 1 : 2));
+  }
+  assertMsg(same, "The loaded image stepped differently");
+  assertMsg(getCompiledOutput(&img, getCompiledStateIndex(&img, 1), getCompiledInputIndex(&img, 1))->id == 40, "The output Event was not loaded");
+  freeCompiledFSM(&img);
+
+  // Damaged images are refused
+  mfsm_ImageHeader *h = (mfsm_ImageHeader*)buf;
+  assertMsg(loadCompiledImage(&img, buf, size - 8) == -3, "A truncated image was loaded");
+  h->version++;
+  assertMsg(loadCompiledImage(&img, buf, size) == -2, "An image of another version was loaded");
+  h->version--;
+  h->outputs += 2;
+  assertMsg(loadCompiledImage(&img, buf, size) == -3, "A corrupt image was loaded");
+  h->magic = 0;
+  assertMsg(loadCompiledImage(&img, buf, size) == -1, "Something which is not an image was loaded");
+
+  free(buf);
+  freeCompiledFSM(&c);
+
+  report("loadCompiledImage()");
+}
+
+void test_mapCompiledFSM(void) {
+  mfsm_CompiledFSM c;
+  buildPoolFSM(&c);
+  const char *path = "tests/image.tmp";
+  assertMsg(saveCompiledFSM(&c, path) == 0, "The image file could not be written");
+
+  // The file holds the same bytes as writeCompiledImage()
+  size_t size = getCompiledImageSize(&c);
+  uint64_t *buf = malloc(size);
+  writeCompiledImage(&c, buf, size);
+  unsigned char *file = malloc(size + 1);
+  FILE *f = fopen(path, "rb");
+  size_t read = fread(file, 1, size + 1, f);
+  fclose(f);
+  assertMsg(read == size && memcmp(file, buf, size) == 0, "The file differed from the image");
+
+  mfsm_CompiledFSM img;
+  assertMsg(mapCompiledFSM(&img, path) == 0, "The image file could not be mapped");
+  int states[2] = {getCompiledStateIndex(&img, 1), getCompiledStateIndex(&img, 6)};
+  int inputs[2] = {getCompiledInputIndex(&img, 1), getCompiledInputIndex(&img, 1)};
+  stepCompiledMany(&img, states, inputs, 2);
+  assertMsg(img.stateIDs[states[0]] == 2 && img.stateIDs[states[1]] == 1, "The mapped image stepped incorrectly");
+
+  // Mapped images have no allocator, so scanners use the default one
+  int byteInputs[SCANNER_BYTES] = {0};
+  byteInputs['x'] = 1;
+  mfsm_Scanner sc;
+  assertMsg(initScanner(&sc, &img, byteInputs, 0, 0) == 0, "A scanner could not be built from a mapped image");
+  freeScanner(&sc);
+  freeCompiledFSM(&img);
+  assertMsg(img.mem == 0, "The image file was not unmapped");
+
+  assertMsg(mapCompiledFSM(&img, "tests/missing.tmp") == -4, "A missing file was mapped");
+  f = fopen(path, "wb");
+  fputs("not an image", f);
+  fclose(f);
+  assertMsg(mapCompiledFSM(&img, path) == -1, "A file which is not an image was mapped");
+  remove(path);
+
+  free(file);
+  free(buf);
+  freeCompiledFSM(&c);
+
+  report("mapCompiledFSM()");
+}
+
+void test_loadFSMText(void) {
+  const char *text =
+    "# Turnstile\n"
+    "1 1 -> 2 40   # coin\n"
+    "\n"
+    "2 2 -> 1\r\n"
+    "\t2 1->2 -7\n"
+    "1 2 -> 1";
+
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  int line = -1;
+  assertMsg(loadFSMText(&fsm, text, strlen(text), &line) == 0 && line == 0, "A valid definition could not be loaded");
+  assertMsg(isValidStateIDPtr(&fsm, 1) == 0 && isValidStateIDPtr(&fsm, 2) == 0, "The states were not added");
+  assertMsg(isValidInputIDPtr(&fsm, 1) == 0 && isValidInputIDPtr(&fsm, 2) == 0, "The inputs were not added");
+  assertMsg(fsm.curState == 1, "The first state did not become the current state");
+  assertMsg(getTransition(&fsm, 1, 1)->dest == 2 && getTransitionOutput(&fsm, 1, 1)->id == 40, "The first transition was not loaded");
+  assertMsg(getTransition(&fsm, 2, 2)->dest == 1 && getTransitionOutput(&fsm, 2, 2) == 0, "A transition without an Event was loaded with one");
+  assertMsg(getTransitionOutput(&fsm, 1, 2)->id == -7, "A negative Event ID was not loaded");
+  assertMsg(isValidTransitionPtr(&fsm, 2, 1) == 0, "The last line without a line break was not loaded");
+  freeFSM(&fsm);
+
+  // Errors stop loading and give the line they were found on
+  const char *bad[] = {
+    "1 1 -> 2\n1 1 2\n",
+    "1 1 -> 2\n\n1 1 -> 0\n",
+    "1 1 -> 2\n1 1 -> 3\n",
+    "1 1 -> 2 x\n",
+    "11 -> 2\n",
+    "1 1 -> 2 -1\n",
+    "1 1 -> 99999999999\n",
+  };
+  int codes[] = {-1, -2, -3, -1, -1, -2, -1};
+  int lines[] = {2, 3, 2, 1, 1, 1, 1};
+  int i = 0;
+  for (; i < 7; i++) {
+    initFSM(&fsm);
+    int status = loadFSMText(&fsm, bad[i], strlen(bad[i]), &line);
+    if (status != codes[i] || line != lines[i]) {
+      printf("Definition %d: %d on line %d\n", i, status, line);
+    }
+    assertMsg(status == codes[i] && line == lines[i], "An invalid definition gave the wrong error");
+    freeFSM(&fsm);
+  }
+
+  // Fixed storage fills up
+  static mfsm_FixedStorage storage;
+  initFixedFSM(&fsm, &storage);
+  char big[64];
+  int status = 0;
+  for (i = 1; i <= MAX_STATES && status == 0; i++) {
+    sprintf(big, "%d 1 -> %d\n", i, i + 1);
+    status = loadFSMText(&fsm, big, strlen(big), 0);
+  }
+  assertMsg(status == -4, "A full FSM did not give an error");
+
+  report("loadFSMText()");
+}
+
+void test_feedLoader(void) {
+  const char *text = "1 1 -> 2 40\n2 1 -> 3\n3 2 -> 1 41\n# done\n3 1 -> 3";
+  size_t len = strlen(text);
+
+  // Feeding one byte at a time gives the same FSM as loading it whole
+  mfsm_fsm whole;
+  mfsm_fsm fed;
+  initFSM(&whole);
+  initFSM(&fed);
+  loadFSMText(&whole, text, len, 0);
+
+  mfsm_Loader ld;
+  initLoader(&ld, &fed);
+  int status = 0;
+  size_t i = 0;
+  for (; i < len; i++) {
+    status |= feedLoader(&ld, text + i, 1);
+  }
+  status |= finishLoader(&ld);
+  assertMsg(status == 0, "The definition could not be fed a byte at a time");
+
+  int same = 1;
+  int s = 1;
+  int n = 1;
+  for (; s <= 3; s++) {
+    for (n = 1; n <= 2; n++) {
+      const mfsm_Transition *a = getTransition(&whole, n, s);
+      const mfsm_Transition *b = getTransition(&fed, n, s);
+      same &= (a->dest == b->dest && a->output == b->output);
+    }
+  }
+  assertMsg(same, "Feeding the definition in pieces gave a different FSM");
+  freeFSM(&whole);
+
+  // Errors in split lines keep their line numbers, and stick
+  initLoader(&ld, &fed);
+  feedLoader(&ld, "4 1 -> 5\n5 1", 13);
+  assertMsg(feedLoader(&ld, " -> \n", 5) == -1 && ld.errorLine == 2, "An error in a split line gave the wrong line");
+  assertMsg(feedLoader(&ld, "5 2 -> 4\n", 9) == -1 && isValidTransitionPtr(&fed, 2, 5) != 0, "Loading continued after an error");
+
+  // Split lines must fit the partial buffer
+  char longLine[LOADER_MAX_LINE + 2];
+  memset(longLine, ' ', sizeof(longLine));
+  initLoader(&ld, &fed);
+  assertMsg(feedLoader(&ld, longLine, sizeof(longLine)) == -5, "An overlong split line was accepted");
+  freeFSM(&fed);
+
+  report("feedLoader()");
+}
+
+// Transitions in the timed load test
+#define LOAD_STATES 10000
+#define LOAD_INPUTS 10
+
+// Time allowed to load LOAD_STATES * LOAD_INPUTS transitions from a file,
+// leaving plenty of room for unoptimized and sanitizer builds
+#define LOAD_BUDGET_MS 1000
+
+void test_loadFSMFile(void) {
+  // Every transition sends its own Event, the slowest case for the FSM's
+  // outputs table
+  const char *path = "tests/loader.tmp";
+  FILE *f = fopen(path, "w");
+  unsigned int seed = 12345;
+  int s = 1;
+  int n = 1;
+  for (; s <= LOAD_STATES; s++) {
+    for (n = 1; n <= LOAD_INPUTS; n++) {
+      seed = seed * 1103515245u + 12345u;
+      fprintf(f, "%d %d -> %d %d\n", s, n, (int)((seed >> 8) % LOAD_STATES) + 1, s * LOAD_INPUTS + n);
+    }
+  }
+  fclose(f);
+
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  struct timespec t0;
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int line = -1;
+  int status = loadFSMFile(&fsm, path, &line);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+  assertMsg(status == 0 && line == 0, "The definition file could not be loaded");
+  assertMsg(ms < LOAD_BUDGET_MS, "Loading 100000 transitions took too long");
+  assertMsg(getTransitionOutput(&fsm, LOAD_INPUTS, LOAD_STATES)->id == LOAD_STATES * LOAD_INPUTS + LOAD_INPUTS, "The last transition was not loaded");
+
+  int count = 0;
+  for (s = 1; s <= LOAD_STATES; s++) {
+    for (n = 1; n <= LOAD_INPUTS; n++) {
+      count += (isValidTransitionPtr(&fsm, n, s) == 0);
+    }
+  }
+  assertMsg(count == LOAD_STATES * LOAD_INPUTS, "Transitions were missing");
+  freeFSM(&fsm);
+  remove(path);
+
+  initFSM(&fsm);
+  assertMsg(loadFSMFile(&fsm, "tests/missing.tmp", &line) == -6 && line == 0, "A missing file was loaded");
+  freeFSM(&fsm);
+
+  report("loadFSMFile()");
+}
+
+void test_saveCheckpoint(void) {
+  mfsm_Instance insts[3];
+  int i = 0;
+  for (; i < 3; i++) {
+    initInstance(&insts[i], i + 1, 0);
+    insts[i].curInput = 10 + i;
+  }
+
+  mfsm_EventListener a;
+  mfsm_EventListener b;
+  initEventListener(&a);
+  initEventListener(&b);
+  mfsm_Event e;
+  initEvent(&e, 7);
+  appendEvent(&a, e);
+  initEvent(&e, 8);
+  appendEvent(&a, e);
+  mfsm_EventListener *listeners[2] = {&a, &b};
+
+  size_t size = getCheckpointSize(3, listeners, 2);
+  assertMsg(size == sizeof(mfsm_CheckpointHeader) + 8 * 3 + 8 + sizeof(mfsm_Event) * 2, "The checkpoint size was incorrect");
+
+  uint64_t *buf = malloc(size);
+  size_t used = 0;
+  assertMsg(saveCheckpoint(insts, 3, listeners, 2, buf, size, &used) == 0 && used == size, "The checkpoint could not be saved");
+  const mfsm_CheckpointHeader *h = (const mfsm_CheckpointHeader*)buf;
+  assertMsg(h->numInstances == 3 && h->numListeners == 2 && h->numEvents == 2, "The header was not filled in");
+  assertMsg(a.numEvents == 2, "Saving removed Events from a listener");
+
+  assertMsg(saveCheckpoint(insts, 3, listeners, 2, buf, size - 1, 0) == -2, "A buffer which was too small was accepted");
+  assertMsg(saveCheckpoint(insts, 3, listeners, 2, (char*)buf + 4, size, 0) == -2, "An unaligned buffer was accepted");
+  listeners[1] = 0;
+  assertMsg(saveCheckpoint(insts, 3, listeners, 2, buf, size, 0) == -1, "A null listener was accepted");
+  listeners[1] = &b;
+  free(buf);
+
+  // Payloads live outside the listeners, so they cannot be saved
+  void *poolMem = malloc(getPayloadPoolBytes(8, 1));
+  mfsm_PayloadPool payloads;
+  initPayloadPool(&payloads, poolMem, 8, 1);
+  initEvent(&e, 9);
+  e.payload = allocPayload(&payloads);
+  appendEvent(&b, e);
+  size = getCheckpointSize(3, listeners, 2);
+  buf = malloc(size);
+  assertMsg(saveCheckpoint(insts, 3, listeners, 2, buf, size, 0) == -3, "An Event with a payload was saved");
+  getNextEvent(&b, &e);
+  releaseEvent(&e);
+  free(buf);
+  free(poolMem);
+
+  report("saveCheckpoint()");
+}
+
+void test_restoreCheckpoint(void) {
+  // Run some sessions with their own listener
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  loadFSMText(&fsm, "1 1 -> 2 40\n2 1 -> 3 41\n3 1 -> 1 42\n", 36, 0);
+
+  mfsm_EventQueue eq;
+  mfsm_EventListener el;
   initEventQueue(&eq);
+  initEventListener(&el);
+  addListener(&eq, &el);
+
+  mfsm_Instance insts[4];
+  int i = 0;
+  for (; i < 4; i++) {
+    initInstance(&insts[i], 1, &eq);
+    int j = 0;
+    for (; j < i; j++) {
+      doInstanceTransition(&fsm, &insts[i], 1);
+    }
+  }
+
+  mfsm_EventListener *listeners[1] = {&el};
+  size_t size = getCheckpointSize(4, listeners, 1);
+  uint64_t *buf = malloc(size);
+  saveCheckpoint(insts, 4, listeners, 1, buf, size, 0);
+
+  // Restore onto fresh sessions with a listener holding something else
+  mfsm_EventQueue eq2;
+  mfsm_EventListener el2;
+  initEventQueue(&eq2);
+  initEventListener(&el2);
+  addListener(&eq2, &el2);
+  mfsm_Event e;
+  initEvent(&e, 99);
+  appendEvent(&el2, e);
+
+  mfsm_Instance restored[4];
+  for (i = 0; i < 4; i++) {
+    initInstance(&restored[i], 1, &eq2);
+  }
+
+  listeners[0] = &el2;
+  assertMsg(restoreCheckpoint(restored, 4, listeners, 1, buf, size) == 0, "The checkpoint could not be restored");
+
+  int same = 1;
+  for (i = 0; i < 4; i++) {
+    same &= (restored[i].curState == insts[i].curState && restored[i].curInput == insts[i].curInput);
+    same &= (restored[i].eq == &eq2);
+  }
+  assertMsg(same, "The instances were not restored");
+
+  mfsm_Event a[MAX_EVENTS];
+  mfsm_Event b[MAX_EVENTS];
+  int n = getEvents(&el, a, MAX_EVENTS);
+  assertMsg(getEvents(&el2, b, MAX_EVENTS) == n && n == 6, "The pending Events were not restored");
+  same = 1;
+  for (i = 0; i < n; i++) {
+    same &= (a[i].id == b[i].id);
+  }
+  assertMsg(same, "The pending Events were restored out of order");
+
+  // Restored sessions carry on where the saved ones were
+  doInstanceTransition(&fsm, &restored[2], 1);
+  assertMsg(restored[2].curState == 1 && getNextEvent(&el2, &e) == 0 && e.id == 42, "A restored session did not carry on");
+
+  // Mismatched or damaged checkpoints restore nothing
+  assertMsg(restoreCheckpoint(restored, 3, listeners, 1, buf, size) == -2, "A checkpoint of another number of instances was restored");
+  assertMsg(restoreCheckpoint(restored, 4, listeners, 1, buf, size - 8) == -3, "A truncated checkpoint was restored");
+  ((mfsm_CheckpointHeader*)buf)->numEvents--;
+  assertMsg(restoreCheckpoint(restored, 4, listeners, 1, buf, size) == -3, "A corrupt checkpoint was restored");
+  ((mfsm_CheckpointHeader*)buf)->magic = 0;
+  assertMsg(restoreCheckpoint(restored, 4, listeners, 1, buf, size) == -1, "Something which is not a checkpoint was restored");
+  assertMsg(restored[2].curState == 1 && el2.numEvents == 0, "A failed restore changed something");
+  free(buf);
+
+  // Listeners must have room for their Events
+  mfsm_EventListener big;
+  initEventListener(&big);
+  mfsm_Event grown[MAX_EVENTS * 2];
+  setOverflowPolicy(&big, MFSM_OVERFLOW_GROW);
+  setOverflowStorage(&big, grown, MAX_EVENTS * 2);
+  for (i = 0; i < MAX_EVENTS + 1; i++) {
+    initEvent(&e, i);
+    appendEvent(&big, e);
+  }
+
+  listeners[0] = &big;
+  size = getCheckpointSize(0, listeners, 1);
+  buf = malloc(size);
+  saveCheckpoint(0, 0, listeners, 1, buf, size, 0);
+  listeners[0] = &el2;
+  assertMsg(restoreCheckpoint(0, 0, listeners, 1, buf, size) == -4, "Too many Events were restored into a listener");
+  assertMsg(el2.numEvents == 0, "A listener without room was changed");
+  free(buf);
+  freeFSM(&fsm);
+
+  report("restoreCheckpoint()");
+}
+
+#ifdef MFSM_STATS
+void test_initStats(void) {
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  loadFSMText(&fsm, "1 1 -> 2 40\n2 2 -> 1\n", 20, 0);
+
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&fsm.eq, &el);
+
+  uint64_t pairs[2 * 2];
+  mfsm_Stats stats;
+  initStats(&stats, pairs, 2, 2);
+  fsm.stats = &stats;
+
+  doTransition(&fsm, 1);
+  doTransition(&fsm, 2);
+  doTransition(&fsm, 1);
+  doTransition(&fsm, 3);
+  int inputs[3] = {2, 1, 7};
+  doTransitionBatch(&fsm, inputs, 3, 0, 0);
+
+  int s1 = getStateIndexPtr(&fsm, 1);
+  int s2 = getStateIndexPtr(&fsm, 2);
+  int n1 = getInputIndexPtr(&fsm, 1);
+  int n2 = getInputIndexPtr(&fsm, 2);
+  assertMsg(stats.transitions == 5 && stats.failed[0] == 2 && stats.failed[1] == 0, "Transitions were not counted");
+  assertMsg(pairs[s1 * 2 + n1] == 3 && pairs[s2 * 2 + n2] == 2, "Transitions were not counted per state and input");
+  assertMsg(stats.eventsSent == 3, "Output Events were not counted");
+
+  // Instances count into their own Stats
+  mfsm_Instance inst;
+  mfsm_Stats own;
+  initInstance(&inst, 7, 0);
+  initStats(&own, 0, 0, 0);
+  inst.stats = &own;
+  doInstanceTransition(&fsm, &inst, 1);
+  assertMsg(own.failed[1] == 1 && stats.failed[1] == 0, "An instance did not count into its own Stats");
+
+  mfsm_Stats snap;
+  uint64_t snapPairs[2 * 2];
+  snapshotStats(&stats, &snap, snapPairs);
+  resetStats(&stats);
+  assertMsg(snap.transitions == 5 && snap.pairs == snapPairs && snapPairs[s1 * 2 + n1] == 3, "The snapshot did not copy the counters");
+  assertMsg(stats.transitions == 0 && stats.eventsSent == 0 && pairs[s1 * 2 + n1] == 0, "The counters were not reset");
+
+  freeFSM(&fsm);
+
+  report("initStats()");
+}
 
-  // Add the listeners to the EventQueue
+void test_snapshotListenerStats(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+  mfsm_Event e;
+  initEvent(&e, 1);
+  int i = 0;
+  for (; i < MAX_EVENTS + 3; i++) {
+    appendEvent(&el, e);
+  }
+
+  mfsm_ListenerStats stats;
+  snapshotListenerStats(&el, &stats);
+  assertMsg(stats.delivered == MAX_EVENTS && stats.dropped == 3 && stats.highWater == MAX_EVENTS, "The listener counters were wrong");
+
+  getNextEvent(&el, &e);
+  resetListenerStats(&el);
+  snapshotListenerStats(&el, &stats);
+  assertMsg(stats.delivered == 0 && stats.dropped == 0 && stats.highWater == MAX_EVENTS - 1, "The listener counters were not reset");
+
+  report("snapshotListenerStats()");
+}
+#endif //MFSM_STATS
+
+#ifdef MFSM_TIMING
+void test_getPercentile(void) {
+  static mfsm_Histogram h;
+  initHistogram(&h);
+  assertMsg(getPercentile(&h, 50) == 0, "An empty Histogram had a percentile");
+
+  // Small values are exact
+  uint64_t i = 1;
+  for (; i <= 10; i++) {
+    recordSample(&h, i);
+  }
+  assertMsg(getPercentile(&h, 50) == 5 && getPercentile(&h, 100) == 10 && getPercentile(&h, 0) == 1, "Small percentiles were not exact");
+
+  // Percentages outside 0 to 100 are clamped
+  assertMsg(getPercentile(&h, -5) == 1 && getPercentile(&h, -1e300) == 1, "A negative percentile was not clamped");
+  assertMsg(getPercentile(&h, 250) == 10 && getPercentile(&h, 1e300) == 10, "A percentile above 100 was not clamped");
+
+  // Larger ones are within a bucket
+  initHistogram(&h);
+  for (i = 1; i <= 100000; i++) {
+    recordSample(&h, i * 10);
+  }
+  uint64_t p99 = getPercentile(&h, 99);
+  assertMsg(p99 >= 990000 && p99 <= 990000 + 990000 / (1 << MFSM_HIST_SUB_BITS), "A large percentile was not within a bucket");
+  assertMsg(getPercentile(&h, 100) == 1000000 && h.min == 10 && h.total == 100000, "The extremes were not tracked");
+
+  recordSample(&h, UINT64_MAX);
+  assertMsg(getPercentile(&h, 100) == UINT64_MAX, "The largest value was not recorded");
+
+  static mfsm_Histogram other;
+  initHistogram(&other);
+  recordSample(&other, 3);
+  mergeHistogram(&other, &h);
+  assertMsg(other.total == 100002 && other.min == 3 && other.max == UINT64_MAX, "Histograms were not merged");
+
+  report("getPercentile()");
+}
+
+void test_initTiming(void) {
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  loadFSMText(&fsm, "1 1 -> 2 40\n2 1 -> 1\n", 20, 0);
+
+  static mfsm_Timing timing;
+  initTiming(&timing);
+  fsm.timing = &timing;
+
+  doTransition(&fsm, 1);
+  doTransition(&fsm, 1);
+  doTransition(&fsm, 9);
+  assertMsg(timing.transition.total == 2, "Transitions were not timed");
+  assertMsg(timing.dispatch.total == 1, "Output Events were not timed");
+
+  // Instances use their own histograms, or else the definition's
+  mfsm_Instance inst;
+  initInstance(&inst, 1, 0);
+  doInstanceTransition(&fsm, &inst, 1);
+  assertMsg(timing.transition.total == 3 && timing.dispatch.total == 1, "An instance did not fall back to the definition's histograms");
+
+  static mfsm_Timing own;
+  initTiming(&own);
+  inst.timing = &own;
+  doInstanceTransition(&fsm, &inst, 1);
+  assertMsg(own.transition.total == 1 && timing.transition.total == 3, "An instance did not use its own histograms");
+
+  freeFSM(&fsm);
+
+  report("initTiming()");
+}
+#endif //MFSM_TIMING
+
+/****************************************
+* Test Event System
+****************************************/
+void test_initEvent(void) {
+  // Initialize an event
+  mfsm_Event e;
+  initEvent(&e, 7);
+
+  // Test if it was properly initialized
+  assertMsg(e.id == 7, "Event ID was not properly initialized");
+  if (e.id != 7) {
+    printf("Value: %d\n", e.id);
+  }
+  assertMsg(e.type == DEFAULT_EVENT_TYPE, "Event type was not properly initialized");
+
+  report("initEvent()");
+}
+
+void test_initTypedEvent(void) {
+  mfsm_Event e;
+  initTypedEvent(&e, 7, 3);
+
+  assertMsg(e.id == 7, "Event ID was not properly initialized");
+  assertMsg(e.type == 3, "Event type was not properly initialized");
+
+  report("initTypedEvent()");
+}
+
+void test_setEventData(void) {
+  mfsm_Event e;
+  initEvent(&e, 1);
+  assertMsg(e.payload == 0 && e.data[EVENT_DATA_SIZE - 1] == 0, "Event data was not properly initialized");
+
+  long long range[2] = {1024, 4096};
+  assertMsg(setEventData(&e, range, sizeof(range)) == 0, "Event data could not be set");
+
+  // Data travels with copies of the Event
+  mfsm_EventListener el;
+  initEventListener(&el);
+  appendEvent(&el, e);
+  mfsm_Event d;
+  getNextEvent(&el, &d);
+  long long out[2];
+  memcpy(out, d.data, sizeof(out));
+  assertMsg(out[0] == 1024 && out[1] == 4096, "Event data was not copied");
+
+  char big[EVENT_DATA_SIZE + 1] = {0};
+  assertMsg(setEventData(&e, big, sizeof(big)) == -2, "Oversized data was accepted");
+  assertMsg(setEventData(&e, 0, 1) == -2, "Null data was accepted");
+  assertMsg(setEventData(0, range, 1) == -1, "Data was set on a null Event");
+
+  report("setEventData()");
+}
+
+void test_initPayloadPool(void) {
+  mfsm_PayloadPool pool;
+  size_t bytes = getPayloadPoolBytes(100, 4);
+  assertMsg(bytes >= 4 * (sizeof(mfsm_Payload) + 100), "Not enough memory was requested");
+
+  void *mem = malloc(bytes);
+  assertMsg(initPayloadPool(&pool, mem, 100, 4) == 0, "PayloadPool could not be initialized");
+  assertMsg(pool.numFree == 4, "PayloadPool blocks were not all free");
+  assertMsg(initPayloadPool(0, mem, 100, 4) == -1, "A null PayloadPool was initialized");
+  assertMsg(initPayloadPool(&pool, 0, 100, 4) == -2, "A PayloadPool was initialized without memory");
+  assertMsg(initPayloadPool(&pool, (char*)mem + 1, 100, 4) == -2, "Misaligned memory was accepted");
+  assertMsg(initPayloadPool(&pool, mem, 100, 0) == -3, "An empty PayloadPool was initialized");
+
+  free(mem);
+  report("initPayloadPool()");
+}
+
+void test_allocPayload(void) {
+  mfsm_PayloadPool pool;
+  void *mem = malloc(getPayloadPoolBytes(64, 2));
+  initPayloadPool(&pool, mem, 64, 2);
+
+  mfsm_Payload *p1 = allocPayload(&pool);
+  mfsm_Payload *p2 = allocPayload(&pool);
+  assertMsg(p1 != 0 && p2 != 0 && p1 != p2, "Payloads could not be allocated");
+  assertMsg(allocPayload(&pool) == 0, "A Payload was allocated from an empty pool");
+  assertMsg(allocPayload(0) == 0, "A Payload was allocated from a null pool");
+
+  // The whole data area is usable without touching the neighbouring block
+  memset(p1->data, 0xAB, 64);
+  memset(p2->data, 0xCD, 64);
+  assertMsg(p1->data[63] == 0xAB && p1->pool == &pool, "Payload data overlapped");
+
+  // Released blocks are reused
+  assertMsg(releasePayload(p1) == 0, "The last reference was not released");
+  assertMsg(pool.numFree == 1, "The Payload did not return to the pool");
+  assertMsg(allocPayload(&pool) == p1, "The released Payload was not reused");
+
+  free(mem);
+  report("allocPayload()");
+}
+
+void test_releasePayload(void) {
+  mfsm_PayloadPool pool;
+  void *mem = malloc(getPayloadPoolBytes(256, 1));
+  initPayloadPool(&pool, mem, 256, 1);
+
+  mfsm_Payload *p = allocPayload(&pool);
+  assertMsg(retainPayload(p) == 2, "The reference was not added");
+  assertMsg(releasePayload(p) == 1, "The reference was not dropped");
+  assertMsg(retainPayload(0) == -1 && releasePayload(0) == -1, "A null Payload was counted");
+
+  // One shared Payload for every listener the Event reaches
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  mfsm_EventListener el1;
+  mfsm_EventListener el2;
+  mfsm_EventListener full;
+  initEventListener(&el1);
+  initEventListener(&el2);
+  initEventListener(&full);
   addListener(&eq, &el1);
   addListener(&eq, &el2);
 
-  // Test if the listeners were added to the EventQueue.
+  mfsm_Event e;
+  initEvent(&e, 0);
+  int i = 0;
+  for (; i < MAX_EVENTS; i++) {
+    appendEvent(&full, e);
+  }
+  addListener(&eq, &full);
+
+  initEvent(&e, 5);
+  strcpy((char*)p->data, "session");
+  e.payload = p;
+  sendEventPtr(&eq, e);
+  assertMsg(atomic_load(&p->refs) == 3, "Each receiving listener did not take a reference");
+  releasePayload(p); // The sender's reference
+
+  mfsm_Event d;
+  getNextEvent(&el1, &d);
+  assertMsg(d.payload == p && strcmp((char*)d.payload->data, "session") == 0, "The Payload was not shared");
+  releaseEvent(&d);
+  assertMsg(d.payload == 0 && pool.numFree == 0, "The Payload was freed while still referenced");
+
+  getNextEvent(&el2, &d);
+  releaseEvent(&d);
+  assertMsg(pool.numFree == 1, "The Payload was not freed by the last receiver");
+
+  free(mem);
+  report("releasePayload()");
+}
+
+void test_setOverflowPolicy(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+  assertMsg(el.overflow == MFSM_OVERFLOW_DROP_NEWEST, "The default policy was not drop-newest");
+
+  // Drop-newest rejects the Event and counts it
+  mfsm_Event e;
+  int i = 0;
+  for (; i < MAX_EVENTS; i++) {
+    initEvent(&e, i);
+    appendEvent(&el, e);
+  }
+  assertMsg(el.highWater == MAX_EVENTS, "The high-water mark was not tracked");
+  assertMsg(appendEvent(&el, e) == -2 && el.dropped == 1, "The dropped Event was not counted");
+
+  // Drop-oldest overwrites and keeps first-in-first-out order
+  assertMsg(setOverflowPolicy(&el, MFSM_OVERFLOW_DROP_OLDEST) == 0, "Policy could not be set");
+  initEvent(&e, 100);
+  assertMsg(appendEvent(&el, e) == MAX_EVENTS, "The Event was not appended over the oldest");
+  assertMsg(el.dropped == 2, "The overwritten Event was not counted");
+
+  mfsm_Event d;
+  getNextEvent(&el, &d);
+  assertMsg(d.id == 1, "The oldest Event was not the one dropped");
+  mfsm_Event out[MAX_EVENTS];
+  int n = getEvents(&el, out, MAX_EVENTS);
+  assertMsg(out[n - 1].id == 100, "The new Event was not the newest");
+
+  // Policies that need a consumer thread are SPSC only, and vice versa
+  assertMsg(setOverflowPolicy(&el, MFSM_OVERFLOW_BLOCK) == -2, "Blocking was allowed without a consumer thread");
+  assertMsg(setOverflowPolicy(&el, 42) == -2, "An unknown policy was accepted");
+  assertMsg(setOverflowPolicy(0, MFSM_OVERFLOW_GROW) == -1, "Policy was set on a null listener");
+
+  mfsm_EventListener spsc;
+  initSPSCEventListener(&spsc);
+  assertMsg(setOverflowPolicy(&spsc, MFSM_OVERFLOW_BLOCK) == 0, "Blocking was not allowed for SPSC");
+  assertMsg(setOverflowPolicy(&spsc, MFSM_OVERFLOW_DROP_OLDEST) == -2, "Drop-oldest was allowed for SPSC");
+  assertMsg(setOverflowPolicy(&spsc, MFSM_OVERFLOW_GROW) == -2, "Growing was allowed for SPSC");
+
+  report("setOverflowPolicy()");
+}
+
+void test_setOverflowStorage(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  mfsm_Event storage[MAX_EVENTS * 4];
+  assertMsg(setOverflowStorage(&el, storage, MAX_EVENTS) == -3, "Storage that is too small was accepted");
+  assertMsg(setOverflowStorage(&el, storage, MAX_EVENTS * 3) == -3, "A capacity that is not a power of two was accepted");
+  assertMsg(setOverflowStorage(&el, 0, MAX_EVENTS * 4) == -2, "Null storage was accepted");
+  assertMsg(setOverflowStorage(&el, storage, MAX_EVENTS * 4) == 0, "Storage could not be set");
+  setOverflowPolicy(&el, MFSM_OVERFLOW_GROW);
+
+  // Wrap the ring before it fills so growing has to unwrap it
+  mfsm_Event e;
+  mfsm_Event d;
+  int i = 0;
+  for (; i < MAX_EVENTS / 2; i++) {
+    initEvent(&e, -1);
+    appendEvent(&el, e);
+    getNextEvent(&el, &d);
+  }
+
+  for (i = 0; i < MAX_EVENTS * 4; i++) {
+    initEvent(&e, i);
+    if (appendEvent(&el, e) < 0) {
+      break;
+    }
+  }
+  assertMsg(i == MAX_EVENTS * 4, "The listener did not grow");
+  assertMsg(el.grown == storage && el.dropped == 0, "The listener did not move to the new storage");
+  assertMsg(appendEvent(&el, e) == -2 && el.dropped == 1, "The grown listener did not drop when full");
+  assertMsg(setOverflowStorage(&el, storage, MAX_EVENTS * 4) == -1, "Storage was set after growing");
+
+  int errors = 0;
+  for (i = 0; i < MAX_EVENTS * 4; i++) {
+    getNextEvent(&el, &d);
+    errors += (d.id != i);
+  }
+  assertMsg(errors == 0, "Events were out of order after growing");
+
+  report("setOverflowStorage()");
+}
+
+void test_setSubscriptions(void) {
+  mfsm_EventListener all;
+  mfsm_EventListener odd;
+  initEventListener(&all);
+  initEventListener(&odd);
+  assertMsg(all.subscriptions == ALL_EVENT_TYPES, "Listeners do not receive every type by default");
+  assertMsg(setSubscriptions(&odd, (1u << 1) | (1u << 3)) == 0, "Subscriptions could not be set");
+  assertMsg(setSubscriptions(0, 0) == -1, "Subscriptions were set on a null listener");
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  addListener(&eq, &all);
+  addListener(&eq, &odd);
+
+  // Only subscribed listeners get each type
+  mfsm_Event e;
+  int type = 0;
+  for (; type < 4; type++) {
+    initTypedEvent(&e, 10 + type, type);
+    sendEventPtr(&eq, e);
+  }
+  assertMsg(all.numEvents == 4, "Events were filtered from a listener subscribed to all types");
+  assertMsg(odd.numEvents == 2, "Events of unsubscribed types were delivered");
+  assertMsg(odd.events[0].id == 11 && odd.events[1].id == 13, "The wrong Events were delivered");
+
+  // Types out of range reach no listener
+  initTypedEvent(&e, 99, MAX_EVENT_TYPES);
+  sendEventPtr(&eq, e);
+  assertMsg(all.numEvents == 4, "An Event with an invalid type was delivered");
+
+  report("setSubscriptions()");
+}
+
+void test_refreshListener(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  addListener(&eq, &el);
+
+  // The queue keeps the subscriptions from when the listener was added
+  setSubscriptions(&el, 1u << 2);
+  mfsm_Event e;
+  initTypedEvent(&e, 1, 0);
+  sendEventPtr(&eq, e);
+  assertMsg(el.numEvents == 1, "The queue did not keep the old subscriptions");
+
+  assertMsg(refreshListener(&eq, &el) == 0, "Listener could not be refreshed");
+  sendEventPtr(&eq, e);
+  assertMsg(el.numEvents == 1, "The new subscriptions were not used");
+  initTypedEvent(&e, 2, 2);
+  sendEventPtr(&eq, e);
+  assertMsg(el.numEvents == 2, "A subscribed type was not delivered");
+
+  mfsm_EventListener other;
+  initEventListener(&other);
+  assertMsg(refreshListener(&eq, &other) == -3, "An unregistered listener was refreshed");
+  assertMsg(refreshListener(&eq, 0) == -2, "A null listener was refreshed");
+  assertMsg(refreshListener(0, &el) == -1, "A listener was refreshed on a null EventQueue");
+
+  // Removed listeners no longer receive anything
+  removeListener(&eq, &el);
+  sendEventPtr(&eq, e);
+  assertMsg(el.numEvents == 2, "A removed listener received an Event");
+
+  report("refreshListener()");
+}
+
+void test_appendEvent(void) {
+  // Create some Events and an EventListener
+  mfsm_Event e1;
+  mfsm_Event e2;
+  initEvent(&e1, 7);
+  initEvent(&e2, 9);
+
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  // Add the events to the listener and test if they were added to the queue.
+  appendEvent(&el, e1);
+  assertMsg(el.events[0].id == 7, "Event #1 was not successfully appended");
+  assertMsg(el.numEvents == 1, "numEvents was not updated");
+
+  appendEvent(&el, e2);
+  assertMsg(el.events[1].id == 9, "Event #2 was not successfully appended");
+  assertMsg(el.numEvents == 2, "numEvents was not updated");
+
+  report("appendEvent()");
+}
+
+void test_getNextEvent(void) {
+  // Create some Events and an EventListener
+  mfsm_Event e1;
+  mfsm_Event e2;
+  initEvent(&e1, 7);
+  initEvent(&e2, 9);
+
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  // Add the events to the listener and test if they were added to the queue.
+  appendEvent(&el, e1);
+  assertMsg(el.events[0].id == 7, "Event #1 was not successfully appended");
+  assertMsg(el.numEvents == 1, "numEvents was not updated");
+
+  appendEvent(&el, e2);
+  assertMsg(el.events[1].id == 9, "Event #2 was not successfully appended");
+  assertMsg(el.numEvents == 2, "numEvents was not updated");
+
+  // Try to retrieve the events in first-in-first-out order and retest them
+  mfsm_Event d;
+  getNextEvent(&el, &d);
+  assertMsg(d.id == 7, "Event #1 was not successfully retrieved");
+  assertMsg(el.numEvents == 1, "numEvents was not updated");
+
+  getNextEvent(&el, &d);
+  assertMsg(d.id == 9, "Event #2 was not successfully retrieved");
+  assertMsg(el.numEvents == 0, "numEvents was not updated");
+
+  // Keep the queue order when it wraps around the end of the events array
+  int i = 0;
+  int errors = 0;
+  for (; i < MAX_EVENTS * 3; i++) {
+    initEvent(&e1, i);
+    appendEvent(&el, e1);
+    if (i % 3 == 2) {
+      // Drain more slowly than the queue is filled, but never fill it
+      getNextEvent(&el, &d);
+      errors += (d.id != i - 2);
+      getNextEvent(&el, &d);
+      errors += (d.id != i - 1);
+      getNextEvent(&el, &d);
+      errors += (d.id != i);
+    }
+  }
+  assertMsg(errors == 0, "Events were retrieved out of order after wrapping");
+
+  report("getNextEvent()");
+}
+
+void test_getEvents(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  // Move the head near the end of the array so the queue wraps
+  mfsm_Event e;
+  mfsm_Event d;
+  int i = 0;
+  for (; i < MAX_EVENTS - 2; i++) {
+    initEvent(&e, -1);
+    appendEvent(&el, e);
+    getNextEvent(&el, &d);
+  }
+
+  for (i = 0; i < 5; i++) {
+    initEvent(&e, i);
+    appendEvent(&el, e);
+  }
+
+  // Drain part of the queue across the wrap, then the rest
+  mfsm_Event out[MAX_EVENTS];
+  int n = getEvents(&el, out, 3);
+  assertMsg(n == 3, "The wrong number of Events was retrieved");
+  assertMsg(out[0].id == 0 && out[1].id == 1 && out[2].id == 2, "Events were retrieved out of order");
+  assertMsg(el.numEvents == 2, "numEvents was not updated");
+
+  n = getEvents(&el, out, MAX_EVENTS);
+  assertMsg(n == 2, "The remaining Events were not retrieved");
+  assertMsg(out[0].id == 3 && out[1].id == 4, "Events were retrieved out of order");
+
+  n = getEvents(&el, out, MAX_EVENTS);
+  assertMsg(n == 0, "Events were retrieved from an empty queue");
+
+  report("getEvents()");
+}
+
+void test_peekEvents(void) {
+  mfsm_EventListener el;
+  initEventListener(&el);
+
+  // Wrap the queue around the end of the array
+  mfsm_Event e;
+  mfsm_Event d;
+  int i = 0;
+  for (; i < MAX_EVENTS - 2; i++) {
+    initEvent(&e, -1);
+    appendEvent(&el, e);
+    getNextEvent(&el, &d);
+  }
+
+  for (i = 0; i < 5; i++) {
+    initEvent(&e, i);
+    appendEvent(&el, e);
+  }
+
+  mfsm_Event out[MAX_EVENTS];
+  int n = peekEvents(&el, out, MAX_EVENTS);
+  assertMsg(n == 5 && out[0].id == 0 && out[4].id == 4, "Events were not copied in order across the wrap");
+  assertMsg(el.numEvents == 5 && peekEvents(&el, out, 2) == 2, "Peeking removed Events");
+  assertMsg(getNextEvent(&el, &d) == 4 && d.id == 0, "Peeking changed the oldest Event");
+  assertMsg(peekEvents(0, out, 1) == -1 && peekEvents(&el, 0, 1) == -2, "Invalid arguments were accepted");
+
+#ifndef MFSM_NO_THREADS
+  initSPSCEventListener(&el);
+  for (i = 0; i < 3; i++) {
+    initEvent(&e, i);
+    appendEvent(&el, e);
+  }
+  getNextEvent(&el, &d);
+  n = peekEvents(&el, out, MAX_EVENTS);
+  assertMsg(n == 2 && out[0].id == 1 && getNumEvents(&el) == 2, "SPSC Events were not peeked");
+#endif
+
+  report("peekEvents()");
+}
+
+void test_initSPSCEventListener(void) {
+  mfsm_EventListener el;
+  initSPSCEventListener(&el);
+
+  // Fill the queue completely, one past the end should fail
+  mfsm_Event e;
+  int i = 0;
+  int errors = 0;
+  for (; i < MAX_EVENTS; i++) {
+    initEvent(&e, i);
+    errors += (appendEvent(&el, e) != i + 1);
+  }
+  assertMsg(errors == 0, "Events could not be appended");
+  assertMsg(appendEvent(&el, e) == -2, "An Event was appended to a full queue");
+  assertMsg(getNumEvents(&el) == MAX_EVENTS, "The number of Events was incorrect");
+
+  // Retrieve in first-in-first-out order with both dequeue functions
+  mfsm_Event d;
+  i = getNextEvent(&el, &d);
+  assertMsg(d.id == 0, "The oldest Event was not retrieved");
+  assertMsg(i == MAX_EVENTS - 1, "The new number of Events was incorrect");
+
+  mfsm_Event out[MAX_EVENTS];
+  i = getEvents(&el, out, MAX_EVENTS);
+  assertMsg(i == MAX_EVENTS - 1, "The remaining Events were not retrieved");
+  assertMsg(out[0].id == 1 && out[i-1].id == MAX_EVENTS - 1, "Events were retrieved out of order");
+  assertMsg(getNextEvent(&el, &d) == -3, "An Event was retrieved from an empty queue");
+
+  // SPSC listeners work with sendEvent() too
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  addListener(&eq, &el);
+  initEvent(&e, 77);
+  sendEvent(eq, e);
+  assertMsg(getNumEvents(&el) == 1, "The sent Event was not received");
+
+  report("initSPSCEventListener()");
+}
+
+void test_initEventQueue(void) {
+  // Initialize an EventQueue
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+
+  // Test if it was properly initialized
+  assertMsg(eq.numListeners == 0, "EventQueue was not properly initialized");
+  if (eq.numListeners != 0) {
+    printf("Value: %d\n", eq.numListeners);
+  }
+
+  assertMsg(eq.listeners[3] == 0, "EventQueue was not properly initialized");
+  if (eq.listeners[3] != 0) {
+    printf("Value: %p\n", eq.listeners[3]);
+  }
+
+  report("initEventQueue()");
+}
+
+void test_addListener(void) {
+  // Create some EventListeners and an EventQueue
+  mfsm_EventListener el1;
+  mfsm_EventListener el2;
+  initEventListener(&el1);
+  initEventListener(&el2);
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+
+  // Add the listeners to the EventQueue and test if they were added.
+  addListener(&eq, &el1);
   if (eq.listeners[0] != &el1) {
     printf("EventListener #1 was not successfully added\n");
     printf("Expected: %p\n", &el1);
@@ -444,6 +2949,7 @@ void test_addListener(void) {
   }
   assertMsg(eq.numListeners == 1, "numListeners was not updated");
 
+  addListener(&eq, &el2);
   if (eq.listeners[1] != &el2) {
     printf("EventListener #2 was not successfully added\n");
     printf("Expected: %p\n", &el2);
@@ -464,11 +2970,8 @@ void test_removeListener(void) {
   mfsm_EventQueue eq;
   initEventQueue(&eq);
 
-  // Add the listeners to the EventQueue
+  // Add the listeners to the EventQueue and test if they were added.
   addListener(&eq, &el1);
-  addListener(&eq, &el2);
-
-  // Test if the listeners were added to the EventQueue.
   if (eq.listeners[0] != &el1) {
     printf("EventListener #1 was not successfully added\n");
     printf("Expected: %p\n", &el1);
@@ -476,6 +2979,7 @@ void test_removeListener(void) {
   }
   assertMsg(eq.numListeners == 1, "numListeners was not updated");
 
+  addListener(&eq, &el2);
   if (eq.listeners[1] != &el2) {
     printf("EventListener #2 was not successfully added\n");
     printf("Expected: %p\n", &el2);
@@ -524,9 +3028,229 @@ void test_sendEvent(void) {
   assertMsg(el1.events[0].id == 7, "Event was not successfully send to EL#1");
   assertMsg(el2.events[0].id == 7, "Event was not successfully send to EL#2");
 
+  // Listeners after a hole left by removeListener() still get Events
+  mfsm_EventListener el3;
+  initEventListener(&el3);
+  addListener(&eq, &el3);
+  removeListener(&eq, &el1);
+
+  initEvent(&e, 8);
+  sendEvent(eq, e);
+  assertMsg(el1.numEvents == 1, "Event was sent to a removed listener");
+  assertMsg(el2.numEvents == 2, "Event was not sent to EL#2");
+  assertMsg(el3.numEvents == 1, "Event was not sent to a listener after a hole");
+
   report("sendEvent()");
 }
 
+void test_sendEventPtr(void) {
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&eq, &el);
+
+  mfsm_Event e;
+  initEvent(&e, 5);
+  assertMsg(sendEventPtr(&eq, e) == 0, "Event could not be sent");
+  assertMsg(el.numEvents == 1 && el.events[0].id == 5, "Event was not received");
+  assertMsg(sendEventPtr(0, e) == -1, "Event was sent to a null EventQueue");
+
+  // Full listeners are counted as failures
+  mfsm_EventListener spare;
+  initEventListener(&spare);
+  addListener(&eq, &spare);
+
+  int i = 1;
+  for (; i < MAX_EVENTS; i++) {
+    sendEventPtr(&eq, e);
+  }
+  assertMsg(sendEventPtr(&eq, e) == 1, "The full listener was not counted");
+  assertMsg(spare.numEvents == MAX_EVENTS, "The listener with room did not get the Event");
+  assertMsg(sendEventPtr(&eq, e) == 2, "Both full listeners were not counted");
+
+  report("sendEventPtr()");
+}
+
+// Callback for the callback tests: records the last Event id and counts calls
+typedef struct testCallbackCtx {
+  int calls;
+  int lastID;
+} testCallbackCtx;
+
+static void testCallback(void *ctx, const mfsm_Event *e) {
+  testCallbackCtx *c = ctx;
+  c->calls++;
+  c->lastID = e->id;
+}
+
+void test_addCallback(void) {
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+
+  testCallbackCtx c1 = {0, 0};
+  testCallbackCtx c2 = {0, 0};
+  assertMsg(addCallback(&eq, testCallback, &c1) == 0, "Callback #1 could not be added");
+  assertMsg(addCallback(&eq, testCallback, &c2) == 0, "Callback #2 could not be added");
+  assertMsg(eq.numCallbacks == 2, "numCallbacks was not updated");
+  assertMsg(addCallback(0, testCallback, &c1) == -1, "Callback was added to a null EventQueue");
+  assertMsg(addCallback(&eq, 0, &c1) == -3, "A null callback was added");
+
+  // Polled listeners and callbacks both receive the Event
+  mfsm_EventListener el;
+  initEventListener(&el);
+  addListener(&eq, &el);
+
+  mfsm_Event e;
+  initEvent(&e, 9);
+  sendEventPtr(&eq, e);
+  assertMsg(c1.calls == 1 && c1.lastID == 9, "Callback #1 was not called");
+  assertMsg(c2.calls == 1 && c2.lastID == 9, "Callback #2 was not called");
+  assertMsg(el.numEvents == 1, "The polled listener did not receive the Event");
+
+  // Callbacks are called during the transition that emits the Event
+  mfsm_fsm fsm;
+  initFSM(&fsm);
+  addState(&fsm, 1);
+  addState(&fsm, 2);
+  addInput(&fsm, 1);
+  addTransition(&fsm, 1, 1, 2);
+  initEvent(&e, 12);
+  setTransitionOutput(&fsm, 1, 1, e);
+  addCallback(&fsm.eq, testCallback, &c1);
+  fsm.curState = 1;
+  doTransition(&fsm, 1);
+  assertMsg(c1.calls == 2 && c1.lastID == 12, "Callback was not called by doTransition()");
+  freeFSM(&fsm);
+
+  report("addCallback()");
+}
+
+void test_removeCallback(void) {
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+
+  testCallbackCtx c1 = {0, 0};
+  testCallbackCtx c2 = {0, 0};
+  addCallback(&eq, testCallback, &c1);
+  addCallback(&eq, testCallback, &c2);
+
+  // Only the callback with the matching context is removed
+  assertMsg(removeCallback(&eq, testCallback, &c1) == 0, "Callback could not be removed");
+  assertMsg(eq.numCallbacks == 1, "numCallbacks was not updated");
+  assertMsg(removeCallback(&eq, testCallback, &c1) == -3, "Callback was removed twice");
+  assertMsg(removeCallback(&eq, 0, &c1) == -2, "A null callback was removed");
+  assertMsg(removeCallback(0, testCallback, &c1) == -1, "Callback was removed from a null EventQueue");
+
+  // The callback after the hole is still called
+  mfsm_Event e;
+  initEvent(&e, 4);
+  sendEventPtr(&eq, e);
+  assertMsg(c1.calls == 0, "A removed callback was called");
+  assertMsg(c2.calls == 1, "The remaining callback was not called");
+
+  report("removeCallback()");
+}
+
+void test_initEventBus(void) {
+  static mfsm_EventBus bus;
+  initEventBus(&bus);
+
+  assertMsg(atomic_load(&bus.tail) == 0, "EventBus was not properly initialized");
+  assertMsg(atomic_load(&bus.slots[MAX_BUS_EVENTS - 1].seq) == 0, "EventBus slots were not properly initialized");
+  assertMsg(atomic_load(&bus.slots[0].seq) == 2 * (0u - MAX_BUS_EVENTS) + 2, "The first publisher to a slot would wait forever");
+
+  report("initEventBus()");
+}
+
+void test_publishEvent(void) {
+  static mfsm_EventBus bus;
+  initEventBus(&bus);
+
+  // Cursors only see Events published after they start
+  mfsm_Event e;
+  initEvent(&e, 1);
+  publishEvent(&bus, e);
+
+  mfsm_BusCursor cur1;
+  mfsm_BusCursor cur2;
+  initBusCursor(&cur1, &bus);
+  initBusCursor(&cur2, &bus);
+
+  initEvent(&e, 2);
+  e.data[EVENT_DATA_SIZE - 1] = 7;
+  assertMsg(publishEvent(&bus, e) == 0, "Event could not be published");
+  assertMsg(publishEvent(0, e) == -1, "Event was published to a null EventBus");
+
+  // Every cursor reads the same Event
+  mfsm_Event d;
+  assertMsg(readBusEvent(&cur1, &d) == 0 && d.id == 2, "Cursor #1 did not read the Event");
+  assertMsg(d.data[EVENT_DATA_SIZE - 1] == 7 && d.payload == 0, "The Event's data was not copied");
+  assertMsg(readBusEvent(&cur2, &d) == 0 && d.id == 2, "Cursor #2 did not read the Event");
+  assertMsg(readBusEvent(&cur1, &d) == -3, "An Event was read twice");
+  assertMsg(readBusEvent(&cur1, 0) == -2, "An Event was read to a null destination");
+
+  report("publishEvent()");
+}
+
+void test_readBusEvents(void) {
+  static mfsm_EventBus bus;
+  initEventBus(&bus);
+
+  mfsm_BusCursor cur;
+  initBusCursor(&cur, &bus);
+
+  mfsm_Event e;
+  int i = 0;
+  for (; i < 10; i++) {
+    initEvent(&e, i);
+    publishEvent(&bus, e);
+  }
+
+  mfsm_Event out[MAX_BUS_EVENTS];
+  int n = readBusEvents(&cur, out, 4);
+  assertMsg(n == 4 && out[0].id == 0 && out[3].id == 3, "The oldest Events were not read");
+  n = readBusEvents(&cur, out, MAX_BUS_EVENTS);
+  assertMsg(n == 6 && out[0].id == 4 && out[5].id == 9, "The remaining Events were not read");
+  assertMsg(cur.dropped == 0, "Events were dropped");
+
+  // A cursor that falls a whole ring behind skips to the oldest Event left
+  for (i = 0; i < MAX_BUS_EVENTS + 5; i++) {
+    initEvent(&e, 100 + i);
+    publishEvent(&bus, e);
+  }
+  n = readBusEvents(&cur, out, MAX_BUS_EVENTS);
+  assertMsg(cur.dropped == 5, "Overwritten Events were not counted");
+  assertMsg(n == MAX_BUS_EVENTS && out[0].id == 105, "The cursor did not skip ahead");
+  assertMsg(readBusEvents(0, out, 1) == -1, "Events were read from a null cursor");
+
+  report("readBusEvents()");
+}
+
+void test_setEventBus(void) {
+  static mfsm_EventBus bus;
+  initEventBus(&bus);
+
+  mfsm_BusCursor cur;
+  initBusCursor(&cur, &bus);
+
+  mfsm_EventQueue eq;
+  initEventQueue(&eq);
+  assertMsg(setEventBus(&eq, &bus) == 0, "EventBus could not be set");
+  assertMsg(setEventBus(0, &bus) == -1, "EventBus was set on a null EventQueue");
+
+  // Events sent with no listeners still reach the bus
+  mfsm_Event e;
+  initEvent(&e, 3);
+  assertMsg(sendEventPtr(&eq, e) == 0, "Event could not be sent");
+
+  mfsm_Event d;
+  assertMsg(readBusEvent(&cur, &d) == 0 && d.id == 3, "Event was not published to the bus");
+
+  report("setEventBus()");
+}
+
 
 int main(int argc, char **argv) {
   printf("Running tests...\n\n");
@@ -538,15 +3262,25 @@ int main(int argc, char **argv) {
   // Test utility functions
   test_getStateIndex();
   test_getInputIndex();
+  test_getStateIndexPtr();
+  test_getInputIndexPtr();
+  test_idMap();
+  test_reindexFSM();
+  test_initDynamicFSM();
+  test_initSparseFSM();
+  test_initFixedFSM();
 
   // Test validators
   test_isValidStateID();
   test_isValidInputID();
   test_isValidTransition();
+  test_isValidIDPtr();
 
   // Test state addition/removal
   test_addState();
   test_removeState();
+  test_setAcceptingState();
+  test_clearAcceptingState();
 
   // Test input addition/removal
   test_addInput();
@@ -561,6 +3295,59 @@ int main(int argc, char **argv) {
 
   // Test transition functionality
   test_doTransition();
+  test_doInstanceTransition();
+  test_doTransitionBatch();
+
+  // Test compiled FSMs
+  test_compileFSM();
+  test_doCompiledTransition();
+  test_doCompiledTransitionBatch();
+  test_transitionOutputOrder();
+  test_stepCompiledMany();
+
+  // Test minimization
+  test_minimizeFSM();
+
+  // Test NFAs
+  test_addNFAState();
+  test_addNFAEdge();
+  test_determinizeNFA();
+
+  // Test byte scanners
+  test_initScanner();
+  test_scanBytes();
+  test_scanMatches();
+
+  // Test step pools
+  test_initStepPool();
+  test_runStepPool();
+  test_setPoolEventBuffer();
+
+  // Test compiled FSM images
+  test_writeCompiledImage();
+  test_loadCompiledImage();
+  test_mapCompiledFSM();
+
+  // Test the text loader
+  test_loadFSMText();
+  test_feedLoader();
+  test_loadFSMFile();
+
+  // Test checkpoints
+  test_saveCheckpoint();
+  test_restoreCheckpoint();
+
+#ifdef MFSM_STATS
+  // Test instrumentation
+  test_initStats();
+  test_snapshotListenerStats();
+#endif
+
+#ifdef MFSM_TIMING
+  // Test timing
+  test_getPercentile();
+  test_initTiming();
+#endif
 
   /****************************************
   * Test Event System
@@ -568,12 +3355,31 @@ int main(int argc, char **argv) {
 
   // Event functions
   test_initEvent();
+  test_initTypedEvent();
+  test_setEventData();
+  test_initPayloadPool();
+  test_allocPayload();
+  test_releasePayload();
   test_appendEvent();
   test_getNextEvent();
+  test_getEvents();
+  test_peekEvents();
+  test_initSPSCEventListener();
   test_initEventQueue();
   test_addListener();
   test_removeListener();
   test_sendEvent();
+  test_sendEventPtr();
+  test_setOverflowPolicy();
+  test_setOverflowStorage();
+  test_setSubscriptions();
+  test_refreshListener();
+  test_addCallback();
+  test_removeCallback();
+  test_initEventBus();
+  test_publishEvent();
+  test_readBusEvents();
+  test_setEventBus();
 
   return 0;
 }
@@ -20,7 +20,7 @@ results. (Eg. report("I Value Test")).
 static int testSuccess = 0;
 
 // Evaluates cond and prints msg upon failure.
-#define assertMsg(cond, msg) if ((!cond)) { printf("Error: "); printf(msg); testSuccess++; printf("\n"); }
+#define assertMsg(cond, msg) if (!(cond)) { printf("Error: "); printf(msg); testSuccess++; printf("\n"); }
 
 // Call this after each test (each collection of asserts). Outputs the number
 // of errors present from the last call of report(), or success if no errors